@@ -0,0 +1,278 @@
+#!/bin/bash
+
+################################################################################
+# Benchmark the bridge driver on the local computer.
+#
+# The driver that buildBridgeDriver.sh just built is mounted over a local
+# backing directory, and a fixed set of fio workloads is run twice: once
+# directly on the backing directory, and once through the mount.  The two runs
+# are printed side by side, so the numbers show what the driver itself costs,
+# without a NAS or a network in the way.
+#
+# Each workload reports:
+#   ops/s      - Operations (I/Os, or files for the small-file workloads) per
+#                second.
+#   MB/s       - Data moved per second.
+#   p50, p99   - Latency of one operation, in usec.  For fsync-write, it's the
+#                latency of the fsync.
+#   cpu/op     - CPU time per operation, in usec.  This is fio's own user and
+#                system time (which includes the kernel's FUSE work) plus the
+#                driver's, so it's the whole cost of an operation on this box.
+#
+# The results go to a directory (BENCH_OUT, default /tmp/benchBridgeDriver.<time>):
+#   results.csv      - One line per workload and target, for tracking
+#                      regressions.
+#   env.txt          - The driver tuning, git commit, kernel and fio version.
+#   <workload>.<target>.json  - fio's raw output.
+#   <workload>.metrics        - The driver's statistics after the workload.
+#
+# With no backing directory, a tmpfs is mounted for one (this needs root).
+# To benchmark on a disk, pass a directory on an ext4 file system instead.
+# Any PROXY_BRIDGE_* variables that are set are passed to the driver, so a
+# tuning can be benchmarked like this:
+#   PROXY_BRIDGE_PROFILE=streaming ./benchBridgeDriver.sh /data/bench
+#
+# Other knobs:
+#   BENCH_SECONDS   - How long each data workload runs (default 15).
+#   BENCH_FILE_SIZE - How big each workload's files are (default 256m).
+#   BENCH_FILES     - How many files the small-file workloads use (default 10000).
+#   BENCH_FILTER    - Only run the workloads whose names match this regex.
+#   BENCH_TMPFS_SIZE - How big the tmpfs is (default 4g).
+#
+# Needs fio (3.28 or later for the small-file workloads), jq, and curl.
+#
+# Usage: benchBridgeDriver.sh [backing directory]
+################################################################################
+
+DRIVER_NAME=proxy_bridge
+
+readonly BLD_DIR=$( cd `dirname ${0}`    && echo ${PWD} )
+readonly TOP_DIR=$( cd ${BLD_DIR}/..     && echo ${PWD} )
+
+readonly BENCH_SECONDS=${BENCH_SECONDS:-15}
+readonly BENCH_FILE_SIZE=${BENCH_FILE_SIZE:-256m}
+readonly BENCH_FILES=${BENCH_FILES:-10000}
+readonly BENCH_FILTER=${BENCH_FILTER:-.}
+readonly BENCH_TMPFS_SIZE=${BENCH_TMPFS_SIZE:-4g}
+readonly BENCH_OUT=${BENCH_OUT:-/tmp/benchBridgeDriver.`date +%Y%m%d-%H%M%S`}
+
+readonly WORK_DIR=/tmp/benchBridgeDriver.$$
+readonly MNT_DIR=${WORK_DIR}/mnt
+readonly STATS_SOCK=${WORK_DIR}/stats.sock
+
+# The workloads.  Each line is "<name> <fio options>".
+readonly DATA_OPTS="--ioengine=psync --size=${BENCH_FILE_SIZE} --runtime=${BENCH_SECONDS} --time_based --ramp_time=2 --invalidate=1"
+readonly FILE_OPTS="--nrfiles=${BENCH_FILES} --filesize=4k --openfiles=1 --fallocate=none"
+readonly WORKLOADS="
+seq-read-4k         ${DATA_OPTS} --rw=read --bs=4k
+seq-read-128k       ${DATA_OPTS} --rw=read --bs=128k
+seq-read-1m         ${DATA_OPTS} --rw=read --bs=1m
+seq-write-4k        ${DATA_OPTS} --rw=write --bs=4k
+seq-write-128k      ${DATA_OPTS} --rw=write --bs=128k
+seq-write-1m        ${DATA_OPTS} --rw=write --bs=1m
+rand-read-4k        ${DATA_OPTS} --rw=randread --bs=4k
+rand-read-64k       ${DATA_OPTS} --rw=randread --bs=64k
+rand-write-4k       ${DATA_OPTS} --rw=randwrite --bs=4k
+rand-write-64k      ${DATA_OPTS} --rw=randwrite --bs=64k
+par4-seq-read-1m    ${DATA_OPTS} --rw=read --bs=1m --numjobs=4
+par4-rand-read-4k   ${DATA_OPTS} --rw=randread --bs=4k --numjobs=4
+par4-rand-write-4k  ${DATA_OPTS} --rw=randwrite --bs=4k --numjobs=4
+fsync-write-4k      ${DATA_OPTS} --rw=write --bs=4k --fsync=1
+small-create        ${FILE_OPTS} --ioengine=filecreate
+small-stat          ${FILE_OPTS} --ioengine=filestat
+small-unlink        ${FILE_OPTS} --ioengine=filedelete
+"
+
+# Pick the numbers out of fio's JSON output: ops/s, MB/s, p50 and p99 (usec),
+# and the number of operations.  The latency comes from whichever direction
+# did the work, or from the fsyncs if there were any.
+readonly FIO_JQ='
+.jobs[0] as $j
+| (if ($j.sync.total_ios // 0) > 0 then $j.sync.lat_ns
+   elif $j.read.total_ios >= $j.write.total_ios then $j.read.clat_ns
+   else $j.write.clat_ns end) as $lat
+| [ ($j.read.iops + $j.write.iops),
+    (($j.read.bw_bytes + $j.write.bw_bytes) / 1048576),
+    (($lat.percentile["50.000000"] // 0) / 1000),
+    (($lat.percentile["99.000000"] // 0) / 1000),
+    ($j.read.total_ios + $j.write.total_ios) ]
+| @tsv'
+
+################################################################################
+# Run one workload in a directory, and append its line to results.csv.
+#
+# Input:
+#   NAME    - The workload's name.
+#   TARGET  - "direct" or "proxied".
+#   DIR     - Where to run it.
+#   OPTIONS - The fio options.
+#
+# Output:
+#   Returns 0 if success, 1 if fio failed.
+################################################################################
+runWorkload() {
+	local NAME=${1}
+	local TARGET=${2}
+	local DIR=${3}
+	local OPTIONS=${4}
+	local JSON=${BENCH_OUT}/${NAME}.${TARGET}.json
+
+	mkdir -p ${DIR} &> /dev/null || return 1
+
+	local DRIVER_START=0
+	[ "${TARGET}" = "proxied" ] && DRIVER_START=`cpuTicks ${DRIVER_PID} self`
+	local FIO_START=`cpuTicks $$ children`
+
+	fio --name=${NAME} --directory=${DIR} --group_reporting --output-format=json --output=${JSON} ${OPTIONS} &>> ${LOG}
+	local RETCODE=$?
+
+	local FIO_END=`cpuTicks $$ children`
+	local DRIVER_END=0
+	[ "${TARGET}" = "proxied" ] && DRIVER_END=`cpuTicks ${DRIVER_PID} self`
+
+	if [ "${TARGET}" = "proxied" ]; then
+		benchMetrics > ${BENCH_OUT}/${NAME}.metrics
+	fi
+
+	rm -rf ${DIR} &> /dev/null
+	[ ${RETCODE} -ne 0 ] && return 1
+
+	local NUMBERS=`jq -r "${FIO_JQ}" ${JSON} 2>> ${LOG}`
+	[ -z "${NUMBERS}" ] && return 1
+
+	echo "${NUMBERS}" | awk -v name=${NAME} -v target=${TARGET} \
+		-v ticks=$(( FIO_END - FIO_START + DRIVER_END - DRIVER_START )) -v hz=${CLK_TCK} \
+		'BEGIN { FS = "\t"; OFS = "," }
+		{ printf "%s,%s,%.0f,%.1f,%.1f,%.1f,%.2f\n", name, target, $1, $2, $3, $4, ($5 > 0 ? ticks * 1000000 / hz / $5 : 0) }' \
+		>> ${BENCH_OUT}/results.csv
+	return 0
+}
+
+################################################################################
+################################################################################
+# Processing starts here.
+################################################################################
+################################################################################
+
+echo "Benchmarking the bridge driver:"
+
+########################################
+# Initialize some stuff before we start.
+echo "  Initialization:"
+
+readonly LOG=/tmp/`basename ${0}`.log
+echo -n "    Initialize log file (${LOG}) ... "
+rm -f ${LOG} &> /dev/null
+[ $? -ne 0 ] && echo "Unable to delete old log file." && exit 1
+touch ${LOG} &> /dev/null
+[ $? -ne 0 ] && echo "Unable to create empty log file." && exit 1
+echo "Pass."
+
+# Load our print utilities.
+echo -n "    Loading print utilities library ... "
+readonly PRINT_UTILS_FILE=${TOP_DIR}/lib/printUtils
+[ ! -f ${PRINT_UTILS_FILE} ] && echo "File not found." && exit 1
+. ${PRINT_UTILS_FILE}
+[ $? -ne 0 ] && echo "Fail." && exit 1 ; printResult ${RESULT_PASS}
+
+# Load our benchmark utilities.
+echo -n "    Loading benchmark utilities library ... "
+readonly BENCH_UTILS_FILE=${TOP_DIR}/lib/benchUtils
+[ ! -f ${BENCH_UTILS_FILE} ] && echo "File not found." && exit 1
+. ${BENCH_UTILS_FILE}
+[ $? -ne 0 ] && echo "Fail." && exit 1 ; printResult ${RESULT_PASS}
+
+for TOOL in fio jq curl; do
+	echo -n "    Check for ${TOOL} ... "
+	which ${TOOL} &> /dev/null
+	[ $? -ne 0 ] && printResult ${RESULT_FAIL} "Missing.\n" && exit 1 ; printResult ${RESULT_PASS}
+done
+
+echo -n "    Check for the driver ... "
+readonly DRIVER=${BLD_DIR}/${DRIVER_NAME}
+[ ! -x ${DRIVER} ] && printResult ${RESULT_FAIL} "Run buildBridgeDriver.sh first.\n" && exit 1 ; printResult ${RESULT_PASS}
+
+readonly CLK_TCK=`getconf CLK_TCK`
+
+trap benchCleanup EXIT
+
+echo -n "    Create work directory (${WORK_DIR}) ... "
+mkdir -p ${WORK_DIR} ${BENCH_OUT} &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+benchBackingDir "${1}" ${BENCH_TMPFS_SIZE} || exit 1
+readonly BACKING_DIR
+
+echo -n "    Record environment ... "
+{
+	echo "date=`date -Is`"
+	echo "commit=`git -C ${TOP_DIR} rev-parse --short HEAD 2> /dev/null`"
+	echo "kernel=`uname -r`"
+	echo "fio=`fio --version`"
+	echo "backing=${BACKING_DIR} (`stat -f -c %T ${BACKING_DIR}`)"
+	echo "seconds=${BENCH_SECONDS} file_size=${BENCH_FILE_SIZE} files=${BENCH_FILES}"
+	env | grep -E '^PROXY_BRIDGE_[A-Z_]+=' | sort
+} > ${BENCH_OUT}/env.txt 2>> ${LOG}
+echo "workload,target,ops_per_sec,mb_per_sec,p50_usec,p99_usec,cpu_usec_per_op" > ${BENCH_OUT}/results.csv
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+benchStartDriver ${DRIVER} ${MNT_DIR} ${STATS_SOCK} || exit 1
+
+echo ""
+
+########################################
+# Run the workloads.
+echo "  Run workloads (results in ${BENCH_OUT}):"
+
+FAILED=0
+while read NAME OPTIONS; do
+	[ -z "${NAME}" ] && continue
+	echo ${NAME} | grep -qE "${BENCH_FILTER}" || continue
+
+	# The small-file engines need a newer fio than the rest.
+	ENGINE=`echo ${OPTIONS} | grep -oP '(?<=--ioengine=)file\w+'`
+	if [ -n "${ENGINE}" ]; then
+		fio --enghelp=${ENGINE} &> /dev/null
+		if [ $? -ne 0 ]; then
+			printResult ${RESULT_WARN} "    ${NAME}: fio has no ${ENGINE} engine.  Skipped.\n"
+			continue
+		fi
+	fi
+
+	for TARGET in direct proxied; do
+		echo -n "    ${NAME} (${TARGET}) ... "
+		if [ "${TARGET}" = "direct" ]; then
+			DIR=${BACKING_DIR}/bench.$$
+		else
+			DIR=${MNT_DIR}/bench.$$
+		fi
+		runWorkload ${NAME} ${TARGET} ${DIR} "${OPTIONS}"
+		if [ $? -ne 0 ]; then
+			printResult ${RESULT_FAIL}
+			FAILED=1
+		else
+			printResult ${RESULT_PASS}
+		fi
+	done
+done <<< "${WORKLOADS}"
+
+echo ""
+
+########################################
+# Print the two runs side by side.
+echo "  Results (direct / proxied):"
+printf "    %-20s %21s %21s %21s %21s %21s\n" "workload" "ops/s" "MB/s" "p50 usec" "p99 usec" "cpu usec/op"
+awk -F, 'NR > 1 {
+		if ($2 == "direct") { for (i = 3; i <= 7; i++) d[$1, i] = $i; next }
+		printf "    %-20s", $1
+		for (i = 3; i <= 7; i++) printf " %10s/%-10s", d[$1, i], $i
+		printf "\n"
+	}' ${BENCH_OUT}/results.csv
+
+echo ""
+if [ ${FAILED} -ne 0 ]; then
+	printResult ${RESULT_FAIL} "  `basename ${0}` Some workloads failed (see ${LOG}).\n"
+	exit 1
+fi
+printResult ${RESULT_PASS} "  `basename ${0}` Success.\n"
+exit 0
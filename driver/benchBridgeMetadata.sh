@@ -0,0 +1,316 @@
+#!/bin/bash
+
+################################################################################
+# Stress the bridge driver's metadata path on the local computer.
+#
+# The slow cases in the field are metadata, not data: directories with a
+# million entries, deep trees, and find/du/rsync walking all of it.  Those go
+# through lo_do_lookup(), lo_do_readdir() and the inode table, and they get
+# slower (and the driver gets bigger) as the kernel hands the driver more
+# inodes.  This benchmark builds that kind of tree, walks it through the mount,
+# and shows how the numbers move as the inode count grows.
+#
+# The trees are built directly on the backing directory, so building them
+# doesn't count.  Then, through the mount:
+#   flat-readdir     - List a flat directory without looking at the entries
+#                      (ls -f).  Run after each step of BENCH_STEPS, as the
+#                      directory grows.
+#   flat-readdirplus - List it with attributes (ls -l), which lets the kernel
+#                      switch to readdirplus.
+#   flat-stat        - Look up and stat every entry by name.
+#   tree-scan        - Walk a deep tree (find).
+#   tree-stat        - Stat everything in it (du -s).
+#   tree-rsync       - Compare it with an empty directory (rsync -an), if
+#                      rsync is installed.
+#   storm-create     - Create BENCH_STORM files in one directory.
+#   storm-rename     - Move them all to another directory.
+#   storm-unlink     - Delete them all.
+#
+# Each pass reports entries (or files) per second, and how many inodes the
+# driver has, how much memory it uses, and how many fds it has open when the
+# pass is done.  Before each pass the kernel's dentry and inode caches are
+# dropped (if we're root), so the pass goes to the driver instead of being
+# answered by the kernel.  That also makes the kernel forget the inodes, so the
+# driver's inode count is what that one pass left behind.
+#
+# While it runs, the driver's memory, fd count and inode count are sampled
+# every BENCH_SAMPLE_SECONDS, so growth that doesn't go away shows up too.
+#
+# The results go to a directory (BENCH_OUT, default /tmp/benchBridgeMetadata.<time>):
+#   results.csv  - One line per pass.
+#   samples.csv  - The samples.
+#   env.txt      - The driver tuning, git commit and kernel version.
+#   metrics      - The driver's statistics at the end.
+#
+# With no backing directory, a tmpfs is mounted for one (this needs root).
+# Any PROXY_BRIDGE_* variables that are set are passed to the driver.
+#
+# Knobs:
+#   BENCH_STEPS          - The sizes the flat directory grows through
+#                          (default "10000 100000 1000000").
+#   BENCH_DEPTH          - How deep the tree is (default 8).
+#   BENCH_FANOUT         - Subdirectories in each of its directories (default 3).
+#   BENCH_TREE_FILES     - Files in each of its directories (default 8).
+#   BENCH_STORM          - Files in the create/rename/unlink storms (default 100000).
+#   BENCH_SAMPLE_SECONDS - How often to sample the driver (default 1).
+#   BENCH_TMPFS_SIZE     - How big the tmpfs is (default 4g).
+#
+# Needs curl.
+#
+# Usage: benchBridgeMetadata.sh [backing directory]
+################################################################################
+
+DRIVER_NAME=proxy_bridge
+
+readonly BLD_DIR=$( cd `dirname ${0}`    && echo ${PWD} )
+readonly TOP_DIR=$( cd ${BLD_DIR}/..     && echo ${PWD} )
+
+readonly BENCH_STEPS=${BENCH_STEPS:-10000 100000 1000000}
+readonly BENCH_DEPTH=${BENCH_DEPTH:-8}
+readonly BENCH_FANOUT=${BENCH_FANOUT:-3}
+readonly BENCH_TREE_FILES=${BENCH_TREE_FILES:-8}
+readonly BENCH_STORM=${BENCH_STORM:-100000}
+readonly BENCH_SAMPLE_SECONDS=${BENCH_SAMPLE_SECONDS:-1}
+readonly BENCH_TMPFS_SIZE=${BENCH_TMPFS_SIZE:-4g}
+readonly BENCH_OUT=${BENCH_OUT:-/tmp/benchBridgeMetadata.`date +%Y%m%d-%H%M%S`}
+
+readonly WORK_DIR=/tmp/benchBridgeMetadata.$$
+readonly MNT_DIR=${WORK_DIR}/mnt
+readonly STATS_SOCK=${WORK_DIR}/stats.sock
+readonly PHASE_FILE=${WORK_DIR}/phase
+
+SAMPLER_PID=""
+
+################################################################################
+# Print the driver's resident memory (KB) and open fd count, separated by a
+# comma.
+################################################################################
+driverUsage() {
+	local RSS=`awk '$1 == "VmRSS:" { print $2 }' /proc/${DRIVER_PID}/status 2> /dev/null`
+	local FDS=`ls /proc/${DRIVER_PID}/fd 2> /dev/null | wc -l`
+	echo "${RSS:-0},${FDS}"
+}
+
+################################################################################
+# Sample the driver until we're killed.  Each line of samples.csv is the time,
+# the pass that was running, the inode count, the memory and the fd count.
+################################################################################
+sampler() {
+	local START=`date +%s%N`
+
+	echo "seconds,phase,inodes,rss_kb,fds" > ${BENCH_OUT}/samples.csv
+	while true; do
+		local NOW=`date +%s%N`
+		echo "$(( (NOW - START) / 1000000000 )),`cat ${PHASE_FILE} 2> /dev/null`,`benchMetrics inodes`,`driverUsage`" >> ${BENCH_OUT}/samples.csv
+		sleep ${BENCH_SAMPLE_SECONDS}
+	done
+}
+
+################################################################################
+# Time one pass, and append its line to results.csv.
+#
+# Input:
+#   PHASE   - The pass's name.
+#   ENTRIES - How many entries (or files) it handles.
+#   ...     - The command that runs it.
+#
+# Output:
+#   0 - success.
+#   1 - failure.
+################################################################################
+measure() {
+	local PHASE=${1}
+	local ENTRIES=${2}
+	shift 2
+
+	printf "    %-18s %10d ... " ${PHASE} ${ENTRIES}
+
+	sync
+	echo 2 2> /dev/null > /proc/sys/vm/drop_caches
+	echo ${PHASE} > ${PHASE_FILE}
+
+	local START=`date +%s%N`
+	"$@" > /dev/null 2>> ${LOG}
+	local RETCODE=$?
+	local END=`date +%s%N`
+
+	echo "idle" > ${PHASE_FILE}
+	[ ${RETCODE} -ne 0 ] && printResult ${RESULT_FAIL} && return 1
+
+	local NSEC=$(( END - START ))
+	[ ${NSEC} -le 0 ] && NSEC=1
+	local LINE="${PHASE},${ENTRIES},`awk -v n=${NSEC} 'BEGIN { printf "%.3f", n / 1e9 }'`,$(( ENTRIES * 1000000000 / NSEC )),`benchMetrics inodes`,`driverUsage`"
+	echo ${LINE} >> ${BENCH_OUT}/results.csv
+	echo ${LINE} | awk -F, '{ printf "%8.2fs %10d/s  inodes %-9d rss %7.1f MB  fds %d\n", $3, $4, $5, $6 / 1024, $7 }'
+	return 0
+}
+
+################################################################################
+# Print the paths in the tree, relative to its top.  With "dirs", print its
+# directories, otherwise print its files.
+################################################################################
+treePaths() {
+	awk -v mode=${1} -v depth=${BENCH_DEPTH} -v fanout=${BENCH_FANOUT} -v files=${BENCH_TREE_FILES} '
+		function walk(path, level,   i) {
+			if (mode == "dirs")
+				print path
+			else
+				for (i = 0; i < files; i++)
+					print path "/f" i
+			if (level < depth)
+				for (i = 0; i < fanout; i++)
+					walk(path "/d" i, level + 1)
+		}
+		BEGIN { walk(".", 0) }'
+}
+
+# The passes.  Each one runs in a subshell, in the directory that it works on.
+flatReaddir()     ( cd ${MNT_DIR}/flat && ls -f )
+flatReaddirplus() ( cd ${MNT_DIR}/flat && ls -U -l )
+flatStat()        ( cd ${MNT_DIR}/flat && seq -f 'f%.0f' 1 ${1} | xargs stat -c %s )
+treeScan()        ( find ${MNT_DIR}/tree )
+treeStat()        ( du -s ${MNT_DIR}/tree )
+treeRsync()       ( mkdir -p ${WORK_DIR}/empty && rsync -an ${MNT_DIR}/tree/ ${WORK_DIR}/empty/ )
+stormCreate()     ( cd ${MNT_DIR}/storm && seq -f 'a/f%.0f' 1 ${BENCH_STORM} | xargs touch )
+stormRename()     ( cd ${MNT_DIR}/storm && seq -f 'a/f%.0f' 1 ${BENCH_STORM} | xargs mv -t b )
+stormUnlink()     ( cd ${MNT_DIR}/storm && seq -f 'b/f%.0f' 1 ${BENCH_STORM} | xargs rm -f )
+
+################################################################################
+# Stop the sampler, then the driver.
+################################################################################
+metadataCleanup() {
+	[ -n "${SAMPLER_PID}" ] && kill ${SAMPLER_PID} &> /dev/null && wait ${SAMPLER_PID} &> /dev/null
+	benchCleanup
+}
+
+################################################################################
+################################################################################
+# Processing starts here.
+################################################################################
+################################################################################
+
+echo "Benchmarking the bridge driver's metadata path:"
+
+########################################
+# Initialize some stuff before we start.
+echo "  Initialization:"
+
+readonly LOG=/tmp/`basename ${0}`.log
+echo -n "    Initialize log file (${LOG}) ... "
+rm -f ${LOG} &> /dev/null
+[ $? -ne 0 ] && echo "Unable to delete old log file." && exit 1
+touch ${LOG} &> /dev/null
+[ $? -ne 0 ] && echo "Unable to create empty log file." && exit 1
+echo "Pass."
+
+# Load our print utilities.
+echo -n "    Loading print utilities library ... "
+readonly PRINT_UTILS_FILE=${TOP_DIR}/lib/printUtils
+[ ! -f ${PRINT_UTILS_FILE} ] && echo "File not found." && exit 1
+. ${PRINT_UTILS_FILE}
+[ $? -ne 0 ] && echo "Fail." && exit 1 ; printResult ${RESULT_PASS}
+
+# Load our benchmark utilities.
+echo -n "    Loading benchmark utilities library ... "
+readonly BENCH_UTILS_FILE=${TOP_DIR}/lib/benchUtils
+[ ! -f ${BENCH_UTILS_FILE} ] && echo "File not found." && exit 1
+. ${BENCH_UTILS_FILE}
+[ $? -ne 0 ] && echo "Fail." && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Check for curl ... "
+which curl &> /dev/null
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} "Missing.\n" && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Check for the driver ... "
+readonly DRIVER=${BLD_DIR}/${DRIVER_NAME}
+[ ! -x ${DRIVER} ] && printResult ${RESULT_FAIL} "Run buildBridgeDriver.sh first.\n" && exit 1 ; printResult ${RESULT_PASS}
+
+trap metadataCleanup EXIT
+
+echo -n "    Create work directory (${WORK_DIR}) ... "
+mkdir -p ${WORK_DIR} ${BENCH_OUT} &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+benchBackingDir "${1}" ${BENCH_TMPFS_SIZE} || exit 1
+readonly BACKING_DIR
+
+echo -n "    Create test directories ... "
+mkdir ${BACKING_DIR}/flat ${BACKING_DIR}/tree ${BACKING_DIR}/storm ${BACKING_DIR}/storm/a ${BACKING_DIR}/storm/b &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} "Is the backing directory empty?\n" && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Record environment ... "
+{
+	echo "date=`date -Is`"
+	echo "commit=`git -C ${TOP_DIR} rev-parse --short HEAD 2> /dev/null`"
+	echo "kernel=`uname -r`"
+	echo "backing=${BACKING_DIR} (`stat -f -c %T ${BACKING_DIR}`)"
+	echo "steps=${BENCH_STEPS} depth=${BENCH_DEPTH} fanout=${BENCH_FANOUT} tree_files=${BENCH_TREE_FILES} storm=${BENCH_STORM}"
+	env | grep -E '^PROXY_BRIDGE_[A-Z_]+=' | sort
+} > ${BENCH_OUT}/env.txt 2>> ${LOG}
+echo "phase,entries,seconds,ops_per_sec,inodes,rss_kb,fds" > ${BENCH_OUT}/results.csv
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+benchStartDriver ${DRIVER} ${MNT_DIR} ${STATS_SOCK} || exit 1
+
+echo "idle" > ${PHASE_FILE}
+sampler &
+SAMPLER_PID=$!
+
+echo ""
+
+########################################
+# Grow the flat directory, and list it at each size.
+echo "  Flat directory (results in ${BENCH_OUT}):"
+
+FAILED=0
+HAVE=0
+for STEP in ${BENCH_STEPS}; do
+	if [ ${STEP} -gt ${HAVE} ]; then
+		echo -n "    Grow to ${STEP} entries ... "
+		( cd ${BACKING_DIR}/flat && seq -f 'f%.0f' $(( HAVE + 1 )) ${STEP} | xargs touch ) &>> ${LOG}
+		[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+		HAVE=${STEP}
+	fi
+
+	measure flat-readdir ${HAVE} flatReaddir || FAILED=1
+	measure flat-readdirplus ${HAVE} flatReaddirplus || FAILED=1
+	measure flat-stat ${HAVE} flatStat ${HAVE} || FAILED=1
+done
+
+echo ""
+
+########################################
+# Walk the deep tree.
+echo "  Tree (depth ${BENCH_DEPTH}, fanout ${BENCH_FANOUT}):"
+
+echo -n "    Create tree ... "
+( cd ${BACKING_DIR}/tree && treePaths dirs | xargs mkdir -p && treePaths files | xargs touch ) &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1
+TREE_ENTRIES=$(( `treePaths dirs | wc -l` + `treePaths files | wc -l` ))
+printResult ${RESULT_PASS} "Pass (${TREE_ENTRIES} entries).\n"
+
+measure tree-scan ${TREE_ENTRIES} treeScan || FAILED=1
+measure tree-stat ${TREE_ENTRIES} treeStat || FAILED=1
+if which rsync &> /dev/null; then
+	measure tree-rsync ${TREE_ENTRIES} treeRsync || FAILED=1
+fi
+
+echo ""
+
+########################################
+# Create, rename and delete a lot of files.
+echo "  Storms:"
+
+measure storm-create ${BENCH_STORM} stormCreate || FAILED=1
+measure storm-rename ${BENCH_STORM} stormRename || FAILED=1
+measure storm-unlink ${BENCH_STORM} stormUnlink || FAILED=1
+
+benchMetrics > ${BENCH_OUT}/metrics
+
+echo ""
+if [ ${FAILED} -ne 0 ]; then
+	printResult ${RESULT_FAIL} "  `basename ${0}` Some passes failed (see ${LOG}).\n"
+	exit 1
+fi
+printResult ${RESULT_PASS} "  `basename ${0}` Success.\n"
+exit 0
@@ -5,6 +5,12 @@
 ################################################################################
 
 DRIVER_NAME=proxy_bridge
+REPLAY_NAME=proxy_replay
+ENCRYPT_NAME=proxy_encrypt
+SWEEP_NAME=proxy_dedup_sweep
+
+# The source files that make up the driver.
+DRIVER_SOURCES="${DRIVER_NAME} proxy_cache proxy_closer proxy_compress proxy_crypt proxy_dcache proxy_dedup proxy_emulate proxy_engine proxy_inode proxy_journal proxy_log proxy_pool proxy_profile proxy_stats proxy_trace proxy_uring proxy_wbuf"
 
 readonly BLD_DIR=$( cd `dirname ${0}`    && echo ${PWD} )
 readonly TOP_DIR=$( cd ${BLD_DIR}/..     && echo ${PWD} )
@@ -56,18 +62,72 @@ echo ""
 # Go build it.
 echo "  Build driver:"
 
-readonly SWITCHES="-D_REENTRANT -Wall -W -Wno-sign-compare -Wmissing-declarations -Wwrite-strings -DFE_OPTIMIZE_HEADER -DKEY_SET_PER_FILE -DDEBUG -DOVERLAY_MOUNT -Wno-unused -I . -I /usr/local/include -g -O0 -fno-strict-aliasing -MD -MP -c"
+# Debug builds (the default) keep every log message.  Release builds
+# (BUILD_TYPE=release) compile out the ENTER/EXIT/TRACE messages and turn on
+# the optimizer.
+if [ "${BUILD_TYPE}" = "release" ]; then
+	readonly BUILD_TYPE_SWITCHES="-g -O2"
+else
+	readonly BUILD_TYPE_SWITCHES="-DDEBUG -g -O0"
+fi
+
+# The io_uring data path is only built if liburing is installed.
+echo -n "    Checking for liburing ... "
+echo "#include <liburing.h>" | gcc -E -x c - &> /dev/null
+if [ $? -eq 0 ]; then
+	readonly URING_SWITCHES="-DHAVE_LIBURING"
+	readonly URING_LIBS="-luring"
+	printResult ${RESULT_PASS}
+else
+	readonly URING_SWITCHES=""
+	readonly URING_LIBS=""
+	printResult ${RESULT_WARN} "Missing.  Building without io_uring.\n"
+fi
+
+readonly SWITCHES="-D_REENTRANT -Wall -W -Wno-sign-compare -Wmissing-declarations -Wwrite-strings -DFE_OPTIMIZE_HEADER -DKEY_SET_PER_FILE -DOVERLAY_MOUNT -Wno-unused -I . -I /usr/local/include ${BUILD_TYPE_SWITCHES} ${URING_SWITCHES} -fno-strict-aliasing -MD -MP -c"
+
+DRIVER_OBJECTS=""
+for SRC in ${DRIVER_SOURCES}; do
+	echo -n "    Compiling ${SRC}.c ... "
+	gcc ${SWITCHES} -D_FILE_OFFSET_BITS=64 -MT ${SRC}.o -o ${SRC}.o ${SRC}.c &>> ${LOG}
+	[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+	DRIVER_OBJECTS="${DRIVER_OBJECTS} ${SRC}.o"
+done
 
-echo -n "    Compiling ... "
-gcc ${SWITCHES} -D_FILE_OFFSET_BITS=64 -MT ${DRIVER_NAME}.o -o ${DRIVER_NAME}.o ${DRIVER_NAME}.c &>> ${LOG}
+echo -n "    Linking ... "
+gcc -o${DRIVER_NAME} ${DRIVER_OBJECTS} ${URING_LIBS} -lfuse3 -lcrypto -lz -lm -lc -lpthread -lrt -ldl &>> ${LOG}
 [ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
 
-echo -n "    Linking ... "
-gcc -o${DRIVER_NAME} ${DRIVER_NAME}.o -lfuse3 -lcrypto -lz -lc -lpthread -lrt -ldl &>> ${LOG}
+# The trace replayer (see proxy_replay.c) is a plain program.
+echo -n "    Compiling ${REPLAY_NAME}.c ... "
+gcc ${SWITCHES} -D_FILE_OFFSET_BITS=64 -MT ${REPLAY_NAME}.o -o ${REPLAY_NAME}.o ${REPLAY_NAME}.c &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Linking ${REPLAY_NAME} ... "
+gcc -o${REPLAY_NAME} ${REPLAY_NAME}.o -lpthread &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+# The export encrypter (see proxy_encrypt.c) uses the driver's modules, all
+# but the bridge itself.
+echo -n "    Compiling ${ENCRYPT_NAME}.c ... "
+gcc ${SWITCHES} -D_FILE_OFFSET_BITS=64 -MT ${ENCRYPT_NAME}.o -o ${ENCRYPT_NAME}.o ${ENCRYPT_NAME}.c &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Linking ${ENCRYPT_NAME} ... "
+gcc -o${ENCRYPT_NAME} ${ENCRYPT_NAME}.o ${DRIVER_OBJECTS/${DRIVER_NAME}.o/} ${URING_LIBS} -lfuse3 -lcrypto -lz -lm -lc -lpthread -lrt -ldl &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+# So does the chunk store sweeper (see proxy_dedup_sweep.c).
+echo -n "    Compiling ${SWEEP_NAME}.c ... "
+gcc ${SWITCHES} -D_FILE_OFFSET_BITS=64 -MT ${SWEEP_NAME}.o -o ${SWEEP_NAME}.o ${SWEEP_NAME}.c &>> ${LOG}
+[ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
+
+echo -n "    Linking ${SWEEP_NAME} ... "
+gcc -o${SWEEP_NAME} ${SWEEP_NAME}.o ${DRIVER_OBJECTS/${DRIVER_NAME}.o/} ${URING_LIBS} -lfuse3 -lcrypto -lz -lm -lc -lpthread -lrt -ldl &>> ${LOG}
 [ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
 
 echo -n "    Cleanup ... "
-rm -f ${DRIVER_NAME}.d ${DRIVER_NAME}.o &> /dev/null
+rm -f *.d *.o &> /dev/null
 [ $? -ne 0 ] && printResult ${RESULT_FAIL} && exit 1 ; printResult ${RESULT_PASS}
 
 echo ""
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -27,25 +28,75 @@
 #include <unistd.h>
 
 #include <sys/fsuid.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 
 #include <attr/xattr.h> // Needed for extended attributes.
 
+#include "proxy_cache.h"
+#include "proxy_closer.h"
+#include "proxy_compress.h"
+#include "proxy_crypt.h"
+#include "proxy_dedup.h"
+#include "proxy_emulate.h"
+#include "proxy_dcache.h"
+#include "proxy_engine.h"
+#include "proxy_inode.h"
+#include "proxy_journal.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+#include "proxy_profile.h"
+#include "proxy_stats.h"
+#include "proxy_trace.h"
+#include "proxy_uring.h"
+#include "proxy_wbuf.h"
+
 #define PROCFS_LINK_SZ (64)
 
-struct lo_inode {
-	struct lo_inode *next;
-	struct lo_inode *prev;
-	int fd;
-	bool is_symlink;
-	ino_t ino;
+/* How long (in seconds) the kernel may cache what we tell it. */
+struct lo_timeouts {
+	double attr;                  /* Attributes (getattr, lookup). */
+	double entry;                 /* Name -> inode mappings. */
+	double negative;              /* ENOENT lookups.  0 = don't cache. */
+};
+
+/* A directory that the admin said is read-mostly. */
+struct lo_dir_id {
 	dev_t dev;
-	uint64_t nlookup;
+	ino_t ino;
 };
 
 struct lo_data {
 	int debug;
-	struct lo_inode root;
+	struct lo_inode root;         /* Not in the inode table. */
+	struct inode_table inodes;
+
+	struct lo_timeouts timeouts;
+	struct lo_timeouts readMostlyTimeouts;
+	struct lo_dir_id *readMostlyDirs;
+	size_t numReadMostlyDirs;
+
+	/* Let the kernel do file I/O against the backend itself.  Asked for in
+	 * main(), and turned off by lo_init() if the kernel can't do it. */
+	bool passthrough;
+
+	/* Let the kernel cache writes and send them in big batches.  Asked
+	 * for in main(), and turned off by lo_init() if the kernel can't. */
+	bool writeback;
+};
+
+/* One of these for every open file.  fi->fh points at it. */
+struct lo_file {
+	int fd;
+	int ringSlot;                 /* Registered with the io_uring, or -1. */
+	struct write_buf *wb;         /* NULL if writes go straight through. */
+	bool passthrough;             /* The kernel does the reads and writes. */
+	bool journal;                 /* Writes go to the journal. */
+
+	/* Filled in by lo_release() for the background close. */
+	struct lo_data *lo;
+	struct lo_inode *inode;
+	fuse_ino_t ino;
 };
 
 /* Used by opendir/readdir(plus)/closedir to keep track of the state. */
@@ -54,49 +105,32 @@ struct lo_dirp {
 	DIR *dp;
 	struct dirent *entry;
 	off_t offset;
+	int err;                      /* A readdir() error for the next call. */
 };
 
-/* *****************************************************************************
- * Logging.
- * ****************************************************************************/
+/* The most names that readdirplus looks up at the same time. */
+#define LO_READDIR_BATCH (64)
 
-static int logToSyslog = 0;
-static void logMsg(fuse_req_t req, const char *func, int priority, const char *fmt, ...)
-{
-	char fmtBuf[1024];
-	if(req != NULL) {
-		const struct fuse_ctx *ctx = fuse_req_ctx(req);
-		snprintf(fmtBuf, sizeof(fmtBuf), "[%s] (%d %d %d): %s\n", func,
-		         ctx->uid, ctx->gid, ctx->pid, fmt);
-	}
-	else {
-		snprintf(fmtBuf, sizeof(fmtBuf), "[%s]: %s\n", func, fmt);
-	}
+/* One name in a readdirplus batch. */
+struct lo_dirent {
+	char name[NAME_MAX + 1];
+	off_t offset;                 /* Directory position of this entry. */
+	off_t nextoff;                /* Directory position of the next one. */
+	int err;
+	struct fuse_entry_param e;
+};
 
-	va_list args;
-	va_start(args, fmt);
-	if(logToSyslog) {
-		vsyslog(priority, fmtBuf, args);
-	}
-	else {
-		vfprintf(stderr, fmtBuf, args);
-	}
-	va_end(args);
-}
+/* What the workers need to look up a readdirplus batch. */
+struct lo_readdir_batch {
+	fuse_req_t req;
+	fuse_ino_t parent;
+	struct lo_dirent *ents;
+};
 
-#define LOG_ENTER(req, fmt, ...) { \
-	int u = 0, g = 0, p = 0; \
-	if(req != NULL) { \
-		const struct fuse_ctx *ctx = fuse_req_ctx(req); \
-		u = ctx->uid; \
-		g = ctx->gid; \
-		p = ctx->pid; \
-	} \
-	logMsg(req, __func__, LOG_INFO, "ENTER: (%d %d %d) " fmt, u, g, p, ##__VA_ARGS__); \
-}
-#define LOG_EXIT(req, fmt, ...)  logMsg(req, __func__, LOG_INFO, "EXIT: " fmt, ##__VA_ARGS__)
-#define LOG_TRACE(req, fmt, ...) logMsg(req, __func__, LOG_INFO, fmt, ##__VA_ARGS__)
-#define LOG_ERROR(req, fmt, ...) logMsg(req, __func__, LOG_INFO, "ERROR: " fmt, ##__VA_ARGS__)
+/* *****************************************************************************
+ * Logging helpers.  These are only called from inside LOG_*() arguments, so
+ * they never run unless the message is actually going to be logged.
+ * ****************************************************************************/
 
 /* This function returns a string that describes the access mode for a file.
  *  */
@@ -132,56 +166,49 @@ static const char *fuseAccessModeToString(int flags)
 
 static char *modeToString(mode_t mode)
 {
-	static __thread char modeString[2048];
-	modeString[0] = 0;
+	static __thread char modeString[16];
+	const char *type = "";
 
-	if(S_ISLNK(mode))  { strcat(modeString, "LNK ");  }
-	if(S_ISREG(mode))  { strcat(modeString, "REG ");  }
-	if(S_ISDIR(mode))  { strcat(modeString, "DIR ");  }
-	if(S_ISCHR(mode))  { strcat(modeString, "CHR ");  }
-	if(S_ISBLK(mode))  { strcat(modeString, "BLK ");  }
-	if(S_ISFIFO(mode)) { strcat(modeString, "FIFO "); }
-	if(S_ISSOCK(mode)) { strcat(modeString, "SOCK "); }
+	if(S_ISLNK(mode))       { type = "LNK ";  }
+	else if(S_ISREG(mode))  { type = "REG ";  }
+	else if(S_ISDIR(mode))  { type = "DIR ";  }
+	else if(S_ISCHR(mode))  { type = "CHR ";  }
+	else if(S_ISBLK(mode))  { type = "BLK ";  }
+	else if(S_ISFIFO(mode)) { type = "FIFO "; }
+	else if(S_ISSOCK(mode)) { type = "SOCK "; }
 
-	strcat(modeString, (mode & S_IRUSR) ? "r" : "-");
-	strcat(modeString, (mode & S_IWUSR) ? "w" : "-");
-	strcat(modeString, (mode & S_IXUSR) ? "x" : "-");
+	char *p = stpcpy(modeString, type);
 
-	strcat(modeString, (mode & S_IRGRP) ? "r" : "-");
-	strcat(modeString, (mode & S_IWGRP) ? "w" : "-");
-	strcat(modeString, (mode & S_IXGRP) ? "x" : "-");
+	*p++ = (mode & S_IRUSR) ? 'r' : '-';
+	*p++ = (mode & S_IWUSR) ? 'w' : '-';
+	*p++ = (mode & S_IXUSR) ? 'x' : '-';
 
-	strcat(modeString, (mode & S_IROTH) ? "r" : "-");
-	strcat(modeString, (mode & S_IWOTH) ? "w" : "-");
-	strcat(modeString, (mode & S_IXOTH) ? "x" : "-");
+	*p++ = (mode & S_IRGRP) ? 'r' : '-';
+	*p++ = (mode & S_IWGRP) ? 'w' : '-';
+	*p++ = (mode & S_IXGRP) ? 'x' : '-';
+
+	*p++ = (mode & S_IROTH) ? 'r' : '-';
+	*p++ = (mode & S_IWOTH) ? 'w' : '-';
+	*p++ = (mode & S_IXOTH) ? 'x' : '-';
+	*p = 0;
 
 	return modeString;
 }
+
 /* *****************************************************************************
  * PRIVATE UTILITY FUNCTIONS.
  * ****************************************************************************/
 
-/* Get the symbolic link of an fd. */
+/* Get the symbolic link of an fd.  The kernel resolves the link straight to
+ * the fd's file, so calls that take it (open, chmod, getxattr, ...) don't
+ * walk a path on the backend.  Never turn it into a real pathname with
+ * readlink(); on a deep tree, looking that path up again costs a LOOKUP per
+ * component. */
 static void linkFromFD(int fd, char *linkName, size_t linkSize)
 {
 	snprintf(linkName, linkSize, "/proc/self/fd/%i", fd);
 }
 
-/* Get the full path of a file from its fd.
- *
- * Retcode:
- * >0 = length of the pathname.
- * -1 = failure (errno = reason for failure).
- */
-static int pathFromFD(int fd, char *pathName, size_t pathSize)
-{
-	char linkName[PROCFS_LINK_SZ];
-	linkFromFD(fd, linkName, sizeof(linkName));
-
-	memset(pathName, 0, pathSize);
-	return readlink(linkName, pathName, pathSize);
-}
-
 static struct lo_data *lo_data(fuse_req_t req)
 {
 	return (struct lo_data *) fuse_req_userdata(req);
@@ -195,22 +222,60 @@ static struct lo_inode *lo_inode(fuse_req_t req, fuse_ino_t ino)
 		return (struct lo_inode *) (uintptr_t) ino;
 }
 
-static int lo_fd(fuse_req_t req, fuse_ino_t ino)
+/* Tell the trace which inode a handler is working on (see proxy_trace.h).
+ * It's recorded by its backend inode number, which outlives this run. */
+#define LO_TRACE(node, off, size) do { \
+	if (traceEnabled()) \
+		STATS_TRACE(lo_inode(req, (node))->ino, (off), (size)); \
+} while (0)
+
+/* The timeouts that apply to an inode (or, for entries, to its parent).
+ * Everything in a read-mostly tree gets the longer ones. */
+static const struct lo_timeouts *lo_timeouts(fuse_req_t req, struct lo_inode *inode)
 {
-	return lo_inode(req, ino)->fd;
+	struct lo_data *lo = lo_data(req);
+	return inode->read_mostly ? &lo->readMostlyTimeouts : &lo->timeouts;
 }
 
-static struct lo_inode *lo_find(struct lo_data *lo, struct stat *st)
+/* Is this one of the directories that the admin flagged as read-mostly?  The
+ * flag is inherited, so we only need to ask when an inode is created. */
+static bool lo_is_read_mostly_dir(struct lo_data *lo, const struct stat *st)
 {
-	struct lo_inode *p;
-
-	for (p = lo->root.next; p != &lo->root; p = p->next) {
-		if (p->ino == st->st_ino && p->dev == st->st_dev)
-			return p;
+	size_t i;
+	for(i = 0; (i < lo->numReadMostlyDirs) && S_ISDIR(st->st_mode); i++) {
+		if((lo->readMostlyDirs[i].ino == st->st_ino) &&
+		   (lo->readMostlyDirs[i].dev == st->st_dev)) {
+			return true;
+		}
 	}
-	return NULL;
+	return false;
+}
+
+/* An inode's O_PATH fd, borrowed for as long as the LO_FD() variable is in
+ * scope (the inode table can close it any time that nobody is using it).
+ * fd is -1 (and errno is set) if the inode couldn't be reopened. */
+struct lo_fd_ref {
+	struct inode_table *inodes;
+	struct lo_inode *inode;
+	int fd;
+};
+
+static struct lo_fd_ref lo_fd_get(fuse_req_t req, fuse_ino_t ino)
+{
+	struct lo_fd_ref r = { &lo_data(req)->inodes, lo_inode(req, ino), -1 };
+	r.fd = inodeFdGet(r.inodes, r.inode);
+	return r;
 }
 
+static void lo_fd_put(struct lo_fd_ref *r)
+{
+	if(r->fd != -1)
+		inodeFdPut(r->inodes, r->inode);
+}
+
+#define LO_FD(var, req, ino) \
+	struct lo_fd_ref var __attribute__((cleanup(lo_fd_put))) = lo_fd_get(req, ino)
+
 /*
  * Returns:
  *   0 = success
@@ -223,12 +288,16 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 	int res;
 	int saverr;
 	struct lo_inode *inode;
+	struct lo_inode *dir = lo_inode(req, parent);
 
 	memset(e, 0, sizeof(*e));
-	e->attr_timeout = 1.0;
-	e->entry_timeout = 1.0;
 
-	newfd = openat(lo_fd(req, parent), name, O_PATH | O_NOFOLLOW);
+	LO_FD(dirFD, req, parent);
+	newfd = -1;
+	if (dirFD.fd == -1)
+		goto out_err;
+
+	newfd = STATS_BACKEND(openat(dirFD.fd, name, O_PATH | O_NOFOLLOW));
 	if (newfd == -1) {
 		saverr = errno;
 		LOG_TRACE(req, "openat() failed (%m).");
@@ -236,7 +305,7 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		goto out_err;
 	}
 
-	res = fstatat(newfd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+	res = STATS_BACKEND(fstatat(newfd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW));
 	if (res == -1) {
 		saverr = errno;
 		LOG_ERROR(req, "fstatat() failed (%m).");
@@ -244,33 +313,30 @@ static int lo_do_lookup(fuse_req_t req, fuse_ino_t parent, const char *name,
 		goto out_err;
 	}
 
-	inode = lo_find(lo_data(req), &e->attr);
-	if (inode) {
+	/* Find or create the inode.  Its nlookup count is bumped either way. */
+	bool created;
+	bool readMostly = dir->read_mostly || lo_is_read_mostly_dir(lo_data(req), &e->attr);
+	inode = inodeTableGet(&lo_data(req)->inodes, e->attr.st_dev, e->attr.st_ino,
+	                      newfd, S_ISLNK(e->attr.st_mode), readMostly, &created);
+	if (!inode)
+		goto out_err;
+	if (journalPending(inode))
+		journalStat(inode, &e->attr);
+	cryptStat(&e->attr);
+	compressStat(&e->attr);
+	if (created) {
+		inodeTableSetOrigin(&lo_data(req)->inodes, inode, dir, name);
+	}
+	else {
 		close(newfd);
-		newfd = -1;
-	} else {
-		struct lo_inode *prev = &lo_data(req)->root;
-		struct lo_inode *next = prev->next;
-		saverr = ENOMEM;
-		inode = calloc(1, sizeof(struct lo_inode));
-		if (!inode)
-			goto out_err;
-
-		inode->is_symlink = S_ISLNK(e->attr.st_mode);
-		inode->fd = newfd;
-		inode->ino = e->attr.st_ino;
-		inode->dev = e->attr.st_dev;
-
-		next->prev = inode;
-		inode->next = next;
-		inode->prev = prev;
-		prev->next = inode;
-	}
-	inode->nlookup++;
+	}
+	newfd = -1;
 	e->ino = (uintptr_t) inode;
+	e->attr_timeout = lo_timeouts(req, inode)->attr;
+	e->entry_timeout = lo_timeouts(req, dir)->entry;
 
-	LOG_TRACE(req, "%lli/%s -> %lli: fd %d: dev/ino %d/%d.",
-	          (unsigned long long) parent, name, (unsigned long long) e->ino, inode->fd,
+	LOG_TRACE(req, "%lli/%s -> %lli: dev/ino %d/%d.",
+	          (unsigned long long) parent, name, (unsigned long long) e->ino,
 	          inode->dev, inode->ino);
 
 	return 0;
@@ -282,15 +348,246 @@ out_err:
 	return saverr;
 }
 
-static void lo_free(struct lo_inode *inode)
+/* pread() until we have len bytes or hit the end of the file.
+ *
+ * Returns:
+ * >=0 = number of bytes read.
+ *  -1 = failure (errno = reason for failure).
+ */
+static ssize_t preadFull(int fd, char *buf, size_t len, off_t offset)
+{
+	size_t total = 0;
+	while(total < len) {
+		ssize_t n = STATS_BACKEND(pread(fd, buf + total, len - total, offset + total));
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0)
+			break;
+		total += n;
+	}
+	return total;
+}
+
+/* Look for a block in memory, then on the local disk.  Blocks that come off
+ * the disk are kept in memory too.
+ *
+ * Returns:
+ *  >=0 = number of bytes copied.
+ *   -1 = miss.
+ */
+static ssize_t lo_cache_get(struct lo_inode *inode, uint64_t blk,
+                            const struct cache_stamp *stamp, char *dst)
+{
+	ssize_t n = -1;
+	if(blockCacheEnabled())
+		n = blockCacheGet(inode->dev, inode->ino, blk, stamp, dst);
+	if((n == -1) && diskCacheEnabled()) {
+		n = diskCacheGet(inode->dev, inode->ino, blk, stamp, dst);
+		if((n >= 0) && blockCacheEnabled())
+			blockCachePut(inode->dev, inode->ino, blk, stamp, dst, n);
+	}
+	return n;
+}
+
+/* Add a block that we just read from the backend to both caches. */
+static void lo_cache_put(struct lo_inode *inode, uint64_t blk,
+                         const struct cache_stamp *stamp, const char *src, size_t len)
+{
+	if(blockCacheEnabled())
+		blockCachePut(inode->dev, inode->ino, blk, stamp, src, len);
+	if(diskCacheEnabled())
+		diskCachePut(inode->dev, inode->ino, blk, stamp, src, len);
+}
+
+/* Serve a read through the block cache.  The reply covers whole cache
+ * blocks, so we read [first, last] into one buffer: hits are copied out of
+ * the cache, and each run of consecutive misses is read from the backend with
+ * a single pread() and then added to the cache.
+ *
+ * For an encrypted file (cf != NULL), the cache holds what's on the backend,
+ * header and all.  The read is widened to whole encryption units, and only
+ * those are decrypted.
+ *
+ * Returns:
+ *   0 = success (the reply has been sent).
+ *  !0 = errno of failure (no reply has been sent).
+ */
+static int lo_read_cached(fuse_req_t req, struct lo_inode *inode, size_t size,
+                          off_t plainOffset, int fd, struct crypt_file *cf)
+{
+	/* Get the generation before we look at the backend.  See
+	 * inodeDataGen(). */
+	uint64_t gen = inodeDataGen(inode);
+
+	struct stat st;
+	if(STATS_BACKEND(fstat(fd, &st)) == -1)
+		return errno;
+
+	struct cache_stamp stamp;
+	blockCacheStamp(&stamp, &st, gen);
+
+	/* What to read from the backend: [offset, offset + want), of which
+	 * the reply starts skip bytes in. */
+	off_t offset = plainOffset;
+	size_t want = size;
+	size_t skip = 0;
+	if(cf != NULL) {
+		cryptReadBegin(cf);
+		cryptReadRange(cf, plainOffset, size, &offset, &want);
+		skip = CRYPT_HEADER_SZ + plainOffset - offset;
+	}
+
+	if((want == 0) || (offset + (off_t) skip >= st.st_size)) {
+		if(cf != NULL)
+			cryptReadEnd(cf);
+		fuse_reply_buf(req, NULL, 0);
+		return 0;
+	}
+
+	uint64_t first = offset / CACHE_BLOCK_SZ;
+	uint64_t last = (offset + want - 1) / CACHE_BLOCK_SZ;
+	char *buf = malloc((last - first + 1) * CACHE_BLOCK_SZ);
+	if(buf == NULL) {
+		if(cf != NULL)
+			cryptReadEnd(cf);
+		return ENOMEM;
+	}
+
+	/* The number of good bytes at the front of buf. */
+	size_t valid = 0;
+
+	uint64_t blk = first;
+	while(blk <= last) {
+		char *p = buf + ((blk - first) * CACHE_BLOCK_SZ);
+		ssize_t n = lo_cache_get(inode, blk, &stamp, p);
+		if(n >= 0) {
+			valid = (p - buf) + n;
+			if(n < CACHE_BLOCK_SZ)
+				break;
+			blk++;
+			continue;
+		}
+
+		/* Extend the run of misses as far as it goes.  If it ends on a
+		 * hit, that block has already been copied into place. */
+		uint64_t end = blk + 1;
+		ssize_t hit = -1;
+		while(end <= last) {
+			char *q = buf + ((end - first) * CACHE_BLOCK_SZ);
+			hit = lo_cache_get(inode, end, &stamp, q);
+			if(hit >= 0)
+				break;
+			end++;
+		}
+
+		size_t need = (end - blk) * CACHE_BLOCK_SZ;
+		ssize_t got = preadFull(fd, p, need, blk * CACHE_BLOCK_SZ);
+		if(got == -1) {
+			int error = errno;
+			if(cf != NULL)
+				cryptReadEnd(cf);
+			free(buf);
+			return error;
+		}
+
+		uint64_t b;
+		for(b = 0; (b * CACHE_BLOCK_SZ) < got; b++) {
+			size_t len = got - (b * CACHE_BLOCK_SZ);
+			if(len > CACHE_BLOCK_SZ)
+				len = CACHE_BLOCK_SZ;
+			lo_cache_put(inode, blk + b, &stamp, p + (b * CACHE_BLOCK_SZ), len);
+		}
+
+		valid = (p - buf) + got;
+		if(got < need)
+			break;
+
+		if(hit >= 0) {
+			valid = ((end - first) * CACHE_BLOCK_SZ) + hit;
+			if(hit < CACHE_BLOCK_SZ)
+				break;
+		}
+		blk = end + 1;
+	}
+
+	size_t start = offset - (first * CACHE_BLOCK_SZ);
+	size_t len = (valid > start) ? (valid - start) : 0;
+	if(len > want)
+		len = want;
+	if(cf != NULL) {
+		cryptDecrypt(cf, buf + start, len, offset);
+		cryptReadEnd(cf);
+	}
+
+	len = (len > skip) ? (len - skip) : 0;
+	if(len > size)
+		len = size;
+	fuse_reply_buf(req, buf + start + skip, len);
+
+	free(buf);
+	return 0;
+}
+
+/* Read from an encrypted file without the block cache.  The read is widened
+ * to whole encryption units.
+ *
+ * Returns:
+ *   0 = success (the reply has been sent).
+ *  !0 = errno of failure (no reply has been sent).
+ */
+static int lo_read_crypt(fuse_req_t req, struct lo_inode *inode, struct crypt_file *cf,
+                         size_t size, off_t offset, int fd)
 {
-	struct lo_inode *prev = inode->prev;
-	struct lo_inode *next = inode->next;
+	cryptReadBegin(cf);
+	off_t from;
+	size_t want;
+	cryptReadRange(cf, offset, size, &from, &want);
+	char *buf = engineReplyBuf(want);
+	ssize_t got = -1;
+	int error = ENOMEM;
+	if(buf != NULL) {
+		got = journalRead(inode, fd, buf, want, from);
+		error = (got == -1) ? errno : 0;
+	}
+	if(got > 0)
+		cryptDecrypt(cf, buf, got, from);
+	cryptReadEnd(cf);
+	if(error != 0)
+		return error;
+
+	size_t head = CRYPT_HEADER_SZ + offset - from;
+	if(got <= (ssize_t) head) {
+		fuse_reply_buf(req, NULL, 0);
+		return 0;
+	}
+	size_t len = got - head;
+	if(len > size)
+		len = size;
+	fuse_reply_buf(req, buf + head, len);
+	return 0;
+}
 
-	next->prev = prev;
-	prev->next = next;
-	close(inode->fd);
-	free(inode);
+/* Read from a file that has journaled writes that aren't on the NAS yet.
+ *
+ * Returns:
+ *   0 = success (the reply has been sent).
+ *  !0 = errno of failure (no reply has been sent).
+ */
+static int lo_read_journal(fuse_req_t req, struct lo_inode *inode, size_t size,
+                           off_t offset, int fd)
+{
+	char *buf = engineReplyBuf(size);
+	if(buf == NULL)
+		return ENOMEM;
+
+	ssize_t got = journalRead(inode, fd, buf, size, offset);
+	if(got == -1)
+		return errno;
+	fuse_reply_buf(req, buf, got);
+	return 0;
 }
 
 /* Get the lo_dirp data structure that is being used to manage the multiple
@@ -300,38 +597,424 @@ static struct lo_dirp *lo_dirp(struct fuse_file_info *fi)
 	return (struct lo_dirp *) (uintptr_t) fi->fh;
 }
 
+/* Get the lo_file data structure for an open file. */
+static struct lo_file *lo_file(struct fuse_file_info *fi)
+{
+	return (struct lo_file *) (uintptr_t) fi->fh;
+}
+
+/* FUSE passthrough.  The kernel only allows one backing file per inode at a
+ * time, so every passthrough open of an inode shares the backing id that
+ * the first one registered, and the last release drops it.  (The kernel
+ * opens its own file for each open, with that open's flags, so it doesn't
+ * matter which fd got registered.)  Registration is an ioctl on the FUSE
+ * device, not a NAS call, so one lock for all of them is fine. */
+static pthread_mutex_t lo_passthrough_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Try to hand an open file to the kernel.
+ *
+ * Returns true if the kernel will do its I/O.
+ */
+static bool lo_passthrough_open(fuse_req_t req, fuse_ino_t ino, int fd,
+                                struct fuse_file_info *fi)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	if(!lo_data(req)->passthrough)
+		return false;
+
+	struct lo_inode *inode = lo_inode(req, ino);
+	bool ok = true;
+
+	pthread_mutex_lock(&lo_passthrough_lock);
+	if(inode->backingOpens == 0) {
+		int id = fuse_passthrough_open(req, fd);
+		if(id > 0)
+			inode->backingId = id;
+		else
+			ok = false;
+	}
+	if(ok) {
+		inode->backingOpens++;
+		fi->backing_id = inode->backingId;
+	}
+	pthread_mutex_unlock(&lo_passthrough_lock);
+
+	if(ok)
+		statsCount(STATS_CTR_passthrough_opens, 1);
+	else
+		LOG_TRACE(req, "fuse_passthrough_open(%d) failed (%m).", fd);
+	return ok;
+#else
+	(void) req, ino, fd, fi;
+	return false;
+#endif
+}
+
+/* Call before replying to the release.  The session is only ours to use
+ * until then. */
+static void lo_passthrough_close(fuse_req_t req, fuse_ino_t ino)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+	struct lo_inode *inode = lo_inode(req, ino);
+
+	pthread_mutex_lock(&lo_passthrough_lock);
+	if(--inode->backingOpens == 0) {
+		fuse_passthrough_close(req, inode->backingId);
+		inode->backingId = 0;
+	}
+	pthread_mutex_unlock(&lo_passthrough_lock);
+#else
+	(void) req, ino;
+#endif
+}
+
+/* An O_TRUNC create can truncate a file that already exists.  Its journaled
+ * writes have to land first, or the destager would put them back. */
+static void lo_journal_flush_name(fuse_req_t req, int dirFd, const char *name)
+{
+	if(!journalEnabled())
+		return;
+
+	struct stat st;
+	if(STATS_BACKEND(fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW)) == -1)
+		return;
+
+	struct lo_data *lo = lo_data(req);
+	struct lo_inode *inode = inodeTableFind(&lo->inodes, st.st_dev, st.st_ino);
+	if(inode != NULL) {
+		journalFlushInode(inode);
+		inodeTableUnref(&lo->inodes, inode, 1);
+	}
+}
+
+/* Move the first copies of chunks that have gone into the chunk store over
+ * to it (see proxy_dedup.h).  The files are found in the inode table; one
+ * that the kernel has forgotten keeps its copy.  Called after a write has let
+ * go of its own file, since the first copy can be in any file, that one
+ * included. */
+static void lo_dedup_repoint(fuse_req_t req)
+{
+	struct lo_data *lo = lo_data(req);
+	struct dedup_origin origin;
+	struct dedup_ref ref;
+	while(dedupRepointNext(&origin, &ref)) {
+		int error = ENOENT;
+		struct lo_inode *inode = inodeTableFind(&lo->inodes, origin.dev, origin.ino);
+		if(inode != NULL) {
+			int ifd = inodeFdGet(&lo->inodes, inode);
+			if(ifd != -1) {
+				char linkName[PROCFS_LINK_SZ];
+				linkFromFD(ifd, linkName, sizeof(linkName));
+				int fd = STATS_BACKEND(open(linkName, O_RDWR));
+				if(fd != -1) {
+					error = compressRepoint(inode, fd, origin.chunk, &ref);
+					close(fd);
+				}
+				inodeFdPut(&lo->inodes, inode);
+			}
+			inodeTableUnref(&lo->inodes, inode, 1);
+		}
+		statsCount((error == 0) ? STATS_CTR_dedup_repointed : STATS_CTR_dedup_repoint_skipped, 1);
+	}
+}
+
+/* Is what's on the backend something other than the application's bytes
+ * (encrypted or compressed)?  Then the backend's sizes and offsets aren't the
+ * application's, and only we can read or write the data. */
+static bool lo_transformed(void)
+{
+	return cryptEnabled() || compressEnabled();
+}
+
+/* Fix up the open flags for writeback-cache mode.  The kernel fills in the
+ * rest of a partly written page by reading it through whichever file is
+ * being written, so write-only opens have to be able to read.  It also works
+ * out where O_APPEND writes go from the size that it caches, and sends them
+ * with the right offsets.  If we kept O_APPEND, pwrite() would ignore those
+ * offsets and stick the data on the end of the file again.
+ *
+ * Encryption needs the same: the first open of a file reads its header, and
+ * every write has to land where the kernel said, since that's what it was
+ * encrypted for.  The backend offsets are shifted by the header, so O_DIRECT
+ * can't be passed on either.  Compression is the same again, and it reads
+ * back the rest of each chunk that a write only covers part of.
+ *
+ * Returns:
+ *   true  = A write-only open was turned into a read-write one.
+ *   false = The access mode didn't change.
+ */
+static bool lo_writeback_flags(fuse_req_t req, struct fuse_file_info *fi)
+{
+	if(lo_transformed())
+		fi->flags &= ~O_DIRECT;
+	else if(!lo_data(req)->writeback)
+		return false;
+
+	fi->flags &= ~O_APPEND;
+	if((fi->flags & O_ACCMODE) != O_WRONLY)
+		return false;
+
+	fi->flags = (fi->flags & ~O_ACCMODE) | O_RDWR;
+	return true;
+}
+
+/* Undo lo_writeback_flags() when the caller may write the file but not read
+ * it.  The open works, but the kernel can't fill in partial pages, so writes
+ * that don't cover whole pages will fail with EBADF. */
+static void lo_writeback_demote(fuse_req_t req, struct fuse_file_info *fi)
+{
+	LOG_AT(req, LOG_INFO, "No read access.  Opening write-only.");
+	fi->flags = (fi->flags & ~O_ACCMODE) | O_WRONLY;
+}
+
+/* Set up the lo_file for a file that we just opened, and hang it on fi.
+ * If the kernel can do the file's I/O itself (passthrough), that's all.
+ * Writes to files that the journal covers go to the journal.
+ * Otherwise, writable files get a write buffer, unless the application asked for its
+ * writes to go straight to the disk (O_SYNC, O_DIRECT) or to land at the end
+ * of the file (O_APPEND, which ignores the offsets that we'd write at).
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.  fd is still open.
+ */
+static int lo_file_new(fuse_req_t req, fuse_ino_t ino, int fd,
+                       struct fuse_file_info *fi)
+{
+	struct lo_file *f = calloc(1, sizeof(struct lo_file));
+	if(f == NULL)
+		return ENOMEM;
+	f->fd = fd;
+	f->ringSlot = -1;
+
+	/* Get the file's key (and give a new file its header).  O_TRUNC was
+	 * kept from the backend, so the header would survive.  A compressed
+	 * file does this itself, underneath its own header. */
+	if(cryptEnabled() && !compressEnabled()) {
+		struct lo_inode *inode = lo_inode(req, ino);
+		bool writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+		int error = cryptOpen(inode, fd, writable);
+		if((error == 0) && writable && (fi->flags & O_TRUNC))
+			error = cryptTruncate(inode, fd, 0);
+		if(error != 0) {
+			free(f);
+			return error;
+		}
+	}
+
+	/* The same for a compressed file. */
+	if(compressEnabled()) {
+		struct lo_inode *inode = lo_inode(req, ino);
+		bool writable = (fi->flags & O_ACCMODE) != O_RDONLY;
+		int error = compressOpen(inode, fd, writable);
+		if((error == 0) && writable && (fi->flags & O_TRUNC))
+			error = compressTruncate(inode, fd, 0);
+		if(error != 0) {
+			free(f);
+			return error;
+		}
+	}
+
+	/* Nothing can fail after this, so there's nothing to undo. */
+	if(lo_passthrough_open(req, ino, fd, fi)) {
+		f->passthrough = true;
+		fi->fh = (uintptr_t) f;
+		return 0;
+	}
+
+	f->ringSlot = uringAddFile(fd);
+
+	if(journalCovers(lo_inode(req, ino), fi->flags)) {
+		f->journal = true;
+	}
+	else if(writeBufEnabled() && !compressEnabled() && ((fi->flags & O_ACCMODE) != O_RDONLY) &&
+	   !(fi->flags & (O_SYNC | O_DSYNC | O_DIRECT | O_APPEND))) {
+		f->wb = writeBufOpen(fd, lo_inode(req, ino));
+		if(f->wb == NULL) {
+			uringRemoveFile(f->ringSlot);
+			free(f);
+			return ENOMEM;
+		}
+	}
+
+	fi->fh = (uintptr_t) f;
+	return 0;
+}
+
+/* Worker pool callback.  Look up one name from a readdirplus batch. */
+static void lo_readdir_lookup(void *arg, size_t i)
+{
+	struct lo_readdir_batch *batch = arg;
+	struct lo_dirent *ent = &batch->ents[i];
+	ent->err = lo_do_lookup(batch->req, batch->parent, ent->name, &ent->e);
+}
+
+/* Add one batch of readdirplus entries to p.
+ *
+ * The names are read first, and we stop at the first one that won't fit in
+ * the reply, so we only do lookups (which bump nlookup) for entries that we
+ * are going to return.  Then the lookups run side by side on the worker pool.
+ * If one of them fails, the entries after it give their lookups back and the
+ * directory is rewound to the failed entry.  Names that vanished between
+ * readdir() and the lookup are skipped.
+ *
+ * Returns:
+ *   0 = success.  *used = bytes added.  *full = don't call again.
+ *  !0 = errno of failure.  The entries that were added before it are good.
+ */
+static int lo_readdirplus_batch(fuse_req_t req, fuse_ino_t ino, struct lo_dirp *d,
+                                struct lo_dirent *ents, char *p, size_t rem,
+                                size_t *used, bool *full)
+{
+	size_t n = 0;
+	size_t need = 0;
+	int err = 0;
+
+	*used = 0;
+	*full = false;
+
+	while(n < LO_READDIR_BATCH) {
+		if(!d->entry) {
+			errno = 0;
+			d->entry = STATS_BACKEND(readdir(d->dp));
+			if(!d->entry) {
+				err = errno;
+				*full = true;
+				break;
+			}
+		}
+
+		off_t nextoff = telldir(d->dp);
+		const char *name = d->entry->d_name;
+
+		/* See the comment about "." and ".." in lo_do_readdir(). */
+		if((strcmp(name, ".") != 0) && (strcmp(name, "..") != 0)) {
+			size_t entsize = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
+			if((need + entsize) > rem) {
+				*full = true;
+				break;
+			}
+
+			need += entsize;
+			strcpy(ents[n].name, name);
+			ents[n].offset = d->offset;
+			ents[n].nextoff = nextoff;
+			n++;
+		}
+
+		d->entry = NULL;
+		d->offset = nextoff;
+	}
+
+	/* A readdir() error only counts if it's the first thing in the batch.
+	 * Otherwise we return what we have, and the error on the next call. */
+	if((n > 0) && (err != 0)) {
+		d->err = err;
+		err = 0;
+	}
+
+	struct lo_readdir_batch batch = { .req = req, .parent = ino, .ents = ents };
+	workPoolRun(lo_readdir_lookup, &batch, n);
+
+	size_t i;
+	for(i = 0; i < n; i++) {
+		struct lo_dirent *ent = &ents[i];
+		if(ent->err == ENOENT) {
+			continue;
+		}
+		if(ent->err) {
+			err = ent->err;
+			break;
+		}
+
+		size_t entsize = fuse_add_direntry_plus(req, p + *used, rem - *used,
+		                                        ent->name, &ent->e, ent->nextoff);
+		if(entsize > (rem - *used)) {
+			break;
+		}
+		*used += entsize;
+	}
+
+	/* If the new entries won't all fit into this READDIR buffer, then
+	 * decrement the nlookup counts of the ones we're not returning so we
+	 * don't artificially inflate them. */
+	if(i < n) {
+		size_t j;
+		for(j = i; j < n; j++) {
+			if(ents[j].err == 0) {
+				inodeTableUnref(&lo_data(req)->inodes,
+				                lo_inode(req, ents[j].e.ino), 1);
+			}
+		}
+		seekdir(d->dp, ents[i].offset);
+		d->entry = NULL;
+		d->offset = ents[i].offset;
+		*full = true;
+	}
+
+	return err;
+}
+
 /* The main processing of both readdir and readdirplus operations. */
 static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 			  off_t offset, struct fuse_file_info *fi, int plus)
 {
 	struct lo_dirp *d = lo_dirp(fi);
+	struct lo_dirent *ents = NULL;
 	char *buf;
 	char *p;
-	size_t rem = 0;
+	size_t rem = size;
 	int err;
 
-	(void) ino;
-
-	buf = calloc(size, 1);
+	/* The reply is built in the thread's own buffer.  fuse_reply_buf()
+	 * copies it out before we're done with it. */
+	buf = engineReplyBuf(size);
 	if (!buf) {
 		err = ENOMEM;
 		goto error;
 	}
 
+	if (plus) {
+		ents = malloc(LO_READDIR_BATCH * sizeof(struct lo_dirent));
+		if (!ents) {
+			err = ENOMEM;
+			goto error;
+		}
+	}
+
 	if (offset != d->offset) {
 		seekdir(d->dp, offset);
 		d->entry = NULL;
 		d->offset = offset;
+		d->err = 0;
 	}
 	p = buf;
 	rem = size;
-	while (1) {
+
+	/* The last call hit an error after it had entries to return. */
+	if (d->err) {
+		err = d->err;
+		d->err = 0;
+		goto error;
+	}
+	while (plus) {
+		size_t used;
+		bool full;
+		err = lo_readdirplus_batch(req, ino, d, ents, p, rem, &used, &full);
+		p += used;
+		rem -= used;
+		if (err)
+			goto error;
+		if (full)
+			break;
+	}
+	while (!plus) {
 		size_t entsize;
 		off_t nextoff;
 
 		if (!d->entry) {
 			errno = 0;
-			d->entry = readdir(d->dp);
+			d->entry = STATS_BACKEND(readdir(d->dp));
 			if (!d->entry) {
 				if(errno) {
 					err = errno;
@@ -350,26 +1033,7 @@ static void lo_do_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 			entsize = 0;
 		}
 
-		else if (plus) {
-			struct fuse_entry_param e;
-
-			err = lo_do_lookup(req, ino, d->entry->d_name, &e);
-			if (err)
-				goto error;
-
-			entsize = fuse_add_direntry_plus(req, p, rem,
-							 d->entry->d_name,
-							 &e, nextoff);
-
-			/* If the new entry won't fit into this READDIR buffer,
-			 * then decrement the nlookup count so we don't
-			 * artificially inflate it. */
-			if(entsize > rem) {
-				struct lo_inode *i = lo_find(lo_data(req), &e.attr);
-				i->nlookup--;
-			}
-
-		} else {
+		else {
 			struct stat st = {
 				.st_ino = d->entry->d_ino,
 				.st_mode = d->entry->d_type << 12,
@@ -394,8 +1058,11 @@ error:
 	/* According to libfuse latest documentation, only signal error if we
 	 * haven't stored any entries yet otherwise we'd end up with wrong lookup
 	 * counts for the entries that are already in the buffer.  So we return
-	 * what we've collected until that point. */
+	 * what we've collected until that point, and the error next time. */
 
+	if(err && rem != size) {
+		d->err = err;
+	}
 	if(err && rem == size) {
 		fuse_reply_err(req, err);
 	}
@@ -403,112 +1070,121 @@ error:
 		fuse_reply_buf(req, buf, size - rem);
 	}
 
-	free(buf);
+	free(ents);
 }
 
 /* Called from several functions:
  *    symlink - S_IFLNK(mode) = Symbolic link.
  *
- *    mknod   - S_IFDIR(mode) = Directory.
- *              S_IFLNK(mode) = Hard link.
- *              S_IFREG(mode) = Regular file.
+ *    mknod   - S_IFREG(mode) = Regular file.
+ *              Anything else = Device node, FIFO or socket.
+ *
+ * The new node is given to the caller (the proxy runs as root), and gets its
+ * mode (a symlink's mode can't be set).
  */
 static void lo_mknod_symlink(fuse_req_t req, fuse_ino_t parent,
                              const char *name, mode_t mode, dev_t rdev,
                              const char *link)
 {
-	int newfd = -1;
 	int res;
-	int saverr = ENOMEM;
-	struct lo_inode *dir = lo_inode(req, parent);
-	int dirFD = dir->fd;
+	int saverr = 0;
+	struct fuse_entry_param e;
+	LO_FD(dir, req, parent);
+	int dirFD = dir.fd;
 
 	do {
-		struct lo_inode *inode = calloc(1, sizeof(struct lo_inode));
-		if(inode == NULL) {
-			LOG_ERROR(req, "Unable to allocate inode.");
+		if(dirFD == -1) {
+			saverr = errno;
 			break;
 		}
 
-		if(S_ISLNK(mode)) {
-			res = symlinkat(link, dirFD, name);
-			saverr = errno;
-			LOG_TRACE(req, "symlinkat(%s, %d, %s) returned %d",
-			          link, dirFD, name, res);
-			if(res == -1) {
-				LOG_ERROR(req, "symlinkat(%s, %d, %s) failed (%m).",
-				          link, dirFD, name);
-				errno = saverr;
-				break;
-			}
-		}
+		const struct fuse_ctx *ctx = fuse_req_ctx(req);
 
-		else if(S_ISREG(mode)) {
+		if(S_ISREG(mode)) {
 			int flags = O_CREAT | O_EXCL | O_WRONLY;
-			res = openat(dirFD, name, flags, mode);
-			saverr = errno;
+			int fd = STATS_BACKEND(openat(dirFD, name, flags, mode));
 			LOG_TRACE(req, "openat(%d, %s, %x, %o) returned %d",
-			          dirFD, name, flags, mode, res);
-			if(res == -1) {
+			          dirFD, name, flags, mode, fd);
+			if(fd == -1) {
+				saverr = errno;
 				LOG_ERROR(req, "openat(%d, %s, %x, %o) failed (%m).",
 				          dirFD, name, flags, mode);
-				errno = saverr;
 				break;
 			}
+
+			res = STATS_BACKEND(fchown(fd, ctx->uid, ctx->gid));
+			if(res == -1) {
+				saverr = errno;
+				LOG_ERROR(req, "fchown(%d, %d, %d) failed (%m).",
+				          fd, ctx->uid, ctx->gid);
+			}
+			else if((res = STATS_BACKEND(fchmod(fd, mode))) == -1) {
+				saverr = errno;
+				LOG_ERROR(req, "fchmod(%d, %o) failed (%m).", fd, mode);
+			}
+			close(fd);
+			if(res == -1)
+				break;
 		}
 
 		else {
-			res = mknodat(dirFD, name, mode, rdev);
-			saverr = errno;
-			LOG_TRACE(req, "mknodat(%d, %s, %o, %d) returned %d",
-			          dirFD, name, mode, rdev, res);
+			if(S_ISLNK(mode)) {
+				res = STATS_BACKEND(symlinkat(link, dirFD, name));
+				LOG_TRACE(req, "symlinkat(%s, %d, %s) returned %d",
+				          link, dirFD, name, res);
+			}
+			else {
+				res = STATS_BACKEND(mknodat(dirFD, name, mode, rdev));
+				LOG_TRACE(req, "mknodat(%d, %s, %o, %d) returned %d",
+				          dirFD, name, mode, rdev, res);
+			}
 			if(res == -1) {
-				LOG_ERROR(req, "mknodat(%d, %s, %o, %d) failed (%m).",
-				          dirFD, name, mode, rdev);
-				errno = saverr;
+				saverr = errno;
+				LOG_ERROR(req, "Creating %s in %d failed (%m).", name, dirFD);
 				break;
 			}
-		}
 
-		const struct fuse_ctx *ctx = fuse_req_ctx(req);
-
-		if(fchown(res, ctx->uid, ctx->gid) != 0) {
-			saverr = errno;
-			LOG_ERROR(req, "fchown(%d, %d, %d, 0) failed (%m).",
-			          res, ctx->uid, ctx->gid);
-			errno = saverr;
-			break;
-		}
-
-		if(fchmod(res, mode) == -1) {
-			saverr = errno;
-			LOG_ERROR(req, "fchmod(%d, %o) failed (%m).", res, mode);
-			break;
+			/* There's nothing to open, so go through the name. */
+			res = STATS_BACKEND(fchownat(dirFD, name, ctx->uid, ctx->gid,
+			                             AT_SYMLINK_NOFOLLOW));
+			if(res == -1) {
+				saverr = errno;
+				LOG_ERROR(req, "fchownat(%d, %s, %d, %d) failed (%m).",
+				          dirFD, name, ctx->uid, ctx->gid);
+				break;
+			}
+			if(!S_ISLNK(mode) &&
+			   (STATS_BACKEND(fchmodat(dirFD, name, mode, 0)) == -1)) {
+				saverr = errno;
+				LOG_ERROR(req, "fchmodat(%d, %s, %o) failed (%m).", dirFD, name, mode);
+				break;
+			}
 		}
 
-		struct fuse_entry_param e;
 		saverr = lo_do_lookup(req, parent, name, &e);
 		if(saverr != 0) {
 			LOG_ERROR(req, "lo_do_lookup() failed.");
 			break;
 		}
-
-		fuse_reply_entry(req, &e);
-
 	} while(0);
 
-	fuse_reply_err(req, errno);
+	if(saverr == 0) {
+		fuse_reply_entry(req, &e);
+	}
+	else {
+		fuse_reply_err(req, saverr);
+	}
 }
 
-static int utimensat_empty_nofollow(struct lo_inode *inode, struct timespec *tv)
+static int utimensat_empty_nofollow(struct lo_inode *inode, int fd, struct timespec *tv)
 {
 	int res;
 
 	do {
 		if(inode->is_symlink) {
-			res = utimensat(inode->fd, "", tv, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+			res = STATS_BACKEND(utimensat(fd, "", tv, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW));
 			if((res == -1) && (errno == EINVAL)) {
-				LOG_ERROR(NULL, "utimensat(%d, ...) failed (%m).", inode->fd);
+				LOG_ERROR(NULL, "utimensat(%d, ...) failed (%m).", fd);
 				errno = EPERM;
 			}
 
@@ -516,8 +1192,8 @@ static int utimensat_empty_nofollow(struct lo_inode *inode, struct timespec *tv)
 		}
 
 		char linkName[PROCFS_LINK_SZ];
-		linkFromFD(inode->fd, linkName, sizeof(linkName));
-		res = utimensat(AT_FDCWD, linkName, tv, 0);
+		linkFromFD(fd, linkName, sizeof(linkName));
+		res = STATS_BACKEND(utimensat(AT_FDCWD, linkName, tv, 0));
 		if(res == -1) {
 			int saverr = errno;
 			LOG_ERROR(NULL, "utimensat() failed (%m).");
@@ -529,77 +1205,280 @@ static int utimensat_empty_nofollow(struct lo_inode *inode, struct timespec *tv)
 	return res;
 }
 
-static int linkat_empty_nofollow(struct lo_inode *inode, int dfd, const char *name)
+static int linkat_empty_nofollow(struct lo_inode *inode, int fd, int dfd, const char *name)
+{
+	int res;
+	do {
+		if(inode->is_symlink) {
+			res = STATS_BACKEND(linkat(fd, "", dfd, name, AT_EMPTY_PATH));
+			if((res == -1) && ((errno == ENOENT) || (errno == EINVAL))) {
+				LOG_ERROR(NULL, "Can't hard-link a symlink.");
+				errno = EPERM;
+			}
+			break;
+		}
+
+		char linkName[PROCFS_LINK_SZ];
+		linkFromFD(fd, linkName, sizeof(linkName));
+		res = STATS_BACKEND(linkat(AT_FDCWD, linkName, dfd, name, AT_SYMLINK_FOLLOW));
+		if(res == -1) {
+			int saverr = errno;
+			LOG_ERROR(NULL, "linkat() failed (%m).");
+			errno = saverr;
+			break;
+		}
+
+	} while(0);
+
+	return res;
+}
+
+/* *****************************************************************************
+ * THE EXPORTED API FUNCTIONS.
+ * ****************************************************************************/
+
+static void lo_init(void *userdata, struct fuse_conn_info *conn)
+{
+	struct lo_data *lo = (struct lo_data *) userdata;
+	LOG_ENTER(NULL, "userdata %p : conn %p..", userdata, conn);
+
+	profileNegotiate(conn);
+
+	/* With the writeback cache, the kernel keeps track of the size and
+	 * mtime of the files that it's writing, and we get the writes later
+	 * and in bigger pieces.  The data has to come through us for that,
+	 * so it's one or the other with passthrough. */
+	if(lo->writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		lo->passthrough = false;
+	}
+	else {
+		lo->writeback = false;
+		conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+	}
+	LOG_STATUS(NULL, "Writeback cache: %s.", lo->writeback ? "on" : "off");
+
+	/* The journal, the encryption and the compression have to see the
+	 * data, too. */
+	if(journalEnabled() || lo_transformed())
+		lo->passthrough = false;
+
+	/* Passthrough needs a kernel (6.9+) and a libfuse (3.16+) that know
+	 * about it.  Without it, the data goes through us like always. */
+#ifdef FUSE_CAP_PASSTHROUGH
+	if(lo->passthrough && (conn->capable & FUSE_CAP_PASSTHROUGH))
+		conn->want |= FUSE_CAP_PASSTHROUGH;
+	else
+		lo->passthrough = false;
+#else
+	lo->passthrough = false;
+#endif
+	LOG_STATUS(NULL, "Passthrough: %s.", lo->passthrough ? "on" : "off");
+	profileReport(conn);
+}
+
+/* The most that one copy_file_range request copies (the reply's count is 32
+ * bits), and the most that the fallback copies, which ties up the thread for
+ * as long as it takes.  The kernel asks again for the rest. */
+#define LO_COPY_MAX          (1024 * 1024 * 1024)
+#define LO_COPY_FALLBACK_MAX (64 * 1024 * 1024)
+#define LO_COPY_BUF_SZ       (4 * 1024 * 1024)
+
+/* Set once the backend says it has no copy_file_range() at all. */
+static bool lo_copy_no_offload = false;
+
+/* Copy len bytes the slow way: read them into the proxy and write them back
+ * out, a big buffer at a time.
+ *
+ * Returns:
+ *  >=0 = The number of bytes copied (short at the end of the source).
+ *   -1 = failure (errno is set), and nothing was copied.
+ */
+static ssize_t lo_copy_fallback(int fdIn, off_t offIn, int fdOut, off_t offOut, size_t len)
 {
-	int res;
-	do {
-		if(inode->is_symlink) {
-			res = linkat(inode->fd, "", dfd, name, AT_EMPTY_PATH);
-			if((res == -1) && ((errno == ENOENT) || (errno == EINVAL))) {
-				LOG_ERROR(NULL, "Can't hard-link a symlink.");
-				errno = EPERM;
+	if(len > LO_COPY_FALLBACK_MAX)
+		len = LO_COPY_FALLBACK_MAX;
+	char *buf = malloc(LO_COPY_BUF_SZ);
+	if(buf == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	size_t total = 0;
+	while(total < len) {
+		size_t want = (len - total < LO_COPY_BUF_SZ) ? len - total : LO_COPY_BUF_SZ;
+		ssize_t got = preadFull(fdIn, buf, want, offIn + total);
+		if(got <= 0) {
+			if((got == -1) && (total == 0)) {
+				free(buf);
+				return -1;
 			}
 			break;
 		}
 
-		char linkName[PROCFS_LINK_SZ];
-		linkFromFD(inode->fd, linkName, sizeof(linkName));
-		res = linkat(AT_FDCWD, linkName, dfd, name, AT_SYMLINK_FOLLOW);
-		if(res == -1) {
-			int saverr = errno;
-			LOG_ERROR(NULL, "linkat() failed (%m).");
-			errno = saverr;
-			break;
+		ssize_t put = 0;
+		while(put < got) {
+			ssize_t n = STATS_BACKEND(pwrite(fdOut, buf + put, got - put, offOut + total + put));
+			if(n == -1) {
+				if(errno == EINTR)
+					continue;
+				if(total + put > 0)
+					break;
+				free(buf);
+				return -1;
+			}
+			put += n;
 		}
+		total += put;
+		if((put < got) || (got < (ssize_t) want))
+			break;
+	}
+	free(buf);
+	statsCount(STATS_CTR_copy_fallback_bytes, total);
+	return total;
+}
 
-	} while(0);
+/* Copy a range from one file to another without the data coming up to the
+ * kernel and back.  The backend's copy_file_range() keeps it on the NAS
+ * (NFSv4.2 server-side copy, or a reflink).  If the backend can't do that
+ * for these two files, we copy it ourselves, which still saves the trips
+ * through FUSE.  The op's latency histogram and the copy_*_bytes counters
+ * give the throughput.
+ *
+ * Encrypted and compressed files can't be copied as they are on the backend
+ * (each file has its own key, and its own chunk layout).  ENOSYS makes the
+ * kernel stop asking, and do the copy with reads and writes through us. */
+static void lo_copy_file_range(fuse_req_t req, fuse_ino_t inoIn, off_t offIn,
+                               struct fuse_file_info *fiIn, fuse_ino_t inoOut,
+                               off_t offOut, struct fuse_file_info *fiOut,
+                               size_t len, int flags)
+{
+	STATS_OP(copy_file_range);
+	LO_TRACE(inoIn, offIn, len);
+	LOG_ENTER(req, "nodeid %" PRIu64 " : off %ld -> nodeid %" PRIu64 " : off %ld : len %zu.",
+	          inoIn, offIn, inoOut, offOut, len);
+
+	if(lo_transformed()) {
+		fuse_reply_err(req, ENOSYS);
+		LOG_EXIT(req, "nodeid %" PRIu64 " : transformed.", inoIn);
+		return;
+	}
 
-	return res;
-}
+	/* The copy reads and writes the backend directly, so anything that's
+	 * still on its way there has to land first, on both sides. */
+	struct lo_inode *in = lo_inode(req, inoIn);
+	struct lo_inode *out = lo_inode(req, inoOut);
+	writeBufFlushInode(in);
+	journalFlushInode(in);
+	writeBufFlushInode(out);
+	journalFlushInode(out);
+
+	if(len > LO_COPY_MAX)
+		len = LO_COPY_MAX;
+
+	int fdIn = lo_file(fiIn)->fd;
+	int fdOut = lo_file(fiOut)->fd;
+	ssize_t res = -1;
+	errno = ENOSYS;
+	if(!__atomic_load_n(&lo_copy_no_offload, __ATOMIC_RELAXED)) {
+		loff_t from = offIn;
+		loff_t to = offOut;
+		res = STATS_BACKEND(copy_file_range(fdIn, &from, fdOut, &to, len, flags));
+		if(res >= 0) {
+			statsCount(STATS_CTR_copy_offload_bytes, res);
+		}
+		else if(errno == ENOSYS) {
+			LOG_STATUS(req, "The backend can't do copy_file_range().  Copying through the proxy.");
+			__atomic_store_n(&lo_copy_no_offload, true, __ATOMIC_RELAXED);
+		}
+	}
+	if((res == -1) && (flags == 0) &&
+	   ((errno == ENOSYS) || (errno == EXDEV) || (errno == EOPNOTSUPP))) {
+		res = lo_copy_fallback(fdIn, offIn, fdOut, offOut, len);
+	}
 
-/* *****************************************************************************
- * THE EXPORTED API FUNCTIONS.
- * ****************************************************************************/
+	if(res > 0) {
+		inodeDataChanged(out);
+	}
+	if(res == -1) {
+		int error = errno;
+		LOG_TRACE(req, "copy failed (%m).");
+		fuse_reply_err(req, error);
+	}
+	else {
+		fuse_reply_write(req, res);
+	}
 
-static void lo_init(void *userdata, struct fuse_conn_info *conn)
-{
-	(void) userdata, conn;
-	LOG_ENTER(NULL, "userdata %p : conn %p..", userdata, conn);
+	LOG_EXIT(req, "nodeid %" PRIu64 " -> nodeid %" PRIu64 " : res %zd.", inoIn, inoOut, res);
 }
 
 static void lo_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
 {
-	const char *accessModeStr = "";
-	if(logToSyslog) {
-		accessModeStr = fuseAccessModeToString(fi->flags);
-	}
+	STATS_OP(create);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "nodeid %lld : name %s : mode %o : flags %s.",
-	          parent, name, mode, accessModeStr);
+	          parent, name, mode, fuseAccessModeToString(fi->flags));
 
 	struct fuse_entry_param e;
 	int error = 0;
 
 	do {
-		int dirfd = lo_fd(req, parent);
-		int openatFlags = (fi->flags | O_CREAT) & ~O_NOFOLLOW;
-		int fd = openat(dirfd, name, openatFlags, mode);
+		LO_FD(dir, req, parent);
+		if(dir.fd == -1) {
+			error = errno;
+			break;
+		}
+
+		if(fi->flags & O_TRUNC) {
+			lo_journal_flush_name(req, dir.fd, name);
+		}
+
+		int keep = lo_transformed() ? ~(O_NOFOLLOW | O_TRUNC) : ~O_NOFOLLOW;
+		bool promoted = lo_writeback_flags(req, fi);
+		int openatFlags = (fi->flags | O_CREAT) & keep;
+		int fd = STATS_BACKEND(openat(dir.fd, name, openatFlags, mode));
+		if((fd == -1) && (errno == EACCES) && promoted) {
+			lo_writeback_demote(req, fi);
+			openatFlags = (fi->flags | O_CREAT) & keep;
+			fd = STATS_BACKEND(openat(dir.fd, name, openatFlags, mode));
+		}
 		if(fd == -1) {
 			error = errno;
 			LOG_ERROR(req, "openat(%d, %s, %o, %o) failed (%m).",
-			          dirfd, name, openatFlags, mode);
+			          dir.fd, name, openatFlags, mode);
 			break;
 		}
 
 		if(fchmod(fd, mode) == -1) {
 			error = errno;
 			LOG_ERROR(req, "fchmod(%d, %o) failed (%m).", fd, mode);
+			close(fd);
 			break;
 		}
 
-		fi->fh = fd;
-
 		error = lo_do_lookup(req, parent, name, &e);
+		if(error != 0) {
+			close(fd);
+			break;
+		}
 
+		if(fi->flags & O_TRUNC) {
+			inodeDataChanged(lo_inode(req, e.ino));
+		}
+
+		error = lo_file_new(req, e.ino, fd, fi);
+		if(error != 0) {
+			LOG_ERROR(req, "lo_file_new() failed (%d).", error);
+			inodeTableUnref(&lo_data(req)->inodes, lo_inode(req, e.ino), 1);
+			close(fd);
+			break;
+		}
+
+		/* An encrypted or compressed file is truncated after the
+		 * lookup. */
+		if(lo_transformed() && (fi->flags & O_TRUNC)) {
+			e.attr.st_size = 0;
+		}
 	} while(0);
 
 	if(error) {
@@ -617,84 +1496,162 @@ static void lo_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_
  * "not supported" or not. */
 static void lo_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
 {
+	STATS_OP(fallocate);
+	LO_TRACE(ino, offset, length);
 	(void) fi;
 	LOG_ENTER(req, "nodeid %" PRIu64 " : mode %o : offset %ld : length %ld..", ino, mode, offset, length);
 	fuse_reply_err(req, ENOSYS);
 	LOG_EXIT(req, "nodeid %" PRIu64 " : mode %o : offset %ld : length %ld..", ino, mode, offset, length);
 }
 
-static void lo_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+/* Called on every close() of the file (there can be more than one per open,
+ * e.g. after a dup()).  This is our last chance to hand a write-back error to
+ * the application, and it gives other NAS clients close-to-open consistency. */
+static void lo_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	LOG_ENTER(req, "nodeid %" PRIu64 ": nlookup %" PRIu64 ".", ino, nlookup);
-	do {
-		struct lo_inode *inode = lo_inode(req, ino);
-		LOG_TRACE(req, "nodeid %llu : %llu - %llu = %llu.",
-		          ino, inode->nlookup, nlookup, (inode->nlookup - nlookup));
+	STATS_OP(flush);
+	LO_TRACE(ino, 0, 0);
+	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
+	struct lo_file *f = lo_file(fi);
+	int error = 0;
+	if(f->wb != NULL) {
+		error = writeBufFlush(f->wb);
+	}
+	fuse_reply_err(req, error);
+	LOG_EXIT(req, "nodeid %" PRIu64 " : error %d.", ino, error);
+}
 
-		assert(inode->nlookup >= nlookup);
-		inode->nlookup -= nlookup;
+/* Drop nlookup references from one inode.  Shared by forget and
+ * forget_multi, which reply for themselves. */
+static void lo_forget_one(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	struct lo_inode *inode = lo_inode(req, ino);
+	LOG_TRACE(req, "nodeid %llu : %llu - %llu = %llu.",
+	          ino, inode->nlookup, nlookup, (inode->nlookup - nlookup));
 
-		if(!inode->nlookup) {
-			LOG_TRACE(req, "Freeing %" PRIu64 " : fd %d.", inode, inode->fd);
-			lo_free(inode);
-		}
+	if(inodeTableUnref(&lo_data(req)->inodes, inode, nlookup)) {
+		LOG_TRACE(req, "Freed %" PRIu64 ".", ino);
+	}
+}
 
-		fuse_reply_none(req);
-	} while(0);
-	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+static void lo_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	STATS_OP(forget);
+	LO_TRACE(ino, 0, 0);
+	LOG_ENTER(req, "nodeid %" PRIu64 ": nlookup %" PRIu64 ".", ino, nlookup);
+	lo_forget_one(req, ino, nlookup);
+	fuse_reply_none(req);
+	LOG_EXIT(NULL, "nodeid %" PRIu64 ".", ino);
 }
 
-#undef DO_FORGET_MULTI
-#ifdef DO_FORGET_MULTI
+/* The kernel sends these in batches when it drops a lot of inodes at once
+ * (rm -rf, memory pressure, unmount).  One request, one pass, and the fd
+ * closes go to the closer, so it doesn't hold up a session thread. */
 static void lo_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
 {
-	(void) req, count, forgets;
-	LOG_ENTER(req, "count %ld : forgets %p.", count, forgets);
-	int i;
+	STATS_OP(forget_multi);
+	if (traceEnabled())
+		STATS_TRACE(0, 0, count);
+	LOG_ENTER(req, "count %zu : forgets %p.", count, forgets);
+	size_t i;
 	for(i = 0; i < count; i++) {
-		struct fuse_forget_data *f = &forgets[i];
-		fuse_ino_t ino     = f->ino;
-		uint64_t   nlookup = f->nlookup;
-		lo_forget(req, ino, nlookup);
+		lo_forget_one(req, forgets[i].ino, forgets[i].nlookup);
 	}
-	LOG_EXIT(req, "count %ld : forgets %p.", count, forgets);
+	fuse_reply_none(req);
+	LOG_EXIT(NULL, "count %zu.", count);
 }
-#endif // DO_FORGET_MULTI
 
 static void lo_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
 {
+	STATS_OP(fsync);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "nodeid %lld : datasync %d.", ino, datasync);
 
+	/* Push out our own buffer, and any that other opens of this file are
+	 * holding, before we ask the backend to make it stable. */
+	struct lo_file *f = lo_file(fi);
+	int error = 0;
+	if(f->wb != NULL) {
+		error = writeBufFlush(f->wb);
+	}
+	writeBufFlushInode(lo_inode(req, ino));
+
+	/* The file's slots can point at chunks that were just added to the
+	 * chunk store.  Only the ones it has written since the last sync of
+	 * the store need one. */
+	if((error == 0) && dedupEnabled()) {
+		error = dedupSync(compressDedupSeq(lo_inode(req, ino)));
+	}
+
+	/* Journaled writes were stable when we acknowledged them. */
+	if(f->journal) {
+		fuse_reply_err(req, error);
+		LOG_EXIT(req, "nodeid %lld : datasync %d : journaled.", ino, datasync);
+		return;
+	}
+
+	/* A write-back error has to be reported now, so only hand the fsync
+	 * off to the io_uring if there isn't one. */
+	if((error == 0) && uringEnabled() &&
+	   (uringFsync(req, f->fd, f->ringSlot, datasync) == 0)) {
+		LOG_EXIT(NULL, "nodeid %lld : datasync %d : queued.", ino, datasync);
+		return;
+	}
+
 	int res;
 	if(datasync) {
-		res = fdatasync(fi->fh);
+		res = STATS_BACKEND(fdatasync(f->fd));
 	}
 	else {
-		res = fsync(fi->fh);
+		res = STATS_BACKEND(fsync(f->fd));
 	}
-	fuse_reply_err(req, res == -1 ? errno : 0);
+	if((res == -1) && (error == 0)) {
+		error = errno;
+	}
+	fuse_reply_err(req, error);
 
 	LOG_EXIT(req, "nodeid %lld : datasync %d : res %d (%m).", ino, datasync, res);
 }
 
 static void lo_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-	(void) fi;
+	STATS_OP(getattr);
+	LO_TRACE(ino, 0, 0);
 
 	LOG_ENTER(req, "nodeid %lld.", ino);
 
+	/* Buffered writes change the size and mtime.  Journaled ones are
+	 * added in from memory, so they don't wait for the destager. */
+	writeBufFlushInode(lo_inode(req, ino));
+	bool journaled = journalPending(lo_inode(req, ino));
+
+	/* Use the open file if we have one.  It works even if the inode's fd
+	 * is closed and the file has been unlinked since. */
 	struct stat buf;
-	int fd = lo_fd(req, ino);
-	if(fstatat(fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+	struct lo_fd_ref ref __attribute__((cleanup(lo_fd_put))) = { .fd = -1 };
+	int fd;
+	if(fi != NULL) {
+		fd = lo_file(fi)->fd;
+	}
+	else {
+		ref = lo_fd_get(req, ino);
+		fd = ref.fd;
+	}
+	if((fd == -1) ||
+	   (STATS_BACKEND(fstatat(fd, "", &buf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW)) == -1)) {
 		int error = errno;
 		LOG_TRACE(req, "fstatat(%d) failed (%m).", fd);
 		fuse_reply_err(req, error);
 	}
 	else {
+		if(journaled)
+			journalStat(lo_inode(req, ino), &buf);
+		cryptStat(&buf);
+		compressStat(&buf);
 		LOG_TRACE(req, "dev/ino %d/%d : uid/gid %d/%d : %s : size %lld.",
 		          buf.st_dev, buf.st_ino, buf.st_uid, buf.st_gid,
 		          modeToString(buf.st_mode), buf.st_size);
-		fuse_reply_attr(req, &buf, 0);
+		fuse_reply_attr(req, &buf, lo_timeouts(req, lo_inode(req, ino))->attr);
 	}
 
 	LOG_EXIT(req, "nodeid %lld.", ino);
@@ -704,6 +1661,8 @@ static void lo_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 #ifdef DO_GETXATTR
 static void lo_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
 {
+	STATS_OP(getxattr);
+	LO_TRACE(ino, 0, size);
 	LOG_ENTER(req, "nodeid %" PRIu64 " : name %s : size %ld.", ino, name, size);
 
 	char *buf = NULL;
@@ -711,7 +1670,8 @@ static void lo_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t
 	int error = 0;
 
 	do {
-		int fd = lo_fd(req, ino);
+		LO_FD(ref, req, ino);
+		int fd = ref.fd;
 
 		/* If we want to read the data, allocate a buffer. */
 		if(size > 0) {
@@ -722,17 +1682,18 @@ static void lo_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t
 			}
 		}
 
-		char pathName[PATH_MAX + 1];
-		if(pathFromFD(fd, pathName, sizeof(pathName)) == -1) {
-			LOG_ERROR(req, "malloc(%d) failed (%m).", size);
-			error = ERANGE;
+		if(fd == -1) {
+			error = errno;
 			break;
 		}
 
-		rc = getxattr(pathName, name, buf, size);
+		char linkName[PROCFS_LINK_SZ];
+		linkFromFD(fd, linkName, sizeof(linkName));
+
+		rc = getxattr(linkName, name, buf, size);
 		error = errno;
 		LOG_TRACE(req, "getxattr(%s, %s, %p, %ld) returned %d (%m).",
-		          pathName, name, buf, size, rc);
+		          linkName, name, buf, size, rc);
 		if(rc == -1) {
 			/* The call failed.  This might be due to the buffer being too
 			 * small (ERANGE). */
@@ -759,6 +1720,8 @@ static void lo_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t
 
 static void lo_link(fuse_req_t req, fuse_ino_t oldIno, fuse_ino_t newParentIno, const char *newPath)
 {
+	STATS_OP(link);
+	LO_TRACE(newParentIno, 0, 0);
 	LOG_ENTER(req, "inode %" PRIu64 " --> NewParent %" PRIu64 ": newPath %s", oldIno, newParentIno, newPath);
 	int res;
 	struct lo_data *lo = lo_data(req);
@@ -771,7 +1734,15 @@ static void lo_link(fuse_req_t req, fuse_ino_t oldIno, fuse_ino_t newParentIno,
 	entry.entry_timeout = 1;
 
 	do {
-		res = linkat_empty_nofollow(inode, lo_fd(req, newParentIno), newPath);
+		LO_FD(src, req, oldIno);
+		LO_FD(dst, req, newParentIno);
+		if((src.fd == -1) || (dst.fd == -1)) {
+			saverr = errno;
+			res = -1;
+			break;
+		}
+
+		res = linkat_empty_nofollow(inode, src.fd, dst.fd, newPath);
 		if(res == -1) {
 			saverr = errno;
 			LOG_ERROR(req, "linkat_empty_nofollow() failed.");
@@ -791,7 +1762,12 @@ static void lo_link(fuse_req_t req, fuse_ino_t oldIno, fuse_ino_t newParentIno,
 		entry.ino = (fuse_ino_t) inode;
 #endif
 
-		lo_do_lookup(req, newParentIno, newPath, &entry);
+		saverr = lo_do_lookup(req, newParentIno, newPath, &entry);
+		if(saverr != 0) {
+			LOG_ERROR(req, "lo_do_lookup() failed.");
+			res = -1;
+			break;
+		}
 
 	} while(0);
 
@@ -807,20 +1783,35 @@ static void lo_link(fuse_req_t req, fuse_ino_t oldIno, fuse_ino_t newParentIno,
 
 static void lo_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+	STATS_OP(lookup);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "parent %lld: name %s", parent, name);
 	do {
 		struct fuse_entry_param e;
 		int err = lo_do_lookup(req, parent, name, &e);
-		if (err)
+		double negative = lo_timeouts(req, lo_inode(req, parent))->negative;
+
+		/* A negative entry (ino 0) tells the kernel to remember that
+		 * the name doesn't exist, so it won't ask again for a while. */
+		if ((err == ENOENT) && (negative > 0)) {
+			e.ino = 0;
+			e.entry_timeout = negative;
+			fuse_reply_entry(req, &e);
+		}
+		else if (err)
 			fuse_reply_err(req, err);
-		else
+		else {
+			LO_TRACE(parent, e.attr.st_ino, 0);
 			fuse_reply_entry(req, &e);
+		}
 	} while(0);
 	LOG_EXIT(req, "parent %lld: name %s", parent, name);
 }
 
 static void lo_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
+	STATS_OP(mkdir);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "parent %" PRIu64 ": name %s : mode %o", parent, name, mode);
 	int res;
 	int saverr;
@@ -831,10 +1822,16 @@ static void lo_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t
 		LOG_TRACE(req, "CTX: UID %d : GID %d : PID %d : UMASK %o.",
 		          ctx->uid, ctx->gid, ctx->pid, ctx->umask);
 
-		struct lo_inode *dir = lo_inode(req, parent);
-		if((res = mkdirat(dir->fd, name, mode)) == -1) {
+		LO_FD(dir, req, parent);
+		if(dir.fd == -1) {
 			saverr = errno;
-			LOG_ERROR(req, "mkdirat(%d, %s, %o) failed (%m).", dir->fd, name, mode);
+			res = -1;
+			break;
+		}
+
+		if((res = STATS_BACKEND(mkdirat(dir.fd, name, mode))) == -1) {
+			saverr = errno;
+			LOG_ERROR(req, "mkdirat(%d, %s, %o) failed (%m).", dir.fd, name, mode);
 			break;
 		}
 
@@ -845,25 +1842,28 @@ static void lo_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t
 			break;
 		}
 
-		struct lo_inode *inode = lo_inode(req, e.ino);
-
-		char pathName[PATH_MAX + 1];
-		if(pathFromFD(inode->fd, pathName, sizeof(pathName)) == -1) {
+		/* Fix the owner and mode through the new directory's fd.  An
+		 * O_PATH fd is good enough for fchownat(), but chmod needs the
+		 * procfs link (fchmod() won't take an O_PATH fd). */
+		LO_FD(newDir, req, e.ino);
+		if(newDir.fd == -1) {
 			saverr = errno;
-			LOG_ERROR(req, "Unable to read full directory name.");
 			res = -1;
 			break;
 		}
 
-		if((res = chown(pathName, ctx->uid, ctx->gid)) == -1) {
+		if((res = STATS_BACKEND(fchownat(newDir.fd, "", ctx->uid, ctx->gid,
+		                                 AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW))) == -1) {
 			saverr = errno;
-			LOG_ERROR(req, "chown(%s, %d, %d) failed (%m).", pathName, ctx->uid, ctx->gid);
+			LOG_ERROR(req, "fchownat(%d, %d, %d) failed (%m).", newDir.fd, ctx->uid, ctx->gid);
 			break;
 		}
 
-		if((res = chmod(pathName, mode)) == -1) {
+		char linkName[PROCFS_LINK_SZ];
+		linkFromFD(newDir.fd, linkName, sizeof(linkName));
+		if((res = STATS_BACKEND(chmod(linkName, mode))) == -1) {
 			saverr = errno;
-			LOG_ERROR(req, "chmod(%s, %o) failed (%m).", pathName, mode);
+			LOG_ERROR(req, "chmod(%s, %o) failed (%m).", linkName, mode);
 			break;
 		}
 	} while(0);
@@ -880,6 +1880,8 @@ static void lo_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t
 
 static void lo_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
 {
+	STATS_OP(mknod);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "parent %lld: name %s : mode %o (%s ) : rdev %d.",
 	          parent, name, mode, modeToString(mode), rdev);
 	lo_mknod_symlink(req, parent, name, mode, rdev, NULL);
@@ -888,30 +1890,60 @@ static void lo_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t
 
 static void lo_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	STATS_OP(open);
+	LO_TRACE(ino, 0, 0);
 	int fd = -1;
 	LOG_ENTER(req, "nodeid %lld.", ino);
 	do {
-		int linkFD = lo_fd(req, ino);
-
-		char pathName[PATH_MAX + 1];
-		if(pathFromFD(linkFD, pathName, sizeof(pathName)) == -1) {
-			LOG_ERROR(req, "Unable to convert fd %d into a pathName.", fd);
+		/* Reopen the inode's fd with the caller's flags.  Going through
+		 * the procfs link means no path lookups on the backend, no
+		 * matter how deep the file is. */
+		LO_FD(ref, req, ino);
+		if(ref.fd == -1) {
 			break;
 		}
 
-		int flags = fi->flags & ~O_NOFOLLOW;
-		fd = open(pathName, flags);
+		char linkName[PROCFS_LINK_SZ];
+		linkFromFD(ref.fd, linkName, sizeof(linkName));
+
+		/* Journaled writes must land before the truncate. */
+		if(fi->flags & O_TRUNC) {
+			journalFlushInode(lo_inode(req, ino));
+		}
+
+		/* Encrypted and compressed files are truncated by
+		 * lo_file_new(), after their header. */
+		int keep = lo_transformed() ? ~(O_NOFOLLOW | O_TRUNC) : ~O_NOFOLLOW;
+		bool promoted = lo_writeback_flags(req, fi);
+		int flags = fi->flags & keep;
+		fd = STATS_BACKEND(open(linkName, flags));
+		if((fd == -1) && (errno == EACCES) && promoted) {
+			lo_writeback_demote(req, fi);
+			flags = fi->flags & keep;
+			fd = STATS_BACKEND(open(linkName, flags));
+		}
 		if(fd == -1) {
 			int error = errno;
-			LOG_TRACE(req, "open(%s, %o) failed (%m).", pathName, flags);
+			LOG_TRACE(req, "open(%s, %o) failed (%m).", linkName, flags);
 			errno = error;
 			break;
 		}
 		else {
-			LOG_TRACE(req, "open(%s, %o) returned %d.", pathName, flags, fd);
+			LOG_TRACE(req, "open(%s, %o) returned %d.", linkName, flags, fd);
+		}
+
+		if(fi->flags & O_TRUNC) {
+			inodeDataChanged(lo_inode(req, ino));
 		}
 
-		fi->fh = fd;
+		int error = lo_file_new(req, ino, fd, fi);
+		if(error != 0) {
+			LOG_ERROR(req, "lo_file_new() failed (%d).", error);
+			close(fd);
+			fd = -1;
+			errno = error;
+			break;
+		}
 	} while(0);
 
 	if(fd == -1) {
@@ -926,6 +1958,8 @@ static void lo_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 
 static void lo_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	STATS_OP(opendir);
+	LO_TRACE(ino, 0, 0);
 	int error = 0;
 	struct lo_dirp *d = NULL;
 
@@ -938,10 +1972,11 @@ static void lo_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 			break;
 		}
 
-		d->fd = openat(lo_fd(req, ino), ".", O_RDONLY);
+		LO_FD(ref, req, ino);
+		d->fd = (ref.fd == -1) ? -1 : STATS_BACKEND(openat(ref.fd, ".", O_RDONLY));
 		if (d->fd == -1) {
 			error = errno;
-			LOG_ERROR(req, "openat(%d) failed. (%m).", lo_fd(req, ino));
+			LOG_ERROR(req, "openat(%d) failed. (%m).", ref.fd);
 			break;
 		}
 
@@ -977,19 +2012,104 @@ static void lo_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi
 
 static void lo_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	STATS_OP(read);
+	LO_TRACE(ino, offset, size);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
+
+	/* Reads have to see buffered writes, no matter who made them.
+	 * Journaled ones are read from the journal. */
+	writeBufFlushInode(lo_inode(req, ino));
+	bool journaled = journalPending(lo_inode(req, ino));
+
+	/* An encrypted file without a key is empty. */
+	struct lo_file *f = lo_file(fi);
+	struct crypt_file *cf = NULL;
+	if(cryptEnabled()) {
+		int error = cryptOpen(lo_inode(req, ino), f->fd, false);
+		cf = cryptFile(lo_inode(req, ino));
+		if((error != 0) || (cf == NULL)) {
+			if(error != 0)
+				fuse_reply_err(req, error);
+			else
+				fuse_reply_buf(req, NULL, 0);
+			LOG_EXIT(req, "nodeid %" PRIu64 " : error %d.", ino, error);
+			return;
+		}
+	}
+
+	/* Compressed files are read a chunk at a time, and don't use the
+	 * block cache.  The kernel's page cache holds what we decompress. */
+	if(compressEnabled()) {
+		char *buf = NULL;
+		int error = compressOpen(lo_inode(req, ino), f->fd, false);
+		ssize_t res = (error != 0) ? -error :
+		              compressRead(lo_inode(req, ino), f->fd, size, offset, &buf);
+		if(res < 0) {
+			LOG_ERROR(req, "compressRead() failed (%zd).", res);
+			fuse_reply_err(req, -res);
+		}
+		else {
+			fuse_reply_buf(req, buf, res);
+		}
+		LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+		return;
+	}
+
+	/* O_DIRECT readers want to see the backend, so they skip the cache.
+	 * So do reads of data that's still in the journal. */
+	if((blockCacheEnabled() || diskCacheEnabled()) && !(fi->flags & O_DIRECT) && !journaled) {
+		int error = lo_read_cached(req, lo_inode(req, ino), size, offset,
+		                           f->fd, cf);
+		if(error != 0) {
+			LOG_ERROR(req, "lo_read_cached() failed (%d).", error);
+			fuse_reply_err(req, error);
+		}
+		LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+		return;
+	}
+
+	if(cf != NULL) {
+		int error = lo_read_crypt(req, lo_inode(req, ino), cf, size, offset, f->fd);
+		if(error != 0) {
+			LOG_ERROR(req, "lo_read_crypt() failed (%d).", error);
+			fuse_reply_err(req, error);
+		}
+		LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+		return;
+	}
+
+	if(journaled) {
+		int error = lo_read_journal(req, lo_inode(req, ino), size, offset, f->fd);
+		if(error != 0) {
+			LOG_ERROR(req, "lo_read_journal() failed (%d).", error);
+			fuse_reply_err(req, error);
+		}
+		LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+		return;
+	}
+
+	/* Once the io_uring has the request, req belongs to its completion
+	 * thread, so don't log it. */
+	if(uringEnabled() && (uringRead(req, f->fd, f->ringSlot, size, offset) == 0)) {
+		LOG_EXIT(NULL, "nodeid %" PRIu64 " : queued.", ino);
+		return;
+	}
+
 	struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
 
 	buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	buf.buf[0].fd = fi->fh;
+	buf.buf[0].fd = f->fd;
 	buf.buf[0].pos = offset;
 
-	fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+	/* fuse_reply_data() is where the backend read actually happens. */
+	STATS_BACKEND_BYTES(fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE), size);
 	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
 }
 
 static void lo_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	STATS_OP(readdir);
+	LO_TRACE(ino, offset, size);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
 	lo_do_readdir(req, ino, size, offset, fi, 0);
 	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
@@ -997,6 +2117,8 @@ static void lo_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset
 
 static void lo_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	STATS_OP(readdirplus);
+	LO_TRACE(ino, offset, size);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
 	lo_do_readdir(req, ino, size, offset, fi, 1);
 	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
@@ -1004,10 +2126,13 @@ static void lo_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t of
 
 static void lo_readlink(fuse_req_t req, fuse_ino_t ino)
 {
+	STATS_OP(readlink);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
 	do {
 		char buf[PATH_MAX + 1];
-		int res = readlinkat(lo_fd(req, ino), "", buf, sizeof(buf));
+		LO_FD(ref, req, ino);
+		int res = (ref.fd == -1) ? -1 : STATS_BACKEND(readlinkat(ref.fd, "", buf, sizeof(buf)));
 		if (res == -1) {
 			fuse_reply_err(req, errno);
 			break;
@@ -1024,20 +2149,57 @@ static void lo_readlink(fuse_req_t req, fuse_ino_t ino)
 	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
 }
 
+/* Closer callback.  The slow half of lo_release(). */
+static void lo_release_file(void *arg)
+{
+	struct lo_file *f = arg;
+
+	/* Nobody is left to report a write-back error to. */
+	if(f->wb != NULL) {
+		int error = writeBufClose(f->wb);
+		if(error != 0) {
+			LOG_ERROR(NULL, "Lost write-back error on %" PRIu64 " (%d).", f->ino, error);
+		}
+		inodeTableUnref(&f->lo->inodes, f->inode, 1);
+	}
+	uringRemoveFile(f->ringSlot);
+	close(f->fd);
+	free(f);
+}
+
+/* There's nothing the application can do with an error from here, so reply
+ * right away and let the closer do the flush and the close.  The write
+ * buffer needs the inode, so it holds a reference until the closer is done
+ * (the kernel can FORGET the inode as soon as we reply). */
 static void lo_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	STATS_OP(release);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
-	LOG_TRACE(req, "Closing %" PRIu64 " : fd %d.", ino, fi->fh);
-	close(fi->fh);
+	struct lo_file *f = lo_file(fi);
+	LOG_TRACE(req, "Closing %" PRIu64 " : fd %d.", ino, f->fd);
+
+	if(f->passthrough)
+		lo_passthrough_close(req, ino);
+
+	f->lo = lo_data(req);
+	f->ino = ino;
+	if(f->wb != NULL) {
+		f->inode = lo_inode(req, ino);
+		inodeTableRef(&f->lo->inodes, f->inode);
+	}
 	fuse_reply_err(req, 0);
-	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
+	closerQueue(lo_release_file, f);
+	LOG_EXIT(NULL, "nodeid %" PRIu64 ".", ino);
 }
 
 static void lo_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
+	STATS_OP(releasedir);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
 	struct lo_dirp *d = lo_dirp(fi);
-	closedir(d->dp);
+	STATS_BACKEND(closedir(d->dp));
 	free(d);
 	fuse_reply_err(req, 0);
 	LOG_EXIT(req, "nodeid %" PRIu64 ".", ino);
@@ -1045,6 +2207,8 @@ static void lo_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info
 
 static void lo_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 {
+	STATS_OP(removexattr);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "inode %" PRIu64 ": name %s", ino, name);
 	int saverr;
 
@@ -1056,8 +2220,14 @@ static void lo_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 			break;
 		}
 
+		LO_FD(ref, req, ino);
+		if(ref.fd == -1) {
+			saverr = errno;
+			break;
+		}
+
 		char linkName[PROCFS_LINK_SZ];
-		linkFromFD(inode->fd, linkName, sizeof(linkName));
+		linkFromFD(ref.fd, linkName, sizeof(linkName));
 		int ret = removexattr(linkName, name);
 		saverr = (ret == -1) ? errno : 0;
 
@@ -1069,6 +2239,8 @@ static void lo_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
 
 static void lo_rename(fuse_req_t req, fuse_ino_t oldParent, const char *oldName, fuse_ino_t newParent, const char *newName, unsigned int flags)
 {
+	STATS_OP(rename);
+	LO_TRACE(oldParent, 0, 0);
 	LOG_ENTER(req, "oldParent %" PRIu64 ": oldName %s -> newParent %" PRIu64 ": newName %s",
 	          oldParent, oldName, newParent, newName);
 
@@ -1082,11 +2254,34 @@ static void lo_rename(fuse_req_t req, fuse_ino_t oldParent, const char *oldName,
 			break;
 		}
 
-		res = renameat(lo_fd(req, oldParent), oldName,
-		               lo_fd(req, newParent), newName);
-		if(res == -1) {
+		LO_FD(oldDir, req, oldParent);
+		LO_FD(newDir, req, newParent);
+		if((oldDir.fd == -1) || (newDir.fd == -1)) {
 			saverr = errno;
-			LOG_ERROR(req, "renameat() failed (%m).");
+			res = -1;
+			break;
+		}
+
+		/* Inodes that reopen by name have to follow the rename.  That
+		 * takes an extra stat, so only do it if there are any. */
+		struct lo_data *lo = lo_data(req);
+		struct lo_inode *moved = NULL;
+		struct stat st;
+		if(inodeTableUsesPaths(&lo->inodes) &&
+		   (STATS_BACKEND(fstatat(oldDir.fd, oldName, &st, AT_SYMLINK_NOFOLLOW)) == 0)) {
+			moved = inodeTableFind(&lo->inodes, st.st_dev, st.st_ino);
+		}
+
+		res = STATS_BACKEND(renameat(oldDir.fd, oldName, newDir.fd, newName));
+		saverr = errno;
+		if(moved != NULL) {
+			if(res == 0) {
+				inodeTableRename(&lo->inodes, moved, lo_inode(req, newParent), newName);
+			}
+			inodeTableUnref(&lo->inodes, moved, 1);
+		}
+		if(res == -1) {
+			LOG_ERROR(req, "renameat() failed (%s).", strerror(saverr));
 			break;
 		}
 
@@ -1100,8 +2295,11 @@ static void lo_rename(fuse_req_t req, fuse_ino_t oldParent, const char *oldName,
 
 static void lo_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+	STATS_OP(rmdir);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "parent %" PRIu64 ": name %s", parent, name);
-	int res = unlinkat(lo_fd(req, parent), name, AT_REMOVEDIR);
+	LO_FD(dir, req, parent);
+	int res = (dir.fd == -1) ? -1 : STATS_BACKEND(unlinkat(dir.fd, name, AT_REMOVEDIR));
 	fuse_reply_err(req, res == -1 ? errno : 0);
 	LOG_EXIT(req, "parent %" PRIu64 ": name %s", parent, name);
 }
@@ -1110,27 +2308,49 @@ static void lo_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
                        int valid, struct fuse_file_info *fi)
 {
+	STATS_OP(setattr);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "inode %" PRIu64 ".", ino);
 	int saverr;
 	struct lo_inode *inode = lo_inode(req, ino);
-	int ifd = inode->fd;
-	int res;
+	int res = 0;
+
+	/* Without an open file, the changes go through the inode's fd. */
+	struct lo_fd_ref ref __attribute__((cleanup(lo_fd_put))) = { .fd = -1 };
+	int ifd = -1;
+
+	/* Buffered writes must land before a truncate or a time change, or
+	 * they'd undo it.  A mode or owner change doesn't need to wait for
+	 * the journal. */
+	writeBufFlushInode(inode);
+	if(valid & (FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+		journalFlushInode(inode);
+	}
 
 	do {
+		if(fi == NULL) {
+			ref = lo_fd_get(req, ino);
+			if((ifd = ref.fd) == -1) {
+				saverr = errno;
+				res = -1;
+				break;
+			}
+		}
+
 		if(valid & FUSE_SET_ATTR_MODE) {
 			if(fi) {
-				res = fchmod(fi->fh, attr->st_mode);
+				res = STATS_BACKEND(fchmod(lo_file(fi)->fd, attr->st_mode));
 				if(res == -1) {
 					saverr = errno;
 					LOG_ERROR(req, "fchmod(%d, %o) failed (%m).",
-					          fi->fh, attr->st_mode);
+					          lo_file(fi)->fd, attr->st_mode);
 					break;
 				}
 			}
 			else {
 				char linkName[PROCFS_LINK_SZ];
 				linkFromFD(ifd, linkName, sizeof(linkName));
-				res = chmod(linkName, attr->st_mode);
+				res = STATS_BACKEND(chmod(linkName, attr->st_mode));
 				if(res == -1) {
 					saverr = errno;
 					LOG_ERROR(req, "chmod(%s, %o) failed (%m).",
@@ -1141,19 +2361,44 @@ static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 		}
 
 		if(valid & FUSE_SET_ATTR_SIZE) {
-			if(fi) {
-				res = ftruncate(fi->fh, attr->st_size);
+			if(lo_transformed()) {
+				/* The header stays, and the edges of a new gap
+				 * get encrypted zeros (or the new last chunk is
+				 * rewritten), so it needs a file that's open for
+				 * reading and writing. */
+				int tmpfd = -1;
+				if(fi == NULL) {
+					char linkName[PROCFS_LINK_SZ];
+					linkFromFD(ifd, linkName, sizeof(linkName));
+					tmpfd = STATS_BACKEND(open(linkName, O_RDWR));
+				}
+				int fd = (fi != NULL) ? lo_file(fi)->fd : tmpfd;
+				saverr = (fd == -1) ? errno :
+				         compressEnabled() ? compressTruncate(inode, fd, attr->st_size) :
+				                             cryptTruncate(inode, fd, attr->st_size);
+				if(tmpfd != -1) {
+					close(tmpfd);
+				}
+				if(saverr != 0) {
+					res = -1;
+					LOG_ERROR(req, "Truncate of %d to %d failed (%d).",
+					          fd, attr->st_size, saverr);
+					break;
+				}
+			}
+			else if(fi) {
+				res = STATS_BACKEND(ftruncate(lo_file(fi)->fd, attr->st_size));
 				if(res == -1) {
 					saverr = errno;
 					LOG_ERROR(req, "ftruncate(%d, %d) failed (%m).",
-					          fi->fh, attr->st_size);
+					          lo_file(fi)->fd, attr->st_size);
 					break;
 				}
 			}
 			else {
 				char linkName[PROCFS_LINK_SZ];
 				linkFromFD(ifd, linkName, sizeof(linkName));
-				res = truncate(linkName, attr->st_size);
+				res = STATS_BACKEND(truncate(linkName, attr->st_size));
 				if(res == -1) {
 					saverr = errno;
 					LOG_ERROR(req, "truncate(%s, %d) failed (%m).",
@@ -1161,6 +2406,7 @@ static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 					break;
 				}
 			}
+			inodeDataChanged(inode);
 		}
 
 		if(valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
@@ -1185,15 +2431,15 @@ static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 			}
 
 			if(fi) {
-				res = futimens(fi->fh, tv);
+				res = futimens(lo_file(fi)->fd, tv);
 				if(res == -1) {
 					saverr = errno;
-					LOG_ERROR(req, "futimens(%d, ...) failed {%m).", fi->fh);
+					LOG_ERROR(req, "futimens(%d, ...) failed {%m).", lo_file(fi)->fd);
 					break;
 				}
 			}
 			else {
-				res = utimensat_empty_nofollow(inode, tv);
+				res = utimensat_empty_nofollow(inode, ifd, tv);
 				if(res == -1) {
 					saverr = errno;
 					LOG_ERROR(req, "utimensat_empty_nofollow() failed. (%m)");
@@ -1215,10 +2461,13 @@ static void lo_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 
 static void lo_statfs(fuse_req_t req, fuse_ino_t ino)
 {
+	STATS_OP(statfs);
+	LO_TRACE(ino, 0, 0);
 	LOG_ENTER(req, "nodeid %" PRIu64 ".", ino);
-	int fd = lo_fd(req, ino);
+	LO_FD(ref, req, ino);
+	int fd = ref.fd;
 	struct statvfs stbuf;
-	int rc = fstatvfs(fd, &stbuf);
+	int rc = (fd == -1) ? -1 : STATS_BACKEND(fstatvfs(fd, &stbuf));
 	if(rc == 0) {
 		LOG_TRACE(req, "fstatvfs(%d) succeeded: fsid %ld.", fd, stbuf.f_fsid);
 		fuse_reply_statfs(req, &stbuf);
@@ -1232,6 +2481,8 @@ static void lo_statfs(fuse_req_t req, fuse_ino_t ino)
 
 static void lo_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
 {
+	STATS_OP(symlink);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "parent %" PRIu64 " : name %s -> %s.", parent, name, link);
 	lo_mknod_symlink(req, parent, name, S_IFLNK, 0, link);
 	LOG_EXIT(req, "parent %" PRIu64 " : name %s -> %s.", parent, name, link);
@@ -1239,14 +2490,75 @@ static void lo_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, cons
 
 static void lo_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
 {
+	STATS_OP(write_buf);
+	LO_TRACE(ino, off, fuse_buf_size(bufv));
 	LOG_ENTER(req, "nodeid %lld : off %ld.", ino, off);
 
-	struct fuse_bufvec outBuf = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
-	outBuf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
-	outBuf.buf[0].fd = fi->fh;
-	outBuf.buf[0].pos = off;
+	/* Encrypted files write what cryptWrite() hands back, which can be
+	 * bigger than what the application wrote.  The reply is for the
+	 * application's part, so they can't use the io_uring, which replies
+	 * for itself. */
+	struct lo_file *f = lo_file(fi);
+	struct fuse_bufvec cipher;
+	ssize_t plain = 0;
+
+	/* Compressed files write their own chunks and index. */
+	if(compressEnabled()) {
+		ssize_t res = compressWrite(lo_inode(req, ino), f->fd, bufv, off);
+		inodeDataChanged(lo_inode(req, ino));
+		if(res < 0)
+			fuse_reply_err(req, -res);
+		else
+			fuse_reply_write(req, (size_t) res);
+		if(dedupEnabled())
+			lo_dedup_repoint(req);
+		LOG_EXIT(req, "nodeid %lld : off %ld : res %zd.", ino, off, res);
+		return;
+	}
+
+	if(cryptEnabled()) {
+		plain = cryptWrite(lo_inode(req, ino), f->fd, bufv, &off, &cipher);
+		if(plain < 0) {
+			fuse_reply_err(req, -plain);
+			LOG_EXIT(req, "nodeid %lld : off %ld : res %d.", ino, off, plain);
+			return;
+		}
+		bufv = &cipher;
+	}
+
+	ssize_t res = -EFBIG;
+	if(f->journal) {
+		res = journalWrite(lo_inode(req, ino), bufv, off);
+	}
+
+	/* Not journaled, or too big for a record.  Whatever the journal still
+	 * has for this file has to land first, or it would be written over
+	 * this later. */
+	if(res == -EFBIG) {
+		journalFlushInode(lo_inode(req, ino));
+		if(f->wb != NULL) {
+			res = writeBufWrite(f->wb, bufv, off);
+		}
+		else if(uringEnabled() && !cryptEnabled() &&
+		        (uringWrite(req, f->fd, f->ringSlot, bufv, off, lo_inode(req, ino)) == 0)) {
+			LOG_EXIT(NULL, "nodeid %lld : off %ld : queued.", ino, off);
+			return;
+		}
+		else {
+			struct fuse_bufvec outBuf = FUSE_BUFVEC_INIT(fuse_buf_size(bufv));
+			outBuf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			outBuf.buf[0].fd = f->fd;
+			outBuf.buf[0].pos = off;
 
-	ssize_t res = fuse_buf_copy(&outBuf, bufv, 0);
+			res = STATS_BACKEND(fuse_buf_copy(&outBuf, bufv, 0));
+		}
+	}
+	inodeDataChanged(lo_inode(req, ino));
+	if(bufv == &cipher) {
+		cryptWriteEnd(lo_inode(req, ino));
+		if(res >= 0)
+			res = (res == (ssize_t) fuse_buf_size(&cipher)) ? plain : -EIO;
+	}
 	if(res < 0) {
 		fuse_reply_err(req, -res);
 	}
@@ -1259,8 +2571,11 @@ static void lo_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *buf
 
 static void lo_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+	STATS_OP(unlink);
+	LO_TRACE(parent, 0, 0);
 	LOG_ENTER(req, "nodeid %" PRIu64 " : name %s", parent, name);
-	int res = unlinkat(lo_fd(req, parent), name, 0);
+	LO_FD(dir, req, parent);
+	int res = (dir.fd == -1) ? -1 : STATS_BACKEND(unlinkat(dir.fd, name, 0));
 	fuse_reply_err(req, res == -1 ? errno : 0);
 	LOG_EXIT(req, "nodeid %" PRIu64 " : name %s", parent, name);
 }
@@ -1277,7 +2592,6 @@ static void lo_access(fuse_req_t req, fuse_ino_t ino, int mask) { (void) req, in
 static void lo_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize, uint64_t idx) { (void) req, ino, blocksize, idx; assert(0); }
 static void lo_destroy(void *userdata) { (void) userdata; assert(0); }
 static void lo_flock(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, int op) { (void) req, ino, fi, op; assert(0); }
-static void lo_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) { (void) req, ino, fi; assert(0); }
 static void lo_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) { (void) req, ino, datasync, fi; assert(0); }
 static void lo_getlk(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi, struct flock *lock) { (void) req, ino, fi, lock; assert(0); }
 static void lo_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) { (void) req, ino, cmd, arg, fi, flags, in_buf, in_bufsz, out_bufsz; assert(0); }
@@ -1291,12 +2605,12 @@ static void lo_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t siz
 
 static struct fuse_lowlevel_ops lo_oper = {
 	.init		= lo_init, 
+	.copy_file_range = lo_copy_file_range,
 	.create		= lo_create,
 	.fallocate	= lo_fallocate,
+	.flush		= lo_flush,
 	.forget		= lo_forget,
-#ifdef DO_FORGET_MULTI
 	.forget_multi	= lo_forget_multi,
-#endif // DO_FORGET_MULTI
 	.fsync		= lo_fsync,
 	.getattr	= lo_getattr,
 #ifdef DO_GETXATTR
@@ -1327,7 +2641,6 @@ static struct fuse_lowlevel_ops lo_oper = {
 	.bmap		= lo_bmap,
 	.destroy	= lo_destroy,
 	.flock		= lo_flock,
-	.flush		= lo_flush,
 	.fsyncdir	= lo_fsyncdir,
 	.getlk		= lo_getlk,
 	.ioctl		= lo_ioctl,
@@ -1340,6 +2653,97 @@ static struct fuse_lowlevel_ops lo_oper = {
 #endif /* DO_UNIMPLEMENTED_FUNCS */
 };
 
+/* Gauge callback for the stats exporter. */
+static double lo_inode_count(void *arg)
+{
+	return (double) inodeTableCount((struct inode_table *) arg);
+}
+
+static double lo_inode_fds(void *arg)
+{
+	return (double) inodeTableOpenFds((struct inode_table *) arg);
+}
+
+/* How many O_PATH fds the inode table may keep open.  We take as many fds as
+ * the hard limit allows, and give the inodes half of them (open files,
+ * directories and the rest of the driver need the others).
+ * PROXY_BRIDGE_MAX_FDS overrides that, and 0 means no limit. */
+static size_t lo_fd_budget(void)
+{
+	char *maxFds = getenv("PROXY_BRIDGE_MAX_FDS");
+	if (maxFds != NULL)
+		return (size_t) atol(maxFds);
+
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0)
+		return 0;
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur == RLIM_INFINITY)
+		return 0;
+	return rl.rlim_cur / 2;
+}
+
+/* Read a number of seconds from the environment.  Garbage and negative
+ * numbers get the default. */
+static double envSeconds(const char *name, double def)
+{
+	char *str = getenv(name);
+	if(str == NULL)
+		return def;
+
+	char *end;
+	double val = strtod(str, &end);
+	if((end == str) || (*end != '\0') || (val < 0)) {
+		LOG_ERROR(NULL, "Ignoring %s=%s.  Using %g.", name, str, def);
+		return def;
+	}
+	return val;
+}
+
+/* Look up the read-mostly directories.  list is a ':' separated list of
+ * paths, relative to the top of the export ("." is the top itself). */
+static void lo_load_read_mostly(struct lo_data *lo, const char *list)
+{
+	char *copy = strdup(list);
+	size_t max = 1;
+	const char *p;
+	for(p = list; *p != '\0'; p++) {
+		if(*p == ':')
+			max++;
+	}
+
+	lo->readMostlyDirs = calloc(max, sizeof(struct lo_dir_id));
+	if((copy == NULL) || (lo->readMostlyDirs == NULL))
+		err(1, "lo_load_read_mostly()");
+
+	char *save = NULL;
+	char *dir;
+	for(dir = strtok_r(copy, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+		struct stat st;
+		while(*dir == '/')
+			dir++;
+		if(fstatat(lo->root.fd, (*dir == '\0') ? "." : dir, &st, 0) == -1) {
+			LOG_ERROR(NULL, "Read-mostly directory %s: %m.", dir);
+			continue;
+		}
+		if(!S_ISDIR(st.st_mode)) {
+			LOG_ERROR(NULL, "Read-mostly directory %s: not a directory.", dir);
+			continue;
+		}
+
+		lo->readMostlyDirs[lo->numReadMostlyDirs].dev = st.st_dev;
+		lo->readMostlyDirs[lo->numReadMostlyDirs].ino = st.st_ino;
+		lo->numReadMostlyDirs++;
+		LOG_STATUS(NULL, "Read-mostly directory: %s.", dir);
+	}
+
+	free(copy);
+}
+
 int main(int argc, char *argv[])
 {
 	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
@@ -1348,8 +2752,9 @@ int main(int argc, char *argv[])
 	struct lo_data lo = { .debug = 0 };
 	int ret = -1;
 
-	lo.root.next = lo.root.prev = &lo.root;
 	lo.root.fd = -1;
+	if (inodeTableInit(&lo.inodes, lo_fd_budget()) != 0)
+		err(1, "inodeTableInit()");
 
 	if (fuse_parse_cmdline(&args, &opts) != 0)
 		return 1;
@@ -1371,12 +2776,162 @@ int main(int argc, char *argv[])
 	printf("dstMntPnt = >%s<.\n", dstMntPnt);
 
 	lo.debug = opts.debug;
+
+	/* The block cache is off unless it's given a budget. */
+	char *cacheMB = getenv("PROXY_BRIDGE_CACHE_MB");
+	if (cacheMB != NULL && blockCacheInit((size_t) atol(cacheMB) * 1024 * 1024) != 0)
+		err(1, "blockCacheInit(%s MB)", cacheMB);
+
+	/* The disk cache is off unless it's given a file to use (default
+	 * size 1 GB).  It survives restarts. */
+	char *diskCache = getenv("PROXY_BRIDGE_DISK_CACHE");
+	char *diskCacheMB = getenv("PROXY_BRIDGE_DISK_CACHE_MB");
+	if (diskCache != NULL) {
+		size_t mb = (diskCacheMB != NULL) ? (size_t) atol(diskCacheMB) : 1024;
+		int error = diskCacheInit(diskCache, mb * 1024 * 1024);
+		if (error != 0)
+			errx(1, "diskCacheInit(%s, %zu MB): %s", diskCache, mb, strerror(error));
+	}
+
+	/* Write buffering is off unless it's given a size.  The age limit
+	 * bounds how long data can sit in the proxy (default 1 second). */
+	char *wbufKB = getenv("PROXY_BRIDGE_WRITE_BUF_KB");
+	char *wbufMS = getenv("PROXY_BRIDGE_WRITE_BUF_MS");
+	if (wbufKB != NULL &&
+	    writeBufInit((size_t) atol(wbufKB) * 1024,
+	                 (wbufMS != NULL) ? atoi(wbufMS) : 1000) != 0)
+		errx(1, "writeBufInit(%s KB): must be at least 4 KB", wbufKB);
+
+	/* Logging.  "-d" turns on everything.  Otherwise we only log errors,
+	 * unless PROXY_BRIDGE_LOG_LEVEL (error, info, debug) says otherwise. */
+	int level = logLevelFromString(getenv("PROXY_BRIDGE_LOG_LEVEL"));
+	if (level == -1)
+		level = lo.debug ? LOG_DEBUG : LOG_ERR;
+	char *logSyslog = getenv("PROXY_BRIDGE_LOG_SYSLOG");
+	logInit(level, (logSyslog != NULL) && (atoi(logSyslog) != 0));
+	/* Passthrough is used if the kernel supports it, unless it's turned
+	 * off.  It skips the block cache, write buffers and io_uring, because
+	 * the data never comes through the driver at all. */
+	char *passthrough = getenv("PROXY_BRIDGE_PASSTHROUGH");
+	lo.passthrough = (passthrough == NULL) || (atoi(passthrough) != 0);
+
+	/* The kernel's writeback cache is off unless it's asked for.  It
+	 * turns passthrough off. */
+	char *writeback = getenv("PROXY_BRIDGE_WRITEBACK_CACHE");
+	lo.writeback = (writeback != NULL) && (atoi(writeback) != 0);
+
+	/* The tuning profile decides what we ask the kernel for in lo_init(). */
+	char *profile = getenv("PROXY_BRIDGE_PROFILE");
+	if (profileInit(profile) != 0)
+		errx(1, "PROXY_BRIDGE_PROFILE=%s: must be default, streaming, metadata-heavy or small-files", profile);
+
 	lo.root.is_symlink = false;
 	lo.root.fd = open(dstMntPnt, O_PATH);
+	lo.root.fdFixed = true;
+	lo.root.pinned = true;
 	lo.root.nlookup = 2;
 	if (lo.root.fd == -1)
 		err(1, "open(\"%s\", O_PATH)", dstMntPnt);
 
+	/* The rest of the inodes only keep their fds while they're in use. */
+	bool handles = inodeTableProbeHandles(&lo.inodes, lo.root.fd);
+	LOG_STATUS(NULL, "Inode fds: limit %zu : reopen by %s.",
+	           lo.inodes.maxFds, (lo.inodes.maxFds == 0) ? "(never)" :
+	           handles ? "file handle" : "name");
+
+	/* Encryption is off unless it's given the master key. */
+	char *keyFile = getenv("PROXY_BRIDGE_KEY_FILE");
+	if (keyFile != NULL) {
+		int error = cryptInit(keyFile);
+		if (error != 0)
+			errx(1, "cryptInit(%s): %s", keyFile, strerror(error));
+	}
+
+	/* So is compression, unless it's given a codec ("zlib" or "zlib:6").
+	 * It sits on top of the encryption and the journal: chunks are
+	 * compressed, then encrypted, then journaled. */
+	char *compress = getenv("PROXY_BRIDGE_COMPRESS");
+	if (compress != NULL) {
+		if (compressInit(compress) != 0)
+			errx(1, "PROXY_BRIDGE_COMPRESS=%s: unknown codec", compress);
+	}
+
+	/* Dedup is off unless it's given a chunk store.  It works on the
+	 * compressed layout's chunks (PROXY_BRIDGE_COMPRESS=none just dedups).
+	 * The store stops growing at PROXY_BRIDGE_DEDUP_STORE_GB (default 64,
+	 * 0 = no limit).  The store isn't encrypted, so it can't be used with
+	 * PROXY_BRIDGE_KEY_FILE. */
+	char *dedupDir = getenv("PROXY_BRIDGE_DEDUP");
+	char *dedupMB = getenv("PROXY_BRIDGE_DEDUP_MB");
+	char *dedupStoreGB = getenv("PROXY_BRIDGE_DEDUP_STORE_GB");
+	if (dedupDir != NULL) {
+		size_t mb = (dedupMB != NULL) ? (size_t) atol(dedupMB) : 256;
+		uint64_t storeGB = (dedupStoreGB != NULL) ? (uint64_t) atoll(dedupStoreGB) : 64;
+		if (compress == NULL)
+			errx(1, "PROXY_BRIDGE_DEDUP needs PROXY_BRIDGE_COMPRESS (\"none\" if you don't want compression)");
+		if (keyFile != NULL)
+			errx(1, "PROXY_BRIDGE_DEDUP can't be used with PROXY_BRIDGE_KEY_FILE");
+		int error = dedupInit(dedupDir, mb * 1024 * 1024, storeGB * 1024 * 1024 * 1024);
+		if (error != 0)
+			errx(1, "dedupInit(%s, %zu MB): %s", dedupDir, mb, strerror(error));
+	}
+
+	/* The write-back journal is off unless it's given a file to use
+	 * (default size 1 GB).  Records name their files by handle.  Whatever
+	 * the last run left in it goes to the backend before we mount. */
+	char *journalPath = getenv("PROXY_BRIDGE_JOURNAL");
+	char *journalMB = getenv("PROXY_BRIDGE_JOURNAL_MB");
+	if (journalPath != NULL) {
+		size_t mb = (journalMB != NULL) ? (size_t) atol(journalMB) : 1024;
+		if (!handles)
+			errx(1, "PROXY_BRIDGE_JOURNAL needs file handles (and PROXY_BRIDGE_MAX_FDS > 0)");
+		int error = journalInit(journalPath, mb * 1024 * 1024, lo.root.fd);
+		if (error != 0)
+			errx(1, "journalInit(%s, %zu MB): %s", journalPath, mb, strerror(error));
+	}
+
+	/* The trace is off unless it's given a file to record to (default
+	 * size 256 MB).  proxy_replay plays it back. */
+	char *tracePath = getenv("PROXY_BRIDGE_TRACE");
+	char *traceMB = getenv("PROXY_BRIDGE_TRACE_MB");
+	if (tracePath != NULL) {
+		size_t mb = (traceMB != NULL) ? (size_t) atol(traceMB) : 256;
+		int error = traceInit(tracePath, mb * 1024 * 1024);
+		if (error != 0)
+			errx(1, "traceInit(%s, %zu MB): %s", tracePath, mb, strerror(error));
+	}
+
+	/* The backend emulator is off unless it's told what NAS to be (see
+	 * proxy_emulate.h).  It can only slow down calls that come through
+	 * the driver, so it turns passthrough off. */
+	char *emulate = getenv("PROXY_BRIDGE_EMULATE");
+	if (emulateInit(emulate) != 0)
+		errx(1, "PROXY_BRIDGE_EMULATE=%s: must be [lan|wan,]<class>=<latency>[:<dist>[:<spread>]],"
+		     "readbw=<MB/s>,writebw=<MB/s>,slots=<n>", emulate);
+	if (emulateEnabled())
+		lo.passthrough = false;
+
+	/* How long the kernel may cache attributes, names and missing names.
+	 * Read-mostly trees (e.g. toolchains and include directories) can
+	 * use longer timeouts than the rest of the export. */
+	lo.timeouts.attr = envSeconds("PROXY_BRIDGE_ATTR_TIMEOUT", 1.0);
+	lo.timeouts.entry = envSeconds("PROXY_BRIDGE_ENTRY_TIMEOUT", 1.0);
+	lo.timeouts.negative = envSeconds("PROXY_BRIDGE_NEGATIVE_TIMEOUT", 0.0);
+	double readMostly = envSeconds("PROXY_BRIDGE_READ_MOSTLY_TIMEOUT", 60.0);
+	lo.readMostlyTimeouts.attr = readMostly;
+	lo.readMostlyTimeouts.entry = readMostly;
+	lo.readMostlyTimeouts.negative = readMostly;
+	char *readMostlyDirs = getenv("PROXY_BRIDGE_READ_MOSTLY_DIRS");
+	if (readMostlyDirs != NULL) {
+		struct stat rootStat;
+		lo_load_read_mostly(&lo, readMostlyDirs);
+		if (fstat(lo.root.fd, &rootStat) == 0)
+			lo.root.read_mostly = lo_is_read_mostly_dir(&lo, &rootStat);
+	}
+	LOG_STATUS(NULL, "Timeouts: attr %gs : entry %gs : negative %gs : read-mostly %gs (%zu dirs).",
+	           lo.timeouts.attr, lo.timeouts.entry, lo.timeouts.negative,
+	           readMostly, lo.numReadMostlyDirs);
+
 	se = fuse_session_new(&args, &lo_oper, sizeof(lo_oper), &lo);
 	if (se == NULL)
 	    goto err_out1;
@@ -1389,13 +2944,96 @@ int main(int argc, char *argv[])
 
 	fuse_daemonize(opts.foreground);
 
-	/* Block until ctrl+c or fusermount -u */
+	/* Now that we've forked, start the background log writer. */
+	if (logStart() != 0)
+		LOG_ERROR(NULL, "Unable to start the log writer.  Logging synchronously.");
+
+	if (writeBufStart() != 0)
+		LOG_ERROR(NULL, "Unable to start the write buffer flusher.");
+
+	if (diskCacheStart() != 0)
+		LOG_ERROR(NULL, "Unable to start the disk cache writer.  Not filling the disk cache.");
+
+	if (journalStart() != 0)
+		LOG_ERROR(NULL, "Unable to start the journal destager.  Writing straight through.");
+
+	/* Helpers for handlers that can do several backend calls at once
+	 * (readdirplus).  0 means the handlers do everything themselves. */
+	char *workers = getenv("PROXY_BRIDGE_WORKERS");
+	if (workPoolStart((workers != NULL) ? atoi(workers) : 8) != 0)
+		LOG_ERROR(NULL, "Unable to start the worker pool.");
+
+	/* Closes are NAS round trips that nobody waits for, so RELEASE and
+	 * FORGET hand them to these threads. */
+	char *closers = getenv("PROXY_BRIDGE_CLOSERS");
+	if (closerStart((closers != NULL) ? atoi(closers) : 4) != 0)
+		LOG_ERROR(NULL, "Unable to start the closer.  Closing synchronously.");
+
+	/* The io_uring data path is off unless it's given a queue depth.  If
+	 * we can't have it, reads/writes/fsyncs are done synchronously. */
+	char *uringDepth = getenv("PROXY_BRIDGE_URING_DEPTH");
+	if ((uringDepth != NULL) && emulateEnabled()) {
+		LOG_STATUS(NULL, "Not using the io_uring while emulating the backend.");
+	} else if (uringDepth != NULL) {
+		int error = uringStart(atoi(uringDepth));
+		if (error != 0)
+			LOG_ERROR(NULL, "io_uring unavailable (%s).  Using synchronous I/O.",
+			          strerror(error));
+	}
+
+	/* The stats are always collected.  They're only served if we're told
+	 * where to put the socket. */
+	statsAddGauge("inodes", "Number of inodes in the inode table.",
+	              lo_inode_count, &lo.inodes);
+	statsAddGauge("inode_fds", "Inode fds that are open and may be closed to save fds.",
+	              lo_inode_fds, &lo.inodes);
+	statsAddGauge("cache_bytes", "Bytes of file data in the block cache.",
+	              blockCacheBytes, NULL);
+	statsAddGauge("dcache_bytes", "Bytes of file data in the disk cache.",
+	              diskCacheBytes, NULL);
+	statsAddGauge("journal_pending_bytes", "Bytes in the journal that aren't on the backend yet.",
+	              journalPendingBytes, NULL);
+	statsAddGauge("dedup_table_entries", "Fingerprints in the dedup table.",
+	              dedupEntries, NULL);
+	statsAddGauge("engine_threads", "Request threads.",
+	              engineThreads, NULL);
+	statsAddGauge("engine_idle_threads", "Request threads waiting for a request.",
+	              engineIdleThreads, NULL);
+	statsAddGauge("engine_target_threads", "Request threads that the engine keeps, busy or not.",
+	              engineTargetThreads, NULL);
+	char *statsSock = getenv("PROXY_BRIDGE_STATS_SOCK");
+	if (statsSock != NULL && statsStart(statsSock) != 0)
+		LOG_ERROR(NULL, "Unable to serve stats on %s.", statsSock);
+
+	/* Block until ctrl+c or fusermount -u.  Our engine can't clone the
+	 * /dev/fuse fd, so "-o clone_fd" gets libfuse's loop. */
 	if (opts.singlethread)
 		ret = fuse_session_loop(se);
-	else
+	else if (opts.clone_fd)
 		ret = fuse_session_loop_mt(se, opts.clone_fd);
+	else {
+		char *minThreads = getenv("PROXY_BRIDGE_THREADS_MIN");
+		char *maxThreads = getenv("PROXY_BRIDGE_THREADS_MAX");
+		char *maxIdle = getenv("PROXY_BRIDGE_THREADS_IDLE");
+		char *pin = getenv("PROXY_BRIDGE_PIN_THREADS");
+		struct engine_config cfg = {
+			.minThreads = (minThreads != NULL) ? atoi(minThreads) : 2,
+			.maxThreads = (maxThreads != NULL) ? atoi(maxThreads) : 64,
+			.maxIdle = (maxIdle != NULL) ? atoi(maxIdle) : 10,
+			.pin = (pin != NULL) && (atoi(pin) != 0),
+		};
+		ret = engineRun(se, &cfg);
+	}
 
 	fuse_session_unmount(se);
+	closerStop();
+	uringStop();
+	workPoolStop();
+	writeBufStop();
+	journalStop();
+	diskCacheStop();
+	statsStop();
+	logStop();
 err_out3:
 	fuse_remove_signal_handlers(se);
 err_out2:
@@ -1404,8 +3042,15 @@ err_out1:
 	free(opts.mountpoint);
 	fuse_opt_free_args(&args);
 
-	while (lo.root.next != &lo.root)
-		lo_free(lo.root.next);
+	inodeTableDestroy(&lo.inodes);
+	blockCacheDestroy();
+	diskCacheDestroy();
+	journalDestroy();
+	traceDestroy();
+	dedupDestroy();
+	compressDestroy();
+	cryptDestroy();
+	free(lo.readMostlyDirs);
 	if (lo.root.fd >= 0)
 		close(lo.root.fd);
 
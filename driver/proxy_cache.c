@@ -0,0 +1,425 @@
+/* *****************************************************************************
+ * The block cache.  See proxy_cache.h for the big picture.
+ *
+ * Each shard runs its own copy of ARC with 4 lists:
+ *   T1 - Resident blocks that have been used once.
+ *   T2 - Resident blocks that have been used more than once.
+ *   B1 - Ghosts (key only, no data) of blocks recently evicted from T1.
+ *   B2 - Ghosts of blocks recently evicted from T2.
+ * p is the target size of T1.  A hit on a B1 ghost means T1 was too small, so
+ * p grows.  A hit on a B2 ghost means T2 was too small, so p shrinks.
+ *
+ * Every list is circular, with the MRU entry at head.next and the LRU entry at
+ * head.prev.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "proxy_cache.h"
+#include "proxy_stats.h"
+
+/* Must be a power of 2. */
+#define CACHE_SHARDS (16)
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_LISTS };
+
+struct cache_entry {
+	struct cache_entry *hnext;   /* Next entry in the same hash bucket. */
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	int list;
+	dev_t dev;
+	ino_t ino;
+	uint64_t blk;
+	struct cache_stamp stamp;
+	size_t len;
+	char *data;                  /* NULL for ghosts. */
+};
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct cache_entry **buckets;
+	size_t nbuckets;             /* Always a power of 2. */
+	struct cache_entry lists[ARC_LISTS];
+	size_t counts[ARC_LISTS];
+	size_t c;                    /* Capacity, in blocks. */
+	size_t p;                    /* Target size of T1. */
+} __attribute__((aligned(64)));
+
+static struct cache_shard *shards = NULL;
+static size_t residentBytes = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static uint64_t cacheHash(dev_t dev, ino_t ino, uint64_t blk)
+{
+	uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^
+	             ((uint64_t) dev * 0xC2B2AE3D27D4EB4FULL) ^
+	             (blk * 0x165667B19E3779F9ULL);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static bool cacheStampEqual(const struct cache_stamp *a, const struct cache_stamp *b)
+{
+	return (a->gen == b->gen) &&
+	       (a->size == b->size) &&
+	       (a->mtime.tv_sec == b->mtime.tv_sec) &&
+	       (a->mtime.tv_nsec == b->mtime.tv_nsec) &&
+	       (a->ctime.tv_sec == b->ctime.tv_sec) &&
+	       (a->ctime.tv_nsec == b->ctime.tv_nsec);
+}
+
+static void listRemove(struct cache_shard *s, struct cache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	s->counts[e->list]--;
+}
+
+static void listPushMRU(struct cache_shard *s, struct cache_entry *e, int list)
+{
+	struct cache_entry *head = &s->lists[list];
+	e->list = list;
+	e->next = head->next;
+	e->prev = head;
+	head->next->prev = e;
+	head->next = e;
+	s->counts[list]++;
+}
+
+static struct cache_entry *listLRU(struct cache_shard *s, int list)
+{
+	struct cache_entry *head = &s->lists[list];
+	return (head->prev == head) ? NULL : head->prev;
+}
+
+static struct cache_entry *hashFind(struct cache_shard *s, uint64_t h,
+                                    dev_t dev, ino_t ino, uint64_t blk)
+{
+	struct cache_entry *e;
+	for(e = s->buckets[(h >> 32) & (s->nbuckets - 1)]; e != NULL; e = e->hnext) {
+		if((e->blk == blk) && (e->ino == ino) && (e->dev == dev)) {
+			break;
+		}
+	}
+	return e;
+}
+
+static void hashRemove(struct cache_shard *s, struct cache_entry *e)
+{
+	uint64_t h = cacheHash(e->dev, e->ino, e->blk);
+	struct cache_entry **pp = &s->buckets[(h >> 32) & (s->nbuckets - 1)];
+	while(*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+}
+
+/* Throw away a block's data.  The entry stays where it is. */
+static void entryDropData(struct cache_entry *e)
+{
+	if(e->data != NULL) {
+		free(e->data);
+		e->data = NULL;
+		__atomic_sub_fetch(&residentBytes, e->len, __ATOMIC_RELAXED);
+	}
+}
+
+/* Remove an entry from the shard completely. */
+static void entryFree(struct cache_shard *s, struct cache_entry *e)
+{
+	if(e == NULL) {
+		return;
+	}
+	hashRemove(s, e);
+	listRemove(s, e);
+	entryDropData(e);
+	free(e);
+}
+
+/* Turn the LRU block of a resident list into a ghost. */
+static void entryDemote(struct cache_shard *s, int from, int to)
+{
+	struct cache_entry *e = listLRU(s, from);
+	listRemove(s, e);
+	entryDropData(e);
+	listPushMRU(s, e, to);
+	statsCount(STATS_CTR_cache_evictions, 1);
+}
+
+/* ARC's REPLACE.  Make room for one more resident block by evicting from T1
+ * or T2, depending on how the target (p) compares to the actual T1 size. */
+static void arcReplace(struct cache_shard *s, bool inB2)
+{
+	size_t t1 = s->counts[ARC_T1];
+	size_t t2 = s->counts[ARC_T2];
+
+	if((t1 + t2) < s->c) {
+		return;
+	}
+
+	if((t1 > 0) && ((t1 > s->p) || (inB2 && (t1 == s->p)))) {
+		entryDemote(s, ARC_T1, ARC_B1);
+	}
+	else if(t2 > 0) {
+		entryDemote(s, ARC_T2, ARC_B2);
+	}
+	else if(t1 > 0) {
+		entryDemote(s, ARC_T1, ARC_B1);
+	}
+}
+
+/* Find or create the entry for a block that is about to become resident.
+ * This is where ARC does its bookkeeping.  Called with the shard lock held. */
+static struct cache_entry *arcAdmit(struct cache_shard *s, uint64_t h,
+                                    dev_t dev, ino_t ino, uint64_t blk)
+{
+	struct cache_entry *e = hashFind(s, h, dev, ino, blk);
+
+	if(e != NULL) {
+		size_t b1 = s->counts[ARC_B1];
+		size_t b2 = s->counts[ARC_B2];
+
+		switch(e->list) {
+		case ARC_T1:
+		case ARC_T2:
+			/* Somebody else filled it while we were reading. */
+			entryDropData(e);
+			return e;
+
+		case ARC_B1: {
+			size_t delta = (b2 > b1) ? (b2 / b1) : 1;
+			s->p = ((s->p + delta) < s->c) ? (s->p + delta) : s->c;
+			listRemove(s, e);
+			arcReplace(s, false);
+			listPushMRU(s, e, ARC_T2);
+			return e;
+		}
+
+		case ARC_B2: {
+			size_t delta = (b1 > b2) ? (b1 / b2) : 1;
+			s->p = (s->p > delta) ? (s->p - delta) : 0;
+			listRemove(s, e);
+			arcReplace(s, true);
+			listPushMRU(s, e, ARC_T2);
+			return e;
+		}
+		}
+	}
+
+	/* A complete miss. */
+	size_t t1 = s->counts[ARC_T1];
+	size_t l1 = t1 + s->counts[ARC_B1];
+	size_t total = l1 + s->counts[ARC_T2] + s->counts[ARC_B2];
+
+	if(l1 >= s->c) {
+		if(t1 < s->c) {
+			entryFree(s, listLRU(s, ARC_B1));
+			arcReplace(s, false);
+		}
+		else {
+			entryFree(s, listLRU(s, ARC_T1));
+			statsCount(STATS_CTR_cache_evictions, 1);
+		}
+	}
+	else if(total >= s->c) {
+		if(total >= (2 * s->c)) {
+			entryFree(s, listLRU(s, ARC_B2));
+		}
+		arcReplace(s, false);
+	}
+
+	e = calloc(1, sizeof(struct cache_entry));
+	if(e == NULL) {
+		return NULL;
+	}
+	e->dev = dev;
+	e->ino = ino;
+	e->blk = blk;
+
+	size_t b = (h >> 32) & (s->nbuckets - 1);
+	e->hnext = s->buckets[b];
+	s->buckets[b] = e;
+	listPushMRU(s, e, ARC_T1);
+
+	return e;
+}
+
+/* *****************************************************************************
+ * THE EXPORTED API FUNCTIONS.
+ * ****************************************************************************/
+
+/* Set up the cache.  A budget of 0 leaves the cache disabled.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int blockCacheInit(size_t budgetBytes)
+{
+	if(budgetBytes == 0) {
+		return 0;
+	}
+
+	size_t c = budgetBytes / CACHE_BLOCK_SZ / CACHE_SHARDS;
+	if(c == 0) {
+		c = 1;
+	}
+
+	/* Resident blocks plus ghosts never exceed 2c per shard. */
+	size_t nbuckets = 1;
+	while(nbuckets < (2 * c)) {
+		nbuckets <<= 1;
+	}
+
+	shards = calloc(CACHE_SHARDS, sizeof(struct cache_shard));
+	if(shards == NULL) {
+		return ENOMEM;
+	}
+
+	int i;
+	for(i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *s = &shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->c = c;
+		s->p = 0;
+		s->nbuckets = nbuckets;
+		s->buckets = calloc(nbuckets, sizeof(*s->buckets));
+		if(s->buckets == NULL) {
+			blockCacheDestroy();
+			return ENOMEM;
+		}
+
+		int l;
+		for(l = 0; l < ARC_LISTS; l++) {
+			s->lists[l].next = s->lists[l].prev = &s->lists[l];
+			s->counts[l] = 0;
+		}
+	}
+
+	return 0;
+}
+
+void blockCacheDestroy(void)
+{
+	if(shards == NULL) {
+		return;
+	}
+
+	int i;
+	for(i = 0; i < CACHE_SHARDS; i++) {
+		struct cache_shard *s = &shards[i];
+		int l;
+		for(l = 0; (s->buckets != NULL) && (l < ARC_LISTS); l++) {
+			struct cache_entry *e;
+			while((e = listLRU(s, l)) != NULL) {
+				entryFree(s, e);
+			}
+		}
+		free(s->buckets);
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	free(shards);
+	shards = NULL;
+}
+
+bool blockCacheEnabled(void)
+{
+	return shards != NULL;
+}
+
+/* Build the stamp that blocks of a file must match.  gen is the generation of
+ * the file's lo_inode. */
+void blockCacheStamp(struct cache_stamp *stamp, const struct stat *st, uint64_t gen)
+{
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->mtime = st->st_mtim;
+	stamp->ctime = st->st_ctim;
+	stamp->size = st->st_size;
+	stamp->gen = gen;
+}
+
+/* Copy a block into dst (which must hold CACHE_BLOCK_SZ bytes).
+ *
+ * Returns:
+ *  >=0 = number of bytes copied.  Less than CACHE_BLOCK_SZ means the block
+ *        holds the end of the file.
+ *   -1 = miss.
+ */
+ssize_t blockCacheGet(dev_t dev, ino_t ino, uint64_t blk,
+                      const struct cache_stamp *stamp, char *dst)
+{
+	uint64_t h = cacheHash(dev, ino, blk);
+	struct cache_shard *s = &shards[h & (CACHE_SHARDS - 1)];
+	ssize_t len = -1;
+
+	pthread_mutex_lock(&s->lock);
+
+	struct cache_entry *e = hashFind(s, h, dev, ino, blk);
+	if((e != NULL) && (e->data != NULL)) {
+		if(cacheStampEqual(&e->stamp, stamp)) {
+			memcpy(dst, e->data, e->len);
+			len = e->len;
+			listRemove(s, e);
+			listPushMRU(s, e, ARC_T2);
+		}
+		else {
+			/* The file has changed since we cached this. */
+			entryFree(s, e);
+			statsCount(STATS_CTR_cache_stale, 1);
+		}
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	statsCount((len == -1) ? STATS_CTR_cache_misses : STATS_CTR_cache_hits, 1);
+	return len;
+}
+
+/* Add a block that we just read from the backend. */
+void blockCachePut(dev_t dev, ino_t ino, uint64_t blk,
+                   const struct cache_stamp *stamp, const char *src, size_t len)
+{
+	/* Allocate outside of the lock. */
+	char *data = malloc(len ? len : 1);
+	if(data == NULL) {
+		return;
+	}
+	memcpy(data, src, len);
+
+	uint64_t h = cacheHash(dev, ino, blk);
+	struct cache_shard *s = &shards[h & (CACHE_SHARDS - 1)];
+
+	pthread_mutex_lock(&s->lock);
+
+	struct cache_entry *e = arcAdmit(s, h, dev, ino, blk);
+	if(e != NULL) {
+		e->stamp = *stamp;
+		e->len = len;
+		e->data = data;
+		data = NULL;
+		__atomic_add_fetch(&residentBytes, len, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	free(data);
+}
+
+/* Gauge callback for the stats exporter. */
+double blockCacheBytes(void *arg)
+{
+	(void) arg;
+	return (double) __atomic_load_n(&residentBytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,49 @@
+/* *****************************************************************************
+ * The block cache.
+ *
+ * An in-memory cache of file data that sits in front of lo_read().  Files are
+ * cached in fixed-size blocks, keyed by (dev, ino, block number).
+ *
+ * Every block carries a stamp: the backend file's mtime, ctime and size, plus
+ * the generation of our lo_inode (which changes every time the proxy modifies
+ * the file).  A block is only used if its stamp matches the file's current
+ * stamp, so writes through the proxy and writes by other NAS clients both
+ * make old blocks invisible.
+ *
+ * Eviction is ARC (Adaptive Replacement Cache), done separately in each
+ * shard.  ARC keeps "recently used once" and "used more than once" blocks on
+ * separate lists, and remembers recently evicted keys, so a big sequential
+ * scan can't flush out the blocks that are actually hot.
+ * ****************************************************************************/
+
+#ifndef PROXY_CACHE_H
+#define PROXY_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CACHE_BLOCK_SZ (64 * 1024)
+
+struct cache_stamp {
+	struct timespec mtime;
+	struct timespec ctime;
+	off_t size;
+	uint64_t gen;
+};
+
+int blockCacheInit(size_t budgetBytes);
+void blockCacheDestroy(void);
+bool blockCacheEnabled(void);
+
+void blockCacheStamp(struct cache_stamp *stamp, const struct stat *st, uint64_t gen);
+ssize_t blockCacheGet(dev_t dev, ino_t ino, uint64_t blk,
+                      const struct cache_stamp *stamp, char *dst);
+void blockCachePut(dev_t dev, ino_t ino, uint64_t blk,
+                   const struct cache_stamp *stamp, const char *src, size_t len);
+double blockCacheBytes(void *arg);
+
+#endif /* PROXY_CACHE_H */
@@ -0,0 +1,172 @@
+/* *****************************************************************************
+ * The background closer.  See proxy_closer.h for the big picture.
+ *
+ * The jobs sit on one list.  A closer thread takes the whole list at once and
+ * works through it without the lock, so a burst of closes costs each thread
+ * one trip through the lock instead of one per file.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "proxy_closer.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+struct closer_job {
+	struct closer_job *next;
+	closer_fn fn;
+	void *arg;
+};
+
+static pthread_mutex_t closerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t closerWork = PTHREAD_COND_INITIALIZER;
+static struct closer_job *closerJobs = NULL;
+static bool closerRunning = false;
+static bool closerStopping = false;
+
+static pthread_t *closerThreads = NULL;
+static unsigned int closerNumThreads = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static void closerRunJobs(struct closer_job *job)
+{
+	uint64_t count = 0;
+	while(job != NULL) {
+		struct closer_job *next = job->next;
+		job->fn(job->arg);
+		free(job);
+		job = next;
+		count++;
+	}
+	statsCount(STATS_CTR_closer_jobs, count);
+}
+
+static void *closerThread(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&closerLock);
+	for(;;) {
+		struct closer_job *jobs = closerJobs;
+		if(jobs == NULL) {
+			if(closerStopping) {
+				break;
+			}
+			pthread_cond_wait(&closerWork, &closerLock);
+			continue;
+		}
+		closerJobs = NULL;
+		pthread_mutex_unlock(&closerLock);
+
+		closerRunJobs(jobs);
+
+		pthread_mutex_lock(&closerLock);
+	}
+	pthread_mutex_unlock(&closerLock);
+
+	return NULL;
+}
+
+static void closerCloseFD(void *arg)
+{
+	close((int) (intptr_t) arg);
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Start the closer threads.  Call it after fuse_daemonize().  With 0 threads,
+ * every job runs on the thread that queues it.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int closerStart(unsigned int numThreads)
+{
+	if(numThreads == 0) {
+		return 0;
+	}
+
+	closerThreads = calloc(numThreads, sizeof(pthread_t));
+	if(closerThreads == NULL) {
+		return ENOMEM;
+	}
+
+	closerStopping = false;
+	unsigned int i;
+	for(i = 0; i < numThreads; i++) {
+		int rc = pthread_create(&closerThreads[i], NULL, closerThread, NULL);
+		if(rc != 0) {
+			LOG_ERROR(NULL, "pthread_create() failed (%d).  Running with %u closers.", rc, i);
+			break;
+		}
+		closerNumThreads++;
+	}
+
+	pthread_mutex_lock(&closerLock);
+	closerRunning = (closerNumThreads > 0);
+	pthread_mutex_unlock(&closerLock);
+
+	return 0;
+}
+
+/* Run everything that's still queued, then stop the threads.  Anything queued
+ * after this runs inline. */
+void closerStop(void)
+{
+	pthread_mutex_lock(&closerLock);
+	closerRunning = false;
+	closerStopping = true;
+	pthread_cond_broadcast(&closerWork);
+	pthread_mutex_unlock(&closerLock);
+
+	unsigned int i;
+	for(i = 0; i < closerNumThreads; i++) {
+		pthread_join(closerThreads[i], NULL);
+	}
+
+	free(closerThreads);
+	closerThreads = NULL;
+	closerNumThreads = 0;
+}
+
+/* Call fn(arg) on a closer thread some time soon. */
+void closerQueue(closer_fn fn, void *arg)
+{
+	struct closer_job *job = malloc(sizeof(struct closer_job));
+	if(job != NULL) {
+		job->fn = fn;
+		job->arg = arg;
+
+		pthread_mutex_lock(&closerLock);
+		if(closerRunning) {
+			job->next = closerJobs;
+			closerJobs = job;
+			pthread_cond_signal(&closerWork);
+			pthread_mutex_unlock(&closerLock);
+			return;
+		}
+		pthread_mutex_unlock(&closerLock);
+		free(job);
+	}
+
+	fn(arg);
+}
+
+/* close(fd) on a closer thread.  There's nobody to tell if it fails. */
+void closerClose(int fd)
+{
+	closerQueue(closerCloseFD, (void *) (intptr_t) fd);
+}
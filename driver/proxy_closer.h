@@ -0,0 +1,27 @@
+/* *****************************************************************************
+ * The background closer.
+ *
+ * Closing a file on the NAS is a round trip (NFS/SMB push out dirty data and
+ * tell the server we're done), and so is the last write-buffer flush.  RELEASE
+ * and FORGET don't have anything to tell the application, so there's no
+ * reason to make a session thread wait for them.  Those handlers hand the
+ * slow part to a few closer threads and move on.  That matters most when the
+ * kernel drops a lot of files at once (rm -rf, a big tar, unmount), where the
+ * closes used to tie up every session thread.
+ *
+ * The jobs run in no particular order.  If the closer isn't running (or we're
+ * out of memory), closerQueue() runs the job on the caller's thread.
+ * ****************************************************************************/
+
+#ifndef PROXY_CLOSER_H
+#define PROXY_CLOSER_H
+
+typedef void (*closer_fn)(void *arg);
+
+int closerStart(unsigned int numThreads);
+void closerStop(void);
+
+void closerQueue(closer_fn fn, void *arg);
+void closerClose(int fd);
+
+#endif /* PROXY_CLOSER_H */
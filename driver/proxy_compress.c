@@ -0,0 +1,1217 @@
+/* *****************************************************************************
+ * File compression.  See proxy_compress.h for the big picture.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "proxy_compress.h"
+#include "proxy_crypt.h"
+#include "proxy_dedup.h"
+#include "proxy_engine.h"
+#include "proxy_journal.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+#include "proxy_stats.h"
+
+#define COMPRESS_MAGIC    "NPXZ"
+#define COMPRESS_VERSION  (1)
+
+/* Room for the index at the front of each group. */
+#define COMPRESS_INDEX_SZ (4096)
+
+/* A chunk's slot: two halves, one for the data that the index points at,
+ * and one for the next time it's written. */
+#define COMPRESS_SLOT_SZ  ((off_t) 2 * COMPRESS_CHUNK_SZ)
+
+/* Plain bytes in a group, and the backend bytes that they take up. */
+#define COMPRESS_GROUP_DATA ((off_t) COMPRESS_GROUP_CHUNKS * COMPRESS_CHUNK_SZ)
+#define COMPRESS_GROUP_SZ   (COMPRESS_INDEX_SZ + COMPRESS_GROUP_CHUNKS * COMPRESS_SLOT_SZ)
+
+/* In compress_entry.len: the chunk is stored as is, or the slot holds a
+ * dedup_ref (see proxy_dedup.h) instead of the chunk, and which half of the
+ * slot it's in. */
+#define COMPRESS_RAW      (0x80000000u)
+#define COMPRESS_DEDUP    (0x40000000u)
+#define COMPRESS_HALF     (0x20000000u)
+#define COMPRESS_LEN_MASK (0x1fffffffu)
+
+/* The front of every file.  The rest of the COMPRESS_HEADER_SZ bytes are
+ * zero.  The layout is fixed by the version; the sizes are there to catch a
+ * file from a build with different ones. */
+struct compress_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t codec;
+	uint8_t pad[2];
+	uint32_t chunkSize;
+	uint32_t groupChunks;
+};
+
+/* One chunk's index entry.  len 0 is a chunk of zeros. */
+struct compress_entry {
+	uint32_t len;             /* Stored bytes, | COMPRESS_RAW, COMPRESS_DEDUP, COMPRESS_HALF. */
+	uint32_t crc;             /* CRC-32 of the stored bytes. */
+};
+_Static_assert(COMPRESS_GROUP_CHUNKS * sizeof(struct compress_entry) <= COMPRESS_INDEX_SZ,
+               "the index doesn't fit in COMPRESS_INDEX_SZ");
+_Static_assert(sizeof(struct compress_header) <= COMPRESS_HEADER_SZ,
+               "compress_header doesn't fit in COMPRESS_HEADER_SZ");
+
+struct compress_codec {
+	const char *name;
+	uint8_t id;               /* What the file header says.  Never reuse one. */
+	int defaultLevel;
+
+	/* Returns the compressed length, or 0 if it doesn't fit in dstLen. */
+	size_t (*compress)(const char *src, size_t len, char *dst, size_t dstLen, int level);
+
+	/* Returns the plain length, or -1 if src is bad. */
+	ssize_t (*decompress)(const char *src, size_t len, char *dst, size_t dstLen);
+};
+
+/* Hangs off the inode once its header has been read. */
+struct compress_file {
+	/* Reads share it.  Writes and truncates take it for themselves, so
+	 * they can read, merge, and rewrite chunks without anybody seeing
+	 * half of it. */
+	pthread_rwlock_t lock;
+
+	/* Protects groups and numGroups.  Reads load indexes while they
+	 * share lock. */
+	pthread_mutex_t indexLock;
+
+	struct lo_inode *inode;   /* For the layers underneath (encryption, the journal). */
+	const struct compress_codec *codec;
+	off_t size;               /* Plain size.  Changed with lock held for writing. */
+	dev_t dev;                /* The backend file, for dedup_origin. */
+	ino_t ino;
+
+	/* dedupAdded() after the last write that left a dedup_ref in a
+	 * slot, for fsync(). */
+	uint64_t dedupSeq;
+
+	/* Each group's index, or NULL if it hasn't been read yet. */
+	struct compress_entry **groups;
+	size_t numGroups;
+
+	/* The last chunk that was written, plain, so the next small write
+	 * doesn't have to read it back.  Changed with lock held for writing. */
+	int64_t cachedChunk;      /* -1 if there isn't one. */
+	char *cached;
+};
+
+/* Chunks [first, first + n), for workPoolRun().  plain has
+ * COMPRESS_CHUNK_SZ bytes for each one. */
+struct compress_job {
+	struct compress_file *cf;
+	int fd;
+	uint64_t first;
+	char *plain;
+	struct compress_entry *entries; /* In: the current entries. Out (stores): the new ones. */
+	bool *todo;               /* Loads: the chunks that need it. */
+	off_t size;               /* Stores: the plain size of the file. */
+	bool store;
+	int error;
+};
+
+static bool compressOn = false;
+static const struct compress_codec *compressCodec = NULL;
+static int compressLevel = 0;
+
+/* Taken while a file's header is read or written, so two first opens can't
+ * both write one. */
+static pthread_mutex_t compressOpenLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* *****************************************************************************
+ * CODECS.
+ * ****************************************************************************/
+
+static size_t compressZlib(const char *src, size_t len, char *dst, size_t dstLen, int level)
+{
+	uLongf n = dstLen;
+	if(compress2((Bytef *) dst, &n, (const Bytef *) src, len, level) != Z_OK)
+		return 0;
+	return n;
+}
+
+static ssize_t decompressZlib(const char *src, size_t len, char *dst, size_t dstLen)
+{
+	uLongf n = dstLen;
+	if(uncompress((Bytef *) dst, &n, (const Bytef *) src, len) != Z_OK)
+		return -1;
+	return n;
+}
+
+/* Never smaller, so every chunk is stored as is.  For dedup on its own. */
+static size_t compressNone(const char *src, size_t len, char *dst, size_t dstLen, int level)
+{
+	(void) src, len, dst, dstLen, level;
+	return 0;
+}
+
+static ssize_t decompressNone(const char *src, size_t len, char *dst, size_t dstLen)
+{
+	(void) src, len, dst, dstLen;
+	return -1;
+}
+
+static const struct compress_codec compressCodecs[] = {
+	{ "zlib", 1, 1, compressZlib, decompressZlib },
+	{ "none", 2, 0, compressNone, decompressNone },
+};
+
+#define COMPRESS_NUM_CODECS (sizeof(compressCodecs) / sizeof(compressCodecs[0]))
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static off_t compressIndexPos(uint64_t group)
+{
+	return COMPRESS_HEADER_SZ + (off_t) group * COMPRESS_GROUP_SZ;
+}
+
+static off_t compressSlotPos(uint64_t chunk)
+{
+	return compressIndexPos(chunk / COMPRESS_GROUP_CHUNKS) + COMPRESS_INDEX_SZ +
+	       (off_t) (chunk % COMPRESS_GROUP_CHUNKS) * COMPRESS_SLOT_SZ;
+}
+
+/* Where a chunk's data is, for its index entry. */
+static off_t compressDataPos(uint64_t chunk, const struct compress_entry *entry)
+{
+	return compressSlotPos(chunk) + ((entry->len & COMPRESS_HALF) ? COMPRESS_CHUNK_SZ : 0);
+}
+
+/* How long the backend file is for a plain size: up to where the last
+ * chunk's plain bytes would end in the second half of its slot. */
+static off_t compressBackendSize(off_t size)
+{
+	if(size == 0)
+		return COMPRESS_HEADER_SZ;
+	uint64_t chunk = (size - 1) / COMPRESS_CHUNK_SZ;
+	return compressSlotPos(chunk) + COMPRESS_CHUNK_SZ + (size - chunk * COMPRESS_CHUNK_SZ);
+}
+
+/* The other way around. */
+static off_t compressPlainSize(off_t backendSize)
+{
+	if(backendSize <= COMPRESS_HEADER_SZ + COMPRESS_INDEX_SZ + COMPRESS_CHUNK_SZ)
+		return 0;
+	off_t x = backendSize - COMPRESS_HEADER_SZ;
+	uint64_t group = (x - COMPRESS_INDEX_SZ - 1) / COMPRESS_GROUP_SZ;
+	off_t y = x - group * COMPRESS_GROUP_SZ - COMPRESS_INDEX_SZ;
+	uint64_t slot = (y - COMPRESS_CHUNK_SZ - 1) / COMPRESS_SLOT_SZ;
+	return group * COMPRESS_GROUP_DATA + slot * COMPRESS_CHUNK_SZ +
+	       (y - slot * COMPRESS_SLOT_SZ - COMPRESS_CHUNK_SZ);
+}
+
+static const struct compress_codec *compressCodecById(uint8_t id)
+{
+	size_t i;
+	for(i = 0; i < COMPRESS_NUM_CODECS; i++) {
+		if(compressCodecs[i].id == id)
+			return &compressCodecs[i];
+	}
+	return NULL;
+}
+
+static bool compressIsZero(const char *p, size_t len)
+{
+	return (len == 0) || ((p[0] == 0) && (memcmp(p, p + 1, len - 1) == 0));
+}
+
+/* The backend reads and writes go through the encryption, if it's on, and
+ * the journal, so what's read includes the writes that haven't been destaged
+ * yet, and the writes stay in order with them.  off is where the compressed
+ * layout has it (below the encryption's header). */
+static int compressReadFull(struct compress_file *cf, int fd, char *buf, size_t len, off_t off)
+{
+	if(cryptEnabled())
+		return cryptPread(cf->inode, fd, buf, len, off);
+
+	size_t total = 0;
+	while(total < len) {
+		ssize_t n = journalRead(cf->inode, fd, buf + total, len - total, off + total);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		if(n == 0)
+			break;
+		total += n;
+	}
+	if(total < len)
+		memset(buf + total, 0, len - total);
+	return 0;
+}
+
+static int compressWriteFull(struct compress_file *cf, int fd, const char *buf, size_t len, off_t off)
+{
+	if(cryptEnabled())
+		return cryptPwrite(cf->inode, fd, buf, len, off);
+	return journalWriteAt(cf->inode, fd, buf, len, off);
+}
+
+/* Make the backend file the right length for a plain size.  A shrink has to
+ * wait for the journal's records, or they'd land past the new end. */
+static int compressResize(struct compress_file *cf, int fd, off_t size)
+{
+	off_t backendSize = compressBackendSize(size);
+	if(cryptEnabled())
+		return cryptTruncate(cf->inode, fd, backendSize);
+
+	if(size < cf->size)
+		journalFlushInode(cf->inode);
+	if(STATS_BACKEND(ftruncate(fd, backendSize)) == -1)
+		return errno;
+	return 0;
+}
+
+/* A group's index, read from the backend the first time.  A group past the
+ * end of the backend file is all zeros (holes).  Call with indexLock held.
+ *
+ * Returns NULL (and sets errno) on failure.
+ */
+static struct compress_entry *compressGroup(struct compress_file *cf, int fd, uint64_t group)
+{
+	if(group >= cf->numGroups) {
+		size_t num = group + 16;
+		struct compress_entry **groups = realloc(cf->groups, num * sizeof(*groups));
+		if(groups == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(groups + cf->numGroups, 0, (num - cf->numGroups) * sizeof(*groups));
+		cf->groups = groups;
+		cf->numGroups = num;
+	}
+	if(cf->groups[group] != NULL)
+		return cf->groups[group];
+
+	/* All of COMPRESS_INDEX_SZ, so it can be written whole.  See
+	 * compressPutEntries(). */
+	size_t len = COMPRESS_GROUP_CHUNKS * sizeof(struct compress_entry);
+	struct compress_entry *index = calloc(1, COMPRESS_INDEX_SZ);
+	if(index == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	int error = compressReadFull(cf, fd, (char *) index, len, compressIndexPos(group));
+	if(error != 0) {
+		free(index);
+		errno = error;
+		return NULL;
+	}
+	cf->groups[group] = index;
+	return index;
+}
+
+/* Copy the index entries for chunks [first, first + n). */
+static int compressGetEntries(struct compress_file *cf, int fd, uint64_t first, size_t n,
+                              struct compress_entry *entries)
+{
+	int error = 0;
+	pthread_mutex_lock(&cf->indexLock);
+	size_t i;
+	for(i = 0; i < n; i++) {
+		uint64_t chunk = first + i;
+		struct compress_entry *index = compressGroup(cf, fd, chunk / COMPRESS_GROUP_CHUNKS);
+		if(index == NULL) {
+			error = errno;
+			break;
+		}
+		entries[i] = index[chunk % COMPRESS_GROUP_CHUNKS];
+	}
+	pthread_mutex_unlock(&cf->indexLock);
+	return error;
+}
+
+/* Change the entries for chunks [first, first + n), here and on the
+ * backend.  One write for each group.  With encryption on, that's the whole
+ * index, which is one encryption unit, so the unit doesn't have to be read
+ * back first, and is still written in one go. */
+static int compressPutEntries(struct compress_file *cf, int fd, uint64_t first, size_t n,
+                              const struct compress_entry *entries)
+{
+	int error = 0;
+	pthread_mutex_lock(&cf->indexLock);
+	size_t i = 0;
+	while((error == 0) && (i < n)) {
+		uint64_t chunk = first + i;
+		uint64_t group = chunk / COMPRESS_GROUP_CHUNKS;
+		size_t slot = chunk % COMPRESS_GROUP_CHUNKS;
+		size_t count = COMPRESS_GROUP_CHUNKS - slot;
+		if(count > n - i)
+			count = n - i;
+
+		struct compress_entry *index = compressGroup(cf, fd, group);
+		if(index == NULL) {
+			error = errno;
+			break;
+		}
+		memcpy(index + slot, entries + i, count * sizeof(*index));
+		if(cryptEnabled())
+			error = compressWriteFull(cf, fd, (char *) index, COMPRESS_INDEX_SZ,
+			                          compressIndexPos(group));
+		else
+			error = compressWriteFull(cf, fd, (char *) (index + slot), count * sizeof(*index),
+			                          compressIndexPos(group) + slot * sizeof(*index));
+		i += count;
+	}
+	pthread_mutex_unlock(&cf->indexLock);
+	return error;
+}
+
+/* Read a chunk and decompress it into dst (COMPRESS_CHUNK_SZ bytes).
+ * Whatever the chunk doesn't cover is zeros.  A dedup_ref is followed into
+ * the chunk store. */
+static int compressLoadChunk(struct compress_file *cf, int fd, uint64_t chunk,
+                             const struct compress_entry *entry, char *dst)
+{
+	size_t len = entry->len & COMPRESS_LEN_MASK;
+	if(len == 0) {
+		memset(dst, 0, COMPRESS_CHUNK_SZ);
+		return 0;
+	}
+	if(len > COMPRESS_CHUNK_SZ) {
+		statsCount(STATS_CTR_compress_bad_chunks, 1);
+		LOG_ERROR(NULL, "Chunk %llu is %zu bytes (fd %d).", (unsigned long long) chunk, len, fd);
+		return EIO;
+	}
+
+	bool raw = entry->len & COMPRESS_RAW;
+	const struct compress_codec *codec = cf->codec;
+	char *scratch = NULL;
+	if(!raw && ((scratch = malloc(COMPRESS_CHUNK_SZ)) == NULL))
+		return ENOMEM;
+	char *src = raw ? dst : scratch;
+
+	statsCount(STATS_CTR_compress_chunk_reads, 1);
+	int error = compressReadFull(cf, fd, src, len, compressDataPos(chunk, entry));
+	ssize_t plain = len;
+	do {
+		if(error != 0)
+			break;
+
+		if(crc32(0, (const Bytef *) src, len) != entry->crc) {
+			LOG_ERROR(NULL, "Chunk %llu failed its CRC (fd %d).", (unsigned long long) chunk, fd);
+			error = EIO;
+			break;
+		}
+
+		if(entry->len & COMPRESS_DEDUP) {
+			struct dedup_ref ref;
+			if(len != sizeof(ref)) {
+				error = EIO;
+				break;
+			}
+			memcpy(&ref, src, sizeof(ref));
+			plain = len = ref.len & ~DEDUP_RAW;
+			raw = ref.len & DEDUP_RAW;
+			codec = compressCodecById(ref.codec);
+			if((len > COMPRESS_CHUNK_SZ) || (!raw && (codec == NULL))) {
+				LOG_ERROR(NULL, "Chunk %llu has a bad dedup_ref (fd %d).",
+				          (unsigned long long) chunk, fd);
+				error = EIO;
+				break;
+			}
+			src = raw ? dst : scratch;
+			error = dedupRead(&ref, src);
+			if(error != 0)
+				break;
+		}
+
+		if(!raw) {
+			plain = codec->decompress(src, len, dst, COMPRESS_CHUNK_SZ);
+			if(plain < 0) {
+				LOG_ERROR(NULL, "Chunk %llu doesn't decompress (fd %d).",
+				          (unsigned long long) chunk, fd);
+				error = EIO;
+				break;
+			}
+		}
+		memset(dst + plain, 0, COMPRESS_CHUNK_SZ - plain);
+	} while(0);
+
+	if(error == EIO)
+		statsCount(STATS_CTR_compress_bad_chunks, 1);
+	free(scratch);
+	return error;
+}
+
+/* Write a chunk's data to the half of its slot at pos, and make its new
+ * index entry. */
+static int compressWriteSlot(struct compress_file *cf, int fd, off_t pos, const char *data,
+                             size_t len, uint32_t flags, struct compress_entry *entry)
+{
+	statsCount(STATS_CTR_compress_bytes_out, len);
+	int error = compressWriteFull(cf, fd, data, len, pos);
+	if(error == 0) {
+		entry->len = len | flags;
+		entry->crc = crc32(0, (const Bytef *) data, len);
+	}
+	return error;
+}
+
+/* The half of a chunk's slot that the entry doesn't use (either, if it's
+ * zeros), as a COMPRESS_HALF flag, and where it is. */
+static uint32_t compressOtherHalf(uint64_t chunk, const struct compress_entry *entry, off_t *pos)
+{
+	uint32_t half = ((entry->len & COMPRESS_LEN_MASK) == 0) ? 0 :
+	                (entry->len & COMPRESS_HALF) ^ COMPRESS_HALF;
+	*pos = compressSlotPos(chunk) + (half ? COMPRESS_CHUNK_SZ : 0);
+	return half;
+}
+
+/* Compress the first len bytes of src, and write them to the half of the
+ * chunk's slot that the old entry doesn't use.  A chunk of zeros isn't
+ * written at all, and a chunk that's in the chunk store only gets a
+ * dedup_ref.  *entry goes in as the old entry, and comes out as the new one.
+ * The old data stays until compressPunch(), after the index has been
+ * written. */
+static int compressStoreChunk(struct compress_file *cf, int fd, uint64_t chunk,
+                              const char *src, size_t len, struct compress_entry *entry)
+{
+	off_t pos;
+	uint32_t half = compressOtherHalf(chunk, entry, &pos);
+
+	/* A dedup_ref can't be longer than the chunk's plain data. */
+	struct dedup_ref ref;
+	bool dedup = dedupEnabled() && (len > sizeof(ref));
+	char *out = NULL;
+	int error = 0;
+	do {
+		if(compressIsZero(src, len)) {
+			entry->len = 0;
+			entry->crc = 0;
+			break;
+		}
+
+		if(dedup) {
+			error = dedupLookup(src, len, &ref);
+			if(error == 0) {
+				error = compressWriteSlot(cf, fd, pos, (const char *) &ref, sizeof(ref),
+				                          COMPRESS_DEDUP | half, entry);
+				break;
+			}
+			dedup = (error == ENOENT);
+			error = 0;
+		}
+
+		out = malloc(len);
+		if(out == NULL) {
+			error = ENOMEM;
+			break;
+		}
+
+		/* It has to get smaller, or it's stored as is. */
+		const char *data = out;
+		size_t n = cf->codec->compress(src, len, out, len - 1, compressLevel);
+		if(n == 0) {
+			statsCount(STATS_CTR_compress_raw_chunks, 1);
+			data = src;
+			n = len;
+		}
+		statsCount(STATS_CTR_compress_bytes_in, len);
+
+		struct dedup_origin origin = { .dev = cf->dev, .ino = cf->ino, .chunk = chunk };
+		if(dedup && (dedupAdd(&ref, data, n, data == src, cf->codec->id, &origin) == 0))
+			error = compressWriteSlot(cf, fd, pos, (const char *) &ref, sizeof(ref),
+			                          COMPRESS_DEDUP | half, entry);
+		else
+			error = compressWriteSlot(cf, fd, pos, data, n,
+			                          ((data == src) ? COMPRESS_RAW : 0) | half, entry);
+	} while(0);
+	free(out);
+	return error;
+}
+
+/* Remember how much of the chunk store the new entries can point into, if
+ * any of them are dedup_refs.  Call after they're written. */
+static void compressNoteRefs(struct compress_file *cf, const struct compress_entry *entries, size_t n)
+{
+	size_t i;
+	for(i = 0; i < n; i++) {
+		if(entries[i].len & COMPRESS_DEDUP) {
+			__atomic_store_n(&cf->dedupSeq, dedupAdded(), __ATOMIC_RELEASE);
+			break;
+		}
+	}
+}
+
+/* Punch out a chunk's old data, now that the index points somewhere else,
+ * where the backend can do that.  The whole half goes, so the block that
+ * the data ended in is freed too.  A journal record for it that lands
+ * afterwards only puts back data that nothing points at. */
+static void compressPunch(struct compress_file *cf, int fd, uint64_t chunk,
+                          const struct compress_entry *old)
+{
+	if((old->len & COMPRESS_LEN_MASK) == 0)
+		return;
+	if(cryptEnabled())
+		cryptPunch(cf->inode, fd, compressDataPos(chunk, old), COMPRESS_CHUNK_SZ);
+	else
+		(void) STATS_BACKEND(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		                               compressDataPos(chunk, old), COMPRESS_CHUNK_SZ));
+}
+
+/* Worker pool callback.  Load or store one chunk. */
+static void compressJobRun(void *arg, size_t i)
+{
+	struct compress_job *job = arg;
+	uint64_t chunk = job->first + i;
+	char *plain = job->plain + i * COMPRESS_CHUNK_SZ;
+
+	int error = 0;
+	if(job->store) {
+		off_t start = (off_t) chunk * COMPRESS_CHUNK_SZ;
+		size_t len = (job->size - start < COMPRESS_CHUNK_SZ) ? job->size - start :
+		                                                       COMPRESS_CHUNK_SZ;
+		error = compressStoreChunk(job->cf, job->fd, chunk, plain, len, &job->entries[i]);
+	}
+	else if(job->todo[i]) {
+		error = compressLoadChunk(job->cf, job->fd, chunk, &job->entries[i], plain);
+	}
+	if(error != 0)
+		__atomic_store_n(&job->error, error, __ATOMIC_RELAXED);
+}
+
+/* Remember the last chunk of a write.  Call with lock held for writing. */
+static void compressCache(struct compress_file *cf, uint64_t chunk, const char *plain)
+{
+	if(cf->cached == NULL) {
+		cf->cached = malloc(COMPRESS_CHUNK_SZ);
+		if(cf->cached == NULL)
+			return;
+	}
+	memcpy(cf->cached, plain, COMPRESS_CHUNK_SZ);
+	cf->cachedChunk = chunk;
+}
+
+/* Forget the indexes of groups after the given one. */
+static void compressDropGroups(struct compress_file *cf, uint64_t keep)
+{
+	pthread_mutex_lock(&cf->indexLock);
+	size_t g;
+	for(g = keep + 1; g < cf->numGroups; g++) {
+		free(cf->groups[g]);
+		cf->groups[g] = NULL;
+	}
+	pthread_mutex_unlock(&cf->indexLock);
+}
+
+/* Write the header of an empty file. */
+static int compressNewHeader(int fd, struct compress_file *cf)
+{
+	char hdrBuf[COMPRESS_HEADER_SZ];
+	struct compress_header *hdr = (struct compress_header *) hdrBuf;
+	memset(hdrBuf, 0, sizeof(hdrBuf));
+	memcpy(hdr->magic, COMPRESS_MAGIC, sizeof(hdr->magic));
+	hdr->version = COMPRESS_VERSION;
+	hdr->codec = compressCodec->id;
+	hdr->chunkSize = COMPRESS_CHUNK_SZ;
+	hdr->groupChunks = COMPRESS_GROUP_CHUNKS;
+	cf->codec = compressCodec;
+	return compressWriteFull(cf, fd, hdrBuf, sizeof(hdrBuf), 0);
+}
+
+/* Read a file's header and find its codec. */
+static int compressReadHeader(int fd, struct compress_file *cf)
+{
+	struct compress_header hdr;
+	int error = compressReadFull(cf, fd, (char *) &hdr, sizeof(hdr), 0);
+	if(error != 0)
+		return (error == EBADF) ? EACCES : error;
+	if((memcmp(hdr.magic, COMPRESS_MAGIC, sizeof(hdr.magic)) != 0) ||
+	   (hdr.version != COMPRESS_VERSION) || (hdr.chunkSize != COMPRESS_CHUNK_SZ) ||
+	   (hdr.groupChunks != COMPRESS_GROUP_CHUNKS)) {
+		LOG_ERROR(NULL, "Not a compressed file (fd %d).", fd);
+		return EIO;
+	}
+	cf->codec = compressCodecById(hdr.codec);
+	if(cf->codec == NULL) {
+		LOG_ERROR(NULL, "Unknown codec %u (fd %d).", hdr.codec, fd);
+		return EIO;
+	}
+	return 0;
+}
+
+static struct compress_file *compressFileGet(struct lo_inode *inode, int fd, int *error)
+{
+	struct compress_file *cf = compressFile(inode);
+	if(cf == NULL) {
+		*error = compressOpen(inode, fd, true);
+		if((*error == 0) && ((cf = compressFile(inode)) == NULL))
+			*error = EIO;
+	}
+	return cf;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Pick the codec.  spec is "name" or "name:level".  NULL leaves compression
+ * off.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int compressInit(const char *spec)
+{
+	if(spec == NULL)
+		return 0;
+
+	const char *colon = strchr(spec, ':');
+	size_t nameLen = (colon != NULL) ? (size_t) (colon - spec) : strlen(spec);
+	size_t i;
+	for(i = 0; i < COMPRESS_NUM_CODECS; i++) {
+		if((strlen(compressCodecs[i].name) == nameLen) &&
+		   (strncmp(compressCodecs[i].name, spec, nameLen) == 0))
+			break;
+	}
+	if(i == COMPRESS_NUM_CODECS)
+		return EINVAL;
+
+	compressCodec = &compressCodecs[i];
+	compressLevel = (colon != NULL) ? atoi(colon + 1) : compressCodec->defaultLevel;
+	compressOn = true;
+	LOG_STATUS(NULL, "Compression: %s level %d : %d KB chunks.",
+	           compressCodec->name, compressLevel, COMPRESS_CHUNK_SZ / 1024);
+	return 0;
+}
+
+void compressDestroy(void)
+{
+	compressOn = false;
+	compressCodec = NULL;
+}
+
+bool compressEnabled(void)
+{
+	return compressOn;
+}
+
+/* Read the header of a file that we just opened.  An empty file gets a new
+ * header if fd is writable.  Otherwise it stays without one until somebody
+ * opens it for writing (it has nothing to read).
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int compressOpen(struct lo_inode *inode, int fd, bool writable)
+{
+	if(compressFile(inode) != NULL)
+		return 0;
+
+	struct compress_file *cf = calloc(1, sizeof(struct compress_file));
+	if(cf == NULL)
+		return ENOMEM;
+	pthread_rwlock_init(&cf->lock, NULL);
+	pthread_mutex_init(&cf->indexLock, NULL);
+	cf->inode = inode;
+	cf->cachedChunk = -1;
+
+	int error = 0;
+	pthread_mutex_lock(&compressOpenLock);
+	do {
+		if(compressFile(inode) != NULL)
+			break;
+
+		/* The encryption's header comes first, and the compressed
+		 * layout is inside it.  The size is the one the layer
+		 * underneath has, with the journal's writes. */
+		if(cryptEnabled()) {
+			error = cryptOpen(inode, fd, writable);
+			if(error != 0)
+				break;
+		}
+
+		bool pending = journalPending(inode);
+		struct stat st;
+		if(STATS_BACKEND(fstat(fd, &st)) == -1) {
+			error = errno;
+			break;
+		}
+		if(pending)
+			journalStat(inode, &st);
+		cryptStat(&st);
+		cf->dev = st.st_dev;
+		cf->ino = st.st_ino;
+
+		if(st.st_size == 0) {
+			if(!writable)
+				break;
+			error = compressNewHeader(fd, cf);
+		}
+		else {
+			error = compressReadHeader(fd, cf);
+			cf->size = compressPlainSize(st.st_size);
+		}
+		if(error != 0)
+			break;
+
+		__atomic_store_n(&inode->compress, cf, __ATOMIC_RELEASE);
+		cf = NULL;
+	} while(0);
+	pthread_mutex_unlock(&compressOpenLock);
+
+	compressFileFree(cf);
+	return error;
+}
+
+/* The inode's index, or NULL if its header hasn't been read yet. */
+struct compress_file *compressFile(struct lo_inode *inode)
+{
+	return __atomic_load_n(&inode->compress, __ATOMIC_ACQUIRE);
+}
+
+/* Called when the inode is freed. */
+void compressFileFree(struct compress_file *cf)
+{
+	if(cf == NULL)
+		return;
+	size_t g;
+	for(g = 0; g < cf->numGroups; g++)
+		free(cf->groups[g]);
+	free(cf->groups);
+	free(cf->cached);
+	pthread_mutex_destroy(&cf->indexLock);
+	pthread_rwlock_destroy(&cf->lock);
+	free(cf);
+}
+
+/* What the file's fsync() has to pass to dedupSync(). */
+uint64_t compressDedupSeq(struct lo_inode *inode)
+{
+	struct compress_file *cf = compressFile(inode);
+	return (cf == NULL) ? 0 : __atomic_load_n(&cf->dedupSeq, __ATOMIC_ACQUIRE);
+}
+
+/* Turn the backend's attributes into the ones the application sees.
+ * st_blocks is left alone, so du shows what the file really takes up. */
+void compressStat(struct stat *st)
+{
+	if(!compressOn || !S_ISREG(st->st_mode))
+		return;
+	st->st_size = compressPlainSize(st->st_size);
+}
+
+/* Read size bytes of plain data at off.  Only the chunks that the read
+ * touches are read and decompressed.  *buf is set to the data, which is in
+ * the thread's reply buffer.
+ *
+ * Returns:
+ *  >=0 = The number of bytes read (0 at the end of the file).
+ *   <0 = -errno of failure.
+ */
+ssize_t compressRead(struct lo_inode *inode, int fd, size_t size, off_t off, char **buf)
+{
+	struct compress_file *cf = compressFile(inode);
+	if(cf == NULL)
+		return 0;
+
+	pthread_rwlock_rdlock(&cf->lock);
+	off_t end = off + size;
+	if(end > cf->size)
+		end = cf->size;
+	if(off >= end) {
+		pthread_rwlock_unlock(&cf->lock);
+		return 0;
+	}
+
+	uint64_t first = off / COMPRESS_CHUNK_SZ;
+	size_t n = (end - 1) / COMPRESS_CHUNK_SZ - first + 1;
+	struct compress_job job = {
+		.cf = cf,
+		.fd = fd,
+		.first = first,
+		.plain = engineReplyBuf(n * COMPRESS_CHUNK_SZ),
+		.entries = calloc(n, sizeof(struct compress_entry)),
+		.todo = calloc(n, sizeof(bool)),
+		.store = false,
+		.error = 0,
+	};
+
+	do {
+		if((job.plain == NULL) || (job.entries == NULL) || (job.todo == NULL)) {
+			job.error = ENOMEM;
+			break;
+		}
+		job.error = compressGetEntries(cf, fd, first, n, job.entries);
+		if(job.error != 0)
+			break;
+
+		size_t i;
+		for(i = 0; i < n; i++) {
+			if((int64_t) (first + i) == cf->cachedChunk)
+				memcpy(job.plain + i * COMPRESS_CHUNK_SZ, cf->cached, COMPRESS_CHUNK_SZ);
+			else
+				job.todo[i] = true;
+		}
+		workPoolRun(compressJobRun, &job, n);
+	} while(0);
+	pthread_rwlock_unlock(&cf->lock);
+
+	free(job.entries);
+	free(job.todo);
+	if(job.error != 0)
+		return -job.error;
+
+	*buf = job.plain + (off - first * COMPRESS_CHUNK_SZ);
+	return end - off;
+}
+
+/* Write plain data at off.  The chunks that the write only covers part of
+ * are read and merged first.  Then every chunk is compressed and written to
+ * the other half of its slot, then the index, then the old halves are
+ * punched out, then the new size.  fd has to be open for reading and
+ * writing.
+ *
+ * Returns:
+ *  >=0 = The number of bytes written.
+ *   <0 = -errno of failure.
+ */
+ssize_t compressWrite(struct lo_inode *inode, int fd, struct fuse_bufvec *src, off_t off)
+{
+	int error = 0;
+	struct compress_file *cf = compressFileGet(inode, fd, &error);
+	if(cf == NULL)
+		return -error;
+
+	size_t len = fuse_buf_size(src);
+	if(len == 0)
+		return 0;
+
+	pthread_rwlock_wrlock(&cf->lock);
+	off_t oldSize = cf->size;
+	off_t end = off + len;
+	off_t newSize = (end > oldSize) ? end : oldSize;
+	uint64_t first = off / COMPRESS_CHUNK_SZ;
+	size_t n = (end - 1) / COMPRESS_CHUNK_SZ - first + 1;
+	struct compress_job job = {
+		.cf = cf,
+		.fd = fd,
+		.first = first,
+		.plain = malloc(n * COMPRESS_CHUNK_SZ),
+		.entries = calloc(n, sizeof(struct compress_entry)),
+		.todo = calloc(n, sizeof(bool)),
+		.size = newSize,
+		.store = false,
+		.error = 0,
+	};
+	struct compress_entry *old = calloc(n, sizeof(struct compress_entry));
+
+	do {
+		if((job.plain == NULL) || (job.entries == NULL) || (job.todo == NULL) ||
+		   (old == NULL)) {
+			job.error = ENOMEM;
+			break;
+		}
+		job.error = compressGetEntries(cf, fd, first, n, job.entries);
+		if(job.error != 0)
+			break;
+
+		/* Find the chunks that have old data that the write doesn't
+		 * cover. */
+		size_t i;
+		size_t loads = 0;
+		for(i = 0; i < n; i++) {
+			uint64_t chunk = first + i;
+			char *plain = job.plain + i * COMPRESS_CHUNK_SZ;
+			off_t start = (off_t) chunk * COMPRESS_CHUNK_SZ;
+			off_t oldEnd = (start + COMPRESS_CHUNK_SZ < oldSize) ? start + COMPRESS_CHUNK_SZ :
+			                                                        oldSize;
+			if((start >= oldSize) || ((off <= start) && (end >= oldEnd))) {
+				memset(plain, 0, COMPRESS_CHUNK_SZ);
+			}
+			else if((int64_t) chunk == cf->cachedChunk) {
+				memcpy(plain, cf->cached, COMPRESS_CHUNK_SZ);
+			}
+			else {
+				job.todo[i] = true;
+				loads++;
+			}
+		}
+		if(loads > 0) {
+			statsCount(STATS_CTR_compress_rmw_reads, loads);
+			workPoolRun(compressJobRun, &job, n);
+			if(job.error != 0)
+				break;
+		}
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+		dst.buf[0].mem = job.plain + (off - first * COMPRESS_CHUNK_SZ);
+		ssize_t res = fuse_buf_copy(&dst, src, 0);
+		if(res != (ssize_t) len) {
+			job.error = (res < 0) ? -res : EIO;
+			break;
+		}
+
+		memcpy(old, job.entries, n * sizeof(*old));
+		job.store = true;
+		workPoolRun(compressJobRun, &job, n);
+		if(job.error != 0)
+			break;
+
+		job.error = compressPutEntries(cf, fd, first, n, job.entries);
+		if(job.error != 0)
+			break;
+		compressNoteRefs(cf, job.entries, n);
+		for(i = 0; i < n; i++)
+			compressPunch(cf, fd, first + i, &old[i]);
+
+		if(newSize > oldSize) {
+			job.error = compressResize(cf, fd, newSize);
+			if(job.error != 0)
+				break;
+			cf->size = newSize;
+		}
+		compressCache(cf, first + n - 1, job.plain + (n - 1) * COMPRESS_CHUNK_SZ);
+	} while(0);
+
+	/* Whatever happened, the chunks on the backend may not match what
+	 * was cached any more. */
+	if(job.error != 0)
+		cf->cachedChunk = -1;
+	pthread_rwlock_unlock(&cf->lock);
+
+	free(job.plain);
+	free(job.entries);
+	free(job.todo);
+	free(old);
+	return (job.error != 0) ? -job.error : (ssize_t) len;
+}
+
+/* Truncate (or extend) a file to size bytes of plain data.  If the new end
+ * is in the middle of a chunk, that chunk is rewritten, since a stored chunk
+ * can't be longer than its plain data.  fd has to be open for reading and
+ * writing.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int compressTruncate(struct lo_inode *inode, int fd, off_t size)
+{
+	int error = 0;
+	struct compress_file *cf = compressFileGet(inode, fd, &error);
+	if(cf == NULL)
+		return error;
+
+	pthread_rwlock_wrlock(&cf->lock);
+	char *plain = NULL;
+	do {
+		if(size >= cf->size)
+			break;
+
+		/* Shrink the new last chunk. */
+		uint64_t last = (size > 0) ? (size - 1) / COMPRESS_CHUNK_SZ : 0;
+		struct compress_entry entry;
+		if(size % COMPRESS_CHUNK_SZ) {
+			error = compressGetEntries(cf, fd, last, 1, &entry);
+			if((error == 0) && (entry.len != 0)) {
+				struct compress_entry old = entry;
+				plain = malloc(COMPRESS_CHUNK_SZ);
+				error = (plain == NULL) ? ENOMEM :
+				        compressLoadChunk(cf, fd, last, &entry, plain);
+				if(error == 0)
+					error = compressStoreChunk(cf, fd, last, plain,
+					                           size % COMPRESS_CHUNK_SZ, &entry);
+				if(error == 0)
+					error = compressPutEntries(cf, fd, last, 1, &entry);
+				if(error == 0) {
+					compressNoteRefs(cf, &entry, 1);
+					compressPunch(cf, fd, last, &old);
+				}
+			}
+			if(error != 0)
+				break;
+		}
+
+		/* Clear the entries after it in its group.  The groups after
+		 * that are cut off with the rest of the file. */
+		if(size > 0) {
+			uint64_t next = last + 1;
+			size_t n = COMPRESS_GROUP_CHUNKS - (next % COMPRESS_GROUP_CHUNKS);
+			if(n < COMPRESS_GROUP_CHUNKS) {
+				struct compress_entry *zeros = calloc(n, sizeof(*zeros));
+				error = (zeros == NULL) ? ENOMEM :
+				        compressPutEntries(cf, fd, next, n, zeros);
+				free(zeros);
+				if(error != 0)
+					break;
+			}
+			compressDropGroups(cf, last / COMPRESS_GROUP_CHUNKS);
+		}
+		else {
+			compressDropGroups(cf, 0);
+			pthread_mutex_lock(&cf->indexLock);
+			if(cf->numGroups > 0) {
+				free(cf->groups[0]);
+				cf->groups[0] = NULL;
+			}
+			pthread_mutex_unlock(&cf->indexLock);
+		}
+	} while(0);
+
+	if(error == 0)
+		error = compressResize(cf, fd, size);
+	if(error == 0)
+		cf->size = size;
+	cf->cachedChunk = -1;
+	pthread_rwlock_unlock(&cf->lock);
+
+	free(plain);
+	return error;
+}
+
+/* Call fn for each dedup_ref that a compressed file's index points at, for
+ * proxy_dedup_sweep.  Nothing else can be writing the file.  fn returning
+ * !0 stops it, and that's what it returns.
+ *
+ * Returns:
+ *        0 = success
+ *   EINVAL = It isn't a compressed file.
+ *      !0 = errno of failure.
+ */
+int compressRefs(int fd, int (*fn)(const struct dedup_ref *ref, void *arg), void *arg)
+{
+	struct lo_inode inode;
+	struct compress_file cf;
+	memset(&inode, 0, sizeof(inode));
+	memset(&cf, 0, sizeof(cf));
+	cf.inode = &inode;
+
+	char magic[4];
+	struct stat st;
+	int error = compressReadFull(&cf, fd, magic, sizeof(magic), 0);
+	if(error != 0)
+		return error;
+	if(memcmp(magic, COMPRESS_MAGIC, sizeof(magic)) != 0)
+		return EINVAL;
+	error = compressReadHeader(fd, &cf);
+	if(error != 0)
+		return error;
+	if(fstat(fd, &st) == -1)
+		return errno;
+
+	off_t size = compressPlainSize(st.st_size);
+	uint64_t numChunks = (size + COMPRESS_CHUNK_SZ - 1) / COMPRESS_CHUNK_SZ;
+	struct compress_entry *index = malloc(COMPRESS_GROUP_CHUNKS * sizeof(*index));
+	if(index == NULL)
+		return ENOMEM;
+
+	uint64_t chunk;
+	for(chunk = 0; (error == 0) && (chunk < numChunks); chunk++) {
+		size_t slot = chunk % COMPRESS_GROUP_CHUNKS;
+		if(slot == 0) {
+			error = compressReadFull(&cf, fd, (char *) index,
+			                         COMPRESS_GROUP_CHUNKS * sizeof(*index),
+			                         compressIndexPos(chunk / COMPRESS_GROUP_CHUNKS));
+			if(error != 0)
+				break;
+		}
+		if(!(index[slot].len & COMPRESS_DEDUP))
+			continue;
+
+		struct dedup_ref ref;
+		if((index[slot].len & COMPRESS_LEN_MASK) != sizeof(ref))
+			error = EIO;
+		else
+			error = compressReadFull(&cf, fd, (char *) &ref, sizeof(ref),
+			                         compressDataPos(chunk, &index[slot]));
+		if((error == 0) && (crc32(0, (const Bytef *) &ref, sizeof(ref)) != index[slot].crc))
+			error = EIO;
+		if(error == EIO)
+			LOG_ERROR(NULL, "Chunk %llu has a bad dedup_ref (fd %d).",
+			          (unsigned long long) chunk, fd);
+		if(error == 0)
+			error = fn(&ref, arg);
+	}
+	free(index);
+	return error;
+}
+
+/* Move the first copy of a chunk over to the chunk store: if the chunk's slot
+ * still holds the chunk that ref points at, write ref to the other half, then
+ * the index, then punch out the copy.  Anything else (the chunk has been
+ * written since, or is already a dedup_ref) is left alone.  fd has to be open
+ * for reading and writing.
+ *
+ * Returns:
+ *        0 = success
+ *   ENOENT = The slot doesn't hold that chunk any more.
+ *      !0 = errno of failure.
+ */
+int compressRepoint(struct lo_inode *inode, int fd, uint64_t chunk, const struct dedup_ref *ref)
+{
+	struct compress_file *cf = compressFile(inode);
+	if(cf == NULL)
+		return ENOENT;
+
+	pthread_rwlock_wrlock(&cf->lock);
+	char *plain = NULL;
+	int error = 0;
+	do {
+		off_t start = (off_t) chunk * COMPRESS_CHUNK_SZ;
+		if(start >= cf->size) {
+			error = ENOENT;
+			break;
+		}
+
+		struct compress_entry entry;
+		error = compressGetEntries(cf, fd, chunk, 1, &entry);
+		if(error != 0)
+			break;
+		if(((entry.len & COMPRESS_LEN_MASK) == 0) || (entry.len & COMPRESS_DEDUP)) {
+			error = ENOENT;
+			break;
+		}
+
+		plain = malloc(COMPRESS_CHUNK_SZ);
+		error = (plain == NULL) ? ENOMEM : compressLoadChunk(cf, fd, chunk, &entry, plain);
+		if(error != 0)
+			break;
+		size_t len = (cf->size - start < COMPRESS_CHUNK_SZ) ? cf->size - start :
+		                                                      COMPRESS_CHUNK_SZ;
+		if(!dedupMatches(plain, len, ref)) {
+			error = ENOENT;
+			break;
+		}
+
+		struct compress_entry old = entry;
+		off_t pos;
+		uint32_t half = compressOtherHalf(chunk, &entry, &pos);
+		error = compressWriteSlot(cf, fd, pos, (const char *) ref, sizeof(*ref),
+		                          COMPRESS_DEDUP | half, &entry);
+		if(error == 0)
+			error = compressPutEntries(cf, fd, chunk, 1, &entry);
+		if(error == 0) {
+			compressNoteRefs(cf, &entry, 1);
+			compressPunch(cf, fd, chunk, &old);
+		}
+	} while(0);
+	pthread_rwlock_unlock(&cf->lock);
+
+	free(plain);
+	return error;
+}
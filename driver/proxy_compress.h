@@ -0,0 +1,102 @@
+/* *****************************************************************************
+ * File compression.
+ *
+ * With PROXY_BRIDGE_COMPRESS set (to a codec name, optionally followed by
+ * ":level", e.g. "zlib:6"), every regular file in the export is stored
+ * compressed on the NAS.  The driver compresses in lo_write_buf() and
+ * decompresses in lo_read(), so only compressed bytes cross the wire.
+ *
+ * A file is cut into chunks of COMPRESS_CHUNK_SZ bytes, and each chunk is
+ * compressed on its own, so any byte range can be read or rewritten without
+ * touching the rest of the file.  Each chunk has a slot of twice
+ * COMPRESS_CHUNK_SZ bytes on the backend, in two halves.  Its compressed data
+ * sits at the front of one of them, and the rest of the slot is never
+ * written (or is punched out), so it's a hole on any NAS that does sparse
+ * files.  A chunk that doesn't get smaller is stored as is.
+ *
+ *   [header][index 0][slot 0][slot 1]...[slot 255][index 1][slot 256]...
+ *
+ * The slots come in groups of COMPRESS_GROUP_CHUNKS.  Each group starts with
+ * an index: the stored length and a CRC for each of its chunks.  A chunk with
+ * a length of 0 is all zeros (a hole).  The indexes are read the first time
+ * that they're needed, and kept with the inode until the kernel forgets it.
+ *
+ * The backend file always ends where the last chunk's second half would,
+ * if it were full of the last chunk's plain data.  So the plain size comes
+ * straight from the backend's st_size (see compressStat()), and getattr
+ * doesn't have to read anything.  That's why a chunk is never stored bigger
+ * than its plain data.  It also means that the NAS's st_size for a file is
+ * about twice its plain size.  The second halves are holes, so st_blocks (and
+ * du) show what it really takes up, but a quota on the NAS that counts
+ * apparent sizes, or a copy that isn't sparse, sees the doubled size.
+ *
+ * A write that only covers part of a chunk has to read, decompress, and
+ * recompress the rest of it.  The last chunk that was written is kept in
+ * memory, so small sequential writes don't read it back each time.  The
+ * writeback cache (PROXY_BRIDGE_WRITEBACK_CACHE) makes the writes bigger, and
+ * is a good idea here.  Chunks are compressed and decompressed on the worker
+ * pool.
+ *
+ * A chunk is never written over in place.  Its new data goes in the half of
+ * its slot that the index doesn't point at, then the index entry is changed
+ * to point at it, and only then is the old half punched out.  If the proxy
+ * dies before the index write, the index still points at the old data, so
+ * the chunk reads back as it was before the write.  An index entry is 8
+ * bytes, and never straddles a sector, so it's either old or new.
+ *
+ * Codecs are listed in compressCodecs[].  The codec is recorded in each
+ * file's header, so files stay readable when the default changes.  "none"
+ * stores every chunk as is, for dedup without compression.
+ *
+ * Compression sits on top of the other layers that change what's on the
+ * backend.  A chunk is compressed, then encrypted (PROXY_BRIDGE_KEY_FILE),
+ * then journaled (PROXY_BRIDGE_JOURNAL), so the offsets above are plain
+ * offsets inside the encryption's header, and the journal replays the
+ * encrypted chunks and indexes like any other write.  Encrypted, an index
+ * is written whole, as the one encryption unit that it is, so it's only
+ * either old or new if the NAS writes 4 KB in one go.  Punched halves are
+ * whole units, so they stay holes.
+ *
+ * With dedup on (see proxy_dedup.h), a slot can hold a dedup_ref, which
+ * says where the chunk is in the chunk store, instead of the chunk.
+ * compressRepoint() moves a chunk's first copy over to one the same way that
+ * a write would.
+ * ****************************************************************************/
+
+#ifndef PROXY_COMPRESS_H
+#define PROXY_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "proxy_inode.h"
+
+#define COMPRESS_HEADER_SZ    (4096)
+#define COMPRESS_CHUNK_SZ     (64 * 1024)
+#define COMPRESS_GROUP_CHUNKS (256)
+
+struct fuse_bufvec;
+struct compress_file;
+struct dedup_ref;
+
+int compressInit(const char *spec);
+void compressDestroy(void);
+bool compressEnabled(void);
+
+int compressOpen(struct lo_inode *inode, int fd, bool writable);
+struct compress_file *compressFile(struct lo_inode *inode);
+void compressFileFree(struct compress_file *cf);
+uint64_t compressDedupSeq(struct lo_inode *inode);
+void compressStat(struct stat *st);
+
+ssize_t compressRead(struct lo_inode *inode, int fd, size_t size, off_t off, char **buf);
+ssize_t compressWrite(struct lo_inode *inode, int fd, struct fuse_bufvec *src, off_t off);
+int compressTruncate(struct lo_inode *inode, int fd, off_t size);
+int compressRepoint(struct lo_inode *inode, int fd, uint64_t chunk, const struct dedup_ref *ref);
+int compressRefs(int fd, int (*fn)(const struct dedup_ref *ref, void *arg), void *arg);
+
+#endif /* PROXY_COMPRESS_H */
@@ -0,0 +1,1075 @@
+/* *****************************************************************************
+ * File encryption.  See proxy_crypt.h for the big picture.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "proxy_crypt.h"
+#include "proxy_engine.h"
+#include "proxy_journal.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+#include "proxy_stats.h"
+#include "proxy_wbuf.h"
+
+#define CRYPT_MAGIC        "NPXE"
+#define CRYPT_VERSION      (1)
+#define CRYPT_KEY_SZ       (32)
+#define CRYPT_XTS_KEY_SZ   (64)
+#define CRYPT_NONCE_SZ     (16)
+#define CRYPT_WRAPPED_SZ   (CRYPT_KEY_SZ + 8)
+
+/* The shortest a unit can be, and the part of the header that goes with
+ * unit 0. */
+#define CRYPT_AES_BLOCK    (16)
+#define CRYPT_LEAD_SZ      (16)
+
+/* The header has a wrapped file key in it. */
+#define CRYPT_HDR_FILE_KEY (0x01)
+
+/* Buffers at least this big are split across the worker pool, in pieces of
+ * CRYPT_CHUNK_SZ. */
+#define CRYPT_PARALLEL_MIN (256 * 1024)
+#define CRYPT_CHUNK_SZ     (64 * 1024)
+
+/* The front of every file.  The rest of the CRYPT_HEADER_SZ bytes are zero,
+ * apart from the lead at the end of them. */
+struct crypt_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t flags;
+	uint8_t pad[2];
+	unsigned char nonce[CRYPT_NONCE_SZ];
+	unsigned char wrappedKey[CRYPT_WRAPPED_SZ];
+};
+_Static_assert(sizeof(struct crypt_header) == 64, "crypt_header must be 64 bytes");
+_Static_assert(sizeof(struct crypt_header) + CRYPT_LEAD_SZ <= CRYPT_HEADER_SZ,
+               "CRYPT_HEADER_SZ has no room for the lead");
+_Static_assert(CRYPT_CHUNK_SZ % CRYPT_UNIT_SZ == 0, "CRYPT_CHUNK_SZ must be a whole number of units");
+
+/* Hangs off the inode once its header has been read. */
+struct crypt_file {
+	pthread_mutex_t lock;
+	pthread_rwlock_t units;   /* Shared by reads and whole-unit writes.  See cryptWrite(). */
+	off_t size;               /* Plain size, as far as writes and truncates go. */
+	unsigned char key[CRYPT_XTS_KEY_SZ];
+	unsigned char nonce[CRYPT_NONCE_SZ];
+};
+
+/* Each thread keeps its own cipher context, and skips the key setup if it's
+ * given the same key (and direction) again. */
+struct crypt_ctx {
+	EVP_CIPHER_CTX *ctx;
+	bool keyed;
+	int enc;
+	unsigned char key[CRYPT_XTS_KEY_SZ];
+};
+
+/* Units first to last of a big buffer, split up for workPoolRun(). */
+struct crypt_job {
+	const struct crypt_file *cf;
+	char *buf;
+	off_t base;
+	uint64_t first;
+	uint64_t last;
+	off_t size;
+	bool decrypt;
+	int error;
+};
+
+static bool cryptOn = false;
+static unsigned char cryptMasterKey[CRYPT_KEY_SZ];
+
+/* Taken while a file's header is read or written, so two first opens can't
+ * both make up a key. */
+static pthread_mutex_t cryptOpenLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t cryptCtxKey;
+static pthread_once_t cryptCtxOnce = PTHREAD_ONCE_INIT;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+/* The unit that plain offset off is in, for a file of size bytes (off <
+ * size).  A last unit that would be shorter than an AES block is part of the
+ * one in front of it. */
+static uint64_t cryptUnit(off_t off, off_t size)
+{
+	uint64_t k = off / CRYPT_UNIT_SZ;
+	if((k > 0) && (size - (off_t) (k * CRYPT_UNIT_SZ) < CRYPT_AES_BLOCK))
+		k--;
+	return k;
+}
+
+/* Where unit k starts.  Unit 0 takes in the lead, so it starts in the
+ * header. */
+static off_t cryptUnitStart(uint64_t k)
+{
+	return (k == 0) ? -CRYPT_LEAD_SZ : (off_t) (k * CRYPT_UNIT_SZ);
+}
+
+/* Where unit k ends, in a file of size bytes. */
+static off_t cryptUnitEnd(uint64_t k, off_t size)
+{
+	off_t end = (k + 1) * CRYPT_UNIT_SZ;
+	if(size < end + CRYPT_AES_BLOCK)
+		end = size;
+	return end;
+}
+
+static off_t cryptSize(struct crypt_file *cf)
+{
+	pthread_mutex_lock(&cf->lock);
+	off_t size = cf->size;
+	pthread_mutex_unlock(&cf->lock);
+	return size;
+}
+
+static void cryptCtxFree(void *arg)
+{
+	struct crypt_ctx *c = arg;
+	EVP_CIPHER_CTX_free(c->ctx);
+	explicit_bzero(c, sizeof(*c));
+	free(c);
+}
+
+static void cryptCtxKeyCreate(void)
+{
+	pthread_key_create(&cryptCtxKey, cryptCtxFree);
+}
+
+static struct crypt_ctx *cryptCtx(void)
+{
+	pthread_once(&cryptCtxOnce, cryptCtxKeyCreate);
+
+	struct crypt_ctx *c = pthread_getspecific(cryptCtxKey);
+	if(c != NULL)
+		return c;
+
+	c = calloc(1, sizeof(struct crypt_ctx));
+	if(c == NULL)
+		return NULL;
+	c->ctx = EVP_CIPHER_CTX_new();
+	if(c->ctx == NULL) {
+		free(c);
+		return NULL;
+	}
+	pthread_setspecific(cryptCtxKey, c);
+	return c;
+}
+
+/* The tweak for unit k: the nonce plus k, as one big-endian 128-bit
+ * number. */
+static void cryptIv(const struct crypt_file *cf, uint64_t k, unsigned char *iv)
+{
+	memcpy(iv, cf->nonce, CRYPT_NONCE_SZ);
+	int i;
+	for(i = CRYPT_NONCE_SZ - 1; (i >= 0) && (k != 0); i--) {
+		uint64_t sum = iv[i] + (k & 0xff);
+		iv[i] = sum & 0xff;
+		k = (k >> 8) + (sum >> 8);
+	}
+}
+
+/* XTS wants two different AES keys.  They're the SHA-512 of the file key. */
+static int cryptXtsKey(struct crypt_file *cf, const unsigned char *fileKey)
+{
+	unsigned int n = 0;
+	int ok = EVP_Digest(fileKey, CRYPT_KEY_SZ, cf->key, &n, EVP_sha512(), NULL);
+	return (ok && (n == CRYPT_XTS_KEY_SZ)) ? 0 : EIO;
+}
+
+/* Encrypt (enc 1) or decrypt (enc 0) unit k, in place.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int cryptXts(const struct crypt_file *cf, uint64_t k, char *buf, size_t len, int enc)
+{
+	struct crypt_ctx *c = cryptCtx();
+	if(c == NULL)
+		return ENOMEM;
+
+	/* A new tweak is enough, unless the key or the direction changed
+	 * (decrypting needs its own key schedule). */
+	unsigned char iv[CRYPT_NONCE_SZ];
+	cryptIv(cf, k, iv);
+	int ok;
+	if(c->keyed && (c->enc == enc) && (memcmp(c->key, cf->key, CRYPT_XTS_KEY_SZ) == 0)) {
+		ok = EVP_CipherInit_ex(c->ctx, NULL, NULL, NULL, iv, enc);
+	}
+	else {
+		ok = EVP_CipherInit_ex(c->ctx, EVP_aes_256_xts(), NULL, cf->key, iv, enc);
+		c->keyed = ok;
+		c->enc = enc;
+		memcpy(c->key, cf->key, CRYPT_XTS_KEY_SZ);
+	}
+
+	int n;
+	if(ok)
+		ok = EVP_CipherUpdate(c->ctx, (unsigned char *) buf, &n,
+		                      (unsigned char *) buf, len);
+	return ok ? 0 : EIO;
+}
+
+static bool cryptIsZero(const char *p, size_t len)
+{
+	return (p[0] == 0) && (memcmp(p, p + 1, len - 1) == 0);
+}
+
+/* Encrypt or decrypt units first to last of buf, which starts at plain
+ * offset base (the start of unit first), for a file of size bytes.  Units
+ * that are all zeros are holes, and stay zeros.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int cryptUnits(const struct crypt_file *cf, char *buf, off_t base, uint64_t first,
+                      uint64_t last, off_t size, bool decrypt)
+{
+	uint64_t k;
+	for(k = first; k <= last; k++) {
+		off_t start = cryptUnitStart(k);
+		size_t len = cryptUnitEnd(k, size) - start;
+		char *p = buf + (start - base);
+		if(decrypt && cryptIsZero(p, len))
+			continue;
+
+		int error = cryptXts(cf, k, p, len, !decrypt);
+		if(error != 0)
+			return error;
+	}
+	return 0;
+}
+
+/* Worker pool callback.  One piece of a big buffer. */
+static void cryptJobRun(void *arg, size_t i)
+{
+	struct crypt_job *job = arg;
+	uint64_t per = CRYPT_CHUNK_SZ / CRYPT_UNIT_SZ;
+	uint64_t first = job->first + i * per;
+	uint64_t last = first + per - 1;
+	if(last > job->last)
+		last = job->last;
+
+	int error = cryptUnits(job->cf, job->buf, job->base, first, last, job->size, job->decrypt);
+	if(error != 0)
+		__atomic_store_n(&job->error, error, __ATOMIC_RELAXED);
+}
+
+/* Encrypt or decrypt a buffer that holds whole units, [from, to) of a file of
+ * size bytes.  It's done in pieces on the worker pool if it's big.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int cryptBuffer(const struct crypt_file *cf, char *buf, off_t from, off_t to,
+                       off_t size, bool decrypt)
+{
+	if(decrypt)
+		statsCount(STATS_CTR_crypt_decrypt_bytes, to - from);
+	else
+		statsCount(STATS_CTR_crypt_encrypt_bytes, to - from);
+
+	uint64_t first = cryptUnit((from < 0) ? 0 : from, size);
+	uint64_t last = cryptUnit(to - 1, size);
+	if(to - from < CRYPT_PARALLEL_MIN)
+		return cryptUnits(cf, buf, from, first, last, size, decrypt);
+
+	struct crypt_job job = {
+		.cf = cf,
+		.buf = buf,
+		.base = from,
+		.first = first,
+		.last = last,
+		.size = size,
+		.decrypt = decrypt,
+		.error = 0,
+	};
+	uint64_t per = CRYPT_CHUNK_SZ / CRYPT_UNIT_SZ;
+	workPoolRun(cryptJobRun, &job, (last - first + per) / per);
+	return job.error;
+}
+
+/* Get the plain data in [from, to) (from can be in the lead), for a file of
+ * size bytes.  Whatever is past size is zeros.  Buffered writes have to get
+ * to the NAS first, or we'd be looking at old data.  Journaled ones are read
+ * from the journal.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int cryptLoad(struct lo_inode *inode, int fd, const struct crypt_file *cf,
+                     off_t size, off_t from, off_t to, char *out)
+{
+	memset(out, 0, to - from);
+	off_t last = (to < size) ? to : size;
+	if(last <= ((from < 0) ? 0 : from))
+		return 0;
+
+	writeBufFlushInode(inode);
+
+	off_t start = cryptUnitStart(cryptUnit((from < 0) ? 0 : from, size));
+	off_t end = cryptUnitEnd(cryptUnit(last - 1, size), size);
+	char *buf = malloc(end - start);
+	if(buf == NULL)
+		return ENOMEM;
+
+	int error = 0;
+	ssize_t got = journalRead(inode, fd, buf, end - start, CRYPT_HEADER_SZ + start);
+	if(got == -1) {
+		error = errno;
+	}
+	else {
+		memset(buf + got, 0, (end - start) - got);
+		error = cryptBuffer(cf, buf, start, end, size, true);
+	}
+	if(error == 0) {
+		off_t a = (from > start) ? from : start;
+		off_t b = (to < end) ? to : end;
+		memcpy(out + (a - from), buf + (a - start), b - a);
+	}
+	free(buf);
+	return error;
+}
+
+/* The units that a file of oldSize bytes has to encrypt again when it becomes
+ * newSize bytes: the ones at the end, if they end somewhere else now.  They're
+ * [*from, *to) (nothing if those are the same).  Nothing in front of them
+ * changes shape. */
+static void cryptEdge(off_t oldSize, off_t newSize, off_t *from, off_t *to)
+{
+	*from = *to = 0;
+	if((oldSize == 0) || (newSize == 0))
+		return;
+
+	/* The units that the last byte the two sizes share is in. */
+	off_t last = ((newSize < oldSize) ? newSize : oldSize) - 1;
+	uint64_t j = cryptUnit(last, oldSize);
+	uint64_t k = cryptUnit(last, newSize);
+	if((j == k) && (cryptUnitEnd(j, oldSize) == cryptUnitEnd(k, newSize)))
+		return;
+
+	*from = cryptUnitStart((j < k) ? j : k);
+	*to = cryptUnitEnd(k, newSize);
+}
+
+/* Encrypt [from, to) again, for a file that's gone from oldSize to newSize
+ * bytes, and write it.  Whatever the write buffers have for the file has to
+ * land first, or it would be written over this later.  It goes through the
+ * journal if that covers the file, so it lands after the journal's records.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int cryptRewrite(struct lo_inode *inode, int fd, const struct crypt_file *cf,
+                        off_t oldSize, off_t newSize, off_t from, off_t to)
+{
+	char *buf = malloc(to - from);
+	if(buf == NULL)
+		return ENOMEM;
+
+	statsCount(STATS_CTR_crypt_unit_rewrites, 1);
+	writeBufFlushInode(inode);
+	int error = cryptLoad(inode, fd, cf, oldSize, from, to, buf);
+	if(error == 0) {
+		if(from < 0)
+			memset(buf, 0, CRYPT_LEAD_SZ);
+		error = cryptBuffer(cf, buf, from, to, newSize, false);
+	}
+	if(error == 0)
+		error = journalWriteAt(inode, fd, buf, to - from, CRYPT_HEADER_SZ + from);
+	free(buf);
+	return error;
+}
+
+/* Make up a key and nonce for an empty file, and write its header. */
+static int cryptNewHeader(int fd, struct crypt_file *cf)
+{
+	char hdrBuf[CRYPT_HEADER_SZ];
+	struct crypt_header *hdr = (struct crypt_header *) hdrBuf;
+	memset(hdrBuf, 0, sizeof(hdrBuf));
+	memcpy(hdr->magic, CRYPT_MAGIC, sizeof(hdr->magic));
+	hdr->version = CRYPT_VERSION;
+
+	if(RAND_bytes(cf->nonce, CRYPT_NONCE_SZ) != 1)
+		return EIO;
+	memcpy(hdr->nonce, cf->nonce, CRYPT_NONCE_SZ);
+
+	unsigned char fileKey[CRYPT_KEY_SZ];
+#ifdef KEY_SET_PER_FILE
+	if(RAND_bytes(fileKey, CRYPT_KEY_SZ) != 1)
+		return EIO;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL)
+		return ENOMEM;
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+	int n = 0;
+	int fin = 0;
+	int ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_wrap(), NULL, cryptMasterKey, NULL) &&
+	         EVP_EncryptUpdate(ctx, hdr->wrappedKey, &n, fileKey, CRYPT_KEY_SZ) &&
+	         EVP_EncryptFinal_ex(ctx, hdr->wrappedKey + n, &fin) &&
+	         (n + fin == CRYPT_WRAPPED_SZ);
+	EVP_CIPHER_CTX_free(ctx);
+	if(!ok) {
+		explicit_bzero(fileKey, sizeof(fileKey));
+		return EIO;
+	}
+	hdr->flags |= CRYPT_HDR_FILE_KEY;
+#else
+	memcpy(fileKey, cryptMasterKey, CRYPT_KEY_SZ);
+#endif
+	int error = cryptXtsKey(cf, fileKey);
+	explicit_bzero(fileKey, sizeof(fileKey));
+	if(error != 0)
+		return error;
+
+	statsCount(STATS_CTR_crypt_header_writes, 1);
+	ssize_t res = STATS_BACKEND(pwrite(fd, hdrBuf, sizeof(hdrBuf), 0));
+	explicit_bzero(hdrBuf, sizeof(hdrBuf));
+	if(res == -1)
+		return errno;
+	return (res == sizeof(hdrBuf)) ? 0 : EIO;
+}
+
+/* Read a file's header and get its key. */
+static int cryptReadHeader(int fd, struct crypt_file *cf)
+{
+	struct crypt_header hdr;
+	statsCount(STATS_CTR_crypt_header_reads, 1);
+	ssize_t res = STATS_BACKEND(pread(fd, &hdr, sizeof(hdr), 0));
+	if(res == -1)
+		return (errno == EBADF) ? EACCES : errno;
+	if((res != sizeof(hdr)) || (memcmp(hdr.magic, CRYPT_MAGIC, sizeof(hdr.magic)) != 0) ||
+	   (hdr.version != CRYPT_VERSION)) {
+		LOG_ERROR(NULL, "Not an encrypted file (fd %d).  Was it there before encryption "
+		          "was turned on?  See proxy_encrypt.", fd);
+		return EIO;
+	}
+	memcpy(cf->nonce, hdr.nonce, CRYPT_NONCE_SZ);
+
+	if(!(hdr.flags & CRYPT_HDR_FILE_KEY))
+		return cryptXtsKey(cf, cryptMasterKey);
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	if(ctx == NULL)
+		return ENOMEM;
+	EVP_CIPHER_CTX_set_flags(ctx, EVP_CIPHER_CTX_FLAG_WRAP_ALLOW);
+	int n = 0;
+	int fin = 0;
+	unsigned char fileKey[CRYPT_KEY_SZ];
+	int ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_wrap(), NULL, cryptMasterKey, NULL) &&
+	         (EVP_DecryptUpdate(ctx, fileKey, &n, hdr.wrappedKey, CRYPT_WRAPPED_SZ) > 0) &&
+	         (EVP_DecryptFinal_ex(ctx, fileKey + n, &fin) > 0) &&
+	         (n + fin == CRYPT_KEY_SZ);
+	EVP_CIPHER_CTX_free(ctx);
+	if(!ok) {
+		explicit_bzero(fileKey, sizeof(fileKey));
+		LOG_ERROR(NULL, "The file key doesn't unwrap (fd %d).  Wrong master key?", fd);
+		return EIO;
+	}
+	int error = cryptXtsKey(cf, fileKey);
+	explicit_bzero(fileKey, sizeof(fileKey));
+	return error;
+}
+
+/* The key file holds 32 bytes, or 64 hex digits. */
+static int cryptLoadKey(const char *keyFile)
+{
+	FILE *fp = fopen(keyFile, "re");
+	if(fp == NULL)
+		return errno;
+
+	char buf[128];
+	size_t len = fread(buf, 1, sizeof(buf), fp);
+	fclose(fp);
+
+	int error = 0;
+	if(len == CRYPT_KEY_SZ) {
+		memcpy(cryptMasterKey, buf, CRYPT_KEY_SZ);
+	}
+	else {
+		while((len > 0) && isspace((unsigned char) buf[len - 1]))
+			len--;
+		size_t i;
+		for(i = 0; (i < CRYPT_KEY_SZ) && (len == 2 * CRYPT_KEY_SZ); i++) {
+			unsigned int byte;
+			if(!isxdigit((unsigned char) buf[2 * i]) ||
+			   !isxdigit((unsigned char) buf[2 * i + 1]) ||
+			   (sscanf(buf + 2 * i, "%2x", &byte) != 1))
+				break;
+			cryptMasterKey[i] = byte;
+		}
+		if(i != CRYPT_KEY_SZ)
+			error = EINVAL;
+	}
+	explicit_bzero(buf, sizeof(buf));
+	return error;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Load the master key.  keyFile NULL leaves encryption off.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int cryptInit(const char *keyFile)
+{
+	if(keyFile == NULL)
+		return 0;
+
+	int error = cryptLoadKey(keyFile);
+	if(error != 0) {
+		explicit_bzero(cryptMasterKey, sizeof(cryptMasterKey));
+		return error;
+	}
+
+	cryptOn = true;
+	LOG_STATUS(NULL, "Encryption: AES-256-XTS : %d-byte units : %d-byte header : %s keys.",
+	           CRYPT_UNIT_SZ, CRYPT_HEADER_SZ,
+#ifdef KEY_SET_PER_FILE
+	           "per-file"
+#else
+	           "shared"
+#endif
+	          );
+	return 0;
+}
+
+void cryptDestroy(void)
+{
+	explicit_bzero(cryptMasterKey, sizeof(cryptMasterKey));
+	cryptOn = false;
+}
+
+bool cryptEnabled(void)
+{
+	return cryptOn;
+}
+
+/* Get the key for a file that we just opened, from its header.  An empty
+ * file gets a new header if fd is writable.  Otherwise it stays without a
+ * key until somebody opens it for writing (it has nothing to decrypt).
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int cryptOpen(struct lo_inode *inode, int fd, bool writable)
+{
+	if(cryptFile(inode) != NULL)
+		return 0;
+
+	struct crypt_file *cf = calloc(1, sizeof(struct crypt_file));
+	if(cf == NULL)
+		return ENOMEM;
+	pthread_mutex_init(&cf->lock, NULL);
+	pthread_rwlock_init(&cf->units, NULL);
+
+	int error = 0;
+	pthread_mutex_lock(&cryptOpenLock);
+	do {
+		if(cryptFile(inode) != NULL)
+			break;
+
+		struct stat st;
+		if(STATS_BACKEND(fstat(fd, &st)) == -1) {
+			error = errno;
+			break;
+		}
+
+		if(st.st_size == 0) {
+			if(!writable)
+				break;
+			error = cryptNewHeader(fd, cf);
+		}
+		else {
+			error = cryptReadHeader(fd, cf);
+			cf->size = (st.st_size > CRYPT_HEADER_SZ) ? st.st_size - CRYPT_HEADER_SZ : 0;
+		}
+		if(error != 0)
+			break;
+
+		__atomic_store_n(&inode->crypt, cf, __ATOMIC_RELEASE);
+		cf = NULL;
+	} while(0);
+	pthread_mutex_unlock(&cryptOpenLock);
+
+	cryptFileFree(cf);
+	return error;
+}
+
+/* Encrypt the plain file plainFD into fd, an empty file, for proxy_encrypt.
+ * Nothing else can have either of them open.  Stretches of zeros that are
+ * whole chunks are left as holes.
+ *
+ * Returns:
+ *   0 = success
+ *  EEXIST = plainFD is encrypted already.  fd is untouched.
+ *  !0 = errno of failure.
+ */
+int cryptImport(int plainFD, int fd)
+{
+	struct stat st;
+	if(fstat(plainFD, &st) == -1)
+		return errno;
+	off_t size = st.st_size;
+
+	struct crypt_header hdr;
+	if((size >= (off_t) sizeof(hdr)) && (pread(plainFD, &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+	   (memcmp(hdr.magic, CRYPT_MAGIC, sizeof(hdr.magic)) == 0))
+		return EEXIST;
+
+	struct crypt_file cf;
+	memset(&cf, 0, sizeof(cf));
+	int error = cryptNewHeader(fd, &cf);
+
+	char *buf = malloc(CRYPT_LEAD_SZ + CRYPT_CHUNK_SZ + CRYPT_AES_BLOCK);
+	if(buf == NULL)
+		error = ENOMEM;
+
+	/* A chunk at a time, and each chunk is whole units. */
+	uint64_t per = CRYPT_CHUNK_SZ / CRYPT_UNIT_SZ;
+	uint64_t lastUnit = (size > 0) ? cryptUnit(size - 1, size) : 0;
+	uint64_t k;
+	for(k = 0; (error == 0) && (size > 0) && (k <= lastUnit); k += per) {
+		uint64_t last = (k + per - 1 < lastUnit) ? k + per - 1 : lastUnit;
+		off_t from = cryptUnitStart(k);
+		off_t to = cryptUnitEnd(last, size);
+		off_t start = (from < 0) ? 0 : from;
+
+		memset(buf, 0, start - from);
+		ssize_t got = pread(plainFD, buf + (start - from), to - start, start);
+		if(got != to - start) {
+			error = (got == -1) ? errno : EIO;
+			break;
+		}
+		if(cryptIsZero(buf, to - from))
+			continue;
+
+		error = cryptBuffer(&cf, buf, from, to, size, false);
+		if(error != 0)
+			break;
+		ssize_t n = pwrite(fd, buf, to - from, CRYPT_HEADER_SZ + from);
+		if(n != to - from)
+			error = (n == -1) ? errno : EIO;
+	}
+
+	if((error == 0) && (ftruncate(fd, CRYPT_HEADER_SZ + size) == -1))
+		error = errno;
+
+	free(buf);
+	explicit_bzero(&cf, sizeof(cf));
+	return error;
+}
+
+/* The inode's key, or NULL if it hasn't got one yet. */
+struct crypt_file *cryptFile(struct lo_inode *inode)
+{
+	return __atomic_load_n(&inode->crypt, __ATOMIC_ACQUIRE);
+}
+
+/* Called when the inode is freed. */
+void cryptFileFree(struct crypt_file *cf)
+{
+	if(cf == NULL)
+		return;
+	pthread_mutex_destroy(&cf->lock);
+	pthread_rwlock_destroy(&cf->units);
+	explicit_bzero(cf, sizeof(*cf));
+	free(cf);
+}
+
+/* Turn the backend's attributes into the ones the application sees. */
+void cryptStat(struct stat *st)
+{
+	if(!cryptOn || !S_ISREG(st->st_mode))
+		return;
+	st->st_size = (st->st_size > CRYPT_HEADER_SZ) ? st->st_size - CRYPT_HEADER_SZ : 0;
+}
+
+/* Reads share the file's lock with whole-unit writes, so they never see a
+ * unit change shape under them. */
+void cryptReadBegin(struct crypt_file *cf)
+{
+	pthread_rwlock_rdlock(&cf->units);
+}
+
+void cryptReadEnd(struct crypt_file *cf)
+{
+	pthread_rwlock_unlock(&cf->units);
+}
+
+/* What to read from the backend to get plain bytes [off, off + size): whole
+ * units, *len bytes from backend offset *from (header and all).  *len is 0
+ * if it's all past the end of the file.  Call it between cryptReadBegin()
+ * and cryptReadEnd(). */
+void cryptReadRange(struct crypt_file *cf, off_t off, size_t size, off_t *from, size_t *len)
+{
+	off_t fileSize = cryptSize(cf);
+	off_t end = off + size;
+	if(end > fileSize)
+		end = fileSize;
+
+	*from = CRYPT_HEADER_SZ + off;
+	*len = 0;
+	if(off >= end)
+		return;
+
+	off_t start = cryptUnitStart(cryptUnit(off, fileSize));
+	*from = CRYPT_HEADER_SZ + start;
+	*len = cryptUnitEnd(cryptUnit(end - 1, fileSize), fileSize) - start;
+}
+
+/* Decrypt len bytes that were read from backend offset from, as
+ * cryptReadRange() said.  If the backend had less than that, the file ends
+ * where they do. */
+void cryptDecrypt(struct crypt_file *cf, char *buf, size_t len, off_t from)
+{
+	if(len == 0)
+		return;
+
+	off_t start = from - CRYPT_HEADER_SZ;
+	off_t end = start + len;
+	off_t size = cryptSize(cf);
+	if((end < size) && (cryptUnitEnd(cryptUnit(end - 1, size), size) != end))
+		size = end;
+
+	int error = EIO;
+	if(cryptUnitStart(cryptUnit((start < 0) ? 0 : start, size)) == start)
+		error = cryptBuffer(cf, buf, start, end, size, true);
+	if(error != 0) {
+		/* Never hand back what we couldn't decrypt. */
+		LOG_ERROR(NULL, "Decrypt of %zu bytes at %lld failed (%d).", len, (long long) from, error);
+		memset(buf, 0, len);
+	}
+}
+
+/* Encrypt a write.  On return, dst holds the whole units to write to the
+ * backend, and *off says where.  That can start before the application's
+ * data and end after it.  fd has to be open for writing.
+ *
+ * A write that covers whole units (or runs to the new end of the file)
+ * shares the file's lock with reads and other writes like it.  Anything else
+ * reads back the rest of its units, so it has the file to itself until the
+ * units are written.  Either way, the caller has to call cryptWriteEnd()
+ * once it has written dst (or given up).
+ *
+ * Returns:
+ *  >=0 = The number of application bytes in dst.
+ *   <0 = -errno of failure.  cryptWriteEnd() isn't needed.
+ */
+ssize_t cryptWrite(struct lo_inode *inode, int fd, struct fuse_bufvec *src,
+                   off_t *off, struct fuse_bufvec *dst)
+{
+	struct crypt_file *cf = cryptFile(inode);
+	if(cf == NULL) {
+		int error = cryptOpen(inode, fd, true);
+		if(error != 0)
+			return -error;
+		if((cf = cryptFile(inode)) == NULL)
+			return -EIO;
+	}
+
+	size_t len = fuse_buf_size(src);
+	off_t start = *off;
+	off_t end = start + len;
+	if(len == 0) {
+		pthread_rwlock_rdlock(&cf->units);
+		*dst = (struct fuse_bufvec) FUSE_BUFVEC_INIT(0);
+		*off = CRYPT_HEADER_SZ + start;
+		return 0;
+	}
+
+	/* Work out which units the write lands in, and whether it has to
+	 * read any of them back.  Deciding that and moving the end of the
+	 * file have to happen together, or two writes past the end could
+	 * each leave the other's data out of a unit. */
+	bool alone = (start % CRYPT_UNIT_SZ) || (end % CRYPT_UNIT_SZ);
+	off_t oldSize, newSize, from, to, edgeFrom, edgeTo;
+	bool keepHead, keepTail;
+	for(;;) {
+		if(alone)
+			pthread_rwlock_wrlock(&cf->units);
+		else
+			pthread_rwlock_rdlock(&cf->units);
+
+		pthread_mutex_lock(&cf->lock);
+		oldSize = cf->size;
+		newSize = (end > oldSize) ? end : oldSize;
+		from = cryptUnitStart(cryptUnit(start, newSize));
+		to = cryptUnitEnd(cryptUnit(end - 1, newSize), newSize);
+
+		/* If the file grows, its last unit can change shape.  When
+		 * that's next to the write, it's part of it. */
+		cryptEdge(oldSize, newSize, &edgeFrom, &edgeTo);
+		if((edgeFrom < edgeTo) && (edgeFrom <= to) && (edgeTo >= from)) {
+			from = (edgeFrom < from) ? edgeFrom : from;
+			to = (edgeTo > to) ? edgeTo : to;
+			edgeFrom = edgeTo = 0;
+		}
+		off_t keepFrom = (from < 0) ? 0 : from;
+		off_t keepTo = (to < oldSize) ? to : oldSize;
+		keepHead = (keepFrom < start) && (keepFrom < keepTo);
+		keepTail = (end < keepTo);
+
+		if(!alone && (keepHead || keepTail || (edgeFrom < edgeTo))) {
+			pthread_mutex_unlock(&cf->lock);
+			pthread_rwlock_unlock(&cf->units);
+			alone = true;
+			continue;
+		}
+		cf->size = newSize;
+		pthread_mutex_unlock(&cf->lock);
+		break;
+	}
+
+	int error = 0;
+	char *buf = NULL;
+	do {
+		/* A gap.  The old last unit gets the zeros that now follow
+		 * it.  The whole units in the middle stay holes. */
+		if(edgeFrom < edgeTo) {
+			error = cryptRewrite(inode, fd, cf, oldSize, newSize, edgeFrom, edgeTo);
+			if(error != 0)
+				break;
+		}
+
+		size_t size = to - from;
+		buf = engineReplyBuf(size);
+		if(buf == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		memset(buf, 0, size);
+		if(keepHead || keepTail)
+			statsCount(STATS_CTR_crypt_unit_rewrites, 1);
+		if(keepHead)
+			error = cryptLoad(inode, fd, cf, oldSize, from, start, buf);
+		if((error == 0) && keepTail)
+			error = cryptLoad(inode, fd, cf, oldSize, end, to, buf + (end - from));
+		if(error != 0)
+			break;
+		if(from < 0)
+			memset(buf, 0, CRYPT_LEAD_SZ);
+
+		struct fuse_bufvec plain = FUSE_BUFVEC_INIT(len);
+		plain.buf[0].mem = buf + (start - from);
+		ssize_t res = fuse_buf_copy(&plain, src, 0);
+		if(res < 0) {
+			error = -res;
+			break;
+		}
+		if(res != (ssize_t) len) {
+			error = EIO;
+			break;
+		}
+
+		error = cryptBuffer(cf, buf, from, to, newSize, false);
+	} while(0);
+	if(error != 0) {
+		pthread_rwlock_unlock(&cf->units);
+		return -error;
+	}
+
+	*dst = (struct fuse_bufvec) FUSE_BUFVEC_INIT(to - from);
+	dst->buf[0].mem = buf;
+	*off = CRYPT_HEADER_SZ + from;
+	return len;
+}
+
+/* Read plain bytes [off, off + len) of a file, for a layer on top of the
+ * encryption (compression).  Whatever is past the end of the file is zeros.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int cryptPread(struct lo_inode *inode, int fd, char *buf, size_t len, off_t off)
+{
+	struct crypt_file *cf = cryptFile(inode);
+	if(cf == NULL) {
+		memset(buf, 0, len);
+		return 0;
+	}
+
+	cryptReadBegin(cf);
+	int error = cryptLoad(inode, fd, cf, cryptSize(cf), off, off + len, buf);
+	cryptReadEnd(cf);
+	return error;
+}
+
+/* Write plain bytes at off, for a layer on top of the encryption.  The
+ * encrypted units go through the journal if it covers the file.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int cryptPwrite(struct lo_inode *inode, int fd, const char *buf, size_t len, off_t off)
+{
+	struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+	src.buf[0].mem = (void *) buf;
+	struct fuse_bufvec cipher;
+	ssize_t res = cryptWrite(inode, fd, &src, &off, &cipher);
+	if(res < 0)
+		return -res;
+
+	int error = journalWriteAt(inode, fd, cipher.buf[0].mem, fuse_buf_size(&cipher), off);
+	cryptWriteEnd(inode);
+	return error;
+}
+
+/* Punch out the whole units in plain bytes [off, off + len), which then read
+ * back as zeros, where the backend can do that.  A unit that only partly
+ * overlaps the range (like a last unit that took in a short tail) is left
+ * alone. */
+void cryptPunch(struct lo_inode *inode, int fd, off_t off, size_t len)
+{
+	struct crypt_file *cf = cryptFile(inode);
+	if((cf == NULL) || (len == 0))
+		return;
+
+	pthread_rwlock_wrlock(&cf->units);
+	off_t size = cryptSize(cf);
+	off_t end = off + len;
+	if(end > size)
+		end = size;
+
+	/* The first unit that starts in the range (unit 0 starts in the
+	 * header, with the lead), and the end of the last one that ends in
+	 * it.  A short tail that's part of the unit in front of it isn't a
+	 * unit of its own. */
+	uint64_t k = (off + CRYPT_UNIT_SZ - 1) / CRYPT_UNIT_SZ;
+	off_t from = (k == 0) ? 0 : cryptUnitStart(k);
+	off_t to = from;
+	while((to < end) && (cryptUnit(k * CRYPT_UNIT_SZ, size) == k) &&
+	      (cryptUnitEnd(k, size) <= end))
+		to = cryptUnitEnd(k++, size);
+	if((from == 0) && (to > 0))
+		from = -CRYPT_LEAD_SZ;
+
+	if(to > from) {
+		writeBufFlushInode(inode);
+		(void) STATS_BACKEND(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		                               CRYPT_HEADER_SZ + from, to - from));
+	}
+	pthread_rwlock_unlock(&cf->units);
+}
+
+/* The write that cryptWrite() encrypted is on its way. */
+void cryptWriteEnd(struct lo_inode *inode)
+{
+	pthread_rwlock_unlock(&cryptFile(inode)->units);
+}
+
+/* Truncate (or extend) a file to size bytes of plain data.  The unit at the
+ * new end (or the old one, if it grows) is encrypted again.  fd has to be
+ * open for writing.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int cryptTruncate(struct lo_inode *inode, int fd, off_t size)
+{
+	int error = cryptOpen(inode, fd, true);
+	if(error != 0)
+		return error;
+	struct crypt_file *cf = cryptFile(inode);
+	if(cf == NULL)
+		return EIO;
+
+	/* Nothing that's on its way to the NAS can land after a truncate
+	 * that shrinks the file.  When it grows, the journal's records are
+	 * inside the new size wherever they land. */
+	pthread_rwlock_wrlock(&cf->units);
+	writeBufFlushInode(inode);
+	pthread_mutex_lock(&cf->lock);
+	off_t oldSize = cf->size;
+	cf->size = size;
+	pthread_mutex_unlock(&cf->lock);
+	if(size < oldSize)
+		journalFlushInode(inode);
+
+	off_t from, to;
+	cryptEdge(oldSize, size, &from, &to);
+	char *buf = NULL;
+	do {
+		/* A unit that gets shorter has to be read before the
+		 * truncate takes the rest of it away. */
+		if((size < oldSize) && (from < to)) {
+			buf = malloc(to - from);
+			if(buf == NULL) {
+				error = ENOMEM;
+				break;
+			}
+			statsCount(STATS_CTR_crypt_unit_rewrites, 1);
+			error = cryptLoad(inode, fd, cf, oldSize, from, to, buf);
+			if(error != 0)
+				break;
+			if(from < 0)
+				memset(buf, 0, CRYPT_LEAD_SZ);
+			error = cryptBuffer(cf, buf, from, to, size, false);
+			if(error != 0)
+				break;
+		}
+
+		if(STATS_BACKEND(ftruncate(fd, CRYPT_HEADER_SZ + size)) == -1) {
+			error = errno;
+			break;
+		}
+
+		if(buf != NULL) {
+			ssize_t n = STATS_BACKEND(pwrite(fd, buf, to - from, CRYPT_HEADER_SZ + from));
+			if(n == -1)
+				error = errno;
+			else if(n != to - from)
+				error = EIO;
+		}
+		else if(from < to) {
+			error = cryptRewrite(inode, fd, cf, oldSize, size, from, to);
+		}
+		else if((size == 0) && (oldSize != 0)) {
+			/* Unit 0 is a hole until it's written again. */
+			static const char zeros[CRYPT_LEAD_SZ];
+			ssize_t n = STATS_BACKEND(pwrite(fd, zeros, CRYPT_LEAD_SZ,
+			                                 CRYPT_HEADER_SZ - CRYPT_LEAD_SZ));
+			if(n == -1)
+				error = errno;
+			else if(n != CRYPT_LEAD_SZ)
+				error = EIO;
+		}
+	} while(0);
+	pthread_rwlock_unlock(&cf->units);
+
+	free(buf);
+	return error;
+}
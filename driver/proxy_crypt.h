@@ -0,0 +1,107 @@
+/* *****************************************************************************
+ * File encryption.
+ *
+ * With PROXY_BRIDGE_KEY_FILE set, every regular file in the export is stored
+ * encrypted on the NAS, and the driver encrypts and decrypts in lo_write_buf()
+ * and lo_read().  That takes the place of stacking EncFS on top of the driver.
+ * The key file holds the 256-bit master key (32 raw bytes, or 64 hex digits).
+ *
+ * Each file starts with a header (CRYPT_HEADER_SZ bytes; 80 with
+ * FE_OPTIMIZE_HEADER, otherwise a whole page) that holds a random nonce and,
+ * with KEY_SET_PER_FILE, a random file key, wrapped with the master key
+ * (AES key wrap, RFC 3394).  Without KEY_SET_PER_FILE, the master key is the
+ * file key.  The data follows the header, encrypted with AES-256-XTS (IEEE
+ * 1619, the mode dm-crypt, BitLocker and FileVault use) in units of
+ * CRYPT_UNIT_SZ bytes.  Each unit's tweak is the nonce plus its number, and
+ * XTS's ciphertext stealing lets a unit be any length from one AES block
+ * (16 bytes) up, so the encrypted file is the same size as the plain one
+ * (plus the header), and its size needs nothing but a stat().  Two things
+ * keep every unit at least an AES block long:
+ * - The last 16 bytes of the header (the lead) are part of unit 0, as if
+ *   the file had 16 bytes of zeros in front of it.
+ * - A last unit that would be shorter than 16 bytes is part of the unit in
+ *   front of it instead.
+ * So the units at the end of a file change shape as it grows and shrinks.
+ * Writes and truncates that don't cover whole units read the rest of them
+ * back, and encrypt the whole units again.  Those take a file's lock for
+ * themselves, while reads and whole-unit writes share it.  OpenSSL uses the
+ * CPU's AES instructions.  Big reads and writes are split across the worker
+ * pool.
+ *
+ * The header is read (or, for an empty file, written) the first time the
+ * file is opened.  The file key and the file's size stay with the inode until
+ * the kernel forgets it, so later opens, reads and writes don't go back for
+ * it.
+ *
+ * Holes: the NAS returns zeros for a hole, and zeros don't decrypt to zeros.
+ * So a unit that's all zeros on the NAS reads back as zeros, and the lead is
+ * zeros until unit 0 is written.  When a file grows past a unit that isn't
+ * whole, that unit is encrypted again with the zeros that now follow it.
+ * The whole units of a gap stay holes.
+ *
+ * Files that were on the export before encryption was turned on have no
+ * header, and can't be opened (EIO, and "Not an encrypted file" in the log).
+ * There's no way to tell them apart from encrypted ones with a stat(), so
+ * they aren't passed through.  Encrypt them first, with the driver stopped:
+ *   proxy_encrypt <key file> <export>
+ * It writes an encrypted copy of each plain file next to it, and renames it
+ * over the original (see proxy_encrypt.c).
+ *
+ * What it protects against: somebody who can read the NAS, or a copy of it
+ * (a snapshot, a backup, a pulled disk), learns nothing but the sizes of the
+ * files and which units are holes.  Unlike a stream cipher, rewriting a unit
+ * doesn't give away anything about the old or the new data beyond that.
+ * What it doesn't: like all of the disk encryption modes, XTS is
+ * deterministic and isn't authenticated.  Somebody who sees the NAS more
+ * than once can tell which units changed, and whether a unit went back to
+ * what it held before.  Somebody who can write to the NAS can put back an
+ * old copy of a unit, or garble one (it decrypts to random bytes), and the
+ * driver won't notice.
+ * ****************************************************************************/
+
+#ifndef PROXY_CRYPT_H
+#define PROXY_CRYPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "proxy_inode.h"
+
+#ifdef FE_OPTIMIZE_HEADER
+#define CRYPT_HEADER_SZ (80)
+#else
+#define CRYPT_HEADER_SZ (4096)
+#endif
+
+/* The encryption unit.  Reads and writes get widened to whole ones. */
+#define CRYPT_UNIT_SZ (4096)
+
+struct fuse_bufvec;
+struct crypt_file;
+
+int cryptInit(const char *keyFile);
+void cryptDestroy(void);
+bool cryptEnabled(void);
+
+int cryptOpen(struct lo_inode *inode, int fd, bool writable);
+int cryptImport(int plainFD, int fd);
+struct crypt_file *cryptFile(struct lo_inode *inode);
+void cryptFileFree(struct crypt_file *cf);
+void cryptStat(struct stat *st);
+
+void cryptReadBegin(struct crypt_file *cf);
+void cryptReadEnd(struct crypt_file *cf);
+void cryptReadRange(struct crypt_file *cf, off_t off, size_t size, off_t *from, size_t *len);
+void cryptDecrypt(struct crypt_file *cf, char *buf, size_t len, off_t from);
+ssize_t cryptWrite(struct lo_inode *inode, int fd, struct fuse_bufvec *src,
+                   off_t *off, struct fuse_bufvec *dst);
+void cryptWriteEnd(struct lo_inode *inode);
+int cryptTruncate(struct lo_inode *inode, int fd, off_t size);
+int cryptPread(struct lo_inode *inode, int fd, char *buf, size_t len, off_t off);
+int cryptPwrite(struct lo_inode *inode, int fd, const char *buf, size_t len, off_t off);
+void cryptPunch(struct lo_inode *inode, int fd, off_t off, size_t len);
+
+#endif /* PROXY_CRYPT_H */
@@ -0,0 +1,687 @@
+/* *****************************************************************************
+ * The disk cache.  See proxy_dcache.h for the big picture.
+ *
+ * Every slot has an entry in the slots array, in one of these states:
+ *   FREE    - On the free list.
+ *   FILLING - The writer thread is putting a block in it.
+ *   LIVE    - Holds a block.  It's in the hash table and on the LRU list.
+ *   DEAD    - Thrown away while a reader was still copying it out.  It goes
+ *             on the free list when the last reader is done.
+ * The lists and the hash chains are linked by slot number, so the whole
+ * index is a handful of flat arrays.
+ *
+ * Files on disk:
+ *   <path>     - slots * CACHE_BLOCK_SZ bytes of data.
+ *   <path>.idx - A header, then one dcache_rec per slot.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "proxy_dcache.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+#define DCACHE_MAGIC      (0x4843434450584e4eULL)
+#define DCACHE_VERSION    (1)
+#define DCACHE_HDR_SZ     (4096)
+#define DCACHE_NONE       (UINT32_MAX)
+
+/* The most blocks that can wait for the writer.  Past that, we drop them. */
+#define DCACHE_QUEUE_MAX  (256)
+
+/* How many index records we read at a time when we load the index. */
+#define DCACHE_LOAD_BATCH (1024)
+
+struct dcache_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t blockSize;
+	uint64_t slots;
+};
+
+/* One slot's record in the index file. */
+struct dcache_rec {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtimeSec;
+	int64_t ctimeSec;
+	uint32_t blk;
+	uint32_t mtimeNsec;
+	uint32_t ctimeNsec;
+	uint32_t len;             /* 0 = empty. */
+	uint32_t dataCrc;
+	uint32_t crc;             /* Of everything before it. */
+};
+
+_Static_assert(sizeof(struct dcache_rec) == 64, "dcache_rec must be 64 bytes");
+
+enum { SLOT_FREE, SLOT_FILLING, SLOT_LIVE, SLOT_DEAD };
+
+struct dcache_slot {
+	dev_t dev;
+	ino_t ino;
+	uint64_t blk;
+	struct cache_stamp stamp;
+	uint32_t len;
+	uint32_t dataCrc;
+	uint32_t hnext;
+	uint32_t prev;            /* LRU list.  next is also the free list. */
+	uint32_t next;
+	uint16_t pins;            /* Readers copying the data out. */
+	uint8_t state;
+	bool verified;            /* Data checked against dataCrc. */
+	bool onDisk;              /* The index has a record for this slot. */
+};
+
+/* A block that's waiting for the writer. */
+struct dcache_job {
+	struct dcache_job *next;
+	dev_t dev;
+	ino_t ino;
+	uint64_t blk;
+	struct cache_stamp stamp;
+	size_t len;
+	char data[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int dataFd;
+	int idxFd;
+	uint32_t numSlots;
+	struct dcache_slot *slots;
+	uint32_t *buckets;
+	uint32_t nbuckets;        /* Always a power of 2. */
+	uint32_t freeHead;
+	uint32_t lruHead;         /* MRU. */
+	uint32_t lruTail;         /* LRU. */
+	size_t liveBytes;
+
+	/* The writer thread. */
+	pthread_cond_t work;
+	struct dcache_job *jobsHead;
+	struct dcache_job *jobsTail;
+	unsigned int numJobs;
+	bool running;
+	bool stopping;
+	pthread_t writer;
+} dcache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.dataFd = -1,
+	.idxFd = -1,
+};
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static uint64_t dcacheHash(dev_t dev, ino_t ino, uint64_t blk)
+{
+	uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^
+	             ((uint64_t) dev * 0xC2B2AE3D27D4EB4FULL) ^
+	             (blk * 0x165667B19E3779F9ULL);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static uint32_t *dcacheBucket(dev_t dev, ino_t ino, uint64_t blk)
+{
+	return &dcache.buckets[dcacheHash(dev, ino, blk) & (dcache.nbuckets - 1)];
+}
+
+/* Same test as the block cache, so a stamp from blockCacheStamp() works. */
+static bool dcacheStampEqual(const struct cache_stamp *a, const struct cache_stamp *b)
+{
+	return (a->gen == b->gen) &&
+	       (a->size == b->size) &&
+	       (a->mtime.tv_sec == b->mtime.tv_sec) &&
+	       (a->mtime.tv_nsec == b->mtime.tv_nsec) &&
+	       (a->ctime.tv_sec == b->ctime.tv_sec) &&
+	       (a->ctime.tv_nsec == b->ctime.tv_nsec);
+}
+
+static off_t dcacheDataOffset(uint32_t i)
+{
+	return (off_t) i * CACHE_BLOCK_SZ;
+}
+
+static off_t dcacheRecOffset(uint32_t i)
+{
+	return DCACHE_HDR_SZ + ((off_t) i * sizeof(struct dcache_rec));
+}
+
+static uint32_t dcacheRecCrc(const struct dcache_rec *rec)
+{
+	return crc32(0, (const Bytef *) rec, offsetof(struct dcache_rec, crc));
+}
+
+/* The rest of the functions in this section are called with the lock held. */
+
+static uint32_t dcacheHashFind(dev_t dev, ino_t ino, uint64_t blk)
+{
+	uint32_t i;
+	for(i = *dcacheBucket(dev, ino, blk); i != DCACHE_NONE; i = dcache.slots[i].hnext) {
+		struct dcache_slot *s = &dcache.slots[i];
+		if((s->blk == blk) && (s->ino == ino) && (s->dev == dev))
+			break;
+	}
+	return i;
+}
+
+static void dcacheHashRemove(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	uint32_t *pp = dcacheBucket(s->dev, s->ino, s->blk);
+	while(*pp != i)
+		pp = &dcache.slots[*pp].hnext;
+	*pp = s->hnext;
+}
+
+static void dcacheLruRemove(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	if(s->prev != DCACHE_NONE)
+		dcache.slots[s->prev].next = s->next;
+	else
+		dcache.lruHead = s->next;
+	if(s->next != DCACHE_NONE)
+		dcache.slots[s->next].prev = s->prev;
+	else
+		dcache.lruTail = s->prev;
+}
+
+static void dcacheLruPushMRU(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	s->prev = DCACHE_NONE;
+	s->next = dcache.lruHead;
+	if(dcache.lruHead != DCACHE_NONE)
+		dcache.slots[dcache.lruHead].prev = i;
+	else
+		dcache.lruTail = i;
+	dcache.lruHead = i;
+}
+
+/* Make a LIVE slot findable. */
+static void dcacheLink(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	uint32_t *b = dcacheBucket(s->dev, s->ino, s->blk);
+	s->hnext = *b;
+	*b = i;
+	dcacheLruPushMRU(i);
+	s->state = SLOT_LIVE;
+	__atomic_add_fetch(&dcache.liveBytes, s->len, __ATOMIC_RELAXED);
+}
+
+static void dcachePushFree(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	s->state = SLOT_FREE;
+	s->next = dcache.freeHead;
+	dcache.freeHead = i;
+}
+
+/* Throw away a LIVE slot's block.  The record on disk stays until the slot is
+ * reused.  If it's reloaded after a restart, its stamp won't match. */
+static void dcacheKill(uint32_t i)
+{
+	struct dcache_slot *s = &dcache.slots[i];
+	dcacheHashRemove(i);
+	dcacheLruRemove(i);
+	__atomic_sub_fetch(&dcache.liveBytes, s->len, __ATOMIC_RELAXED);
+	if(s->pins > 0)
+		s->state = SLOT_DEAD;
+	else
+		dcachePushFree(i);
+}
+
+/* Get a slot to fill: a free one, or the least recently used one that nobody
+ * is reading. */
+static uint32_t dcacheAlloc(void)
+{
+	uint32_t i = dcache.freeHead;
+	if(i != DCACHE_NONE) {
+		dcache.freeHead = dcache.slots[i].next;
+	}
+	else {
+		for(i = dcache.lruTail; i != DCACHE_NONE; i = dcache.slots[i].prev) {
+			if(dcache.slots[i].pins == 0)
+				break;
+		}
+		if(i == DCACHE_NONE)
+			return DCACHE_NONE;
+		dcacheKill(i);
+		dcache.freeHead = dcache.slots[i].next;
+		statsCount(STATS_CTR_dcache_evictions, 1);
+	}
+	dcache.slots[i].state = SLOT_FILLING;
+	return i;
+}
+
+/* Load the index, or start a new one if it doesn't match the cache file. */
+static int dcacheLoadIndex(void)
+{
+	struct dcache_header hdr;
+	ssize_t n = pread(dcache.idxFd, &hdr, sizeof(hdr), 0);
+	bool good = (n == sizeof(hdr)) &&
+	            (hdr.magic == DCACHE_MAGIC) &&
+	            (hdr.version == DCACHE_VERSION) &&
+	            (hdr.blockSize == CACHE_BLOCK_SZ) &&
+	            (hdr.slots == dcache.numSlots);
+
+	if(!good) {
+		LOG_STATUS(NULL, "Disk cache: starting a new index.");
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = DCACHE_MAGIC;
+		hdr.version = DCACHE_VERSION;
+		hdr.blockSize = CACHE_BLOCK_SZ;
+		hdr.slots = dcache.numSlots;
+		if((ftruncate(dcache.idxFd, 0) == -1) ||
+		   (ftruncate(dcache.idxFd, dcacheRecOffset(dcache.numSlots)) == -1) ||
+		   (pwrite(dcache.idxFd, &hdr, sizeof(hdr), 0) != sizeof(hdr)))
+			return errno;
+	}
+
+	struct dcache_rec *recs = malloc(DCACHE_LOAD_BATCH * sizeof(struct dcache_rec));
+	if(recs == NULL)
+		return ENOMEM;
+
+	static const struct dcache_rec empty;
+	uint32_t loaded = 0;
+	uint32_t first;
+	for(first = 0; first < dcache.numSlots; first += DCACHE_LOAD_BATCH) {
+		uint32_t count = dcache.numSlots - first;
+		if(count > DCACHE_LOAD_BATCH)
+			count = DCACHE_LOAD_BATCH;
+
+		size_t want = count * sizeof(struct dcache_rec);
+		n = good ? pread(dcache.idxFd, recs, want, dcacheRecOffset(first)) : 0;
+		if(n < (ssize_t) want)
+			memset((char *) recs + ((n > 0) ? n : 0), 0, want - ((n > 0) ? n : 0));
+
+		uint32_t j;
+		for(j = 0; j < count; j++) {
+			uint32_t i = first + j;
+			struct dcache_rec *rec = &recs[j];
+			struct dcache_slot *s = &dcache.slots[i];
+
+			s->onDisk = (memcmp(rec, &empty, sizeof(empty)) != 0);
+			if((rec->len == 0) || (rec->len > CACHE_BLOCK_SZ) ||
+			   (rec->crc != dcacheRecCrc(rec)) ||
+			   (dcacheHashFind(rec->dev, rec->ino, rec->blk) != DCACHE_NONE)) {
+				dcachePushFree(i);
+				continue;
+			}
+
+			/* Blocks from before the restart can only match inodes
+			 * that we haven't written to yet (generation 0). */
+			s->dev = rec->dev;
+			s->ino = rec->ino;
+			s->blk = rec->blk;
+			memset(&s->stamp, 0, sizeof(s->stamp));
+			s->stamp.size = rec->size;
+			s->stamp.mtime.tv_sec = rec->mtimeSec;
+			s->stamp.mtime.tv_nsec = rec->mtimeNsec;
+			s->stamp.ctime.tv_sec = rec->ctimeSec;
+			s->stamp.ctime.tv_nsec = rec->ctimeNsec;
+			s->len = rec->len;
+			s->dataCrc = rec->dataCrc;
+			s->verified = false;
+			dcacheLink(i);
+			loaded++;
+		}
+	}
+
+	free(recs);
+	LOG_STATUS(NULL, "Disk cache: %u of %u slots in use.", loaded, dcache.numSlots);
+	return 0;
+}
+
+/* Write one block to a slot.  Called by the writer thread. */
+static void dcacheWrite(struct dcache_job *job)
+{
+	pthread_mutex_lock(&dcache.lock);
+	uint32_t i = dcacheHashFind(job->dev, job->ino, job->blk);
+	if(i != DCACHE_NONE) {
+		if(dcacheStampEqual(&dcache.slots[i].stamp, &job->stamp)) {
+			pthread_mutex_unlock(&dcache.lock);
+			return;
+		}
+		dcacheKill(i);
+	}
+	i = dcacheAlloc();
+	pthread_mutex_unlock(&dcache.lock);
+	if(i == DCACHE_NONE) {
+		statsCount(STATS_CTR_dcache_drops, 1);
+		return;
+	}
+
+	/* Nobody else touches a FILLING slot, so no lock for the I/O. */
+	struct dcache_slot *s = &dcache.slots[i];
+	struct dcache_rec rec;
+	bool ok = true;
+
+	if(s->onDisk) {
+		memset(&rec, 0, sizeof(rec));
+		ok = (pwrite(dcache.idxFd, &rec, sizeof(rec), dcacheRecOffset(i)) == sizeof(rec));
+		s->onDisk = !ok;
+	}
+
+	uint32_t dataCrc = crc32(0, (const Bytef *) job->data, job->len);
+	if(ok) {
+		ok = (pwrite(dcache.dataFd, job->data, job->len, dcacheDataOffset(i)) == (ssize_t) job->len);
+	}
+
+	if(ok) {
+		memset(&rec, 0, sizeof(rec));
+		rec.dev = job->dev;
+		rec.ino = job->ino;
+		rec.blk = job->blk;
+		rec.size = job->stamp.size;
+		rec.mtimeSec = job->stamp.mtime.tv_sec;
+		rec.mtimeNsec = job->stamp.mtime.tv_nsec;
+		rec.ctimeSec = job->stamp.ctime.tv_sec;
+		rec.ctimeNsec = job->stamp.ctime.tv_nsec;
+		rec.len = job->len;
+		rec.dataCrc = dataCrc;
+		rec.crc = dcacheRecCrc(&rec);
+		ok = (pwrite(dcache.idxFd, &rec, sizeof(rec), dcacheRecOffset(i)) == sizeof(rec));
+		s->onDisk = true;
+	}
+
+	if(!ok) {
+		LOG_ERROR(NULL, "Disk cache write to slot %u failed (%m).", i);
+	}
+
+	pthread_mutex_lock(&dcache.lock);
+	if(ok) {
+		s->dev = job->dev;
+		s->ino = job->ino;
+		s->blk = job->blk;
+		s->stamp = job->stamp;
+		s->len = job->len;
+		s->dataCrc = dataCrc;
+		s->verified = true;
+		dcacheLink(i);
+	}
+	else {
+		dcachePushFree(i);
+	}
+	pthread_mutex_unlock(&dcache.lock);
+
+	if(ok)
+		statsCount(STATS_CTR_dcache_fills, 1);
+}
+
+static void *dcacheWriter(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&dcache.lock);
+	for(;;) {
+		struct dcache_job *job = dcache.jobsHead;
+		if(job == NULL) {
+			if(dcache.stopping)
+				break;
+			pthread_cond_wait(&dcache.work, &dcache.lock);
+			continue;
+		}
+		dcache.jobsHead = job->next;
+		if(dcache.jobsHead == NULL)
+			dcache.jobsTail = NULL;
+		dcache.numJobs--;
+		pthread_mutex_unlock(&dcache.lock);
+
+		dcacheWrite(job);
+		free(job);
+
+		pthread_mutex_lock(&dcache.lock);
+	}
+	pthread_mutex_unlock(&dcache.lock);
+
+	return NULL;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Open (or create) the cache files and load the index.  path NULL leaves the
+ * disk cache disabled.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int diskCacheInit(const char *path, size_t bytes)
+{
+	if(path == NULL)
+		return 0;
+
+	size_t slots = bytes / CACHE_BLOCK_SZ;
+	if((slots == 0) || (slots >= DCACHE_NONE))
+		return EINVAL;
+
+	int error = 0;
+	char *idxPath = NULL;
+	do {
+		dcache.numSlots = slots;
+		dcache.nbuckets = 1;
+		while(dcache.nbuckets < dcache.numSlots)
+			dcache.nbuckets <<= 1;
+
+		dcache.slots = calloc(dcache.numSlots, sizeof(struct dcache_slot));
+		dcache.buckets = malloc(dcache.nbuckets * sizeof(uint32_t));
+		if((dcache.slots == NULL) || (dcache.buckets == NULL) ||
+		   (asprintf(&idxPath, "%s.idx", path) == -1)) {
+			idxPath = NULL;
+			error = ENOMEM;
+			break;
+		}
+		memset(dcache.buckets, 0xff, dcache.nbuckets * sizeof(uint32_t));
+		dcache.freeHead = DCACHE_NONE;
+		dcache.lruHead = DCACHE_NONE;
+		dcache.lruTail = DCACHE_NONE;
+
+		dcache.dataFd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(dcache.dataFd == -1) {
+			error = errno;
+			break;
+		}
+		error = posix_fallocate(dcache.dataFd, 0, dcacheDataOffset(dcache.numSlots));
+		if(error != 0)
+			break;
+
+		dcache.idxFd = open(idxPath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if(dcache.idxFd == -1) {
+			error = errno;
+			break;
+		}
+
+		error = dcacheLoadIndex();
+	} while(0);
+
+	free(idxPath);
+	if(error != 0)
+		diskCacheDestroy();
+	return error;
+}
+
+void diskCacheDestroy(void)
+{
+	if(dcache.dataFd != -1)
+		close(dcache.dataFd);
+	if(dcache.idxFd != -1)
+		close(dcache.idxFd);
+	dcache.dataFd = -1;
+	dcache.idxFd = -1;
+	free(dcache.slots);
+	free(dcache.buckets);
+	dcache.slots = NULL;
+	dcache.buckets = NULL;
+	dcache.numSlots = 0;
+	dcache.liveBytes = 0;
+}
+
+bool diskCacheEnabled(void)
+{
+	return dcache.slots != NULL;
+}
+
+/* Start the writer thread.  Call it after fuse_daemonize().  Until it's
+ * running, diskCachePut() drops everything.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int diskCacheStart(void)
+{
+	if(!diskCacheEnabled())
+		return 0;
+
+	dcache.stopping = false;
+	int rc = pthread_create(&dcache.writer, NULL, dcacheWriter, NULL);
+	if(rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&dcache.lock);
+	dcache.running = true;
+	pthread_mutex_unlock(&dcache.lock);
+	return 0;
+}
+
+/* Write out whatever is queued, then stop the writer. */
+void diskCacheStop(void)
+{
+	pthread_mutex_lock(&dcache.lock);
+	bool running = dcache.running;
+	dcache.running = false;
+	dcache.stopping = true;
+	pthread_cond_signal(&dcache.work);
+	pthread_mutex_unlock(&dcache.lock);
+
+	if(running)
+		pthread_join(dcache.writer, NULL);
+}
+
+/* Copy a block into dst (which must hold CACHE_BLOCK_SZ bytes).
+ *
+ * Returns:
+ *  >=0 = number of bytes copied.  Less than CACHE_BLOCK_SZ means the block
+ *        holds the end of the file.
+ *   -1 = miss.
+ */
+ssize_t diskCacheGet(dev_t dev, ino_t ino, uint64_t blk,
+                     const struct cache_stamp *stamp, char *dst)
+{
+	pthread_mutex_lock(&dcache.lock);
+	uint32_t i = dcacheHashFind(dev, ino, blk);
+	if(i == DCACHE_NONE) {
+		pthread_mutex_unlock(&dcache.lock);
+		statsCount(STATS_CTR_dcache_misses, 1);
+		return -1;
+	}
+
+	struct dcache_slot *s = &dcache.slots[i];
+	if(!dcacheStampEqual(&s->stamp, stamp)) {
+		/* The file has changed since we cached this. */
+		dcacheKill(i);
+		pthread_mutex_unlock(&dcache.lock);
+		statsCount(STATS_CTR_dcache_stale, 1);
+		statsCount(STATS_CTR_dcache_misses, 1);
+		return -1;
+	}
+
+	s->pins++;
+	dcacheLruRemove(i);
+	dcacheLruPushMRU(i);
+	uint32_t len = s->len;
+	uint32_t dataCrc = s->dataCrc;
+	bool verified = s->verified;
+	pthread_mutex_unlock(&dcache.lock);
+
+	ssize_t n = pread(dcache.dataFd, dst, len, dcacheDataOffset(i));
+	bool ok = (n == len) && (verified || (crc32(0, (const Bytef *) dst, len) == dataCrc));
+
+	pthread_mutex_lock(&dcache.lock);
+	s->pins--;
+	if(s->state == SLOT_LIVE) {
+		if(ok)
+			s->verified = true;
+		else
+			dcacheKill(i);
+	}
+	else if((s->state == SLOT_DEAD) && (s->pins == 0)) {
+		dcachePushFree(i);
+	}
+	pthread_mutex_unlock(&dcache.lock);
+
+	if(!ok) {
+		LOG_ERROR(NULL, "Disk cache slot %u is bad (read %zd of %u bytes).", i, n, len);
+		statsCount(STATS_CTR_dcache_corrupt, 1);
+		statsCount(STATS_CTR_dcache_misses, 1);
+		return -1;
+	}
+	statsCount(STATS_CTR_dcache_hits, 1);
+	return len;
+}
+
+/* Queue a block that we just read from the backend.  The data is copied, so
+ * the caller can reuse src right away. */
+void diskCachePut(dev_t dev, ino_t ino, uint64_t blk,
+                  const struct cache_stamp *stamp, const char *src, size_t len)
+{
+	if((len == 0) || (len > CACHE_BLOCK_SZ))
+		return;
+
+	struct dcache_job *job = malloc(sizeof(struct dcache_job) + len);
+	if(job == NULL)
+		return;
+	job->next = NULL;
+	job->dev = dev;
+	job->ino = ino;
+	job->blk = blk;
+	job->stamp = *stamp;
+	job->len = len;
+	memcpy(job->data, src, len);
+
+	pthread_mutex_lock(&dcache.lock);
+	if(dcache.running && (dcache.numJobs < DCACHE_QUEUE_MAX)) {
+		if(dcache.jobsTail != NULL)
+			dcache.jobsTail->next = job;
+		else
+			dcache.jobsHead = job;
+		dcache.jobsTail = job;
+		dcache.numJobs++;
+		pthread_cond_signal(&dcache.work);
+		job = NULL;
+	}
+	pthread_mutex_unlock(&dcache.lock);
+
+	if(job != NULL) {
+		statsCount(STATS_CTR_dcache_drops, 1);
+		free(job);
+	}
+}
+
+/* Gauge callback for the stats exporter. */
+double diskCacheBytes(void *arg)
+{
+	(void) arg;
+	return (double) __atomic_load_n(&dcache.liveBytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,52 @@
+/* *****************************************************************************
+ * The disk cache.
+ *
+ * A second cache tier, on a local disk, behind the in-memory block cache.
+ * Read-mostly data that falls out of memory (or is lost when the proxy
+ * restarts) comes off the local disk instead of being pulled over the
+ * network again.
+ *
+ * The data lives in one preallocated file (PROXY_BRIDGE_DISK_CACHE, sized by
+ * PROXY_BRIDGE_DISK_CACHE_MB), cut into CACHE_BLOCK_SZ slots.  Next to it is
+ * an index file (the same name plus ".idx") with one small record per slot,
+ * which says which block of which file is in the slot, and the file's stamp
+ * when the block was read (see proxy_cache.h).  The index is reloaded when
+ * the proxy starts, so the cache survives restarts.
+ *
+ * The blocks that lo_read() has to get from the backend are written to the
+ * disk cache by a background thread, so a read never waits for the local
+ * disk to take a copy.  If the writer falls behind, blocks are dropped
+ * instead of queued.  The least recently used slots are reused first.
+ *
+ * Crash safety: before a slot is reused, its record is zeroed, then the data
+ * is written, then the new record.  Each record carries a CRC of itself and
+ * a CRC of the data.  After a restart, each block's data is checked against
+ * its CRC the first time it's read, so a slot whose data didn't make it to
+ * the disk is thrown away, not returned.  Nothing is ever fsync()ed.  It's
+ * a cache.
+ * ****************************************************************************/
+
+#ifndef PROXY_DCACHE_H
+#define PROXY_DCACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "proxy_cache.h"
+
+int diskCacheInit(const char *path, size_t bytes);
+void diskCacheDestroy(void);
+bool diskCacheEnabled(void);
+int diskCacheStart(void);
+void diskCacheStop(void);
+
+ssize_t diskCacheGet(dev_t dev, ino_t ino, uint64_t blk,
+                     const struct cache_stamp *stamp, char *dst);
+void diskCachePut(dev_t dev, ino_t ino, uint64_t blk,
+                  const struct cache_stamp *stamp, const char *src, size_t len);
+double diskCacheBytes(void *arg);
+
+#endif /* PROXY_DCACHE_H */
@@ -0,0 +1,892 @@
+/* *****************************************************************************
+ * Chunk deduplication.  See proxy_dedup.h for the big picture.
+ *
+ * The fingerprint table is one flat array, with open addressing (linear
+ * probing) on the front of the fingerprint.  When it fills up, the
+ * fingerprints that have only been seen once, and not since the last time
+ * it filled up, are taken out (see dedupPrune()).  Everything else in the
+ * table moves then, so a slot is only good while dedupLock is held.
+ *
+ * Files in the store:
+ *   <id>.pack - Chunks, back to back.
+ *   <id>.idx  - One dedup_ref per chunk in <id>.pack, in the same order.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "proxy_dedup.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+/* When the pack that we're writing gets this big, we start another. */
+#define DEDUP_PACK_MAX    (1024LL * 1024 * 1024)
+
+/* How many index records we read at a time when we load the store. */
+#define DEDUP_LOAD_BATCH  (1024)
+
+/* First copies waiting to be moved over to the store.  If writes store
+ * chunks faster than the bridge moves them, the rest stay where they are. */
+#define DEDUP_REPOINT_MAX (1024)
+
+_Static_assert(sizeof(struct dedup_ref) == 64, "dedup_ref must be 64 bytes");
+
+enum { DEDUP_EMPTY, DEDUP_SEEN, DEDUP_STORING, DEDUP_STORED };
+
+struct dedup_slot {
+	union {
+		struct dedup_ref ref;     /* Once it's STORED. */
+		struct {
+			unsigned char fp[DEDUP_FP_SZ];
+			struct dedup_origin origin; /* Where the first copy is. */
+			uint32_t gen;     /* dedupGen when it was seen. */
+		} seen;                   /* Until then. */
+	};
+	uint8_t state;
+};
+
+/* A first copy to move over to the store. */
+struct dedup_repoint {
+	struct dedup_origin origin;
+	struct dedup_ref ref;
+};
+
+/* An open pack, for reads. */
+struct dedup_pack {
+	uint64_t id;
+	int fd;
+};
+
+static bool dedupOn = false;
+static int dedupDirFd = -1;
+
+/* The fingerprint table. */
+static pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedup_slot *dedupTable = NULL;
+static size_t dedupMask = 0;
+static size_t dedupUsed = 0;
+static size_t dedupMax = 0;
+static uint32_t dedupGen = 0;     /* How many times it's been pruned. */
+
+/* First copies to move, oldest first.  Protected by dedupLock. */
+static struct dedup_repoint dedupRepoints[DEDUP_REPOINT_MAX];
+static size_t dedupRepointHead = 0;
+static size_t dedupRepointCount = 0;
+
+/* The pack that we're adding to.  packFd is -1 until the first chunk. */
+static pthread_mutex_t dedupPackLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t dedupPackId = 0;
+static int dedupPackFd = -1;
+static int dedupIdxFd = -1;
+static uint64_t dedupPackOff = 0;
+static uint64_t dedupIdxOff = 0;
+
+/* Chunks added so far, and how many of them were in the last dedupSync().
+ * Changed with dedupPackLock held, but read without it. */
+static uint64_t dedupAddSeq = 0;
+static uint64_t dedupSyncedSeq = 0;
+
+/* Bytes in all the packs, and how many there can be (0 = no limit).
+ * Protected by dedupPackLock. */
+static uint64_t dedupStoreBytes = 0;
+static uint64_t dedupStoreMax = 0;
+
+/* Packs that we've opened for reading. */
+static pthread_mutex_t dedupFdLock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedup_pack *dedupPacks = NULL;
+static size_t dedupNumPacks = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static int dedupWriteFull(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t total = 0;
+	while(total < len) {
+		ssize_t n = STATS_BACKEND(pwrite(fd, (const char *) buf + total, len - total, off + total));
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		total += n;
+	}
+	return 0;
+}
+
+static int dedupFingerprint(const char *plain, size_t len, unsigned char *fp)
+{
+	return (EVP_Digest(plain, len, fp, NULL, EVP_sha256(), NULL) == 1) ? 0 : EIO;
+}
+
+/* Find a fingerprint's slot, or the empty slot where it would go.  Call with
+ * dedupLock held. */
+static struct dedup_slot *dedupFind(const unsigned char *fp)
+{
+	uint64_t hash;
+	memcpy(&hash, fp, sizeof(hash));
+	size_t i = hash & dedupMask;
+	while(dedupTable[i].state != DEDUP_EMPTY) {
+		if(memcmp(dedupTable[i].ref.fp, fp, DEDUP_FP_SZ) == 0)
+			break;
+		i = (i + 1) & dedupMask;
+	}
+	return &dedupTable[i];
+}
+
+/* Make room in a full table.  A fingerprint that was only seen once (its
+ * first copy never got a second) is forgotten if it's been in the table
+ * since before the last prune, or, if that frees nothing, whatever its age.
+ * Chunks in the store, and ones on their way there, stay.  A first copy
+ * that's forgotten just stays where it is.
+ *
+ * Taking slots out of a table with linear probing leaves holes in the runs
+ * that lookups follow, so everything that's left is put back where a lookup
+ * would find it now.  Starting just after a slot that was empty before (no
+ * run goes through it), each entry in turn is taken out and put in the
+ * first free slot from its home, which is never after where it was.  The
+ * runs of the entries before it are all in front of it, so moving it
+ * doesn't break them.  It goes through the whole table with dedupLock held,
+ * but it only happens each time the table fills up.  Call with dedupLock
+ * held.
+ *
+ * Returns the number of fingerprints forgotten.
+ */
+static size_t dedupPrune(void)
+{
+	size_t start = 0;
+	while(dedupTable[start].state != DEDUP_EMPTY)
+		start++;
+
+	size_t pruned = 0;
+	int pass;
+	for(pass = 0; (pass < 2) && (pruned == 0); pass++) {
+		size_t i;
+		for(i = 0; i <= dedupMask; i++) {
+			struct dedup_slot *slot = &dedupTable[i];
+			if((slot->state == DEDUP_SEEN) && ((pass == 1) || (slot->seen.gen != dedupGen))) {
+				slot->state = DEDUP_EMPTY;
+				pruned++;
+			}
+		}
+	}
+	dedupUsed -= pruned;
+	dedupGen++;
+
+	size_t n;
+	for(n = 1; n <= dedupMask; n++) {
+		struct dedup_slot *slot = &dedupTable[(start + n) & dedupMask];
+		if(slot->state == DEDUP_EMPTY)
+			continue;
+		struct dedup_slot entry = *slot;
+		slot->state = DEDUP_EMPTY;
+		*dedupFind(entry.ref.fp) = entry;
+	}
+
+	statsCount(STATS_CTR_dedup_table_pruned, pruned);
+	LOG_STATUS(NULL, "Dedup: the fingerprint table is full.  Forgot %zu chunks seen once.", pruned);
+	return pruned;
+}
+
+/* Add a fingerprint to the table, pruning it if it's full.  Call with
+ * dedupLock held.
+ *
+ * Returns the slot, or NULL if the table is full (of chunks in the store).
+ */
+static struct dedup_slot *dedupInsert(const unsigned char *fp)
+{
+	struct dedup_slot *slot = dedupFind(fp);
+	if(slot->state != DEDUP_EMPTY)
+		return slot;
+	if(dedupUsed >= dedupMax) {
+		if(dedupPrune() == 0) {
+			statsCount(STATS_CTR_dedup_table_full, 1);
+			return NULL;
+		}
+		slot = dedupFind(fp);
+	}
+	memcpy(slot->ref.fp, fp, DEDUP_FP_SZ);
+	slot->state = DEDUP_SEEN;
+	slot->seen.gen = dedupGen;
+	dedupUsed++;
+	return slot;
+}
+
+static void dedupPackName(char *name, size_t size, uint64_t id, const char *suffix)
+{
+	snprintf(name, size, "%016" PRIx64 ".%s", id, suffix);
+}
+
+/* Make the pack that we're adding to stable.  Call with dedupPackLock
+ * held. */
+static int dedupSyncPack(void)
+{
+	if(dedupPackFd == -1)
+		return 0;
+	if((STATS_BACKEND(fdatasync(dedupPackFd)) == -1) ||
+	   (STATS_BACKEND(fdatasync(dedupIdxFd)) == -1))
+		return errno;
+	__atomic_store_n(&dedupSyncedSeq, dedupAddSeq, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Start a new pack.  The old one is made stable first, since dedupSync()
+ * only syncs the new one.  Call with dedupPackLock held. */
+static int dedupNewPack(void)
+{
+	if(dedupPackFd != -1) {
+		int error = dedupSyncPack();
+		if(error != 0)
+			return error;
+		close(dedupPackFd);
+		close(dedupIdxFd);
+		dedupPackFd = -1;
+		dedupIdxFd = -1;
+	}
+
+	uint64_t id;
+	if(RAND_bytes((unsigned char *) &id, sizeof(id)) != 1)
+		return EIO;
+
+	char name[32];
+	dedupPackName(name, sizeof(name), id, "pack");
+	int packFd = STATS_BACKEND(openat(dedupDirFd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+	if(packFd == -1)
+		return errno;
+	dedupPackName(name, sizeof(name), id, "idx");
+	int idxFd = STATS_BACKEND(openat(dedupDirFd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+	if(idxFd == -1) {
+		int error = errno;
+		close(packFd);
+		return error;
+	}
+
+	LOG_STATUS(NULL, "Dedup: new pack %016" PRIx64 ".", id);
+	dedupPackId = id;
+	dedupPackFd = packFd;
+	dedupIdxFd = idxFd;
+	dedupPackOff = 0;
+	dedupIdxOff = 0;
+	return 0;
+}
+
+/* An fd for reading a pack.  They stay open until dedupDestroy().
+ *
+ * Returns -1 (and sets errno) on failure.
+ */
+static int dedupPackFdGet(uint64_t id)
+{
+	int fd = -1;
+	pthread_mutex_lock(&dedupFdLock);
+	do {
+		size_t i;
+		for(i = 0; i < dedupNumPacks; i++) {
+			if(dedupPacks[i].id == id)
+				break;
+		}
+		if(i < dedupNumPacks) {
+			fd = dedupPacks[i].fd;
+			break;
+		}
+
+		struct dedup_pack *packs = realloc(dedupPacks, (dedupNumPacks + 1) * sizeof(*packs));
+		if(packs == NULL) {
+			errno = ENOMEM;
+			break;
+		}
+		dedupPacks = packs;
+
+		char name[32];
+		dedupPackName(name, sizeof(name), id, "pack");
+		fd = STATS_BACKEND(openat(dedupDirFd, name, O_RDONLY | O_CLOEXEC));
+		if(fd == -1) {
+			LOG_ERROR(NULL, "openat(%s) failed (%m).", name);
+			break;
+		}
+		dedupPacks[dedupNumPacks].id = id;
+		dedupPacks[dedupNumPacks].fd = fd;
+		dedupNumPacks++;
+	} while(0);
+	pthread_mutex_unlock(&dedupFdLock);
+	return fd;
+}
+
+/* Is name a pack's index file?  If it is, *id is the pack's id. */
+static bool dedupIndexName(const char *name, uint64_t *id)
+{
+	char suffix[8];
+	return (strlen(name) == 20) && (sscanf(name, "%16" SCNx64 ".%3s", id, suffix) == 2) &&
+	       (strcmp(suffix, "idx") == 0);
+}
+
+/* Read one pack's index into the table.
+ *
+ * Returns the number of chunks, or -1 if the table filled up.
+ */
+static ssize_t dedupLoadIndex(const char *name)
+{
+	uint64_t id;
+	if(!dedupIndexName(name, &id))
+		return 0;
+
+	int fd = openat(dedupDirFd, name, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) {
+		LOG_ERROR(NULL, "openat(%s) failed (%m).", name);
+		return 0;
+	}
+
+	static struct dedup_ref refs[DEDUP_LOAD_BATCH];
+	ssize_t count = 0;
+	off_t off = 0;
+	for(;;) {
+		ssize_t n = pread(fd, refs, sizeof(refs), off);
+		if(n <= 0)
+			break;
+		off += n;
+
+		/* A record that was only partly written is at the very end. */
+		size_t i;
+		for(i = 0; i < n / sizeof(refs[0]); i++) {
+			if(refs[i].pack != id)
+				continue;
+			struct dedup_slot *slot = dedupInsert(refs[i].fp);
+			if(slot == NULL) {
+				close(fd);
+				return -1;
+			}
+			slot->ref = refs[i];
+			slot->state = DEDUP_STORED;
+			dedupStoreBytes += refs[i].len & ~DEDUP_RAW;
+			count++;
+		}
+		if(n % sizeof(refs[0]))
+			break;
+	}
+	close(fd);
+	return count;
+}
+
+/* Sort order for dedup_refs: by where the chunk is. */
+static int dedupRefCmp(const void *a, const void *b)
+{
+	const struct dedup_ref *x = a;
+	const struct dedup_ref *y = b;
+	if(x->pack != y->pack)
+		return (x->pack < y->pack) ? -1 : 1;
+	if(x->off != y->off)
+		return (x->off < y->off) ? -1 : 1;
+	return 0;
+}
+
+/* Sweep one pack (see dedupSweep()).  The index is written again first, with
+ * only the chunks that are still used, so a chunk that's punched out can't
+ * be found again.  If that's none of them, the pack is deleted.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int dedupSweepPack(int dirFd, uint64_t id, const struct dedup_ref *live, size_t numLive,
+                          uint64_t *chunks, uint64_t *bytes)
+{
+	char idxName[32];
+	char packName[32];
+	char tmpName[40];
+	dedupPackName(idxName, sizeof(idxName), id, "idx");
+	dedupPackName(packName, sizeof(packName), id, "pack");
+	snprintf(tmpName, sizeof(tmpName), "%s.tmp", idxName);
+
+	int idxFd = openat(dirFd, idxName, O_RDONLY | O_CLOEXEC);
+	if(idxFd == -1)
+		return errno;
+	int packFd = -1;
+	int tmpFd = -1;
+	struct dedup_ref *refs = NULL;
+	int error = 0;
+	do {
+		struct stat st;
+		if(fstat(idxFd, &st) == -1) {
+			error = errno;
+			break;
+		}
+
+		/* A record that was only partly written is at the very end. */
+		size_t num = st.st_size / sizeof(*refs);
+		refs = malloc((num > 0) ? num * sizeof(*refs) : 1);
+		if(refs == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		if(pread(idxFd, refs, num * sizeof(*refs), 0) != (ssize_t) (num * sizeof(*refs))) {
+			error = EIO;
+			break;
+		}
+
+		/* Keep the ones in use at the front.  The rest get punched
+		 * out once the new index is in place. */
+		size_t kept = 0;
+		size_t i;
+		for(i = 0; i < num; i++) {
+			if((refs[i].pack == id) &&
+			   (bsearch(&refs[i], live, numLive, sizeof(*live), dedupRefCmp) != NULL)) {
+				struct dedup_ref ref = refs[i];
+				refs[i] = refs[kept];
+				refs[kept++] = ref;
+			}
+		}
+		if(kept == num)
+			break;
+
+		if(kept == 0) {
+			if((unlinkat(dirFd, idxName, 0) == -1) || (unlinkat(dirFd, packName, 0) == -1))
+				error = errno;
+		}
+		else {
+			tmpFd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+			packFd = openat(dirFd, packName, O_RDWR | O_CLOEXEC);
+			if((tmpFd == -1) || (packFd == -1)) {
+				error = errno;
+				break;
+			}
+			error = dedupWriteFull(tmpFd, refs, kept * sizeof(*refs), 0);
+			if((error == 0) && (fsync(tmpFd) == -1))
+				error = errno;
+			if((error == 0) && (renameat(dirFd, tmpName, dirFd, idxName) == -1))
+				error = errno;
+			if(error != 0) {
+				unlinkat(dirFd, tmpName, 0);
+				break;
+			}
+		}
+
+		for(i = kept; i < num; i++) {
+			if(refs[i].pack != id)
+				continue;
+			uint64_t len = refs[i].len & ~DEDUP_RAW;
+			if(packFd != -1)
+				(void) fallocate(packFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				                 refs[i].off, len);
+			(*chunks)++;
+			*bytes += len;
+		}
+	} while(0);
+
+	if(tmpFd != -1)
+		close(tmpFd);
+	if(packFd != -1)
+		close(packFd);
+	close(idxFd);
+	free(refs);
+	return error;
+}
+
+/* Read every pack's index. */
+static void dedupLoad(void)
+{
+	int fd = dup(dedupDirFd);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if(dir == NULL) {
+		LOG_ERROR(NULL, "Can't list the chunk store (%m).");
+		if(fd != -1)
+			close(fd);
+		return;
+	}
+
+	size_t packs = 0;
+	size_t chunks = 0;
+	struct dirent *de;
+	while((de = readdir(dir)) != NULL) {
+		ssize_t n = dedupLoadIndex(de->d_name);
+		if(n == -1) {
+			LOG_ERROR(NULL, "Dedup: the fingerprint table is full.  Not loading the rest of the store.");
+			break;
+		}
+		if(n > 0) {
+			packs++;
+			chunks += n;
+		}
+	}
+	closedir(dir);
+	LOG_STATUS(NULL, "Dedup: loaded %zu chunks (%" PRIu64 " MB) from %zu packs.",
+	           chunks, dedupStoreBytes / (1024 * 1024), packs);
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Open (or make) the chunk store, and load its indexes into a fingerprint
+ * table of up to budgetBytes.  The store takes no new chunks once its packs
+ * add up to storeMax bytes (0 = no limit).  dir NULL leaves dedup off.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int dedupInit(const char *dir, size_t budgetBytes, uint64_t storeMax)
+{
+	if(dir == NULL)
+		return 0;
+
+	if((mkdir(dir, 0700) == -1) && (errno != EEXIST))
+		return errno;
+	dedupDirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dedupDirFd == -1)
+		return errno;
+
+	/* A power of two, no more than three quarters full. */
+	size_t slots = 1024;
+	while(slots * 2 * sizeof(struct dedup_slot) <= budgetBytes)
+		slots *= 2;
+	dedupTable = calloc(slots, sizeof(struct dedup_slot));
+	if(dedupTable == NULL) {
+		close(dedupDirFd);
+		dedupDirFd = -1;
+		return ENOMEM;
+	}
+	dedupMask = slots - 1;
+	dedupMax = slots / 4 * 3;
+	dedupUsed = 0;
+	dedupStoreBytes = 0;
+	dedupStoreMax = storeMax;
+	dedupAddSeq = 0;
+	dedupSyncedSeq = 0;
+	dedupRepointHead = 0;
+	dedupRepointCount = 0;
+
+	dedupLoad();
+	dedupOn = true;
+	LOG_STATUS(NULL, "Dedup: store %s : table %zu MB (%zu chunks).",
+	           dir, slots * sizeof(struct dedup_slot) / (1024 * 1024), dedupMax);
+	return 0;
+}
+
+void dedupDestroy(void)
+{
+	if(dedupPackFd != -1) {
+		close(dedupPackFd);
+		close(dedupIdxFd);
+		dedupPackFd = -1;
+		dedupIdxFd = -1;
+	}
+	size_t i;
+	for(i = 0; i < dedupNumPacks; i++)
+		close(dedupPacks[i].fd);
+	free(dedupPacks);
+	dedupPacks = NULL;
+	dedupNumPacks = 0;
+	free(dedupTable);
+	dedupTable = NULL;
+	if(dedupDirFd != -1)
+		close(dedupDirFd);
+	dedupDirFd = -1;
+	dedupOn = false;
+}
+
+bool dedupEnabled(void)
+{
+	return dedupOn;
+}
+
+/* Is this chunk in the store?  ref->fp is always filled in.  The rest of ref
+ * is filled in if it's there.
+ *
+ * Returns:
+ *        0 = It's in the store.
+ *   ENOENT = It isn't.
+ *      !0 = errno of failure.
+ */
+int dedupLookup(const char *plain, size_t len, struct dedup_ref *ref)
+{
+	memset(ref, 0, sizeof(*ref));
+	if(dedupFingerprint(plain, len, ref->fp) != 0)
+		return EIO;
+
+	int error = ENOENT;
+	pthread_mutex_lock(&dedupLock);
+	struct dedup_slot *slot = dedupFind(ref->fp);
+	if(slot->state == DEDUP_STORED) {
+		*ref = slot->ref;
+		error = 0;
+	}
+	pthread_mutex_unlock(&dedupLock);
+
+	if(error == 0) {
+		statsCount(STATS_CTR_dedup_hits, 1);
+		statsCount(STATS_CTR_dedup_bytes_saved, len);
+	}
+	return error;
+}
+
+/* A chunk that dedupLookup() didn't find.  data is what would be written to
+ * the file's slot (len bytes, compressed by codec unless raw), and origin is
+ * where that slot is.  The first time we see it, we just remember it, and
+ * where it went.  The second time, it goes into the store, ref says where,
+ * and the first copy is queued up for dedupRepointNext().
+ *
+ * Returns:
+ *        0 = It's in the store.  Write ref instead of the data.
+ *   ENOENT = It isn't.  Write the data.
+ *      !0 = errno of failure.
+ */
+int dedupAdd(struct dedup_ref *ref, const char *data, size_t len, bool raw, uint8_t codec,
+             const struct dedup_origin *origin)
+{
+	struct dedup_origin first = { 0 };
+	pthread_mutex_lock(&dedupLock);
+	struct dedup_slot *slot = dedupFind(ref->fp);
+	int state = slot->state;
+	if(state == DEDUP_EMPTY) {
+		slot = dedupInsert(ref->fp);
+		if(slot != NULL)
+			slot->seen.origin = *origin;
+	}
+	else if(state == DEDUP_STORED) {
+		*ref = slot->ref;
+	}
+	else if(state == DEDUP_SEEN) {
+		first = slot->seen.origin;
+		slot->state = DEDUP_STORING;
+	}
+	pthread_mutex_unlock(&dedupLock);
+
+	/* The first time (or the table is full), or somebody else is
+	 * storing it right now. */
+	if(state == DEDUP_STORED)
+		return 0;
+	if(state != DEDUP_SEEN)
+		return ENOENT;
+
+	/* Second time.  Put it in the store. */
+	ref->len = len | (raw ? DEDUP_RAW : 0);
+	ref->crc = crc32(0, (const Bytef *) data, len);
+	ref->codec = codec;
+
+	pthread_mutex_lock(&dedupPackLock);
+	int error = 0;
+	if((dedupStoreMax != 0) && (dedupStoreBytes + len > dedupStoreMax))
+		error = ENOSPC;
+	else if((dedupPackFd == -1) || (dedupPackOff + len > DEDUP_PACK_MAX))
+		error = dedupNewPack();
+	if(error == 0) {
+		ref->pack = dedupPackId;
+		ref->off = dedupPackOff;
+		error = dedupWriteFull(dedupPackFd, data, len, dedupPackOff);
+	}
+	if(error == 0)
+		error = dedupWriteFull(dedupIdxFd, ref, sizeof(*ref), dedupIdxOff);
+	if(error == 0) {
+		dedupPackOff += len;
+		dedupIdxOff += sizeof(*ref);
+		dedupStoreBytes += len;
+		__atomic_store_n(&dedupAddSeq, dedupAddSeq + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&dedupPackLock);
+
+	/* Nobody else touches a slot that's STORING, and a prune keeps it,
+	 * so its origin is still there if it goes back to SEEN.  It may have
+	 * moved, though. */
+	bool queued = false;
+	pthread_mutex_lock(&dedupLock);
+	slot = dedupFind(ref->fp);
+	if(error == 0) {
+		slot->ref = *ref;
+		slot->state = DEDUP_STORED;
+		if(dedupRepointCount < DEDUP_REPOINT_MAX) {
+			struct dedup_repoint *r = &dedupRepoints[(dedupRepointHead + dedupRepointCount) %
+			                                         DEDUP_REPOINT_MAX];
+			r->origin = first;
+			r->ref = *ref;
+			dedupRepointCount++;
+			queued = true;
+		}
+	}
+	else {
+		slot->state = DEDUP_SEEN;
+	}
+	pthread_mutex_unlock(&dedupLock);
+
+	if(error == ENOSPC) {
+		statsCount(STATS_CTR_dedup_store_full, 1);
+		return ENOENT;
+	}
+	if(error != 0) {
+		LOG_ERROR(NULL, "Adding a chunk to the store failed (%d).", error);
+		return ENOENT;
+	}
+	if(!queued)
+		statsCount(STATS_CTR_dedup_repoint_skipped, 1);
+	statsCount(STATS_CTR_dedup_stored_chunks, 1);
+	statsCount(STATS_CTR_dedup_stored_bytes, len);
+	return 0;
+}
+
+/* The next first copy of a chunk that has gone into the store.  Its slot
+ * should get ref, if it still holds that chunk (see dedupMatches()).
+ *
+ * Returns false if there aren't any.
+ */
+bool dedupRepointNext(struct dedup_origin *origin, struct dedup_ref *ref)
+{
+	bool found = false;
+	pthread_mutex_lock(&dedupLock);
+	if(dedupRepointCount > 0) {
+		*origin = dedupRepoints[dedupRepointHead].origin;
+		*ref = dedupRepoints[dedupRepointHead].ref;
+		dedupRepointHead = (dedupRepointHead + 1) % DEDUP_REPOINT_MAX;
+		dedupRepointCount--;
+		found = true;
+	}
+	pthread_mutex_unlock(&dedupLock);
+	return found;
+}
+
+/* Is the plain chunk the one that ref points at? */
+bool dedupMatches(const char *plain, size_t len, const struct dedup_ref *ref)
+{
+	unsigned char fp[DEDUP_FP_SZ];
+	return (dedupFingerprint(plain, len, fp) == 0) &&
+	       (memcmp(fp, ref->fp, DEDUP_FP_SZ) == 0);
+}
+
+/* Read a chunk's stored bytes (ref->len of them) from the store.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int dedupRead(const struct dedup_ref *ref, char *buf)
+{
+	if(!dedupOn) {
+		LOG_ERROR(NULL, "A file points into the chunk store, and PROXY_BRIDGE_DEDUP isn't set.");
+		return EIO;
+	}
+
+	int fd = dedupPackFdGet(ref->pack);
+	if(fd == -1)
+		return errno;
+
+	size_t len = ref->len & ~DEDUP_RAW;
+	size_t total = 0;
+	while(total < len) {
+		ssize_t n = STATS_BACKEND(pread(fd, buf + total, len - total, ref->off + total));
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		if(n == 0)
+			break;
+		total += n;
+	}
+	if((total != len) || (crc32(0, (const Bytef *) buf, len) != ref->crc)) {
+		LOG_ERROR(NULL, "Chunk at %016" PRIx64 ":%" PRIu64 " is bad.", ref->pack, ref->off);
+		return EIO;
+	}
+	return 0;
+}
+
+/* How many chunks have been added to the store.  A file whose slots point
+ * into the store remembers this after it writes them, and passes it to
+ * dedupSync() when it's fsync()ed. */
+uint64_t dedupAdded(void)
+{
+	return __atomic_load_n(&dedupAddSeq, __ATOMIC_ACQUIRE);
+}
+
+/* Make the store's first upTo chunks stable (see dedupAdded()).  A file's
+ * fsync() has to do this too, since its slots can point at them.  If they
+ * already are, the backend isn't asked.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int dedupSync(uint64_t upTo)
+{
+	if(__atomic_load_n(&dedupSyncedSeq, __ATOMIC_ACQUIRE) >= upTo)
+		return 0;
+
+	int error = 0;
+	pthread_mutex_lock(&dedupPackLock);
+	if(dedupSyncedSeq < upTo)
+		error = dedupSyncPack();
+	pthread_mutex_unlock(&dedupPackLock);
+	return error;
+}
+
+/* Give back the chunks in the store in dir that nothing uses any more, for
+ * proxy_dedup_sweep.  live is every dedup_ref that's in a file (see
+ * compressRefs()), and gets sorted.  Nothing else can be using the store,
+ * and dedup has to be off in this process.  *chunks and *bytes are the
+ * chunks (and their stored bytes) that were given back.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of the first failure.  The rest of the packs are still swept.
+ */
+int dedupSweep(const char *dir, struct dedup_ref *live, size_t numLive,
+               uint64_t *chunks, uint64_t *bytes)
+{
+	*chunks = 0;
+	*bytes = 0;
+	if(dedupOn)
+		return EBUSY;
+	qsort(live, numLive, sizeof(*live), dedupRefCmp);
+
+	int dirFd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirFd == -1)
+		return errno;
+	int fd = dup(dirFd);
+	DIR *d = (fd == -1) ? NULL : fdopendir(fd);
+	if(d == NULL) {
+		int error = errno;
+		if(fd != -1)
+			close(fd);
+		close(dirFd);
+		return error;
+	}
+
+	int error = 0;
+	struct dirent *de;
+	while((de = readdir(d)) != NULL) {
+		uint64_t id;
+		if(!dedupIndexName(de->d_name, &id))
+			continue;
+		int res = dedupSweepPack(dirFd, id, live, numLive, chunks, bytes);
+		if(res != 0) {
+			LOG_ERROR(NULL, "Sweeping pack %016" PRIx64 " failed (%d).", id, res);
+			if(error == 0)
+				error = res;
+		}
+	}
+	closedir(d);
+	close(dirFd);
+	return error;
+}
+
+/* Gauge callback for the stats exporter. */
+double dedupEntries(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&dedupLock);
+	double res = dedupUsed;
+	pthread_mutex_unlock(&dedupLock);
+	return res;
+}
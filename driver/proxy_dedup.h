@@ -0,0 +1,109 @@
+/* *****************************************************************************
+ * Chunk deduplication.
+ *
+ * With PROXY_BRIDGE_DEDUP set to a directory on the backend (the chunk store),
+ * chunks of file data that we've seen before aren't sent to the NAS again.
+ * It works on the chunks of the compressed file layout (see proxy_compress.h),
+ * so it needs PROXY_BRIDGE_COMPRESS (the "none" codec dedups without
+ * compressing).  The store isn't encrypted, so it can't be used with
+ * PROXY_BRIDGE_KEY_FILE.
+ *
+ * Those chunks are fixed: 64 KB (COMPRESS_CHUNK_SZ) at a time, from the start
+ * of the file.  So data is only found again at the same offset in its 64 KB
+ * chunk.  Whole files that are copied, and files that are changed in place,
+ * dedup well, but bytes inserted into the middle of a file move everything
+ * after them, and nothing after that matches.  Content-defined chunks would
+ * find those too, but their edges aren't at fixed offsets, and the compressed
+ * layout needs them to be, so that any byte of a file can be found without
+ * reading the ones in front of it.
+ *
+ * Every chunk that's written is fingerprinted (SHA-256).  The first time a
+ * fingerprint turns up, the chunk is written to its file's slot like always,
+ * and the fingerprint is remembered, with where that first copy is (a
+ * dedup_origin).  The second time, the chunk goes into the store, and the
+ * file's slot gets a dedup_ref instead of the data.  The first copy is then
+ * moved over to a dedup_ref too (dedupRepointNext() hands them out once the
+ * write that stored the chunk has let go of its file), so a shared chunk
+ * is only on the NAS once.  From then on, every file that writes that chunk
+ * only writes the dedup_ref.  So only chunks that really are shared end up
+ * in the store.  The first copy is only moved if its file is still in the
+ * inode table and its slot still holds the same chunk; otherwise it stays
+ * where it is.
+ *
+ * The store is a directory of pack files, each with an index file next to it.
+ * A pack holds chunks (compressed, as the file's codec left them), back to
+ * back.  Its index holds a dedup_ref for each one.  Each run of the proxy
+ * starts a new pack with a random name, so more than one proxy can share a
+ * store.  When the proxy starts, it reads the index files into the
+ * fingerprint table (PROXY_BRIDGE_DEDUP_MB of memory, default 256 MB).  When
+ * the table is full of chunks that are in the store, new chunks just aren't
+ * deduplicated.
+ *
+ * A dedup_ref says where its chunk is, so reads don't need the table.  They
+ * do need the store, so a proxy for an export that has used dedup has to keep
+ * PROXY_BRIDGE_DEDUP set.
+ *
+ * Chunks in the store aren't reference counted while the driver runs (a
+ * count would have to stay in step with every file's index, across crashes,
+ * and for every proxy sharing the store), so a chunk stays in the store when
+ * the last file that used it is rewritten, truncated or deleted.
+ * proxy_dedup_sweep gives their space back, with the drivers stopped: it
+ * lists the chunks that the files in the exports point at (compressRefs()),
+ * and takes the rest out of the packs (dedupSweep()).  Between sweeps, the
+ * store stops taking new chunks when it gets to PROXY_BRIDGE_DEDUP_STORE_GB
+ * (default 64 GB, 0 = no limit).  After that, new chunks are just written to
+ * their files.
+ *
+ * Fingerprints that have only been seen once (first copies) come and go.
+ * When the table fills up, the ones that haven't been seen a second time
+ * since it last filled up are forgotten, to make room for new ones.
+ * ****************************************************************************/
+
+#ifndef PROXY_DEDUP_H
+#define PROXY_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_FP_SZ (32)
+
+/* In dedup_ref.len: the chunk is stored as is. */
+#define DEDUP_RAW   (0x80000000u)
+
+/* Where a chunk is in the store.  This is what a slot holds instead of the
+ * chunk, and what the pack indexes hold. */
+struct dedup_ref {
+	unsigned char fp[DEDUP_FP_SZ]; /* SHA-256 of the plain chunk. */
+	uint64_t pack;            /* Pack id (its file name, in hex). */
+	uint64_t off;             /* Where the chunk starts in the pack. */
+	uint32_t len;             /* Stored bytes, | DEDUP_RAW. */
+	uint32_t crc;             /* CRC-32 of the stored bytes. */
+	uint8_t codec;            /* What compressed it.  See proxy_compress.c. */
+	uint8_t pad[7];
+};
+
+/* Where the first copy of a chunk is, until it goes into the store. */
+struct dedup_origin {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t chunk;           /* Chunk number in the file. */
+};
+
+int dedupInit(const char *dir, size_t budgetBytes, uint64_t storeMax);
+void dedupDestroy(void);
+bool dedupEnabled(void);
+
+int dedupLookup(const char *plain, size_t len, struct dedup_ref *ref);
+int dedupAdd(struct dedup_ref *ref, const char *data, size_t len, bool raw, uint8_t codec,
+             const struct dedup_origin *origin);
+bool dedupRepointNext(struct dedup_origin *origin, struct dedup_ref *ref);
+bool dedupMatches(const char *plain, size_t len, const struct dedup_ref *ref);
+int dedupRead(const struct dedup_ref *ref, char *buf);
+uint64_t dedupAdded(void);
+int dedupSync(uint64_t upTo);
+int dedupSweep(const char *dir, struct dedup_ref *live, size_t numLive,
+               uint64_t *chunks, uint64_t *bytes);
+double dedupEntries(void *arg);
+
+#endif /* PROXY_DEDUP_H */
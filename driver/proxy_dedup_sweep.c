@@ -0,0 +1,155 @@
+/* *****************************************************************************
+ * proxy_dedup_sweep - Give back the space of the chunks in a dedup chunk store
+ * (PROXY_BRIDGE_DEDUP) that no file uses any more.
+ *
+ *   proxy_dedup_sweep <chunk store> <export> [<export> ...]
+ *
+ * The driver doesn't keep count of the files that point at a chunk in the
+ * store (see proxy_dedup.h), so a chunk stays when the last of them is
+ * rewritten, truncated or deleted.  This finds them: it reads every
+ * compressed file's index in the exports, and makes a list of the chunks
+ * that their dedup_refs point at.  Then each pack's index is written again
+ * with only those, and the rest of the pack's chunks are punched out (a pack
+ * that has none of them left is deleted).  They stop counting towards
+ * PROXY_BRIDGE_DEDUP_STORE_GB, and their fingerprints don't take up room in
+ * the table, the next time the driver starts.
+ *
+ * Run it with every driver that uses the store stopped, after a clean stop
+ * (with nothing left in their journals), and give it every export that uses
+ * the store, or the chunks of the ones that are left out are lost.  If a
+ * file can't be read, nothing is swept.  If it stops part way, a pack's
+ * index is either old or new, and running it again carries on, but the
+ * chunks it had taken out of an index and not punched out yet stay where
+ * they are.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "proxy_compress.h"
+#include "proxy_dedup.h"
+#include "proxy_log.h"
+
+/* Every dedup_ref in the exports. */
+static struct dedup_ref *liveRefs = NULL;
+static size_t numLive = 0;
+static size_t maxLive = 0;
+
+/* The store, so the walk doesn't go into it. */
+static struct stat storeSt;
+
+static size_t numFiles = 0;
+static size_t numFailed = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS
+ * ****************************************************************************/
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <chunk store> <export> [<export> ...]\n", prog);
+	exit(2);
+}
+
+/* compressRefs() callback.  Remember a chunk that's in use. */
+static int addRef(const struct dedup_ref *ref, void *arg)
+{
+	(void) arg;
+
+	if(numLive == maxLive) {
+		size_t num = (maxLive == 0) ? 4096 : maxLive * 2;
+		struct dedup_ref *refs = realloc(liveRefs, num * sizeof(*refs));
+		if(refs == NULL)
+			return ENOMEM;
+		liveRefs = refs;
+		maxLive = num;
+	}
+	liveRefs[numLive++] = *ref;
+	return 0;
+}
+
+/* nftw() callback.  List the chunks that each compressed file uses. */
+static int sweepVisit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) ftw;
+
+	if((type == FTW_D) && (st->st_dev == storeSt.st_dev) && (st->st_ino == storeSt.st_ino))
+		return FTW_SKIP_SUBTREE;
+	if((type == FTW_DNR) || (type == FTW_NS)) {
+		fprintf(stderr, "%s: can't be read.\n", path);
+		numFailed++;
+		return FTW_CONTINUE;
+	}
+	if((type != FTW_F) || !S_ISREG(st->st_mode) || (st->st_size == 0))
+		return FTW_CONTINUE;
+
+	int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	int error = (fd == -1) ? errno : compressRefs(fd, addRef, NULL);
+	if(fd != -1)
+		close(fd);
+
+	/* A file that isn't compressed doesn't use the store. */
+	if(error == 0) {
+		numFiles++;
+	}
+	else if(error != EINVAL) {
+		fprintf(stderr, "%s: %s.\n", path, strerror(error));
+		numFailed++;
+	}
+	return FTW_CONTINUE;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS
+ * ****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	if(argc < 3)
+		usage(argv[0]);
+
+	const char *store = argv[1];
+	logInit(LOG_ERR, 0);
+	if(stat(store, &storeSt) == -1) {
+		fprintf(stderr, "%s: %s\n", store, strerror(errno));
+		return 1;
+	}
+
+	int i;
+	for(i = 2; i < argc; i++) {
+		if(nftw(argv[i], sweepVisit, 64, FTW_PHYS | FTW_MOUNT | FTW_ACTIONRETVAL) == -1) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return 1;
+		}
+	}
+
+	/* A file that couldn't be read may point at chunks that would look
+	 * unused. */
+	if(numFailed > 0) {
+		fprintf(stderr, "%zu files couldn't be read.  Nothing was swept.\n", numFailed);
+		return 1;
+	}
+
+	uint64_t chunks, bytes;
+	int error = dedupSweep(store, liveRefs, numLive, &chunks, &bytes);
+	printf("%zu compressed files use %zu chunks.  Gave back %llu chunks (%llu MB).\n",
+	       numFiles, numLive, (unsigned long long) chunks,
+	       (unsigned long long) (bytes / (1024 * 1024)));
+	free(liveRefs);
+	if(error != 0) {
+		fprintf(stderr, "%s: %s\n", store, strerror(error));
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,444 @@
+/* *****************************************************************************
+ * Backend emulation.  See proxy_emulate.h for the settings.
+ *
+ * STATS_BACKEND() calls emulateBefore() and emulateAfter() around every
+ * backend call when the emulator is on.  Each call site works out its class
+ * once, from the text of the call, and remembers it in a static.
+ *
+ * A link (one for reads, one for writes) is a pipe that carries one transfer
+ * at a time: each transfer starts when the link is next free, and its caller
+ * sleeps until its last byte is through.  Bytes that are known up front (a
+ * read that fuse_reply_data() is about to send) are charged before the call,
+ * so the reply waits for them.  Otherwise the call's result is the byte
+ * count, and it's charged afterwards.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <sys/prctl.h>
+
+#include "proxy_emulate.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+enum emulate_class {
+	EMULATE_OPEN,
+	EMULATE_STAT,
+	EMULATE_READ,
+	EMULATE_WRITE,
+	EMULATE_SYNC,
+	EMULATE_READDIR,
+	EMULATE_META,
+	EMULATE_MAX,
+	EMULATE_NONE = -1,        /* Not charged at all. */
+};
+
+enum emulate_dist {
+	EMULATE_FIXED,
+	EMULATE_UNIFORM,
+	EMULATE_NORMAL,
+	EMULATE_EXP,
+};
+
+static const char *classNames[EMULATE_MAX] = {
+	"open", "stat", "read", "write", "sync", "readdir", "meta",
+};
+
+static const char *distNames[] = {
+	"fixed", "uniform", "normal", "exp",
+};
+
+/* Which class each backend call is in.  Anything not here is meta. */
+static const struct {
+	const char *name;
+	int cls;
+} emulateCalls[] = {
+	{ "open",              EMULATE_OPEN },
+	{ "openat",            EMULATE_OPEN },
+	{ "open_by_handle_at", EMULATE_OPEN },
+	{ "fstatat",           EMULATE_STAT },
+	{ "fstat",             EMULATE_STAT },
+	{ "fstatvfs",          EMULATE_STAT },
+	{ "pread",             EMULATE_READ },
+	{ "fuse_reply_data",   EMULATE_READ },
+	{ "pwrite",            EMULATE_WRITE },
+	{ "fuse_buf_copy",     EMULATE_WRITE },
+	{ "journalPwrite",     EMULATE_WRITE },
+	{ "fsync",             EMULATE_SYNC },
+	{ "fdatasync",         EMULATE_SYNC },
+	{ "readdir",           EMULATE_READDIR },
+	{ "closedir",          EMULATE_NONE },
+};
+
+/* The presets.  Rough numbers for NFS to a filer on the same 10G LAN, and to
+ * one in another region. */
+static const struct {
+	const char *name;
+	const char *spec;
+} presets[] = {
+	{ "lan", "open=300us:normal:50us,stat=200us:normal:50us,read=250us:normal:50us,"
+	         "write=300us:normal:60us,sync=2ms:exp,readdir=400us:normal:100us,"
+	         "meta=500us:normal:100us,readbw=1100,writebw=1100,slots=128" },
+	{ "wan", "open=20ms:normal:2ms,stat=20ms:normal:2ms,read=20ms:normal:2ms,"
+	         "write=21ms:normal:2ms,sync=40ms:exp,readdir=25ms:normal:3ms,"
+	         "meta=22ms:normal:2ms,readbw=100,writebw=50,slots=64" },
+};
+
+struct emulate_latency {
+	uint64_t ns;              /* Fixed, uniform and normal: the middle.  Exp: the mean. */
+	uint64_t spread;
+	int dist;
+};
+
+struct emulate_link {
+	pthread_mutex_t lock;
+	uint64_t bytesPerSec;     /* 0 = no limit. */
+	uint64_t freeAt;          /* When the last transfer is through (statsNow()). */
+};
+
+static struct {
+	bool enabled;
+	struct emulate_latency latency[EMULATE_MAX];
+	struct emulate_link read;
+	struct emulate_link write;
+	pthread_mutex_t slotLock;
+	pthread_cond_t slotFree;
+	int slots;                /* 0 = no limit. */
+	int inFlight;
+} emu = {
+	.read = { .lock = PTHREAD_MUTEX_INITIALIZER },
+	.write = { .lock = PTHREAD_MUTEX_INITIALIZER },
+	.slotLock = PTHREAD_MUTEX_INITIALIZER,
+	.slotFree = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread uint64_t myRandom = 0;
+static __thread unsigned myReaddirs = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS
+ * ****************************************************************************/
+
+/* A random number in (0, 1].  xorshift64*, one per thread. */
+static double emulateRandom(void)
+{
+	myRandom ^= myRandom >> 12;
+	myRandom ^= myRandom << 25;
+	myRandom ^= myRandom >> 27;
+	return ((double) ((myRandom * 0x2545f4914f6cdd1dULL) >> 11) + 1.0) / 9007199254740992.0;
+}
+
+static uint64_t emulatePick(const struct emulate_latency *l)
+{
+	double ns = (double) l->ns;
+	switch(l->dist) {
+	case EMULATE_UNIFORM:
+		ns += (2.0 * emulateRandom() - 1.0) * (double) l->spread;
+		break;
+	case EMULATE_NORMAL:
+		/* Box-Muller. */
+		ns += sqrt(-2.0 * log(emulateRandom())) * cos(2.0 * M_PI * emulateRandom()) * (double) l->spread;
+		break;
+	case EMULATE_EXP:
+		ns *= -log(emulateRandom());
+		break;
+	}
+	return (ns > 0.0) ? (uint64_t) ns : 0;
+}
+
+static void emulateSleepUntil(uint64_t when)
+{
+	struct timespec ts = {
+		.tv_sec = when / 1000000000ULL,
+		.tv_nsec = when % 1000000000ULL,
+	};
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Put bytes through a link, and wait until they're through. */
+static void emulateTransfer(struct emulate_link *link, int64_t bytes)
+{
+	if((link->bytesPerSec == 0) || (bytes <= 0))
+		return;
+
+	uint64_t now = statsNow();
+	pthread_mutex_lock(&link->lock);
+	uint64_t start = (link->freeAt > now) ? link->freeAt : now;
+	link->freeAt = start + ((uint64_t) bytes * 1000000000ULL) / link->bytesPerSec;
+	uint64_t done = link->freeAt;
+	pthread_mutex_unlock(&link->lock);
+
+	emulateSleepUntil(done);
+}
+
+/* Which class a call is in, from its text, e.g. "pread(fd, buf, size, off)". */
+static int emulateClassify(const char *call)
+{
+	size_t len = strcspn(call, "( \t");
+	size_t i;
+	for(i = 0; i < sizeof(emulateCalls) / sizeof(emulateCalls[0]); i++) {
+		if((strlen(emulateCalls[i].name) == len) && (strncmp(emulateCalls[i].name, call, len) == 0))
+			return emulateCalls[i].cls;
+	}
+	return EMULATE_META;
+}
+
+/* A latency, e.g. "250us", "1.5ms" or "300" (us).
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int emulateParseTime(const char *str, uint64_t *ns)
+{
+	char *end;
+	double val = strtod(str, &end);
+	if((end == str) || (val < 0))
+		return EINVAL;
+
+	double scale;
+	if(strcmp(end, "ns") == 0)
+		scale = 1.0;
+	else if((strcmp(end, "us") == 0) || (*end == '\0'))
+		scale = 1000.0;
+	else if(strcmp(end, "ms") == 0)
+		scale = 1000000.0;
+	else if(strcmp(end, "s") == 0)
+		scale = 1000000000.0;
+	else
+		return EINVAL;
+
+	*ns = (uint64_t) (val * scale);
+	return 0;
+}
+
+/* A class's setting: <latency>[:<dist>[:<spread>]].
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int emulateParseLatency(char *str, struct emulate_latency *l)
+{
+	char *save;
+	char *lat = strtok_r(str, ":", &save);
+	char *dist = strtok_r(NULL, ":", &save);
+	char *spread = strtok_r(NULL, ":", &save);
+	if((lat == NULL) || (strtok_r(NULL, ":", &save) != NULL))
+		return EINVAL;
+
+	struct emulate_latency new = { .dist = EMULATE_FIXED };
+	if(emulateParseTime(lat, &new.ns) != 0)
+		return EINVAL;
+
+	if(dist != NULL) {
+		size_t i;
+		for(i = 0; i < sizeof(distNames) / sizeof(distNames[0]); i++) {
+			if(strcasecmp(dist, distNames[i]) == 0)
+				break;
+		}
+		if(i == sizeof(distNames) / sizeof(distNames[0]))
+			return EINVAL;
+		new.dist = (int) i;
+	}
+
+	/* uniform and normal need to be told how far to stray. */
+	if((new.dist == EMULATE_UNIFORM) || (new.dist == EMULATE_NORMAL)) {
+		if((spread == NULL) || (emulateParseTime(spread, &new.spread) != 0))
+			return EINVAL;
+	} else if(spread != NULL) {
+		return EINVAL;
+	}
+
+	*l = new;
+	return 0;
+}
+
+static int emulateParseCount(const char *str, uint64_t *val)
+{
+	char *end;
+	unsigned long long n = strtoull(str, &end, 10);
+	if((end == str) || (*end != '\0') || (*str == '-'))
+		return EINVAL;
+	*val = n;
+	return 0;
+}
+
+/* Apply one comma separated setting.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int emulateParse(const char *spec, bool presetAllowed)
+{
+	char *copy = strdup(spec);
+	if(copy == NULL)
+		return ENOMEM;
+
+	int error = 0;
+	char *save;
+	char *item;
+	bool first = true;
+	for(item = strtok_r(copy, ",", &save); (item != NULL) && (error == 0);
+	    item = strtok_r(NULL, ",", &save), first = false) {
+		char *value = strchr(item, '=');
+
+		if(value == NULL) {
+			/* Only the first thing may be a preset. */
+			error = EINVAL;
+			size_t i;
+			for(i = 0; presetAllowed && first && (i < sizeof(presets) / sizeof(presets[0])); i++) {
+				if(strcmp(item, presets[i].name) == 0)
+					error = emulateParse(presets[i].spec, false);
+			}
+			continue;
+		}
+		*value++ = '\0';
+
+		uint64_t n = 0;
+		if(strcmp(item, "readbw") == 0) {
+			error = emulateParseCount(value, &n);
+			if(error == 0)
+				emu.read.bytesPerSec = n * 1024 * 1024;
+		} else if(strcmp(item, "writebw") == 0) {
+			error = emulateParseCount(value, &n);
+			if(error == 0)
+				emu.write.bytesPerSec = n * 1024 * 1024;
+		} else if(strcmp(item, "slots") == 0) {
+			error = emulateParseCount(value, &n);
+			if(error == 0)
+				emu.slots = (n > 1000000) ? 1000000 : (int) n;
+		} else {
+			error = EINVAL;
+			int c;
+			for(c = 0; c < EMULATE_MAX; c++) {
+				if(strcmp(item, classNames[c]) == 0)
+					error = emulateParseLatency(value, &emu.latency[c]);
+			}
+		}
+	}
+
+	free(copy);
+	return error;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS
+ * ****************************************************************************/
+
+/* Turn the emulator on (see proxy_emulate.h for what spec looks like).  NULL
+ * leaves it off.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+int emulateInit(const char *spec)
+{
+	if(spec == NULL)
+		return 0;
+
+	int error = emulateParse(spec, true);
+	if(error != 0)
+		return error;
+
+	char line[512];
+	size_t used = 0;
+	int c;
+	for(c = 0; c < EMULATE_MAX; c++) {
+		const struct emulate_latency *l = &emu.latency[c];
+		used += snprintf(line + used, sizeof(line) - used, "%s %gus%s%s",
+		                 classNames[c], l->ns / 1000.0,
+		                 (l->dist == EMULATE_FIXED) ? "" : " ", (l->dist == EMULATE_FIXED) ? "" : distNames[l->dist]);
+		if(l->spread != 0)
+			used += snprintf(line + used, sizeof(line) - used, " %gus", l->spread / 1000.0);
+		used += snprintf(line + used, sizeof(line) - used, " : ");
+	}
+	LOG_STATUS(NULL, "Emulating a NAS: %sread %llu MB/s : write %llu MB/s : %d slots (0 = no limit).", line,
+	           (unsigned long long) (emu.read.bytesPerSec / (1024 * 1024)),
+	           (unsigned long long) (emu.write.bytesPerSec / (1024 * 1024)), emu.slots);
+
+	emu.enabled = true;
+	return 0;
+}
+
+bool emulateEnabled(void)
+{
+	return emu.enabled;
+}
+
+/* Called by STATS_BACKEND() before a backend call.  Waits for a slot and
+ * sleeps for the call's latency.
+ *   site  - The call site's class, worked out on its first call.
+ *   call  - The text of the call.
+ *   bytes - Bytes that the call is known to move, or 0 if its result says.
+ * Returns the class to hand to emulateAfter(), or -1 (EMULATE_NONE) if the
+ * call isn't charged, and emulateAfter() mustn't be called. */
+int emulateBefore(int *site, const char *call, int64_t bytes)
+{
+	int cls = __atomic_load_n(site, __ATOMIC_RELAXED);
+	if(cls == EMULATE_UNCLASSIFIED) {
+		cls = emulateClassify(call);
+		__atomic_store_n(site, cls, __ATOMIC_RELAXED);
+	}
+
+	/* A listing comes back many entries at a time. */
+	if((cls == EMULATE_NONE) || ((cls == EMULATE_READDIR) && ((myReaddirs++ % EMULATE_READDIR_BATCH) != 0)))
+		return EMULATE_NONE;
+
+	if(myRandom == 0) {
+		/* The default 50us of timer slack would swamp the short
+		 * latencies, so this thread's sleeps are made accurate. */
+		prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+		myRandom = (statsNow() ^ ((uint64_t) pthread_self() * 0x9e3779b97f4a7c15ULL)) | 1;
+	}
+
+	uint64_t start = statsNow();
+	if(emu.slots > 0) {
+		pthread_mutex_lock(&emu.slotLock);
+		if(emu.inFlight >= emu.slots) {
+			statsCount(STATS_CTR_emulate_slot_waits, 1);
+			while(emu.inFlight >= emu.slots)
+				pthread_cond_wait(&emu.slotFree, &emu.slotLock);
+		}
+		emu.inFlight++;
+		pthread_mutex_unlock(&emu.slotLock);
+	}
+
+	uint64_t ns = emulatePick(&emu.latency[cls]);
+	if(ns > 0)
+		emulateSleepUntil(statsNow() + ns);
+
+	if(cls == EMULATE_READ)
+		emulateTransfer(&emu.read, bytes);
+	else if(cls == EMULATE_WRITE)
+		emulateTransfer(&emu.write, bytes);
+
+	statsCount(STATS_CTR_emulate_calls, 1);
+	statsCount(STATS_CTR_emulate_delay_ns, statsNow() - start);
+	return cls;
+}
+
+/* Called by STATS_BACKEND() after a backend call that emulateBefore()
+ * charged.  Waits for the bytes that it moved, and gives back its slot.
+ *   cls   - What emulateBefore() returned.
+ *   bytes - Bytes that the call moved (its result), or 0. */
+void emulateAfter(int cls, int64_t bytes)
+{
+	uint64_t start = statsNow();
+	if(cls == EMULATE_READ)
+		emulateTransfer(&emu.read, bytes);
+	else if(cls == EMULATE_WRITE)
+		emulateTransfer(&emu.write, bytes);
+
+	if(emu.slots > 0) {
+		pthread_mutex_lock(&emu.slotLock);
+		emu.inFlight--;
+		pthread_cond_signal(&emu.slotFree);
+		pthread_mutex_unlock(&emu.slotLock);
+	}
+	statsCount(STATS_CTR_emulate_delay_ns, statsNow() - start);
+}
@@ -0,0 +1,61 @@
+/* *****************************************************************************
+ * Backend emulation.
+ *
+ * A local disk answers in microseconds, so on a test box the block cache,
+ * write buffers, journal, readdirplus batching and so on hardly seem to do
+ * anything.  With PROXY_BRIDGE_EMULATE set, every STATS_BACKEND() call is
+ * made to look like a NAS call: it waits for a slot (a NAS only has so many
+ * calls in flight per client), sleeps for a latency picked from the call's
+ * class, makes the call, and then waits for its bytes to get through a link
+ * of limited bandwidth.
+ *
+ * The setting is a comma separated list.  It may start with a preset (lan or
+ * wan), and everything after that overrides the preset:
+ *   <class>=<latency>[:<dist>[:<spread>]]
+ *   readbw=<MB/s>   writebw=<MB/s>   slots=<n>
+ * The classes are:
+ *   open    - openat, open, open_by_handle_at.
+ *   stat    - fstatat, fstat, fstatvfs.
+ *   read    - pread, and the read that fuse_reply_data() does.
+ *   write   - pwrite, fuse_buf_copy, and journal destage writes.
+ *   sync    - fsync, fdatasync.
+ *   readdir - One listing round trip.  readdir() is called for each entry, so
+ *             only every EMULATE_READDIR_BATCH'th call of a thread is charged.
+ *   meta    - Everything else (mkdirat, unlinkat, renameat, chmod, truncate,
+ *             copy_file_range, ...).  closedir is never charged.
+ * A latency is a number with an optional ns, us, ms or s (default us).  The
+ * distributions are:
+ *   fixed   - Always the latency (the default).
+ *   uniform - Anywhere in latency +/- spread.
+ *   normal  - Mean latency, standard deviation spread (never below 0).
+ *   exp     - Exponential with mean latency.  Mostly fast, with a long tail.
+ * For example:
+ *   PROXY_BRIDGE_EMULATE=lan
+ *   PROXY_BRIDGE_EMULATE=wan,sync=40ms:exp,slots=16
+ *   PROXY_BRIDGE_EMULATE=stat=300us:normal:100us,read=1ms,readbw=100
+ * A class, bandwidth or slot limit that isn't given is free (0 = no limit).
+ *
+ * Only the calls that come through the driver can be slowed down.  Passthrough
+ * opens and the io_uring data path bypass STATS_BACKEND(), so the driver turns
+ * both off while it's emulating.
+ * ****************************************************************************/
+
+#ifndef PROXY_EMULATE_H
+#define PROXY_EMULATE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EMULATE_READDIR_BATCH (64)
+
+/* What a STATS_BACKEND() call site starts out as, before its first call
+ * works out which class it is. */
+#define EMULATE_UNCLASSIFIED (-2)
+
+int emulateInit(const char *spec);
+bool emulateEnabled(void);
+
+int emulateBefore(int *site, const char *call, int64_t bytes);
+void emulateAfter(int cls, int64_t bytes);
+
+#endif /* PROXY_EMULATE_H */
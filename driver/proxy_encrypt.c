@@ -0,0 +1,168 @@
+/* *****************************************************************************
+ * proxy_encrypt - Encrypt the plain files in an export, for
+ * PROXY_BRIDGE_KEY_FILE.
+ *
+ *   proxy_encrypt <key file> <export>
+ *
+ * The driver can't open a file that doesn't have its header (see
+ * proxy_crypt.h), so the files that were on the export before encryption was
+ * turned on have to be encrypted first.  Run this with the driver stopped
+ * (nothing else may be writing to the export), and with the same key file and
+ * build of the driver (the header size is a build switch).
+ *
+ * Each plain, non-empty regular file is encrypted into a new file in the same
+ * directory, which gets the original's owner, mode and times, and is then
+ * renamed over it.  If it stops part way, a file is either the old one or the
+ * new one, and running it again carries on (a .proxy_encrypt.* file that's
+ * left behind never got renamed, and can be deleted).  Encrypted and empty
+ * files are left alone.
+ *
+ * Not handled (they're listed, and left plain): files with more than one
+ * link (the rename would split them up), and files it can't read.  Extended
+ * attributes and ACLs aren't copied.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "proxy_crypt.h"
+#include "proxy_log.h"
+
+static size_t numEncrypted = 0;
+static size_t numSkipped = 0;
+static size_t numFailed = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS
+ * ****************************************************************************/
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s <key file> <export>\n", prog);
+	exit(2);
+}
+
+/* Encrypt one file, by way of a new file that's renamed over it.
+ *
+ * Returns:
+ *   0 = success
+ *  EEXIST = it was encrypted already.
+ *  !0 = errno of failure.  The file is as it was.
+ */
+static int encryptFile(const char *path, int plainFD, const struct stat *st)
+{
+	char tmp[PATH_MAX];
+	char dirBuf[PATH_MAX];
+	snprintf(dirBuf, sizeof(dirBuf), "%s", path);
+	if(snprintf(tmp, sizeof(tmp), "%s/.proxy_encrypt.XXXXXX", dirname(dirBuf)) >= (int) sizeof(tmp))
+		return ENAMETOOLONG;
+
+	int fd = mkstemp(tmp);
+	if(fd == -1)
+		return errno;
+
+	int error = cryptImport(plainFD, fd);
+	do {
+		if(error != 0)
+			break;
+
+		struct timespec times[2] = { st->st_atim, st->st_mtim };
+		if((fchown(fd, st->st_uid, st->st_gid) == -1) ||
+		   (fchmod(fd, st->st_mode & 07777) == -1) ||
+		   (futimens(fd, times) == -1) ||
+		   (fsync(fd) == -1)) {
+			error = errno;
+			break;
+		}
+
+		if(rename(tmp, path) == -1)
+			error = errno;
+	} while(0);
+
+	close(fd);
+	if(error != 0)
+		unlink(tmp);
+	return error;
+}
+
+/* nftw() callback.  Encrypt the plain regular files. */
+static int encryptVisit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) ftw;
+
+	if((type != FTW_F) || !S_ISREG(st->st_mode) || (st->st_size == 0))
+		return 0;
+
+	if(st->st_nlink > 1) {
+		fprintf(stderr, "%s: has %lu links.  Left plain.\n", path, (unsigned long) st->st_nlink);
+		numFailed++;
+		return 0;
+	}
+
+	int plainFD = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if(plainFD == -1) {
+		fprintf(stderr, "%s: %s.  Left plain.\n", path, strerror(errno));
+		numFailed++;
+		return 0;
+	}
+
+	int error = encryptFile(path, plainFD, st);
+	close(plainFD);
+	if(error == EEXIST) {
+		numSkipped++;
+	}
+	else if(error != 0) {
+		fprintf(stderr, "%s: %s.  Left plain.\n", path, strerror(error));
+		numFailed++;
+	}
+	else {
+		printf("%s\n", path);
+		numEncrypted++;
+	}
+	return 0;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS
+ * ****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	if(argc != 3)
+		usage(argv[0]);
+
+	const char *keyFile = argv[1];
+	const char *export = argv[2];
+
+	logInit(LOG_ERR, 0);
+	int error = cryptInit(keyFile);
+	if(error != 0) {
+		fprintf(stderr, "%s: %s\n", keyFile, strerror(error));
+		return 1;
+	}
+
+	/* The new files are made as we go, and they're encrypted already, so
+	 * there's no harm in the walk coming across them. */
+	if(nftw(export, encryptVisit, 64, FTW_PHYS | FTW_MOUNT) == -1) {
+		fprintf(stderr, "%s: %s\n", export, strerror(errno));
+		cryptDestroy();
+		return 1;
+	}
+	cryptDestroy();
+
+	printf("Encrypted %zu files.  %zu were encrypted already.  %zu left plain.\n",
+	       numEncrypted, numSkipped, numFailed);
+	return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,448 @@
+/* *****************************************************************************
+ * The request engine.  See proxy_engine.h for the big picture.
+ *
+ * The worker loop is the same as libfuse's: a thread that takes a request
+ * starts another one if nobody else is left waiting, and a thread that
+ * finishes one stops if there are too many waiting.  The differences are the
+ * limits.  They come from the config, and once a second the main thread
+ * moves two of them:
+ *   keep = threads that we hold on to, even if they're idle.
+ *   cap  = threads that we'll start before we'd oversubscribe the CPUs.
+ *
+ * Each worker keeps its own totals (requests, time in the handlers, time in
+ * backend calls), and only that worker writes them.  The main thread adds
+ * them up.  Workers that stop add theirs to the retired totals first.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxy_engine.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+/* How often the main thread resizes the pool. */
+#define ENGINE_TICK_MS (1000)
+
+struct engine_worker {
+	struct engine_worker *prev;
+	struct engine_worker *next;
+	pthread_t thread;
+	struct fuse_buf fbuf;
+	int cpu;                      /* -1 if it isn't pinned. */
+
+	/* Written by the worker, read by the main thread. */
+	uint64_t requests;
+	uint64_t busyNs;
+	uint64_t backendNs;
+};
+
+struct engine_totals {
+	uint64_t requests;
+	uint64_t busyNs;
+	uint64_t backendNs;
+};
+
+static struct {
+	struct fuse_session *se;
+	struct engine_config cfg;
+
+	pthread_mutex_t lock;
+	sem_t finish;
+	struct engine_worker *workers;
+	unsigned int numWorkers;
+	unsigned int numAvail;        /* Waiting for a request. */
+	unsigned int keep;
+	unsigned int cap;
+	bool exiting;
+	int error;
+	struct engine_totals retired;
+
+	int *cpus;
+	unsigned int numCpus;
+	unsigned int nextCpu;
+} engine = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static pthread_key_t engineBufKey;
+static pthread_once_t engineBufOnce = PTHREAD_ONCE_INIT;
+
+struct engine_buf {
+	size_t size;
+	char mem[];
+};
+
+static void *engineWorker(void *arg);
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static void engineBufKeyCreate(void)
+{
+	pthread_key_create(&engineBufKey, free);
+}
+
+static unsigned int engineClamp(unsigned int val, unsigned int lo, unsigned int hi)
+{
+	if(val < lo)
+		return lo;
+	if(val > hi)
+		return hi;
+	return val;
+}
+
+/* Start another worker.  Call it with the lock held.  The new worker counts
+ * as available from the start, so nobody else starts one for the same
+ * request.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int engineSpawn(void)
+{
+	struct engine_worker *w = calloc(1, sizeof(struct engine_worker));
+	if(w == NULL)
+		return ENOMEM;
+
+	w->cpu = -1;
+	if(engine.cfg.pin && (engine.numCpus > 0)) {
+		w->cpu = engine.cpus[engine.nextCpu++ % engine.numCpus];
+	}
+
+	w->next = engine.workers;
+	if(w->next != NULL)
+		w->next->prev = w;
+	engine.workers = w;
+	engine.numWorkers++;
+	engine.numAvail++;
+
+	/* Signals go to the main thread, like they do with libfuse's loop. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int rc = pthread_create(&w->thread, NULL, engineWorker, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if(rc != 0) {
+		if(w->next != NULL)
+			w->next->prev = NULL;
+		engine.workers = w->next;
+		engine.numWorkers--;
+		engine.numAvail--;
+		free(w);
+		return rc;
+	}
+
+	statsCount(STATS_CTR_engine_spawns, 1);
+	return 0;
+}
+
+/* Take a worker off the list.  Call it with the lock held. */
+static void engineUnlink(struct engine_worker *w)
+{
+	if(w->prev != NULL)
+		w->prev->next = w->next;
+	else
+		engine.workers = w->next;
+	if(w->next != NULL)
+		w->next->prev = w->prev;
+	engine.numWorkers--;
+}
+
+static void *engineWorker(void *arg)
+{
+	struct engine_worker *w = arg;
+	struct fuse_session *se = engine.se;
+
+	if(w->cpu != -1) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if(rc != 0)
+			LOG_ERROR(NULL, "Unable to pin a worker to CPU %d (%s).", w->cpu, strerror(rc));
+	}
+
+	while(!fuse_session_exited(se)) {
+		/* The main thread cancels us while we wait, and only then. */
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		int res = fuse_session_receive_buf(se, &w->fbuf);
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+		if(res == -EINTR)
+			continue;
+		if(res <= 0) {
+			if(res < 0) {
+				pthread_mutex_lock(&engine.lock);
+				if(engine.error == 0)
+					engine.error = res;
+				pthread_mutex_unlock(&engine.lock);
+				fuse_session_exit(se);
+			}
+			break;
+		}
+
+		pthread_mutex_lock(&engine.lock);
+		if(engine.exiting) {
+			pthread_mutex_unlock(&engine.lock);
+			break;
+		}
+		engine.numAvail--;
+		if((engine.numAvail == 0) && (engine.numWorkers < engine.cap)) {
+			int rc = engineSpawn();
+			if(rc != 0)
+				LOG_ERROR(NULL, "Unable to start a worker (%s).", strerror(rc));
+		}
+		pthread_mutex_unlock(&engine.lock);
+
+		uint64_t backend = statsBackendTotal();
+		uint64_t start = statsNow();
+		fuse_session_process_buf(se, &w->fbuf);
+		__atomic_store_n(&w->busyNs, w->busyNs + (statsNow() - start), __ATOMIC_RELAXED);
+		__atomic_store_n(&w->backendNs, w->backendNs + (statsBackendTotal() - backend), __ATOMIC_RELAXED);
+		__atomic_store_n(&w->requests, w->requests + 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&engine.lock);
+		engine.numAvail++;
+		if(!engine.exiting && (engine.numAvail > engine.cfg.maxIdle) &&
+		   (engine.numWorkers > engine.keep)) {
+			engineUnlink(w);
+			engine.numAvail--;
+			engine.retired.requests += w->requests;
+			engine.retired.busyNs += w->busyNs;
+			engine.retired.backendNs += w->backendNs;
+			pthread_mutex_unlock(&engine.lock);
+
+			statsCount(STATS_CTR_engine_retires, 1);
+			pthread_detach(pthread_self());
+			free(w->fbuf.mem);
+			free(w);
+			return NULL;
+		}
+		pthread_mutex_unlock(&engine.lock);
+	}
+
+	sem_post(&engine.finish);
+	return NULL;
+}
+
+/* Add up what the workers have done so far. */
+static void engineTotals(struct engine_totals *t)
+{
+	pthread_mutex_lock(&engine.lock);
+	*t = engine.retired;
+	struct engine_worker *w;
+	for(w = engine.workers; w != NULL; w = w->next) {
+		t->requests += __atomic_load_n(&w->requests, __ATOMIC_RELAXED);
+		t->busyNs += __atomic_load_n(&w->busyNs, __ATOMIC_RELAXED);
+		t->backendNs += __atomic_load_n(&w->backendNs, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&engine.lock);
+}
+
+/* Resize the pool from the last tick's numbers.  busy and backend are the
+ * average number of requests in the handlers and in backend calls.  They're
+ * smoothed so one odd second doesn't throw the pool around. */
+static void engineResize(double busy, double backend)
+{
+	unsigned int keep = (unsigned int) (busy * 1.25) + 1;
+	unsigned int cap = engine.cfg.maxThreads;
+
+	/* If a request spends a fraction f of its time waiting for the NAS,
+	 * it takes ncpu / (1 - f) requests in flight to keep every CPU busy.
+	 * More than that and they just wait for each other. */
+	long ncpu = (engine.numCpus > 0) ? (long) engine.numCpus : sysconf(_SC_NPROCESSORS_ONLN);
+	if((busy > 0) && (busy > backend) && (ncpu > 0)) {
+		double need = (double) ncpu * busy / (busy - backend) + 1;
+		if(need < cap)
+			cap = (unsigned int) need;
+	}
+
+	pthread_mutex_lock(&engine.lock);
+	engine.cap = engineClamp(cap, engine.cfg.minThreads, engine.cfg.maxThreads);
+	engine.keep = engineClamp(keep, engine.cfg.minThreads, engine.cap);
+	pthread_mutex_unlock(&engine.lock);
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Serve requests until the session ends.  It's a drop-in for
+ * fuse_session_loop_mt().
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = The error that ended the session.
+ */
+int engineRun(struct fuse_session *se, const struct engine_config *cfg)
+{
+	pthread_once(&engineBufOnce, engineBufKeyCreate);
+
+	engine.se = se;
+	engine.cfg = *cfg;
+	if(engine.cfg.minThreads == 0)
+		engine.cfg.minThreads = 1;
+	if(engine.cfg.maxThreads < engine.cfg.minThreads)
+		engine.cfg.maxThreads = engine.cfg.minThreads;
+	engine.keep = engine.cfg.minThreads;
+	engine.cap = engine.cfg.maxThreads;
+	engine.exiting = false;
+	engine.error = 0;
+	memset(&engine.retired, 0, sizeof(engine.retired));
+	sem_init(&engine.finish, 0, 0);
+
+	/* The CPUs that we're allowed to run on, in order. */
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		engine.cpus = calloc(CPU_COUNT(&set), sizeof(int));
+		int cpu;
+		for(cpu = 0; (engine.cpus != NULL) && (cpu < CPU_SETSIZE); cpu++) {
+			if(CPU_ISSET(cpu, &set))
+				engine.cpus[engine.numCpus++] = cpu;
+		}
+	}
+
+	LOG_STATUS(NULL, "Engine: threads %u..%u : idle %u : %s.",
+	           engine.cfg.minThreads, engine.cfg.maxThreads, engine.cfg.maxIdle,
+	           engine.cfg.pin ? "pinned" : "not pinned");
+
+	pthread_mutex_lock(&engine.lock);
+	unsigned int i;
+	for(i = 0; i < engine.cfg.minThreads; i++) {
+		int rc = engineSpawn();
+		if(rc != 0) {
+			LOG_ERROR(NULL, "Unable to start a worker (%s).", strerror(rc));
+			break;
+		}
+	}
+	bool started = (engine.numWorkers > 0);
+	pthread_mutex_unlock(&engine.lock);
+
+	struct engine_totals last;
+	engineTotals(&last);
+	uint64_t lastTime = statsNow();
+	double busy = 0;
+	double backend = 0;
+
+	while(started && !fuse_session_exited(se)) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ENGINE_TICK_MS / 1000;
+		if(sem_timedwait(&engine.finish, &ts) == 0) {
+			continue;
+		}
+		if(errno != ETIMEDOUT) {
+			continue;
+		}
+
+		struct engine_totals now;
+		engineTotals(&now);
+		uint64_t nowTime = statsNow();
+		double elapsed = (double) (nowTime - lastTime);
+		if(elapsed > 0) {
+			busy = (busy + (now.busyNs - last.busyNs) / elapsed) / 2;
+			backend = (backend + (now.backendNs - last.backendNs) / elapsed) / 2;
+			engineResize(busy, backend);
+		}
+		last = now;
+		lastTime = nowTime;
+	}
+
+	/* Same as libfuse: the workers that are still waiting for requests
+	 * are cancelled, and the busy ones stop after their request. */
+	pthread_mutex_lock(&engine.lock);
+	engine.exiting = true;
+	struct engine_worker *w;
+	for(w = engine.workers; w != NULL; w = w->next)
+		pthread_cancel(w->thread);
+	pthread_mutex_unlock(&engine.lock);
+
+	while((w = engine.workers) != NULL) {
+		pthread_join(w->thread, NULL);
+		pthread_mutex_lock(&engine.lock);
+		engineUnlink(w);
+		pthread_mutex_unlock(&engine.lock);
+		free(w->fbuf.mem);
+		free(w);
+	}
+	pthread_mutex_lock(&engine.lock);
+	engine.numAvail = 0;
+	pthread_mutex_unlock(&engine.lock);
+
+	free(engine.cpus);
+	engine.cpus = NULL;
+	engine.numCpus = 0;
+	sem_destroy(&engine.finish);
+
+	int error = started ? engine.error : -EAGAIN;
+	fuse_session_reset(se);
+	return error;
+}
+
+/* A buffer of at least size bytes that belongs to the calling thread.  It's
+ * good until the thread's next call, and is freed when the thread exits.
+ * Handlers use it for replies that are built up in memory (readdir).
+ *
+ * Returns:
+ *   !NULL = The buffer.  Don't free it.
+ *    NULL = Out of memory.
+ */
+void *engineReplyBuf(size_t size)
+{
+	pthread_once(&engineBufOnce, engineBufKeyCreate);
+
+	struct engine_buf *buf = pthread_getspecific(engineBufKey);
+	if((buf != NULL) && (buf->size >= size))
+		return buf->mem;
+
+	struct engine_buf *bigger = realloc(buf, sizeof(struct engine_buf) + size);
+	if(bigger == NULL)
+		return NULL;
+	bigger->size = size;
+	pthread_setspecific(engineBufKey, bigger);
+	return bigger->mem;
+}
+
+/* Gauges for the stats. */
+static double engineGauge(unsigned int *val)
+{
+	pthread_mutex_lock(&engine.lock);
+	double res = *val;
+	pthread_mutex_unlock(&engine.lock);
+	return res;
+}
+
+double engineThreads(void *arg)
+{
+	(void) arg;
+	return engineGauge(&engine.numWorkers);
+}
+
+double engineIdleThreads(void *arg)
+{
+	(void) arg;
+	return engineGauge(&engine.numAvail);
+}
+
+double engineTargetThreads(void *arg)
+{
+	(void) arg;
+	return engineGauge(&engine.keep);
+}
@@ -0,0 +1,51 @@
+/* *****************************************************************************
+ * The request engine.
+ *
+ * This takes the place of fuse_session_loop_mt().  libfuse's loop starts a
+ * thread whenever none are idle and stops one whenever more than 10 are idle,
+ * so a bursty load keeps creating and destroying threads, and the threads
+ * wander from CPU to CPU.  Our engine:
+ * - Keeps at least PROXY_BRIDGE_THREADS_MIN threads (default 2), never starts
+ *   more than PROXY_BRIDGE_THREADS_MAX (default 64), and lets up to
+ *   PROXY_BRIDGE_THREADS_IDLE (default 10) sit idle.
+ * - Optionally pins each thread to one CPU (PROXY_BRIDGE_PIN_THREADS=1).
+ * - Gives each thread its own reply buffer (engineReplyBuf()), so big replies
+ *   don't go through malloc() every time.
+ * - Sizes the pool from what it sees once a second.  Little's law says the
+ *   number of requests in flight is the arrival rate times the time each one
+ *   takes, and the engine keeps that many threads around (plus headroom)
+ *   instead of letting them go.  The part of that time that isn't spent
+ *   waiting for the NAS is CPU time.  The engine won't start more threads
+ *   than it takes to keep every CPU busy, so CPU-bound loads don't
+ *   oversubscribe.
+ *
+ * All of the threads read from the session's /dev/fuse fd.  libfuse can clone
+ * the fd per thread, but only inside fuse_session_loop_mt().  The kernel
+ * wants the reply on the fd that the request came from, and the public API
+ * always replies on the session's fd.  If "-o clone_fd" is given, we leave
+ * the job to libfuse.
+ * ****************************************************************************/
+
+#ifndef PROXY_ENGINE_H
+#define PROXY_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct fuse_session;
+
+struct engine_config {
+	unsigned int minThreads;
+	unsigned int maxThreads;
+	unsigned int maxIdle;
+	bool pin;
+};
+
+int engineRun(struct fuse_session *se, const struct engine_config *cfg);
+void *engineReplyBuf(size_t size);
+
+double engineThreads(void *arg);
+double engineIdleThreads(void *arg);
+double engineTargetThreads(void *arg);
+
+#endif /* PROXY_ENGINE_H */
@@ -0,0 +1,677 @@
+/* *****************************************************************************
+ * The inode table.  See proxy_inode.h for the locking rules.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "proxy_closer.h"
+#include "proxy_compress.h"
+#include "proxy_crypt.h"
+#include "proxy_inode.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+/* Initial number of buckets in each shard.  Must be a power of 2. */
+#define INODE_SHARD_BUCKETS (256)
+
+/* Source of data generation numbers.  Never reused, even across inodes. */
+static uint64_t genCounter = 0;
+
+/* Mix the dev and ino into a single hash value.  NFS inode numbers tend to be
+ * sequential, so we need to spread them around before we pick a shard. */
+static uint64_t inodeHash(dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) ino * 0x9E3779B97F4A7C15ULL) ^
+	             ((uint64_t) dev * 0xC2B2AE3D27D4EB4FULL);
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+static struct inode_shard *inodeShard(struct inode_table *t, uint64_t h)
+{
+	return &t->shards[h & (INODE_TABLE_SHARDS - 1)];
+}
+
+/* The low bits of the hash pick the shard, so use the high bits to pick the
+ * bucket. */
+static size_t inodeBucket(struct inode_shard *s, uint64_t h)
+{
+	return (h >> 32) & (s->nbuckets - 1);
+}
+
+/* Double the number of buckets in a shard.  Called with the shard lock held.
+ * If we can't get the memory, we just keep running with longer chains. */
+static void inodeShardGrow(struct inode_shard *s)
+{
+	size_t nbuckets = s->nbuckets * 2;
+	struct lo_inode **buckets = calloc(nbuckets, sizeof(*buckets));
+	if(buckets == NULL) {
+		return;
+	}
+
+	size_t i;
+	for(i = 0; i < s->nbuckets; i++) {
+		struct lo_inode *p = s->buckets[i];
+		while(p != NULL) {
+			struct lo_inode *next = p->hnext;
+			size_t b = (inodeHash(p->dev, p->ino) >> 32) & (nbuckets - 1);
+			p->hnext = buckets[b];
+			buckets[b] = p;
+			p = next;
+		}
+	}
+
+	free(s->buckets);
+	s->buckets = buckets;
+	s->nbuckets = nbuckets;
+}
+
+/* Put an inode at the head of the LRU list.  Called with lruLock held. */
+static void inodeLruPush(struct inode_table *t, struct lo_inode *p)
+{
+	p->lruPrev = NULL;
+	p->lruNext = t->lruHead;
+	if(t->lruHead != NULL) {
+		t->lruHead->lruPrev = p;
+	}
+	else {
+		t->lruTail = p;
+	}
+	t->lruHead = p;
+	p->onLru = true;
+	t->lruCount++;
+}
+
+/* Called with lruLock held. */
+static void inodeLruRemove(struct inode_table *t, struct lo_inode *p)
+{
+	if(p->lruPrev != NULL) {
+		p->lruPrev->lruNext = p->lruNext;
+	}
+	else {
+		t->lruHead = p->lruNext;
+	}
+	if(p->lruNext != NULL) {
+		p->lruNext->lruPrev = p->lruPrev;
+	}
+	else {
+		t->lruTail = p->lruPrev;
+	}
+	p->lruPrev = p->lruNext = NULL;
+	p->onLru = false;
+	t->lruCount--;
+}
+
+/* Close fds from the cold end of the list until we're back under the limit.
+ * Called with lruLock held.  An inode that is in use, or has been used since
+ * we last looked at it, gets another trip around the list.  We give up after
+ * two laps, in case everything is busy. */
+static void inodeFdEvict(struct inode_table *t)
+{
+	size_t tries = t->lruCount * 2;
+	while((t->lruCount > t->maxFds) && (tries-- > 0)) {
+		struct lo_inode *p = t->lruTail;
+		inodeLruRemove(t, p);
+
+		if(pthread_mutex_trylock(&p->fdLock) != 0) {
+			inodeLruPush(t, p);
+			continue;
+		}
+		if((p->fdUsers > 0) || p->fdUsed) {
+			p->fdUsed = false;
+			pthread_mutex_unlock(&p->fdLock);
+			inodeLruPush(t, p);
+			continue;
+		}
+		int fd = p->fd;
+		p->fd = -1;
+		pthread_mutex_unlock(&p->fdLock);
+
+		closerClose(fd);
+		statsCount(STATS_CTR_inode_fd_evictions, 1);
+	}
+}
+
+/* The fd that open_by_handle_at() needs for the filesystem that dev is on.
+ * It can't be an O_PATH fd, so we open the first directory that we see on
+ * each filesystem (its mount point, unless the kernel found a file on it
+ * first, in which case those files will just reopen by name).
+ *
+ * Returns -1 if we can't get one.
+ */
+static int inodeMountFd(struct inode_table *t, dev_t dev, int fd)
+{
+	int mountFd = -1;
+	size_t i;
+
+	pthread_mutex_lock(&t->lruLock);
+	for(i = 0; i < t->numMounts; i++) {
+		if(t->mounts[i].dev == dev) {
+			mountFd = t->mounts[i].fd;
+			break;
+		}
+	}
+	if((mountFd == -1) && (t->numMounts < INODE_TABLE_MOUNTS)) {
+		mountFd = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(mountFd != -1) {
+			t->mounts[t->numMounts].dev = dev;
+			t->mounts[t->numMounts].fd = mountFd;
+			t->numMounts++;
+		}
+	}
+	pthread_mutex_unlock(&t->lruLock);
+
+	return mountFd;
+}
+
+/* Get a file handle for the file that fd is open on.
+ *
+ * Returns NULL if the filesystem can't do it (or we're out of memory).
+ */
+static struct file_handle *inodeHandle(int fd)
+{
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} u;
+	int mountId;
+
+	u.fh.handle_bytes = MAX_HANDLE_SZ;
+	if(name_to_handle_at(fd, "", &u.fh, &mountId, AT_EMPTY_PATH) == -1) {
+		return NULL;
+	}
+
+	size_t len = sizeof(struct file_handle) + u.fh.handle_bytes;
+	struct file_handle *fh = malloc(len);
+	if(fh != NULL) {
+		memcpy(fh, &u.fh, len);
+	}
+	return fh;
+}
+
+/* Open a new O_PATH fd for an inode whose fd was closed.  Called with
+ * inode->fdLock held.
+ *
+ * Returns:
+ * >=0 = the fd.
+ *  -1 = failure (errno = reason for failure).
+ */
+static int inodeReopen(struct inode_table *t, struct lo_inode *inode)
+{
+	int fd;
+
+	statsCount(STATS_CTR_inode_reopens, 1);
+
+	if(inode->handle != NULL) {
+		return STATS_BACKEND(open_by_handle_at(inode->mountFd, inode->handle,
+		                                       O_PATH | O_CLOEXEC));
+	}
+
+	if(inode->parent == NULL) {
+		errno = ESTALE;
+		return -1;
+	}
+
+	int dirFD = inodeFdGet(t, inode->parent);
+	if(dirFD == -1) {
+		return -1;
+	}
+	fd = STATS_BACKEND(openat(dirFD, inode->name, O_PATH | O_NOFOLLOW | O_CLOEXEC));
+	inodeFdPut(t, inode->parent);
+	if(fd == -1) {
+		return -1;
+	}
+
+	/* The name might point at a different file by now. */
+	struct stat st;
+	if((STATS_BACKEND(fstat(fd, &st)) == -1) ||
+	   (st.st_dev != inode->dev) || (st.st_ino != inode->ino)) {
+		LOG_TRACE(NULL, "%s no longer names %lu.", inode->name,
+		          (unsigned long) inode->ino);
+		close(fd);
+		errno = ESTALE;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Free an inode that nobody can find anymore. */
+static void inodeFree(struct lo_inode *inode)
+{
+	if(inode->fd != -1) {
+		closerClose(inode->fd);
+	}
+	free(inode->handle);
+	free(inode->name);
+	cryptFileFree(inode->crypt);
+	compressFileFree(inode->compress);
+	pthread_mutex_destroy(&inode->fdLock);
+	free(inode);
+}
+
+/* maxFds is the number of O_PATH fds that the inodes may keep open.  0
+ * means there's no limit, and the inodes keep their fds for life.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int inodeTableInit(struct inode_table *t, size_t maxFds)
+{
+	pthread_mutex_init(&t->lruLock, NULL);
+	t->lruHead = t->lruTail = NULL;
+	t->lruCount = 0;
+	t->maxFds = maxFds;
+	t->useHandles = false;
+	t->numMounts = 0;
+	t->pathInodes = 0;
+
+	int i;
+	for(i = 0; i < INODE_TABLE_SHARDS; i++) {
+		struct inode_shard *s = &t->shards[i];
+		pthread_mutex_init(&s->lock, NULL);
+		s->count = 0;
+		s->nbuckets = INODE_SHARD_BUCKETS;
+		s->buckets = calloc(s->nbuckets, sizeof(*s->buckets));
+		if(s->buckets == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/* Close and free every inode that is still in the table.  Only called at
+ * shutdown, after the session loop has stopped. */
+void inodeTableDestroy(struct inode_table *t)
+{
+	int i;
+	for(i = 0; i < INODE_TABLE_SHARDS; i++) {
+		struct inode_shard *s = &t->shards[i];
+		size_t b;
+		for(b = 0; (s->buckets != NULL) && (b < s->nbuckets); b++) {
+			struct lo_inode *p = s->buckets[b];
+			while(p != NULL) {
+				struct lo_inode *next = p->hnext;
+				if(p->fd != -1) {
+					close(p->fd);
+				}
+				free(p->handle);
+				free(p->name);
+				cryptFileFree(p->crypt);
+				compressFileFree(p->compress);
+				free(p);
+				p = next;
+			}
+		}
+		free(s->buckets);
+		s->buckets = NULL;
+		s->count = 0;
+		pthread_mutex_destroy(&s->lock);
+	}
+
+	size_t m;
+	for(m = 0; m < t->numMounts; m++) {
+		close(t->mounts[m].fd);
+	}
+	t->numMounts = 0;
+	pthread_mutex_destroy(&t->lruLock);
+}
+
+/* See if we can use file handles.  Getting a handle is up to the backend,
+ * but open_by_handle_at() also needs CAP_DAC_READ_SEARCH, so try the whole
+ * round trip on fd (the root).
+ *
+ * Returns true if the inodes will use handles.
+ */
+bool inodeTableProbeHandles(struct inode_table *t, int fd)
+{
+	t->useHandles = false;
+	if(t->maxFds == 0) {
+		return false;
+	}
+
+	struct file_handle *fh = inodeHandle(fd);
+	if(fh == NULL) {
+		LOG_STATUS(NULL, "No file handles on the backend (%m).  Reopening by name.");
+		return false;
+	}
+
+	struct stat st;
+	int mountFd = (fstat(fd, &st) == 0) ? inodeMountFd(t, st.st_dev, fd) : -1;
+	int newfd = open_by_handle_at(mountFd, fh, O_PATH | O_CLOEXEC);
+	if(newfd == -1) {
+		LOG_STATUS(NULL, "Can't open file handles (%m).  Reopening by name.");
+	}
+	else {
+		close(newfd);
+		t->useHandles = true;
+	}
+	free(fh);
+
+	return t->useHandles;
+}
+
+/* Find the inode for (dev, ino) and bump its nlookup count.  If it isn't in
+ * the table yet, create it using fd, is_symlink and read_mostly.
+ *
+ * *created tells the caller who owns fd.  If it's true, the new inode owns it.
+ * If it's false, the caller still owns it and should close it.
+ *
+ * Returns NULL (errno = ENOMEM) if we needed a new inode and couldn't get it.
+ */
+struct lo_inode *inodeTableGet(struct inode_table *t, dev_t dev, ino_t ino,
+                               int fd, bool is_symlink, bool read_mostly,
+                               bool *created)
+{
+	uint64_t h = inodeHash(dev, ino);
+	struct inode_shard *s = inodeShard(t, h);
+	struct lo_inode *p;
+
+	*created = false;
+
+	pthread_mutex_lock(&s->lock);
+
+	size_t b = inodeBucket(s, h);
+	for(p = s->buckets[b]; p != NULL; p = p->hnext) {
+		if((p->ino == ino) && (p->dev == dev)) {
+			break;
+		}
+	}
+
+	if(p == NULL) {
+		p = calloc(1, sizeof(struct lo_inode));
+		if(p == NULL) {
+			pthread_mutex_unlock(&s->lock);
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		pthread_mutex_init(&p->fdLock, NULL);
+		p->fd = fd;
+		p->fdFixed = (t->maxFds == 0);
+		p->mountFd = -1;
+		p->is_symlink = is_symlink;
+		p->read_mostly = read_mostly;
+		p->ino = ino;
+		p->dev = dev;
+		p->gen = __atomic_add_fetch(&genCounter, 1, __ATOMIC_RELAXED);
+		p->hnext = s->buckets[b];
+		s->buckets[b] = p;
+		*created = true;
+
+		if(++s->count > (s->nbuckets * 2)) {
+			inodeShardGrow(s);
+		}
+	}
+
+	p->nlookup++;
+
+	pthread_mutex_unlock(&s->lock);
+
+	return p;
+}
+
+/* Add a reference to an inode that we already have (e.g. to keep it around
+ * while a background job uses it).  Drop it with inodeTableUnref(). */
+void inodeTableRef(struct inode_table *t, struct lo_inode *inode)
+{
+	struct inode_shard *s = inodeShard(t, inodeHash(inode->dev, inode->ino));
+
+	pthread_mutex_lock(&s->lock);
+	inode->nlookup++;
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Drop n lookups from an inode.  If that was the last one, remove it from the
+ * table, close its fd and free it.
+ *
+ * Returns true if the inode was freed.  The caller must not touch it again.
+ */
+bool inodeTableUnref(struct inode_table *t, struct lo_inode *inode, uint64_t n)
+{
+	/* The kernel forgets the root too, but it lives as long as we do, so
+	 * its lookups aren't counted. */
+	if(inode->pinned) {
+		return false;
+	}
+
+	uint64_t h = inodeHash(inode->dev, inode->ino);
+	struct inode_shard *s = inodeShard(t, h);
+
+	pthread_mutex_lock(&s->lock);
+
+	assert(inode->nlookup >= n);
+	inode->nlookup -= n;
+	if(inode->nlookup != 0) {
+		pthread_mutex_unlock(&s->lock);
+		return false;
+	}
+
+	struct lo_inode **pp = &s->buckets[inodeBucket(s, h)];
+	while(*pp != inode) {
+		assert(*pp != NULL);
+		pp = &(*pp)->hnext;
+	}
+	*pp = inode->hnext;
+	s->count--;
+
+	pthread_mutex_unlock(&s->lock);
+
+	/* Nobody can find it anymore, so we can do the slow stuff unlocked.
+	 * The close is a NAS round trip, so the closer does it. */
+	pthread_mutex_lock(&t->lruLock);
+	if(inode->onLru) {
+		inodeLruRemove(t, inode);
+	}
+	pthread_mutex_unlock(&t->lruLock);
+
+	struct lo_inode *parent = inode->parent;
+	inodeFree(inode);
+	if(parent != NULL) {
+		__atomic_sub_fetch(&t->pathInodes, 1, __ATOMIC_RELAXED);
+		inodeTableUnref(t, parent, 1);
+	}
+	return true;
+}
+
+/* Find the inode for (dev, ino) and add a reference to it.
+ *
+ * Returns NULL if it isn't in the table.
+ */
+struct lo_inode *inodeTableFind(struct inode_table *t, dev_t dev, ino_t ino)
+{
+	uint64_t h = inodeHash(dev, ino);
+	struct inode_shard *s = inodeShard(t, h);
+	struct lo_inode *p;
+
+	pthread_mutex_lock(&s->lock);
+	for(p = s->buckets[inodeBucket(s, h)]; p != NULL; p = p->hnext) {
+		if((p->ino == ino) && (p->dev == dev)) {
+			p->nlookup++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	return p;
+}
+
+/* The number of inodes in the table.  The shards are read without their
+ * locks, so this is only a snapshot. */
+size_t inodeTableCount(struct inode_table *t)
+{
+	size_t count = 0;
+	int i;
+	for(i = 0; i < INODE_TABLE_SHARDS; i++) {
+		count += __atomic_load_n(&t->shards[i].count, __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+/* The number of inode fds that are open and that we're allowed to close. */
+size_t inodeTableOpenFds(struct inode_table *t)
+{
+	return __atomic_load_n(&t->lruCount, __ATOMIC_RELAXED);
+}
+
+/* Record how to reopen a new inode (found as name in parent), and let the
+ * evictor have its fd.  Call it once, right after inodeTableGet() creates
+ * the inode.  If we can't record anything, the inode just keeps its fd. */
+void inodeTableSetOrigin(struct inode_table *t, struct lo_inode *inode,
+                         struct lo_inode *parent, const char *name)
+{
+	if(inode->fdFixed) {
+		return;
+	}
+
+	struct file_handle *fh = NULL;
+	int mountFd = -1;
+	if(t->useHandles && ((fh = inodeHandle(inode->fd)) != NULL)) {
+		mountFd = inodeMountFd(t, inode->dev, inode->fd);
+		if(mountFd == -1) {
+			free(fh);
+			fh = NULL;
+		}
+	}
+
+	char *copy = NULL;
+	if(fh == NULL) {
+		if((copy = strdup(name)) == NULL) {
+			return;
+		}
+		inodeTableRef(t, parent);
+		__atomic_add_fetch(&t->pathInodes, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_lock(&inode->fdLock);
+	inode->handle = fh;
+	inode->mountFd = mountFd;
+	inode->parent = (fh == NULL) ? parent : NULL;
+	inode->name = copy;
+	pthread_mutex_unlock(&inode->fdLock);
+
+	pthread_mutex_lock(&t->lruLock);
+	inodeLruPush(t, inode);
+	inodeFdEvict(t);
+	pthread_mutex_unlock(&t->lruLock);
+}
+
+/* True if any inode reopens by name, i.e. renames have to be tracked. */
+bool inodeTableUsesPaths(struct inode_table *t)
+{
+	return __atomic_load_n(&t->pathInodes, __ATOMIC_RELAXED) != 0;
+}
+
+/* The inode was renamed to newName in newParent.  Only matters for inodes
+ * that reopen by name. */
+void inodeTableRename(struct inode_table *t, struct lo_inode *inode,
+                      struct lo_inode *newParent, const char *newName)
+{
+	pthread_mutex_lock(&inode->fdLock);
+	bool byName = (inode->parent != NULL);
+	pthread_mutex_unlock(&inode->fdLock);
+	if(!byName) {
+		return;
+	}
+
+	/* If we can't keep track, the reopen will find out and say ESTALE. */
+	char *name = strdup(newName);
+	if(name == NULL) {
+		return;
+	}
+	inodeTableRef(t, newParent);
+
+	pthread_mutex_lock(&inode->fdLock);
+	struct lo_inode *oldParent = inode->parent;
+	char *oldName = inode->name;
+	inode->parent = newParent;
+	inode->name = name;
+	pthread_mutex_unlock(&inode->fdLock);
+
+	free(oldName);
+	inodeTableUnref(t, oldParent, 1);
+}
+
+/* Get an inode's O_PATH fd, reopening it if it was closed.  It stays open
+ * until the matching inodeFdPut().
+ *
+ * Returns:
+ * >=0 = the fd.
+ *  -1 = failure (errno = reason for failure, ESTALE if the file is gone).
+ */
+int inodeFdGet(struct inode_table *t, struct lo_inode *inode)
+{
+	if(inode->fdFixed) {
+		return inode->fd;
+	}
+
+	bool reopened = false;
+	pthread_mutex_lock(&inode->fdLock);
+	if(inode->fd == -1) {
+		int fd = inodeReopen(t, inode);
+		if(fd == -1) {
+			int error = errno;
+			pthread_mutex_unlock(&inode->fdLock);
+			errno = error;
+			return -1;
+		}
+		inode->fd = fd;
+		reopened = true;
+	}
+	inode->fdUsers++;
+	inode->fdUsed = true;
+	int fd = inode->fd;
+	pthread_mutex_unlock(&inode->fdLock);
+
+	if(reopened) {
+		pthread_mutex_lock(&t->lruLock);
+		inodeLruPush(t, inode);
+		inodeFdEvict(t);
+		pthread_mutex_unlock(&t->lruLock);
+	}
+
+	return fd;
+}
+
+void inodeFdPut(struct inode_table *t, struct lo_inode *inode)
+{
+	(void) t;
+
+	if(inode->fdFixed) {
+		return;
+	}
+
+	pthread_mutex_lock(&inode->fdLock);
+	assert(inode->fdUsers > 0);
+	inode->fdUsers--;
+	pthread_mutex_unlock(&inode->fdLock);
+}
+
+/* The data generation of an inode.  It changes every time the proxy modifies
+ * the file's data, and a given number is never handed out twice (even after
+ * the inode is freed and looked up again).  Anything that caches file data
+ * records the generation it saw *before* reading the backend, so data read
+ * while a write was in progress can never look current. */
+uint64_t inodeDataGen(struct lo_inode *inode)
+{
+	return __atomic_load_n(&inode->gen, __ATOMIC_ACQUIRE);
+}
+
+/* Call this after the proxy has modified a file's data (write, truncate). */
+void inodeDataChanged(struct lo_inode *inode)
+{
+	uint64_t gen = __atomic_add_fetch(&genCounter, 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&inode->gen, gen, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,136 @@
+/* *****************************************************************************
+ * The inode table.
+ *
+ * Every inode that we've handed to the kernel lives in this table, indexed by
+ * its (dev, ino) pair.  The table is split into shards, and each shard has its
+ * own lock, so lookups from the multi-threaded session loop don't all pile up
+ * behind one mutex.
+ *
+ * The nlookup count of an inode is only modified while holding its shard lock.
+ * That's what keeps LOOKUP and FORGET from racing each other (i.e. FORGET
+ * freeing an inode at the same instant that LOOKUP finds it).
+ *
+ * The O_PATH fds that the inodes hang onto are a budget, not a given.  With a
+ * big tree the kernel can hold millions of inodes, and an fd for each one
+ * runs us into RLIMIT_NOFILE (and pins a struct file and a dentry on the NFS
+ * client for every one of them).  So each inode remembers how to get its fd
+ * back, and only the most recently used ones keep an fd open:
+ * - A file handle (name_to_handle_at), if the backend and our capabilities
+ *   allow it.  open_by_handle_at() gets the fd back, even after a rename.
+ * - Otherwise the parent and the name that we found it under.  Renames done
+ *   through the proxy keep that up to date (inodeTableRename()), and the
+ *   reopen checks dev/ino, so a name that now points at a different file
+ *   gets ESTALE instead of the wrong file.
+ * Use inodeFdGet()/inodeFdPut() around every use of the fd, so it can't be
+ * closed while it's in use.  The fd is protected by fdLock.  The LRU list is
+ * protected by the table's lruLock, and the evictor only trylocks an inode's
+ * fdLock, so the two can be taken in either order.
+ * ****************************************************************************/
+
+#ifndef PROXY_INODE_H
+#define PROXY_INODE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+struct compress_file;
+struct crypt_file;
+struct file_handle;
+
+struct lo_inode {
+	struct lo_inode *hnext;   /* Next inode in the same hash bucket. */
+	int fd;                   /* O_PATH fd, or -1 if it's been closed. */
+	bool is_symlink;
+	bool read_mostly;         /* In a read-mostly tree.  Set at creation. */
+	bool fdFixed;             /* fd is never closed (e.g. the root). */
+	bool pinned;              /* Not in the table, and never freed (the root). */
+	ino_t ino;
+	dev_t dev;
+	uint64_t nlookup;
+	uint64_t gen;             /* Data generation.  See inodeDataChanged(). */
+	int wbufs;                /* Open write buffers.  See proxy_wbuf.h. */
+	int backingId;            /* FUSE passthrough.  See lo_passthrough_open(). */
+	int backingOpens;
+	uint64_t journalSeq;      /* Last journal record.  See proxy_journal.h. */
+	uint64_t journalEnd;      /* Where its journaled writes end, and when the */
+	uint64_t journalMtime;    /* last one was (ns).  Under the journal's lock. */
+	struct crypt_file *crypt; /* File key.  See proxy_crypt.h. */
+	struct compress_file *compress; /* Chunk index.  See proxy_compress.h. */
+
+	/* How to reopen fd.  See inodeTableSetOrigin(). */
+	pthread_mutex_t fdLock;
+	struct file_handle *handle; /* NULL if we don't have one. */
+	int mountFd;              /* For open_by_handle_at().  Owned by the table. */
+	struct lo_inode *parent;  /* Holds a reference.  Changed by renames. */
+	char *name;
+	int fdUsers;              /* inodeFdGet() calls without a Put. */
+	bool fdUsed;              /* Used since the evictor last looked. */
+
+	/* The LRU list of fds that we're allowed to close.  lruLock. */
+	bool onLru;
+	struct lo_inode *lruPrev;
+	struct lo_inode *lruNext;
+};
+
+/* Must be a power of 2. */
+#define INODE_TABLE_SHARDS (64)
+
+struct inode_shard {
+	pthread_mutex_t lock;
+	struct lo_inode **buckets;
+	size_t nbuckets;          /* Always a power of 2. */
+	size_t count;
+} __attribute__((aligned(64)));
+
+/* The number of different filesystems that can use file handles. */
+#define INODE_TABLE_MOUNTS (16)
+
+struct inode_mount {
+	dev_t dev;
+	int fd;
+};
+
+struct inode_table {
+	struct inode_shard shards[INODE_TABLE_SHARDS];
+
+	pthread_mutex_t lruLock;
+	struct lo_inode *lruHead; /* Most recently opened. */
+	struct lo_inode *lruTail;
+	size_t lruCount;
+	size_t maxFds;            /* 0 = no limit. */
+	bool useHandles;
+	struct inode_mount mounts[INODE_TABLE_MOUNTS];
+	size_t numMounts;
+	size_t pathInodes;        /* Inodes that reopen by name.  Atomic. */
+} __attribute__((aligned(64)));
+
+int inodeTableInit(struct inode_table *t, size_t maxFds);
+void inodeTableDestroy(struct inode_table *t);
+bool inodeTableProbeHandles(struct inode_table *t, int fd);
+
+struct lo_inode *inodeTableGet(struct inode_table *t, dev_t dev, ino_t ino,
+                               int fd, bool is_symlink, bool read_mostly,
+                               bool *created);
+void inodeTableRef(struct inode_table *t, struct lo_inode *inode);
+bool inodeTableUnref(struct inode_table *t, struct lo_inode *inode, uint64_t n);
+size_t inodeTableCount(struct inode_table *t);
+size_t inodeTableOpenFds(struct inode_table *t);
+
+void inodeTableSetOrigin(struct inode_table *t, struct lo_inode *inode,
+                         struct lo_inode *parent, const char *name);
+bool inodeTableUsesPaths(struct inode_table *t);
+struct lo_inode *inodeTableFind(struct inode_table *t, dev_t dev, ino_t ino);
+void inodeTableRename(struct inode_table *t, struct lo_inode *inode,
+                      struct lo_inode *newParent, const char *newName);
+
+int inodeFdGet(struct inode_table *t, struct lo_inode *inode);
+void inodeFdPut(struct inode_table *t, struct lo_inode *inode);
+
+uint64_t inodeDataGen(struct lo_inode *inode);
+void inodeDataChanged(struct lo_inode *inode);
+
+#endif /* PROXY_INODE_H */
@@ -0,0 +1,1114 @@
+/* *****************************************************************************
+ * The write-back journal.  See proxy_journal.h for the big picture.
+ *
+ * Layout of the journal file:
+ *   0              Superblock A.
+ *   JOURNAL_SB_SZ  Superblock B.
+ *   JOURNAL_DATA   The ring of records, dataSize bytes.
+ * The superblock with the higher gen is the current one.
+ *
+ * Each write becomes one record: a journal_rec header, then the data, padded
+ * to JOURNAL_ALIGN.  A record that doesn't fit before the end of the ring
+ * goes at the front instead, and recovery knows to look there.  Records
+ * carry the epoch (bumped every time the journal is opened), so a record
+ * from an earlier run can never be mistaken for the next one.
+ *
+ * In memory, every record that hasn't been destaged has a journal_pending on
+ * a FIFO list.  Writers add to the tail and the destager takes from the head.
+ *   durableSeq  - Every record up to here is in the log, or failed.
+ *   destagedSeq - Every record up to here is on the NAS.
+ *
+ * If a record can't be written, its write fails and the journal is broken:
+ * recovery would stop at that record, so nothing after it can be trusted to
+ * the log.  No new writes are journaled, and the writes that already have a
+ * record after the broken one aren't acknowledged until they're destaged.
+ * The destager checks every record the way recovery does, and skips the
+ * failed ones.
+ *
+ * Until a file's records are destaged, getattr and read see them without
+ * waiting: journalStat() adds the size and mtime that the inode keeps, and
+ * journalRead() lays the records over what's on the NAS.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <sys/stat.h>
+
+#include "proxy_journal.h"
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+#define JOURNAL_MAGIC      (0x4c4e524a50584e4eULL)
+#define JOURNAL_REC_MAGIC  (0x4345524a50584e4eULL)
+#define JOURNAL_VERSION    (1)
+#define JOURNAL_SB_SZ      (4096)
+#define JOURNAL_DATA       (2 * JOURNAL_SB_SZ)
+#define JOURNAL_ALIGN      (512)
+#define JOURNAL_HANDLE_SZ  (128)
+
+/* The biggest write that we journal.  Bigger ones write straight through. */
+#define JOURNAL_MAX_WRITE  (4 * 1024 * 1024)
+
+/* The destager waits this long for a batch to fill up, unless somebody is
+ * waiting for it. */
+#define JOURNAL_DELAY_MS   (100)
+#define JOURNAL_BATCH_MIN  (4 * 1024 * 1024)
+#define JOURNAL_BATCH_MAX  (64 * 1024 * 1024)
+
+/* Adjacent writes to a file are merged into backend writes of up to this. */
+#define JOURNAL_MERGE_SZ   (1024 * 1024)
+
+/* How many files one batch can have open. */
+#define JOURNAL_BATCH_FDS  (32)
+
+/* How many times journalRead() starts over because the destager moved
+ * records out from under it, before it waits for the destager instead. */
+#define JOURNAL_READ_TRIES (3)
+
+struct journal_sb {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t epoch;
+	uint64_t gen;
+	uint64_t dataSize;
+	uint64_t headPos;         /* The oldest record that isn't on the NAS. */
+	uint64_t headSeq;
+	uint32_t pad;
+	uint32_t crc;             /* Of everything before it. */
+};
+
+struct journal_rec {
+	uint64_t magic;
+	uint64_t seq;
+	uint64_t offset;          /* Where the data goes in the file. */
+	uint32_t epoch;
+	uint32_t len;             /* Bytes of data after the header. */
+	uint32_t handleBytes;
+	int32_t handleType;
+	uint32_t pad;
+	uint32_t crc;             /* Of the header (crc = 0) and the data. */
+	unsigned char handle[JOURNAL_HANDLE_SZ];
+};
+
+struct journal_pending {
+	struct journal_pending *next;
+	uint64_t seq;
+	uint64_t pos;
+	uint32_t recLen;
+	ino_t ino;                /* Where the data goes, for journalRead(). */
+	uint64_t offset;
+	uint32_t len;
+	bool written;
+	bool failed;              /* It never made it into the log. */
+};
+
+/* The files that a batch of records is being written to. */
+struct journal_batch {
+	struct {
+		struct file_handle *fh;
+		int fd;
+	} files[JOURNAL_BATCH_FDS];
+	int numFiles;
+
+	/* Data that hasn't been written yet.  It all goes to one place. */
+	int fd;
+	off_t off;
+	size_t len;
+	char *buf;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t space;
+	pthread_cond_t durable;
+	pthread_cond_t destaged;
+
+	int fd;
+	int mountFd;
+	dev_t dev;
+	uint64_t dataSize;
+	uint32_t epoch;
+	uint64_t sbGen;
+
+	uint64_t tailPos;         /* Where the next record goes. */
+	uint64_t nextSeq;
+	uint64_t durableSeq;
+	uint64_t destagedSeq;
+	uint64_t flushTarget;     /* Somebody is waiting for this record. */
+	struct journal_pending *head;
+	struct journal_pending *tail;
+	struct journal_pending *notDurable; /* First record not in the log. */
+	size_t pendingBytes;
+
+	/* A record write failed.  Nothing new is journaled, and records after
+	 * brokenSeq are only safe once they're destaged. */
+	bool broken;
+	uint64_t brokenSeq;
+
+	bool running;
+	bool stopping;
+	pthread_t destager;
+} journal = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work = PTHREAD_COND_INITIALIZER,
+	.space = PTHREAD_COND_INITIALIZER,
+	.durable = PTHREAD_COND_INITIALIZER,
+	.destaged = PTHREAD_COND_INITIALIZER,
+	.fd = -1,
+	.mountFd = -1,
+};
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+static uint32_t journalRecLen(size_t len)
+{
+	return (sizeof(struct journal_rec) + len + JOURNAL_ALIGN - 1) & ~(JOURNAL_ALIGN - 1);
+}
+
+static uint32_t journalSbCrc(const struct journal_sb *sb)
+{
+	return crc32(0, (const Bytef *) sb, offsetof(struct journal_sb, crc));
+}
+
+/* The CRC of a record that's laid out in memory: header then data. */
+static uint32_t journalRecCrc(const struct journal_rec *rec)
+{
+	struct journal_rec hdr = *rec;
+	hdr.crc = 0;
+	uLong crc = crc32(0, (const Bytef *) &hdr, sizeof(hdr));
+	return crc32(crc, (const Bytef *) (rec + 1), rec->len);
+}
+
+static int journalPwrite(int fd, const void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = pwrite(fd, (const char *) buf + done, len - done, off + done);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		done += n;
+	}
+	return 0;
+}
+
+static int journalPread(int fd, void *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = pread(fd, (char *) buf + done, len - done, off + done);
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		if(n == 0)
+			return EIO;
+		done += n;
+	}
+	return 0;
+}
+
+/* Read from a file on the NAS until we have len bytes or reach the end.
+ *
+ * Returns:
+ *  >=0 = bytes read.
+ *   -1 = failure (errno says why).
+ */
+static ssize_t journalReadNas(int fd, char *buf, size_t len, off_t off)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = STATS_BACKEND(pread(fd, buf + done, len - done, off + done));
+		if(n == -1) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+		if(n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/* Does a record header look like the record seq of this epoch?  The caller
+ * still has to check the CRC once it has the data. */
+static bool journalRecHeaderOk(const struct journal_rec *rec, uint64_t seq, uint32_t epoch)
+{
+	return (rec->magic == JOURNAL_REC_MAGIC) && (rec->seq == seq) &&
+	       (rec->epoch == epoch) && (rec->len <= JOURNAL_MAX_WRITE) &&
+	       (rec->handleBytes <= JOURNAL_HANDLE_SZ);
+}
+
+/* Stop journaling.  Called with the lock held. */
+static void journalBreak(uint64_t seq)
+{
+	if(!journal.broken) {
+		journal.broken = true;
+		journal.brokenSeq = seq;
+		LOG_ERROR(NULL, "Journal: record %llu is bad.  Writing straight through from now on.",
+		          (unsigned long long) seq);
+	}
+}
+
+/* Write the next superblock.  The journal fd is O_DSYNC, so it's stable when
+ * this returns. */
+static int journalWriteSb(uint64_t headPos, uint64_t headSeq)
+{
+	struct journal_sb sb;
+	memset(&sb, 0, sizeof(sb));
+	sb.magic = JOURNAL_MAGIC;
+	sb.version = JOURNAL_VERSION;
+	sb.epoch = journal.epoch;
+	sb.gen = ++journal.sbGen;
+	sb.dataSize = journal.dataSize;
+	sb.headPos = headPos;
+	sb.headSeq = headSeq;
+	sb.crc = journalSbCrc(&sb);
+	return journalPwrite(journal.fd, &sb, sizeof(sb), (sb.gen & 1) * JOURNAL_SB_SZ);
+}
+
+/* Read the current superblock.
+ *
+ * Returns:
+ *   true  = sb is the current superblock.
+ *   false = There isn't one (a new journal).
+ */
+static bool journalReadSb(struct journal_sb *sb)
+{
+	bool found = false;
+	int i;
+	for(i = 0; i < 2; i++) {
+		struct journal_sb s;
+		if((journalPread(journal.fd, &s, sizeof(s), i * JOURNAL_SB_SZ) != 0) ||
+		   (s.magic != JOURNAL_MAGIC) || (s.version != JOURNAL_VERSION) ||
+		   (s.crc != journalSbCrc(&s)))
+			continue;
+		if(!found || (s.gen > sb->gen)) {
+			*sb = s;
+			found = true;
+		}
+	}
+	return found;
+}
+
+/* Add one record to a batch.
+ *
+ * Returns:
+ *   0 = success (or the file is gone, so there's nothing to do).
+ *  !0 = errno of failure.  Try the batch again later.
+ */
+static int journalBatchAdd(struct journal_batch *b, const struct journal_rec *rec)
+{
+	union {
+		struct file_handle fh;
+		char buf[sizeof(struct file_handle) + JOURNAL_HANDLE_SZ];
+	} u;
+	u.fh.handle_bytes = rec->handleBytes;
+	u.fh.handle_type = rec->handleType;
+	memcpy(u.fh.f_handle, rec->handle, rec->handleBytes);
+
+	int i;
+	for(i = 0; i < b->numFiles; i++) {
+		struct file_handle *fh = b->files[i].fh;
+		if((fh->handle_type == u.fh.handle_type) &&
+		   (fh->handle_bytes == u.fh.handle_bytes) &&
+		   (memcmp(fh->f_handle, u.fh.f_handle, fh->handle_bytes) == 0))
+			break;
+	}
+
+	if(i == b->numFiles) {
+		if(b->numFiles == JOURNAL_BATCH_FDS)
+			return EMFILE;
+
+		int fd = STATS_BACKEND(open_by_handle_at(journal.mountFd, &u.fh, O_WRONLY | O_CLOEXEC));
+		if((fd == -1) && ((errno == ESTALE) || (errno == ENOENT))) {
+			/* The file has been deleted.  Nobody will miss the data. */
+			statsCount(STATS_CTR_journal_orphans, 1);
+			return 0;
+		}
+		if(fd == -1)
+			return errno;
+
+		size_t fhLen = sizeof(struct file_handle) + u.fh.handle_bytes;
+		b->files[i].fh = malloc(fhLen);
+		if(b->files[i].fh == NULL) {
+			close(fd);
+			return ENOMEM;
+		}
+		memcpy(b->files[i].fh, &u.fh, fhLen);
+		b->files[i].fd = fd;
+		b->numFiles++;
+	}
+
+	int fd = b->files[i].fd;
+	const char *data = (const char *) (rec + 1);
+	size_t len = rec->len;
+
+	/* Merge it into the pending write if it picks up where that ends. */
+	if((b->len > 0) && ((b->fd != fd) || (b->off + (off_t) b->len != (off_t) rec->offset) ||
+	                    (b->len + len > JOURNAL_MERGE_SZ))) {
+		int error = STATS_BACKEND_BYTES(journalPwrite(b->fd, b->buf, b->len, b->off), b->len);
+		if(error != 0)
+			return error;
+		b->len = 0;
+	}
+
+	if(len > JOURNAL_MERGE_SZ)
+		return STATS_BACKEND_BYTES(journalPwrite(fd, data, len, rec->offset), len);
+
+	if(b->len == 0) {
+		b->fd = fd;
+		b->off = rec->offset;
+	}
+	memcpy(b->buf + b->len, data, len);
+	b->len += len;
+	return 0;
+}
+
+/* Write out what's left of a batch, make it stable on the NAS, and close the
+ * files.  If it fails, the batch has to be done again.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+static int journalBatchFinish(struct journal_batch *b, bool ok)
+{
+	int error = 0;
+	if(ok && (b->len > 0))
+		error = STATS_BACKEND_BYTES(journalPwrite(b->fd, b->buf, b->len, b->off), b->len);
+	b->len = 0;
+
+	int i;
+	for(i = 0; i < b->numFiles; i++) {
+		if(ok && (error == 0) && (STATS_BACKEND(fdatasync(b->files[i].fd)) == -1))
+			error = errno;
+		close(b->files[i].fd);
+		free(b->files[i].fh);
+	}
+	b->numFiles = 0;
+	return error;
+}
+
+/* Replay the records that were in the journal when we last stopped.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.  Don't serve the export.
+ */
+static int journalRecover(const struct journal_sb *sb, uint64_t *nextSeq)
+{
+	struct journal_batch b;
+	memset(&b, 0, sizeof(b));
+	b.buf = malloc(JOURNAL_MERGE_SZ);
+	struct journal_rec *rec = malloc(journalRecLen(JOURNAL_MAX_WRITE));
+	if((b.buf == NULL) || (rec == NULL)) {
+		free(b.buf);
+		free(rec);
+		return ENOMEM;
+	}
+
+	uint64_t pos = sb->headPos;
+	uint64_t seq = sb->headSeq;
+	uint64_t count = 0;
+	int error = 0;
+	for(;;) {
+		/* The next record is at pos, or at the front if it didn't fit. */
+		bool found = false;
+		int tries;
+		for(tries = 0; !found && (tries < 2); tries++, pos = 0) {
+			found = (pos + sizeof(*rec) <= sb->dataSize) &&
+			        (journalPread(journal.fd, rec, sizeof(*rec), JOURNAL_DATA + pos) == 0) &&
+			        journalRecHeaderOk(rec, seq, sb->epoch) &&
+			        (pos + journalRecLen(rec->len) <= sb->dataSize) &&
+			        (journalPread(journal.fd, rec + 1, rec->len, JOURNAL_DATA + pos + sizeof(*rec)) == 0) &&
+			        (rec->crc == journalRecCrc(rec));
+			if(found || (pos == 0))
+				break;
+		}
+		if(!found)
+			break;
+
+		if(b.numFiles == JOURNAL_BATCH_FDS)
+			error = journalBatchFinish(&b, true);
+		if(error == 0)
+			error = journalBatchAdd(&b, rec);
+		if(error != 0)
+			break;
+
+		pos += journalRecLen(rec->len);
+		seq++;
+		count++;
+	}
+
+	int finishError = journalBatchFinish(&b, error == 0);
+	if(error == 0)
+		error = finishError;
+	free(b.buf);
+	free(rec);
+
+	if(error == 0) {
+		LOG_STATUS(NULL, "Journal: replayed %llu records.", (unsigned long long) count);
+		*nextSeq = seq;
+	}
+	else {
+		LOG_ERROR(NULL, "Journal: replay stopped at record %llu (%s).",
+		          (unsigned long long) seq, strerror(error));
+	}
+	return error;
+}
+
+/* Find room for a record.  Called with the lock held.
+ *
+ * Returns:
+ *   true  = *pos is where it goes.
+ *   false = The ring is full.
+ */
+static bool journalReserve(uint32_t recLen, uint64_t *pos)
+{
+	uint64_t tail = journal.tailPos;
+	if(journal.head == NULL) {
+		*pos = (tail + recLen <= journal.dataSize) ? tail : 0;
+		return true;
+	}
+
+	uint64_t head = journal.head->pos;
+	if(tail > head) {
+		if(tail + recLen <= journal.dataSize) {
+			*pos = tail;
+			return true;
+		}
+		if(recLen <= head) {
+			*pos = 0;
+			return true;
+		}
+		return false;
+	}
+	if((tail < head) && (tail + recLen <= head)) {
+		*pos = tail;
+		return true;
+	}
+	return false;
+}
+
+static void *journalDestager(void *arg)
+{
+	(void) arg;
+
+	struct journal_batch b;
+	memset(&b, 0, sizeof(b));
+	b.buf = malloc(JOURNAL_MERGE_SZ);
+	struct journal_rec *rec = malloc(journalRecLen(JOURNAL_MAX_WRITE));
+	if((b.buf == NULL) || (rec == NULL)) {
+		LOG_ERROR(NULL, "Journal: no memory for the destager.");
+		free(b.buf);
+		free(rec);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&journal.lock);
+	for(;;) {
+		bool ready = (journal.head != NULL) && (journal.head->seq <= journal.durableSeq);
+		if(!ready) {
+			if(journal.stopping && (journal.head == NULL))
+				break;
+			pthread_cond_wait(&journal.work, &journal.lock);
+			continue;
+		}
+
+		/* Give the batch a chance to fill up, unless somebody needs
+		 * it now. */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += JOURNAL_DELAY_MS * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while((journal.pendingBytes < JOURNAL_BATCH_MIN) && !journal.stopping &&
+		      (journal.flushTarget <= journal.destagedSeq) &&
+		      (pthread_cond_timedwait(&journal.work, &journal.lock, &ts) != ETIMEDOUT))
+			;
+
+		/* Take every durable record, up to the batch limit.  Nobody
+		 * else removes records, so they stay put without the lock. */
+		struct journal_pending *first = journal.head;
+		struct journal_pending *last = first;
+		size_t bytes = first->recLen;
+		while((last->next != NULL) && (last->next->seq <= journal.durableSeq) &&
+		      (bytes + last->next->recLen <= JOURNAL_BATCH_MAX)) {
+			last = last->next;
+			bytes += last->recLen;
+		}
+		bool stopping = journal.stopping;
+		pthread_mutex_unlock(&journal.lock);
+
+		/* A failed record holds nothing that anybody was told is
+		 * written, and a record that doesn't check out would put
+		 * garbage in the file.  Both are skipped. */
+		int error = 0;
+		uint64_t count = 0;
+		struct journal_pending *p;
+		for(p = first; (error == 0); p = p->next) {
+			if(!p->failed) {
+				error = journalPread(journal.fd, rec, p->recLen, JOURNAL_DATA + p->pos);
+				if((error == 0) && (!journalRecHeaderOk(rec, p->seq, journal.epoch) ||
+				                    (journalRecLen(rec->len) != p->recLen) ||
+				                    (rec->crc != journalRecCrc(rec)))) {
+					statsCount(STATS_CTR_journal_bad_records, 1);
+					pthread_mutex_lock(&journal.lock);
+					journalBreak(p->seq);
+					pthread_mutex_unlock(&journal.lock);
+				}
+				else {
+					if((error == 0) && (b.numFiles == JOURNAL_BATCH_FDS))
+						error = journalBatchFinish(&b, true);
+					if(error == 0)
+						error = journalBatchAdd(&b, rec);
+					count++;
+				}
+			}
+			if(p == last)
+				break;
+		}
+		int finishError = journalBatchFinish(&b, error == 0);
+		if(error == 0)
+			error = finishError;
+
+		pthread_mutex_lock(&journal.lock);
+		uint64_t headPos = (last->next != NULL) ? last->next->pos : journal.tailPos;
+		uint64_t headSeq = last->seq + 1;
+		pthread_mutex_unlock(&journal.lock);
+
+		/* The superblock has to move past the records before their space
+		 * can be reused, or recovery could trip over the new ones. */
+		if(error == 0)
+			error = journalWriteSb(headPos, headSeq);
+
+		if(error != 0) {
+			LOG_ERROR(NULL, "Journal: destage of records %llu..%llu failed (%s).  Retrying.",
+			          (unsigned long long) first->seq, (unsigned long long) last->seq,
+			          strerror(error));
+			pthread_mutex_lock(&journal.lock);
+			if(stopping) {
+				/* They're safe in the journal.  The next start
+				 * will replay them. */
+				break;
+			}
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec++;
+			pthread_cond_timedwait(&journal.work, &journal.lock, &ts);
+			continue;
+		}
+		statsCount(STATS_CTR_journal_destaged, count);
+
+		pthread_mutex_lock(&journal.lock);
+		struct journal_pending *next = last->next;
+		while(journal.head != next) {
+			p = journal.head;
+			journal.head = p->next;
+			journal.pendingBytes -= p->recLen;
+			free(p);
+		}
+		if(journal.head == NULL)
+			journal.tail = NULL;
+		__atomic_store_n(&journal.destagedSeq, headSeq - 1, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&journal.space);
+		pthread_cond_broadcast(&journal.destaged);
+	}
+	journal.running = false;
+	pthread_cond_broadcast(&journal.destaged);
+	pthread_mutex_unlock(&journal.lock);
+
+	free(b.buf);
+	free(rec);
+	return NULL;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Open the journal and replay whatever is in it.  path NULL leaves the
+ * journal disabled.  rootFd is the top of the export.  Call it before the
+ * export is mounted.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int journalInit(const char *path, size_t bytes, int rootFd)
+{
+	if(path == NULL)
+		return 0;
+
+	if(bytes < 4 * (uint64_t) journalRecLen(JOURNAL_MAX_WRITE))
+		return EINVAL;
+
+	int error = 0;
+	do {
+		struct stat st;
+		if(fstat(rootFd, &st) == -1) {
+			error = errno;
+			break;
+		}
+		journal.dev = st.st_dev;
+
+		journal.mountFd = openat(rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if(journal.mountFd == -1) {
+			error = errno;
+			break;
+		}
+
+		journal.fd = open(path, O_RDWR | O_CREAT | O_DSYNC | O_CLOEXEC, 0600);
+		if(journal.fd == -1) {
+			error = errno;
+			break;
+		}
+
+		/* Finish what the last run started.  Its records are replayed
+		 * with its ring size, even if ours is different. */
+		struct journal_sb sb;
+		memset(&sb, 0, sizeof(sb));
+		uint64_t nextSeq = 1;
+		journal.epoch = 1;
+		if(journalReadSb(&sb)) {
+			error = journalRecover(&sb, &nextSeq);
+			if(error != 0)
+				break;
+			journal.epoch = sb.epoch + 1;
+			journal.sbGen = sb.gen;
+		}
+
+		journal.dataSize = (bytes - JOURNAL_DATA) & ~((uint64_t) JOURNAL_ALIGN - 1);
+		error = posix_fallocate(journal.fd, 0, JOURNAL_DATA + journal.dataSize);
+		if(error != 0)
+			break;
+
+		journal.tailPos = 0;
+		journal.nextSeq = nextSeq;
+		journal.durableSeq = nextSeq - 1;
+		journal.destagedSeq = nextSeq - 1;
+		journal.flushTarget = 0;
+		error = journalWriteSb(0, nextSeq);
+	} while(0);
+
+	if(error != 0) {
+		journalDestroy();
+		return error;
+	}
+
+	LOG_STATUS(NULL, "Journal: %s : %llu MB.", path,
+	           (unsigned long long) (journal.dataSize / (1024 * 1024)));
+	return 0;
+}
+
+void journalDestroy(void)
+{
+	if(journal.fd != -1)
+		close(journal.fd);
+	if(journal.mountFd != -1)
+		close(journal.mountFd);
+	journal.fd = -1;
+	journal.mountFd = -1;
+}
+
+bool journalEnabled(void)
+{
+	return journal.fd != -1;
+}
+
+/* Start the destager.  Call it after fuse_daemonize().  Nothing is journaled
+ * until it's running.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int journalStart(void)
+{
+	if(!journalEnabled())
+		return 0;
+
+	journal.stopping = false;
+	int rc = pthread_create(&journal.destager, NULL, journalDestager, NULL);
+	if(rc != 0)
+		return rc;
+
+	pthread_mutex_lock(&journal.lock);
+	journal.running = true;
+	pthread_mutex_unlock(&journal.lock);
+	return 0;
+}
+
+/* Destage everything, then stop the destager.  If the NAS won't take the
+ * data, it stays in the journal for the next start. */
+void journalStop(void)
+{
+	pthread_mutex_lock(&journal.lock);
+	bool running = journal.running;
+	journal.stopping = true;
+	pthread_cond_signal(&journal.work);
+	pthread_mutex_unlock(&journal.lock);
+
+	if(running)
+		pthread_join(journal.destager, NULL);
+}
+
+/* Should writes through an open with these flags be journaled? */
+bool journalCovers(struct lo_inode *inode, int openFlags)
+{
+	if(!journalEnabled() || !__atomic_load_n(&journal.running, __ATOMIC_ACQUIRE) ||
+	   __atomic_load_n(&journal.broken, __ATOMIC_ACQUIRE))
+		return false;
+	if(((openFlags & O_ACCMODE) == O_RDONLY) || (openFlags & (O_DIRECT | O_APPEND)))
+		return false;
+	return (inode->handle != NULL) && (inode->dev == journal.dev) &&
+	       (inode->handle->handle_bytes <= JOURNAL_HANDLE_SZ);
+}
+
+/* Journal a write.  It returns when the write (and every write before it) is
+ * stable in the journal.
+ *
+ * Returns:
+ *  >=0 = bytes written.
+ *   <0 = -errno of failure.  -EFBIG means that it wasn't journaled (it's too
+ *        big, or the journal is broken), and should be written straight
+ *        through.
+ */
+ssize_t journalWrite(struct lo_inode *inode, struct fuse_bufvec *src, off_t off)
+{
+	size_t len = fuse_buf_size(src);
+	if((len > JOURNAL_MAX_WRITE) || __atomic_load_n(&journal.broken, __ATOMIC_ACQUIRE))
+		return -EFBIG;
+
+	uint32_t recLen = journalRecLen(len);
+	struct journal_rec *rec = calloc(1, recLen);
+	struct journal_pending *p = malloc(sizeof(struct journal_pending));
+	if((rec == NULL) || (p == NULL)) {
+		free(rec);
+		free(p);
+		return -ENOMEM;
+	}
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+	dst.buf[0].mem = rec + 1;
+	ssize_t res = fuse_buf_copy(&dst, src, 0);
+	if(res < 0) {
+		free(rec);
+		free(p);
+		return res;
+	}
+	len = res;
+
+	rec->magic = JOURNAL_REC_MAGIC;
+	rec->offset = off;
+	rec->epoch = journal.epoch;
+	rec->len = len;
+	rec->handleBytes = inode->handle->handle_bytes;
+	rec->handleType = inode->handle->handle_type;
+	memcpy(rec->handle, inode->handle->f_handle, rec->handleBytes);
+
+	pthread_mutex_lock(&journal.lock);
+	uint64_t pos;
+	if(!journalReserve(recLen, &pos)) {
+		statsCount(STATS_CTR_journal_full_waits, 1);
+		pthread_cond_signal(&journal.work);
+		do {
+			pthread_cond_wait(&journal.space, &journal.lock);
+		} while(!journalReserve(recLen, &pos));
+	}
+	p->next = NULL;
+	p->seq = journal.nextSeq++;
+	p->pos = pos;
+	p->recLen = recLen;
+	p->ino = inode->ino;
+	p->offset = off;
+	p->len = len;
+	p->written = false;
+	p->failed = false;
+	if(journal.tail != NULL)
+		journal.tail->next = p;
+	else
+		journal.head = p;
+	journal.tail = p;
+	if(journal.notDurable == NULL)
+		journal.notDurable = p;
+	journal.tailPos = pos + recLen;
+	journal.pendingBytes += recLen;
+	uint64_t seq = p->seq;
+	pthread_mutex_unlock(&journal.lock);
+
+	rec->seq = seq;
+	rec->crc = journalRecCrc(rec);
+	int error = journalPwrite(journal.fd, rec, recLen, JOURNAL_DATA + pos);
+	free(rec);
+	if(error != 0) {
+		LOG_ERROR(NULL, "Journal: write of record %llu failed (%s).",
+		          (unsigned long long) seq, strerror(error));
+		statsCount(STATS_CTR_journal_write_errors, 1);
+	}
+
+	/* We can only answer once everything before us is in, too.
+	 * Otherwise recovery could stop short of an acknowledged write. */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t mtime = ((uint64_t) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+
+	pthread_mutex_lock(&journal.lock);
+	if(error != 0) {
+		p->failed = true;
+		journalBreak(seq);
+	}
+	p->written = true;
+	while((journal.notDurable != NULL) && journal.notDurable->written) {
+		journal.durableSeq = journal.notDurable->seq;
+		journal.notDurable = journal.notDurable->next;
+	}
+	pthread_cond_broadcast(&journal.durable);
+	pthread_cond_signal(&journal.work);
+	while(journal.durableSeq < seq)
+		pthread_cond_wait(&journal.durable, &journal.lock);
+	if(error == 0) {
+		if(inode->journalEnd < off + len)
+			inode->journalEnd = off + len;
+		if(inode->journalMtime < mtime)
+			inode->journalMtime = mtime;
+		if(inode->journalSeq < seq)
+			__atomic_store_n(&inode->journalSeq, seq, __ATOMIC_RELEASE);
+	}
+
+	/* Recovery would stop at the broken record, before this one, so this
+	 * one is only safe once it's on the NAS. */
+	if((error == 0) && journal.broken && (seq > journal.brokenSeq)) {
+		if(journal.flushTarget < seq)
+			journal.flushTarget = seq;
+		pthread_cond_signal(&journal.work);
+		while(journal.running && (journal.destagedSeq < seq))
+			pthread_cond_wait(&journal.destaged, &journal.lock);
+		if(journal.destagedSeq < seq)
+			error = EIO;
+	}
+	pthread_mutex_unlock(&journal.lock);
+
+	if(error != 0)
+		return -error;
+
+	statsCount(STATS_CTR_journal_writes, 1);
+	statsCount(STATS_CTR_journal_bytes, len);
+	return len;
+}
+
+/* Wait until everything journaled for this file is on the NAS.  Call it
+ * before anything that changes the file on the NAS some other way (truncate,
+ * a write that isn't journaled, ...). */
+void journalFlushInode(struct lo_inode *inode)
+{
+	uint64_t seq = __atomic_load_n(&inode->journalSeq, __ATOMIC_ACQUIRE);
+	if(seq == 0)
+		return;
+
+	pthread_mutex_lock(&journal.lock);
+	if(journal.destagedSeq < seq) {
+		statsCount(STATS_CTR_journal_flush_waits, 1);
+		if(journal.flushTarget < seq)
+			journal.flushTarget = seq;
+		pthread_cond_signal(&journal.work);
+		while(journal.running && (journal.destagedSeq < seq))
+			pthread_cond_wait(&journal.destaged, &journal.lock);
+	}
+
+	/* The NAS has it all now, and the caller is about to change it, so
+	 * what the records said about the size is out of date. */
+	if(journal.destagedSeq >= inode->journalSeq)
+		inode->journalEnd = 0;
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/* Write len bytes at backend offset off: to the journal if it covers the
+ * file, or else straight to the NAS, once the journal's records for the file
+ * are there.  For the layers that write their own backend data (compression
+ * and encryption), so their writes stay in order with the file's others.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int journalWriteAt(struct lo_inode *inode, int fd, const char *buf, size_t len, off_t off)
+{
+	if(journalCovers(inode, O_RDWR)) {
+		struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+		src.buf[0].mem = (void *) buf;
+		ssize_t res = journalWrite(inode, &src, off);
+		if(res >= 0)
+			return (res == (ssize_t) len) ? 0 : EIO;
+		if(res != -EFBIG)
+			return -res;
+	}
+
+	journalFlushInode(inode);
+	return STATS_BACKEND_BYTES(journalPwrite(fd, buf, len, off), len);
+}
+
+/* Does the file have records that aren't on the NAS yet? */
+bool journalPending(struct lo_inode *inode)
+{
+	uint64_t seq = __atomic_load_n(&inode->journalSeq, __ATOMIC_ACQUIRE);
+	return (seq != 0) && (seq > __atomic_load_n(&journal.destagedSeq, __ATOMIC_ACQUIRE));
+}
+
+/* Add the file's journaled writes to what the NAS says about it.  st is from
+ * the backend, so the size is a backend size.  Only call it if
+ * journalPending() was true before the backend was asked. */
+void journalStat(struct lo_inode *inode, struct stat *st)
+{
+	pthread_mutex_lock(&journal.lock);
+	if(st->st_size < (off_t) inode->journalEnd)
+		st->st_size = inode->journalEnd;
+	uint64_t mtime = ((uint64_t) st->st_mtim.tv_sec * 1000000000ULL) + st->st_mtim.tv_nsec;
+	if(mtime < inode->journalMtime) {
+		st->st_mtim.tv_sec = inode->journalMtime / 1000000000ULL;
+		st->st_mtim.tv_nsec = inode->journalMtime % 1000000000ULL;
+		st->st_ctim = st->st_mtim;
+	}
+	pthread_mutex_unlock(&journal.lock);
+}
+
+/* Read a file from the NAS, with the records that haven't been destaged yet
+ * laid over it.  off is a backend offset.
+ *
+ * The records' data is read from the journal without the lock, so the
+ * destager can destage them (and their space can be reused) meanwhile.  If
+ * that happens, the NAS has them, so the read starts over.
+ *
+ * Returns:
+ *  >=0 = bytes read.
+ *   -1 = failure (errno says why).
+ */
+ssize_t journalRead(struct lo_inode *inode, int fd, char *buf, size_t size, off_t off)
+{
+	struct journal_piece {
+		uint64_t seq;
+		uint64_t pos;             /* Of the record in the ring. */
+		uint64_t offset;          /* Of the record's data in the file. */
+		uint32_t len;
+	} *pieces = NULL;
+
+	if(!journalPending(inode))
+		return journalReadNas(fd, buf, size, off);
+
+	size_t numPieces = 0;
+	size_t maxPieces = 0;
+	ssize_t res = -1;
+	int error = 0;
+	int tries;
+
+	for(tries = 0; tries < JOURNAL_READ_TRIES; tries++) {
+		/* The acknowledged records that overlap the read, oldest
+		 * first. */
+		numPieces = 0;
+		pthread_mutex_lock(&journal.lock);
+		uint64_t end = inode->journalEnd;
+		struct journal_pending *p;
+		for(p = journal.head; (p != NULL) && (p->seq <= journal.durableSeq); p = p->next) {
+			if((p->ino != inode->ino) || p->failed || (p->len == 0) ||
+			   (p->offset >= (uint64_t) off + size) || (p->offset + p->len <= (uint64_t) off))
+				continue;
+			if(numPieces == maxPieces) {
+				size_t n = (maxPieces == 0) ? 16 : 2 * maxPieces;
+				void *bigger = realloc(pieces, n * sizeof(*pieces));
+				if(bigger == NULL) {
+					error = ENOMEM;
+					break;
+				}
+				pieces = bigger;
+				maxPieces = n;
+			}
+			pieces[numPieces++] = (struct journal_piece) {
+				.seq = p->seq, .pos = p->pos, .offset = p->offset, .len = p->len,
+			};
+		}
+		pthread_mutex_unlock(&journal.lock);
+		if(error != 0)
+			break;
+
+		/* What the NAS has, then zeros up to where the journaled
+		 * writes end, which can be past the end of the NAS's copy. */
+		ssize_t n = journalReadNas(fd, buf, size, off);
+		if(n == -1) {
+			error = errno;
+			break;
+		}
+		size_t got = n;
+		memset(buf + got, 0, size - got);
+		if((end > (uint64_t) off) && (got < end - off))
+			got = (end - off < size) ? end - off : size;
+		if(numPieces == 0) {
+			res = got;
+			break;
+		}
+
+		size_t i;
+		for(i = 0; (i < numPieces) && (error == 0); i++) {
+			uint64_t from = (pieces[i].offset > (uint64_t) off) ? pieces[i].offset : (uint64_t) off;
+			uint64_t to = pieces[i].offset + pieces[i].len;
+			if(to > (uint64_t) off + size)
+				to = off + size;
+			error = journalPread(journal.fd, buf + (from - off), to - from,
+			                     JOURNAL_DATA + pieces[i].pos + sizeof(struct journal_rec) +
+			                     (from - pieces[i].offset));
+		}
+		if(error != 0)
+			break;
+
+		/* If the oldest record is still in the journal, they all are,
+		 * and they're what we read. */
+		if(pieces[0].seq > __atomic_load_n(&journal.destagedSeq, __ATOMIC_ACQUIRE)) {
+			res = got;
+			break;
+		}
+	}
+	free(pieces);
+
+	if((res == -1) && (error == 0)) {
+		/* The destager keeps beating us.  Let it finish. */
+		journalFlushInode(inode);
+		res = journalReadNas(fd, buf, size, off);
+		if(res == -1)
+			error = errno;
+	}
+
+	if(error != 0)
+		errno = error;
+	return res;
+}
+
+/* Gauge callback for the stats exporter. */
+double journalPendingBytes(void *arg)
+{
+	(void) arg;
+	pthread_mutex_lock(&journal.lock);
+	double bytes = journal.pendingBytes;
+	pthread_mutex_unlock(&journal.lock);
+	return bytes;
+}
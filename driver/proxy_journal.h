@@ -0,0 +1,65 @@
+/* *****************************************************************************
+ * The write-back journal.
+ *
+ * With PROXY_BRIDGE_JOURNAL set, writes to regular files are appended to a
+ * log on local (fast) storage and acknowledged as soon as they're stable
+ * there.  fsync() on those files has nothing left to wait for.  A background
+ * destager replays the log to the NAS, oldest first, in big batches.  It
+ * fsync()s the files that it wrote before it forgets any records.
+ *
+ * The log is a ring in one preallocated file (PROXY_BRIDGE_JOURNAL_MB,
+ * default 1 GB).  Each record holds the file handle of the file, the offset,
+ * the data, and a CRC of the whole record.  Two superblocks at the front of
+ * the file say where the oldest record that hasn't been destaged is.  They
+ * take turns being written, so one of them is always whole.  When the proxy
+ * starts, everything after that point is replayed to the NAS before the
+ * export is mounted.  A write is acknowledged only after it and every write
+ * before it are in the log, so recovery can stop at the first bad record
+ * without losing anything that was acknowledged.  If a record can't be
+ * written, that write fails, and the journal stops taking writes.  From then
+ * on they go straight through to the NAS.
+ *
+ * Files are named by file handle, so the journal needs a backend that gives
+ * out handles (see proxy_inode.h), and only files on the export's own
+ * filesystem are journaled.  Opens with O_DIRECT or O_APPEND write straight
+ * through.  O_SYNC writes are journaled, since they're stable once they're
+ * in the log.
+ *
+ * Reads and getattrs don't wait for the destager.  Reads lay the records
+ * that haven't been destaged over the NAS's copy of the file, and getattr
+ * adds in the size and mtime of the journaled writes.  Anything that changes
+ * the NAS's copy some other way (a truncate, a time change, O_TRUNC, a write
+ * that isn't journaled) first waits for the destager to get through that
+ * file's last record, the same way the write buffers are flushed.  Other NAS
+ * clients don't see the data until it's destaged.
+ * ****************************************************************************/
+
+#ifndef PROXY_JOURNAL_H
+#define PROXY_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "proxy_inode.h"
+
+struct fuse_bufvec;
+struct stat;
+
+int journalInit(const char *path, size_t bytes, int rootFd);
+void journalDestroy(void);
+bool journalEnabled(void);
+int journalStart(void);
+void journalStop(void);
+
+bool journalCovers(struct lo_inode *inode, int openFlags);
+ssize_t journalWrite(struct lo_inode *inode, struct fuse_bufvec *src, off_t off);
+int journalWriteAt(struct lo_inode *inode, int fd, const char *buf, size_t len, off_t off);
+void journalFlushInode(struct lo_inode *inode);
+bool journalPending(struct lo_inode *inode);
+void journalStat(struct lo_inode *inode, struct stat *st);
+ssize_t journalRead(struct lo_inode *inode, int fd, char *buf, size_t size, off_t off);
+double journalPendingBytes(void *arg);
+
+#endif /* PROXY_JOURNAL_H */
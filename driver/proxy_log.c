@@ -0,0 +1,314 @@
+/* *****************************************************************************
+ * Logging.  See proxy_log.h for the big picture.
+ *
+ * Each thread that logs gets its own single-producer/single-consumer ring.
+ * The request thread is the only writer of "head", and the log writer thread
+ * is the only writer of "tail", so neither side needs a lock.  The list of
+ * rings is protected by a mutex, but a thread only takes it once (the first
+ * time it logs).
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "proxy_log.h"
+
+/* Both must be powers of 2. */
+#define LOG_RING_SLOTS (256)
+#define LOG_MSG_SZ     (512)
+
+struct log_rec {
+	int priority;
+	char msg[LOG_MSG_SZ];
+};
+
+struct log_ring {
+	struct log_ring *next;
+	uint64_t head;            /* Written by the request thread. */
+	uint64_t tail;            /* Written by the log writer thread. */
+	uint64_t dropped;
+	int dead;                 /* The owning thread has exited. */
+	struct log_rec recs[LOG_RING_SLOTS];
+};
+
+int logLevel = LOG_ERR;
+static int logToSyslog = 0;
+
+static pthread_mutex_t ringListLock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *ringList = NULL;
+static pthread_key_t ringKey;
+static __thread struct log_ring *myRing = NULL;
+
+static pthread_t writerThread;
+static int writerRunning = 0;
+static int writerStop = 0;
+
+/* *****************************************************************************
+ * Output.  Only the writer thread (or a thread logging synchronously, before
+ * the writer has started) calls this.
+ * ****************************************************************************/
+
+static void logOutput(int priority, const char *msg)
+{
+	if(logToSyslog) {
+		syslog(priority, "%s", msg);
+	}
+	else {
+		fputs(msg, stderr);
+		fputc('\n', stderr);
+	}
+}
+
+/* Format a message into buf.  The prefix is the same one we've always used. */
+static void logFormat(char *buf, size_t bufSize, struct fuse_req *req,
+                      const char *func, const char *fmt, va_list args)
+{
+	int len;
+	if(req != NULL) {
+		const struct fuse_ctx *ctx = fuse_req_ctx(req);
+		len = snprintf(buf, bufSize, "[%s] (%d %d %d): ", func,
+		               ctx->uid, ctx->gid, ctx->pid);
+	}
+	else {
+		len = snprintf(buf, bufSize, "[%s]: ", func);
+	}
+
+	if((len >= 0) && (len < bufSize)) {
+		vsnprintf(buf + len, bufSize - len, fmt, args);
+	}
+}
+
+/* *****************************************************************************
+ * The per-thread rings.
+ * ****************************************************************************/
+
+/* Called when a thread that owns a ring exits.  The writer thread frees the
+ * ring once it has drained it. */
+static void logRingRelease(void *arg)
+{
+	struct log_ring *ring = (struct log_ring *) arg;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static struct log_ring *logRingGet(void)
+{
+	if(myRing == NULL) {
+		struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+		if(ring == NULL) {
+			return NULL;
+		}
+
+		pthread_mutex_lock(&ringListLock);
+		ring->next = ringList;
+		ringList = ring;
+		pthread_mutex_unlock(&ringListLock);
+
+		pthread_setspecific(ringKey, ring);
+		myRing = ring;
+	}
+	return myRing;
+}
+
+/* Drain everything that is currently in a ring.
+ *
+ * Returns the number of messages written. */
+static int logRingDrain(struct log_ring *ring)
+{
+	int count = 0;
+
+	uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+	if(dropped != 0) {
+		char buf[128];
+		snprintf(buf, sizeof(buf), "[logRingDrain]: %llu messages dropped.",
+		         (unsigned long long) dropped);
+		logOutput(LOG_WARNING, buf);
+		count++;
+	}
+
+	uint64_t tail = ring->tail;
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while(tail != head) {
+		struct log_rec *rec = &ring->recs[tail & (LOG_RING_SLOTS - 1)];
+		logOutput(rec->priority, rec->msg);
+		tail++;
+		count++;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+/* Drain all of the rings.  Free the rings whose threads have gone away.
+ *
+ * Returns the number of messages written. */
+static int logDrainAll(void)
+{
+	int count = 0;
+
+	pthread_mutex_lock(&ringListLock);
+	struct log_ring **pp = &ringList;
+	while(*pp != NULL) {
+		struct log_ring *ring = *pp;
+
+		/* Read "dead" before we drain.  If the thread exited, then it
+		 * can't add anything after this. */
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+
+		count += logRingDrain(ring);
+
+		if(dead) {
+			*pp = ring->next;
+			free(ring);
+		}
+		else {
+			pp = &ring->next;
+		}
+	}
+	pthread_mutex_unlock(&ringListLock);
+
+	if((count != 0) && !logToSyslog) {
+		fflush(stderr);
+	}
+
+	return count;
+}
+
+static void *logWriterThread(void *arg)
+{
+	(void) arg;
+
+	while(!__atomic_load_n(&writerStop, __ATOMIC_ACQUIRE)) {
+		if(logDrainAll() == 0) {
+			struct timespec ts = { 0, 10 * 1000 * 1000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	logDrainAll();
+	return NULL;
+}
+
+/* *****************************************************************************
+ * THE EXPORTED API FUNCTIONS.
+ * ****************************************************************************/
+
+void logMsg(struct fuse_req *req, const char *func, int priority, const char *fmt, ...)
+{
+	int saverr = errno;
+	va_list args;
+	va_start(args, fmt);
+
+	struct log_ring *ring = NULL;
+	if(__atomic_load_n(&writerRunning, __ATOMIC_ACQUIRE)) {
+		ring = logRingGet();
+	}
+
+	uint64_t head = 0;
+	if(ring != NULL) {
+		head = ring->head;
+		uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if((head - tail) >= LOG_RING_SLOTS) {
+			/* The ring is full.  Errors are too important to drop, so
+			 * they get written the slow way.  Everything else is
+			 * dropped (and counted). */
+			if(priority > LOG_ERR) {
+				__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+				va_end(args);
+				errno = saverr;
+				return;
+			}
+			ring = NULL;
+		}
+	}
+
+	if(ring == NULL) {
+		/* The writer isn't running (or we're out of memory, or the ring
+		 * is full).  Do it the slow way. */
+		char buf[LOG_MSG_SZ];
+		logFormat(buf, sizeof(buf), req, func, fmt, args);
+		logOutput(priority, buf);
+	}
+	else {
+		struct log_rec *rec = &ring->recs[head & (LOG_RING_SLOTS - 1)];
+		rec->priority = priority;
+		logFormat(rec->msg, sizeof(rec->msg), req, func, fmt, args);
+		__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	}
+
+	va_end(args);
+
+	/* Callers use errno (and %m) after logging. */
+	errno = saverr;
+}
+
+/* Convert a level name ("error", "info", "debug", "trace") into a syslog
+ * priority.  Returns -1 if we don't recognize it. */
+int logLevelFromString(const char *str)
+{
+	if(str == NULL)                   { return -1;          }
+	if(strcasecmp(str, "error") == 0) { return LOG_ERR;     }
+	if(strcasecmp(str, "info")  == 0) { return LOG_INFO;    }
+	if(strcasecmp(str, "debug") == 0) { return LOG_DEBUG;   }
+	if(strcasecmp(str, "trace") == 0) { return LOG_DEBUG;   }
+	return -1;
+}
+
+/* Set the runtime level and the destination.  Safe to call before logStart().
+ * Until logStart() is called, messages are written synchronously. */
+void logInit(int level, int toSyslog)
+{
+	__atomic_store_n(&logLevel, level, __ATOMIC_RELAXED);
+	logToSyslog = toSyslog;
+	if(logToSyslog) {
+		openlog("proxy_bridge", LOG_PID, LOG_DAEMON);
+	}
+}
+
+/* Start the background writer.  This must happen after fuse_daemonize(),
+ * because the fork() won't carry our thread along with it.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int logStart(void)
+{
+	int rc = pthread_key_create(&ringKey, logRingRelease);
+	if(rc != 0) {
+		return rc;
+	}
+
+	writerStop = 0;
+	rc = pthread_create(&writerThread, NULL, logWriterThread, NULL);
+	if(rc != 0) {
+		return rc;
+	}
+
+	__atomic_store_n(&writerRunning, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Stop the background writer after it has written everything that is queued.
+ * Anything logged after this is written synchronously. */
+void logStop(void)
+{
+	if(!__atomic_load_n(&writerRunning, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	__atomic_store_n(&writerRunning, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&writerStop, 1, __ATOMIC_RELEASE);
+	pthread_join(writerThread, NULL);
+}
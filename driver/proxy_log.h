@@ -0,0 +1,62 @@
+/* *****************************************************************************
+ * Logging.
+ *
+ * The level of a message is checked before anything else happens, so a
+ * disabled LOG_TRACE() costs a compare and a branch.  None of its arguments
+ * are evaluated.
+ *
+ * There are 2 levels of filtering:
+ * 1. LOG_COMPILE_LEVEL - Messages above this level are compiled out.  Debug
+ *    builds (-DDEBUG) keep everything.  Release builds drop the
+ *    ENTER/EXIT/TRACE messages.
+ * 2. logLevel - Set at runtime (PROXY_BRIDGE_LOG_LEVEL).
+ * LOG_STATUS() skips both.  It's for the few lines that say how the proxy
+ * is set up (mostly at startup), which are wanted even at the default level
+ * of errors only.  Don't use it for anything that happens per request.
+ *
+ * Once logStart() has been called, messages are formatted into a per-thread
+ * ring buffer and a background thread writes them to stderr or syslog.  So a
+ * request thread never blocks on the output.  If a ring fills up, the message
+ * is dropped and counted.
+ * ****************************************************************************/
+
+#ifndef PROXY_LOG_H
+#define PROXY_LOG_H
+
+#include <syslog.h>
+
+struct fuse_req;
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef DEBUG
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#else
+#define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+#endif
+
+extern int logLevel;
+
+#define LOG_ENABLED(prio) \
+	(((prio) <= LOG_COMPILE_LEVEL) && ((prio) <= __atomic_load_n(&logLevel, __ATOMIC_RELAXED)))
+
+void logMsg(struct fuse_req *req, const char *func, int priority, const char *fmt, ...);
+
+#define LOG_AT(req, prio, fmt, ...) do { \
+	if(LOG_ENABLED(prio)) { \
+		logMsg(req, __func__, prio, fmt, ##__VA_ARGS__); \
+	} \
+} while(0)
+
+#define LOG_ENTER(req, fmt, ...)  LOG_AT(req, LOG_DEBUG, "ENTER: " fmt, ##__VA_ARGS__)
+#define LOG_EXIT(req, fmt, ...)   LOG_AT(req, LOG_DEBUG, "EXIT: " fmt, ##__VA_ARGS__)
+#define LOG_TRACE(req, fmt, ...)  LOG_AT(req, LOG_DEBUG, fmt, ##__VA_ARGS__)
+#define LOG_STATUS(req, fmt, ...) logMsg(req, __func__, LOG_NOTICE, fmt, ##__VA_ARGS__)
+#define LOG_ERROR(req, fmt, ...)  LOG_AT(req, LOG_ERR, "ERROR: " fmt, ##__VA_ARGS__)
+
+int logLevelFromString(const char *str);
+void logInit(int level, int toSyslog);
+int logStart(void);
+void logStop(void);
+
+#endif /* PROXY_LOG_H */
@@ -0,0 +1,189 @@
+/* *****************************************************************************
+ * The worker pool.  See proxy_pool.h for the big picture.
+ *
+ * Each workPoolRun() call posts a job on the queue.  Every thread that works
+ * on a job (the workers and the caller) claims loop indices with an atomic
+ * add until they run out.  The job lives on the caller's stack, so the
+ * caller doesn't return until every thread that joined the job has left it.
+ * The workers charge their backend calls to the caller's handler.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "proxy_log.h"
+#include "proxy_pool.h"
+#include "proxy_stats.h"
+
+struct pool_job {
+	struct pool_job *next;    /* Protected by poolLock. */
+	work_pool_fn fn;
+	void *arg;
+	size_t n;
+	size_t claimed;           /* Next index to hand out.  Atomic. */
+	size_t finished;          /* Protected by poolLock. */
+	int active;               /* Threads working on it.  poolLock. */
+	struct stats_timer *stats; /* The caller's handler, or NULL. */
+	pthread_cond_t done;
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolWork = PTHREAD_COND_INITIALIZER;
+static struct pool_job *poolJobs = NULL;
+static bool poolStop = false;
+
+static pthread_t *poolThreads = NULL;
+static unsigned int poolNumThreads = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+/* Run loop iterations until there are none left.  Returns how many we ran. */
+static size_t workPoolDrain(struct pool_job *job)
+{
+	struct stats_timer *prev = statsAdopt(job->stats);
+	size_t count = 0;
+	size_t i;
+	while((i = __atomic_fetch_add(&job->claimed, 1, __ATOMIC_RELAXED)) < job->n) {
+		job->fn(job->arg, i);
+		count++;
+	}
+	statsAdopt(prev);
+	return count;
+}
+
+/* Take a job off the queue once all of its indices have been handed out.
+ * Called with poolLock held. */
+static void workPoolUnqueue(struct pool_job *job)
+{
+	struct pool_job **pp;
+	for(pp = &poolJobs; *pp != NULL; pp = &(*pp)->next) {
+		if(*pp == job) {
+			*pp = job->next;
+			break;
+		}
+	}
+}
+
+static void *workPoolThread(void *arg)
+{
+	(void) arg;
+
+	pthread_mutex_lock(&poolLock);
+	while(!poolStop) {
+		struct pool_job *job = poolJobs;
+		if(job == NULL) {
+			pthread_cond_wait(&poolWork, &poolLock);
+			continue;
+		}
+
+		job->active++;
+		pthread_mutex_unlock(&poolLock);
+
+		size_t count = workPoolDrain(job);
+
+		pthread_mutex_lock(&poolLock);
+		workPoolUnqueue(job);
+		job->finished += count;
+		if((--job->active == 0) && (job->finished == job->n)) {
+			pthread_cond_signal(&job->done);
+		}
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	return NULL;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Start the worker threads.  Call it after fuse_daemonize().  With 0
+ * threads, workPoolRun() just runs the loop on the caller's thread.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int workPoolStart(unsigned int numThreads)
+{
+	if(numThreads == 0) {
+		return 0;
+	}
+
+	poolThreads = calloc(numThreads, sizeof(pthread_t));
+	if(poolThreads == NULL) {
+		return ENOMEM;
+	}
+
+	poolStop = false;
+	unsigned int i;
+	for(i = 0; i < numThreads; i++) {
+		int rc = pthread_create(&poolThreads[i], NULL, workPoolThread, NULL);
+		if(rc != 0) {
+			LOG_ERROR(NULL, "pthread_create() failed (%d).  Running with %u workers.", rc, i);
+			break;
+		}
+		poolNumThreads++;
+	}
+
+	return 0;
+}
+
+void workPoolStop(void)
+{
+	pthread_mutex_lock(&poolLock);
+	poolStop = true;
+	pthread_cond_broadcast(&poolWork);
+	pthread_mutex_unlock(&poolLock);
+
+	unsigned int i;
+	for(i = 0; i < poolNumThreads; i++) {
+		pthread_join(poolThreads[i], NULL);
+	}
+
+	free(poolThreads);
+	poolThreads = NULL;
+	poolNumThreads = 0;
+}
+
+/* Call fn(arg, i) for every i in [0, n), spread across the pool, and wait for
+ * all of them to finish.  The calls can run in any order. */
+void workPoolRun(work_pool_fn fn, void *arg, size_t n)
+{
+	struct pool_job job = { .fn = fn, .arg = arg, .n = n, .stats = statsCurrent() };
+
+	/* Not worth waking anybody up for. */
+	if((n <= 1) || (poolNumThreads == 0)) {
+		workPoolDrain(&job);
+		return;
+	}
+
+	pthread_cond_init(&job.done, NULL);
+
+	pthread_mutex_lock(&poolLock);
+	struct pool_job **pp = &poolJobs;
+	while(*pp != NULL) {
+		pp = &(*pp)->next;
+	}
+	*pp = &job;
+	pthread_cond_broadcast(&poolWork);
+	pthread_mutex_unlock(&poolLock);
+
+	size_t count = workPoolDrain(&job);
+
+	pthread_mutex_lock(&poolLock);
+	workPoolUnqueue(&job);
+	job.finished += count;
+	while((job.active > 0) || (job.finished < job.n)) {
+		pthread_cond_wait(&job.done, &poolLock);
+	}
+	pthread_mutex_unlock(&poolLock);
+
+	pthread_cond_destroy(&job.done);
+}
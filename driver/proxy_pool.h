@@ -0,0 +1,24 @@
+/* *****************************************************************************
+ * The worker pool.
+ *
+ * A handful of threads that help a request handler do several independent
+ * backend calls at the same time (e.g. the lookups for a READDIRPLUS batch).
+ * NAS calls spend nearly all of their time waiting on the network, so running
+ * them side by side turns N round trips into roughly one.
+ *
+ * workPoolRun() is a parallel "for" loop.  The calling thread works on the
+ * loop too, so it still works (serially) if the pool has no threads.
+ * ****************************************************************************/
+
+#ifndef PROXY_POOL_H
+#define PROXY_POOL_H
+
+#include <stddef.h>
+
+typedef void (*work_pool_fn)(void *arg, size_t i);
+
+int workPoolStart(unsigned int numThreads);
+void workPoolStop(void);
+void workPoolRun(work_pool_fn fn, void *arg, size_t n);
+
+#endif /* PROXY_POOL_H */
@@ -0,0 +1,201 @@
+/* *****************************************************************************
+ * Tuning profiles.  See proxy_profile.h for the big picture.
+ *
+ * A profile is a list of capabilities that we want and don't want, plus the
+ * request sizes to ask for.  Capabilities that aren't in either list are left
+ * the way libfuse set them, and so are the numbers that are 0.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "proxy_log.h"
+#include "proxy_profile.h"
+
+struct conn_profile {
+	const char *name;
+	unsigned int want;
+	unsigned int dontWant;
+	unsigned int maxWrite;
+	unsigned int maxReadahead;
+	unsigned int maxBackground;
+	unsigned int congestionThreshold;
+};
+
+#define PROFILE_SPLICE (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE)
+
+static const struct conn_profile profiles[] = {
+	{
+		.name = "default",
+	},
+	{
+		/* Splicing saves a copy of every byte, which only pays for
+		 * itself on big requests. */
+		.name = "streaming",
+		.want = PROFILE_SPLICE | FUSE_CAP_ASYNC_READ | FUSE_CAP_ASYNC_DIO,
+		.maxWrite = 1024 * 1024,
+		.maxReadahead = 1024 * 1024,
+		.maxBackground = 64,
+		.congestionThreshold = 48,
+	},
+	{
+		/* READDIRPLUS_AUTO makes the kernel fall back to plain READDIR
+		 * once it thinks nobody is stat()ing the entries.  Tools that
+		 * walk trees stat everything, so always send the attributes. */
+		.name = "metadata-heavy",
+		.want = FUSE_CAP_PARALLEL_DIROPS | FUSE_CAP_READDIRPLUS | FUSE_CAP_ASYNC_READ,
+		.dontWant = PROFILE_SPLICE | FUSE_CAP_READDIRPLUS_AUTO,
+		.maxWrite = 128 * 1024,
+		.maxBackground = 128,
+		.congestionThreshold = 96,
+	},
+	{
+		.name = "small-files",
+		.want = FUSE_CAP_ASYNC_READ | FUSE_CAP_PARALLEL_DIROPS |
+		        FUSE_CAP_READDIRPLUS | FUSE_CAP_READDIRPLUS_AUTO,
+		.dontWant = PROFILE_SPLICE,
+		.maxReadahead = 64 * 1024,
+		.maxBackground = 32,
+	},
+};
+
+#define NUM_PROFILES (sizeof(profiles) / sizeof(profiles[0]))
+
+/* The profile that we're using, after the overrides. */
+static struct conn_profile profile = { .name = "default" };
+
+static const struct {
+	unsigned int cap;
+	const char *name;
+} capNames[] = {
+	{ FUSE_CAP_ASYNC_READ,        "async_read" },
+	{ FUSE_CAP_ASYNC_DIO,         "async_dio" },
+	{ FUSE_CAP_SPLICE_READ,       "splice_read" },
+	{ FUSE_CAP_SPLICE_WRITE,      "splice_write" },
+	{ FUSE_CAP_SPLICE_MOVE,       "splice_move" },
+	{ FUSE_CAP_PARALLEL_DIROPS,   "parallel_dirops" },
+	{ FUSE_CAP_READDIRPLUS,       "readdirplus" },
+	{ FUSE_CAP_READDIRPLUS_AUTO,  "readdirplus_auto" },
+	{ FUSE_CAP_AUTO_INVAL_DATA,   "auto_inval_data" },
+	{ FUSE_CAP_WRITEBACK_CACHE,   "writeback_cache" },
+#ifdef FUSE_CAP_PASSTHROUGH
+	{ FUSE_CAP_PASSTHROUGH,       "passthrough" },
+#endif
+};
+
+#define NUM_CAP_NAMES (sizeof(capNames) / sizeof(capNames[0]))
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+/* Replace *val with the number in the environment variable, if there is one. */
+static void profileEnvOverride(const char *name, unsigned int *val)
+{
+	char *str = getenv(name);
+	if(str == NULL)
+		return;
+
+	char *end;
+	long num = strtol(str, &end, 0);
+	if((end == str) || (*end != '\0') || (num < 0)) {
+		LOG_ERROR(NULL, "Ignoring %s=%s.", name, str);
+		return;
+	}
+	*val = (unsigned int) num;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Pick the profile.  NULL means "default".  Call it before the session is
+ * created, so the profile is ready when lo_init() runs.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int profileInit(const char *name)
+{
+	if(name == NULL)
+		name = "default";
+
+	size_t i;
+	for(i = 0; i < NUM_PROFILES; i++) {
+		if(strcmp(profiles[i].name, name) == 0)
+			break;
+	}
+	if(i == NUM_PROFILES)
+		return EINVAL;
+
+	profile = profiles[i];
+	profileEnvOverride("PROXY_BRIDGE_MAX_WRITE", &profile.maxWrite);
+	profileEnvOverride("PROXY_BRIDGE_MAX_READAHEAD", &profile.maxReadahead);
+	profileEnvOverride("PROXY_BRIDGE_MAX_BACKGROUND", &profile.maxBackground);
+	profileEnvOverride("PROXY_BRIDGE_CONGESTION_THRESHOLD", &profile.congestionThreshold);
+
+	return 0;
+}
+
+const char *profileName(void)
+{
+	return profile.name;
+}
+
+/* Apply the profile to the connection.  Called from lo_init().  We only ask
+ * for what the kernel says it can do.  libfuse clamps max_write to its buffer
+ * size, and the kernel never reads ahead further than it offered to. */
+void profileNegotiate(struct fuse_conn_info *conn)
+{
+	conn->want |= (profile.want & conn->capable);
+	conn->want &= ~profile.dontWant;
+
+	if(profile.maxWrite != 0)
+		conn->max_write = profile.maxWrite;
+	if((profile.maxReadahead != 0) && (profile.maxReadahead < conn->max_readahead))
+		conn->max_readahead = profile.maxReadahead;
+	if(profile.maxBackground != 0)
+		conn->max_background = profile.maxBackground;
+	if(profile.congestionThreshold != 0)
+		conn->congestion_threshold = profile.congestionThreshold;
+
+	/* The kernel stops queueing background requests at the congestion
+	 * threshold, so it has to be below max_background to mean anything. */
+	if((conn->max_background != 0) && (conn->congestion_threshold > conn->max_background))
+		conn->congestion_threshold = conn->max_background * 3 / 4;
+}
+
+/* Log what we ended up with.  Call it at the end of lo_init(), after
+ * everybody has had their say about the capabilities. */
+void profileReport(const struct fuse_conn_info *conn)
+{
+	char caps[256] = "";
+	size_t len = 0;
+	size_t i;
+	for(i = 0; i < NUM_CAP_NAMES; i++) {
+		if((conn->want & capNames[i].cap) && (len < sizeof(caps))) {
+			len += snprintf(caps + len, sizeof(caps) - len, "%s%s",
+			                (len == 0) ? "" : " ", capNames[i].name);
+		}
+	}
+
+	long pageSize = sysconf(_SC_PAGESIZE);
+	unsigned int maxPages = (conn->max_write == 0) ? 0 :
+	                        (unsigned int) ((conn->max_write - 1) / pageSize + 1);
+
+	LOG_STATUS(NULL, "Profile %s (FUSE %u.%u): caps %s.", profile.name,
+	           conn->proto_major, conn->proto_minor, (len == 0) ? "(none)" : caps);
+	LOG_STATUS(NULL, "Profile %s: max_write %u (%u pages) : max_readahead %u : "
+	           "max_background %u : congestion_threshold %u.", profile.name,
+	           conn->max_write, maxPages, conn->max_readahead,
+	           conn->max_background, conn->congestion_threshold);
+}
@@ -0,0 +1,36 @@
+/* *****************************************************************************
+ * Tuning profiles.
+ *
+ * When the kernel mounts us, it tells lo_init() what it can do (splice,
+ * async reads, parallel directory ops, ...) and the largest requests it will
+ * send.  Which of those are worth having depends on the workload, so each
+ * export picks a named profile (PROXY_BRIDGE_PROFILE, usually set in the
+ * export's NASProxy_<export>.conf):
+ *
+ *   default        - Whatever libfuse picks.  This is what we always did.
+ *   streaming      - Big sequential files.  Splice, async reads and direct
+ *                    I/O, the biggest requests and a deep background queue.
+ *   metadata-heavy - Lots of lookups, stats and listings (builds, rsync).
+ *                    Parallel directory ops and readdirplus on every
+ *                    listing.  Small requests, so no splice.
+ *   small-files    - Lots of small whole-file reads and writes.  Async reads
+ *                    without splice, and not much readahead past the end of
+ *                    each file.
+ *
+ * PROXY_BRIDGE_MAX_WRITE, _MAX_READAHEAD, _MAX_BACKGROUND and
+ * _CONGESTION_THRESHOLD override the profile's numbers.  The kernel has the
+ * last word on all of them.  For example, it never reads ahead further than
+ * the mount's read_ahead_kb, no matter what we ask for.
+ * ****************************************************************************/
+
+#ifndef PROXY_PROFILE_H
+#define PROXY_PROFILE_H
+
+struct fuse_conn_info;
+
+int profileInit(const char *name);
+const char *profileName(void);
+void profileNegotiate(struct fuse_conn_info *conn);
+void profileReport(const struct fuse_conn_info *conn);
+
+#endif /* PROXY_PROFILE_H */
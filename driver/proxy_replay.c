@@ -0,0 +1,712 @@
+/* *****************************************************************************
+ * proxy_replay - Play a trace (see proxy_trace.h) back against a mount.
+ *
+ *   proxy_replay [-s speed] [-j threads] [-w] <trace> <mount>
+ *   proxy_replay -m <trace> <export>
+ *
+ * The operations are issued as system calls on the mount, at the times that
+ * they were recorded, divided by the speed (2 = twice as fast, 0 = as fast as
+ * possible).  The trace's threads are spread over the replay threads, so a
+ * thread's operations stay in order, and operations that overlapped in
+ * production overlap here.
+ *
+ * The trace names inodes by number.  To find them on a different box, make a
+ * map on the box that recorded the trace, with "-m" and the directory that the
+ * proxy exported.  It's written next to the trace (<trace>.map), and lists
+ * the path of each inode in the trace.  Copy both, and the data, to the test
+ * box.  Without a map, the mount is searched for the inode numbers, which only
+ * works on the same backend.
+ *
+ * What's replayed:
+ *   getattr, lookup     - stat() (a lookup of a name that didn't exist is
+ *                         skipped).
+ *   open, opendir       - open() and close().
+ *   read                - pread() on an O_DIRECT fd, so the replay box's page
+ *                         cache doesn't hide the reads from the proxy.
+ *   readdir(plus)       - getdents64() of the same buffer size.
+ *   fsync, readlink, statfs, getxattr - The same call.  getxattr asks for a
+ *                         name that doesn't exist, since names aren't recorded.
+ *   write_buf, fallocate - Only with "-w", because they change the files.
+ * Everything else is skipped: flush, release and forget come from the kernel
+ * on their own, and the rest change names that the trace doesn't have.  The
+ * files that the trace creates don't exist on the replay box, so what's done
+ * to them is skipped too.
+ *
+ * At the end, each operation's count, p50 and p99 latency are printed as they
+ * were recorded (in the proxy) and as replayed (in the application), with how
+ * far the replay fell behind the clock.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "proxy_trace.h"
+
+#define REPLAY_MAX_THREADS (256)
+#define REPLAY_BUF_SZ      (16 * 1024 * 1024)
+
+/* What we do for each operation in the trace. */
+enum replay_kind {
+	REPLAY_SKIP,
+	REPLAY_STAT,
+	REPLAY_LOOKUP,
+	REPLAY_OPEN,
+	REPLAY_OPENDIR,
+	REPLAY_READ,
+	REPLAY_READDIR,
+	REPLAY_FSYNC,
+	REPLAY_READLINK,
+	REPLAY_STATFS,
+	REPLAY_GETXATTR,
+	REPLAY_WRITE,
+	REPLAY_FALLOCATE,
+};
+
+static const struct {
+	const char *name;
+	enum replay_kind kind;
+} replayOps[] = {
+	{ "getattr",     REPLAY_STAT },
+	{ "lookup",      REPLAY_LOOKUP },
+	{ "open",        REPLAY_OPEN },
+	{ "opendir",     REPLAY_OPENDIR },
+	{ "read",        REPLAY_READ },
+	{ "readdir",     REPLAY_READDIR },
+	{ "readdirplus", REPLAY_READDIR },
+	{ "fsync",       REPLAY_FSYNC },
+	{ "readlink",    REPLAY_READLINK },
+	{ "statfs",      REPLAY_STATFS },
+	{ "getxattr",    REPLAY_GETXATTR },
+	{ "write_buf",   REPLAY_WRITE },
+	{ "fallocate",   REPLAY_FALLOCATE },
+};
+
+/* An inode that the trace uses.  The table is sorted by ino. */
+struct replay_inode {
+	uint64_t ino;
+	char *path;
+	int fd;                   /* For reads and writes, opened when needed. */
+	int dirFd;                /* For readdir, opened when needed. */
+};
+
+/* One record, and what happened when we replayed it. */
+struct replay_op {
+	const struct trace_record *rec;
+	uint32_t thread;
+	uint64_t latency;         /* Replayed, ns. */
+	int result;               /* 0, an errno, or -1 if skipped. */
+};
+
+static struct {
+	const struct trace_header *hdr;
+	size_t numOps;            /* The trace's operations (names). */
+	const char **opNames;
+	enum replay_kind *opKinds;
+
+	struct replay_op *ops;
+	size_t count;
+
+	struct replay_inode *inodes;
+	size_t numInodes;
+	pthread_mutex_t openLock;
+
+	const char *mount;
+	double speed;
+	bool writes;
+	int threads;
+	uint64_t startMono;
+	uint64_t maxLag;
+} replay = {
+	.openLock = PTHREAD_MUTEX_INITIALIZER,
+	.speed = 1.0,
+	.threads = 64,
+};
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS
+ * ****************************************************************************/
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s speed] [-j threads] [-w] <trace> <mount>\n"
+	                "       %s -m <trace> <export>\n", prog, prog);
+	exit(2);
+}
+
+static uint64_t replayNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+static int replayCompareStart(const void *a, const void *b)
+{
+	uint64_t x = ((const struct replay_op *) a)->rec->start;
+	uint64_t y = ((const struct replay_op *) b)->rec->start;
+	return (x < y) ? -1 : (x > y);
+}
+
+static int replayCompareU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x < y) ? -1 : (x > y);
+}
+
+static int replayCompareInode(const void *a, const void *b)
+{
+	return replayCompareU64(&((const struct replay_inode *) a)->ino,
+	                        &((const struct replay_inode *) b)->ino);
+}
+
+static struct replay_inode *replayFindInode(uint64_t ino)
+{
+	struct replay_inode key = { .ino = ino };
+	return bsearch(&key, replay.inodes, replay.numInodes, sizeof(key), replayCompareInode);
+}
+
+static enum replay_kind replayKind(const struct trace_record *r)
+{
+	return (r->op < replay.numOps) ? replay.opKinds[r->op] : REPLAY_SKIP;
+}
+
+/* The inodes that a record needs a path for (lookups need their child). */
+static uint64_t replayRecordInode(const struct trace_record *r)
+{
+	return (replayKind(r) == REPLAY_LOOKUP) ? r->off : r->ino;
+}
+
+/* Map the trace, check it, and read its records into replay.ops, sorted by
+ * start.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int replayLoad(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return errno;
+
+	struct stat st;
+	if((fstat(fd, &st) == -1) || (st.st_size < TRACE_HEADER_SZ)) {
+		close(fd);
+		return EINVAL;
+	}
+
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return errno;
+
+	const struct trace_header *h = (const struct trace_header *) map;
+	if((memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0) ||
+	   (h->recordSize != sizeof(struct trace_record)) ||
+	   (h->chunkSize != TRACE_CHUNK_SZ))
+		return EINVAL;
+	replay.hdr = h;
+
+	/* The operation names.  Anything that we don't know is skipped. */
+	replay.numOps = h->numOps;
+	replay.opNames = calloc(h->numOps, sizeof(char *));
+	replay.opKinds = calloc(h->numOps, sizeof(enum replay_kind));
+	if((replay.opNames == NULL) || (replay.opKinds == NULL))
+		return ENOMEM;
+	const char *name = h->opNames;
+	size_t i, j;
+	for(i = 0; i < h->numOps; i++) {
+		if(name >= h->opNames + sizeof(h->opNames))
+			return EINVAL;
+		replay.opNames[i] = name;
+		for(j = 0; j < sizeof(replayOps) / sizeof(replayOps[0]); j++) {
+			if(strcmp(name, replayOps[j].name) == 0)
+				replay.opKinds[i] = replayOps[j].kind;
+		}
+		name += strnlen(name, h->opNames + sizeof(h->opNames) - name) + 1;
+	}
+
+	/* The header's count can overshoot if the proxy didn't stop cleanly. */
+	uint64_t chunks = (st.st_size - TRACE_HEADER_SZ) / TRACE_CHUNK_SZ;
+	if(h->chunks < chunks)
+		chunks = h->chunks;
+
+	uint64_t c;
+	size_t count = 0;
+	for(c = 0; c < chunks; c++) {
+		const struct trace_chunk *ch = (const struct trace_chunk *) (map + TRACE_HEADER_SZ + c * TRACE_CHUNK_SZ);
+		count += (ch->count < TRACE_CHUNK_RECORDS) ? ch->count : TRACE_CHUNK_RECORDS;
+	}
+
+	replay.ops = calloc(count ? count : 1, sizeof(struct replay_op));
+	if(replay.ops == NULL)
+		return ENOMEM;
+
+	for(c = 0; c < chunks; c++) {
+		const struct trace_chunk *ch = (const struct trace_chunk *) (map + TRACE_HEADER_SZ + c * TRACE_CHUNK_SZ);
+		const struct trace_record *recs = (const struct trace_record *) (ch + 1);
+		uint32_t n = (ch->count < TRACE_CHUNK_RECORDS) ? ch->count : TRACE_CHUNK_RECORDS;
+		for(i = 0; i < n; i++) {
+			replay.ops[replay.count].rec = &recs[i];
+			replay.ops[replay.count].thread = ch->thread;
+			replay.count++;
+		}
+	}
+
+	qsort(replay.ops, replay.count, sizeof(struct replay_op), replayCompareStart);
+	return 0;
+}
+
+/* Build the inode table: every inode that a record needs, with no path yet.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int replayCollectInodes(void)
+{
+	uint64_t *inos = malloc((replay.count + 1) * sizeof(uint64_t));
+	if(inos == NULL)
+		return ENOMEM;
+
+	size_t i, n = 0;
+	for(i = 0; i < replay.count; i++) {
+		if(replayKind(replay.ops[i].rec) != REPLAY_SKIP)
+			inos[n++] = replayRecordInode(replay.ops[i].rec);
+	}
+	qsort(inos, n, sizeof(uint64_t), replayCompareU64);
+
+	replay.inodes = calloc(n ? n : 1, sizeof(struct replay_inode));
+	if(replay.inodes == NULL) {
+		free(inos);
+		return ENOMEM;
+	}
+	for(i = 0; i < n; i++) {
+		if((i > 0) && (inos[i] == inos[i - 1]))
+			continue;
+		struct replay_inode *ri = &replay.inodes[replay.numInodes++];
+		ri->ino = inos[i];
+		ri->path = NULL;
+		ri->fd = -1;
+		ri->dirFd = -1;
+	}
+	free(inos);
+	return 0;
+}
+
+/* nftw() callback.  Give each inode that we need the first path that we find
+ * for it (relative to the top). */
+static size_t walkTopLen;
+static int replayWalk(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+	(void) type, (void) ftw;
+	struct replay_inode *ri = replayFindInode(st->st_ino);
+	if((ri != NULL) && (ri->path == NULL)) {
+		const char *rel = path + walkTopLen;
+		while(*rel == '/')
+			rel++;
+		ri->path = strdup((*rel == '\0') ? "." : rel);
+	}
+	return 0;
+}
+
+/* Find the inodes' paths: from the map if there is one, or else by looking
+ * for their numbers under the mount.  The root of the export is always ".".
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int replayFindPaths(const char *tracePath)
+{
+	char mapPath[PATH_MAX];
+	snprintf(mapPath, sizeof(mapPath), "%s.map", tracePath);
+
+	FILE *f = fopen(mapPath, "r");
+	if(f != NULL) {
+		char line[PATH_MAX + 32];
+		while(fgets(line, sizeof(line), f) != NULL) {
+			char *tab = strchr(line, '\t');
+			if(tab == NULL)
+				continue;
+			line[strcspn(line, "\n")] = '\0';
+			struct replay_inode *ri = replayFindInode(strtoull(line, NULL, 10));
+			if((ri != NULL) && (ri->path == NULL))
+				ri->path = strdup(tab + 1);
+		}
+		fclose(f);
+		printf("Paths from %s.\n", mapPath);
+	} else {
+		walkTopLen = strlen(replay.mount);
+		if(nftw(replay.mount, replayWalk, 64, FTW_PHYS | FTW_MOUNT) == -1)
+			return errno;
+		printf("Paths found by inode number under %s.\n", replay.mount);
+	}
+
+	struct replay_inode *root = replayFindInode(0);
+	if((root != NULL) && (root->path == NULL))
+		root->path = strdup(".");
+
+	size_t i, found = 0;
+	for(i = 0; i < replay.numInodes; i++) {
+		if(replay.inodes[i].path != NULL)
+			found++;
+	}
+	printf("Found %zu of the %zu inodes in the trace.\n", found, replay.numInodes);
+	return 0;
+}
+
+/* The -m mode: write <trace>.map with the paths of the trace's inodes under
+ * the export.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int replayWriteMap(const char *tracePath, const char *exportDir)
+{
+	walkTopLen = strlen(exportDir);
+	if(nftw(exportDir, replayWalk, 64, FTW_PHYS | FTW_MOUNT) == -1)
+		return errno;
+
+	char mapPath[PATH_MAX];
+	snprintf(mapPath, sizeof(mapPath), "%s.map", tracePath);
+	FILE *f = fopen(mapPath, "w");
+	if(f == NULL)
+		return errno;
+
+	size_t i, n = 0;
+	for(i = 0; i < replay.numInodes; i++) {
+		struct replay_inode *ri = &replay.inodes[i];
+		if((ri->path != NULL) && (strpbrk(ri->path, "\t\n") == NULL)) {
+			fprintf(f, "%llu\t%s\n", (unsigned long long) ri->ino, ri->path);
+			n++;
+		}
+	}
+	if(fclose(f) != 0)
+		return errno;
+
+	printf("Wrote %zu of the %zu inodes in the trace to %s.\n", n, replay.numInodes, mapPath);
+	return 0;
+}
+
+/* The fd that reads, writes or readdirs of an inode use.  They're kept open
+ * for the whole replay.  Returns -1 (and sets errno) if it can't be opened. */
+static int replayFd(struct replay_inode *ri, int mountFd, bool dir)
+{
+	int *slot = dir ? &ri->dirFd : &ri->fd;
+	int fd = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if(fd != -1)
+		return fd;
+
+	pthread_mutex_lock(&replay.openLock);
+	if(*slot == -1) {
+		if(dir) {
+			fd = openat(mountFd, ri->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		} else {
+			int flags = (replay.writes ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+			fd = openat(mountFd, ri->path, flags | O_DIRECT);
+			if((fd == -1) && (errno == EINVAL))
+				fd = openat(mountFd, ri->path, flags);
+		}
+		__atomic_store_n(slot, fd, __ATOMIC_RELEASE);
+	}
+	fd = *slot;
+	pthread_mutex_unlock(&replay.openLock);
+	return fd;
+}
+
+/* Issue one operation.
+ * Returns:
+ *   0 = success.
+ *  -1 = skipped.
+ *  >0 = errno of failure. */
+static int replayOne(const struct trace_record *r, int mountFd, char *buf)
+{
+	enum replay_kind kind = replayKind(r);
+	if(kind == REPLAY_SKIP)
+		return -1;
+	if(((kind == REPLAY_WRITE) || (kind == REPLAY_FALLOCATE)) && !replay.writes)
+		return -1;
+	if((kind == REPLAY_LOOKUP) && (r->off == 0))
+		return -1;
+
+	struct replay_inode *ri = replayFindInode(replayRecordInode(r));
+	if((ri == NULL) || (ri->path == NULL))
+		return -1;
+
+	size_t size = (r->size < REPLAY_BUF_SZ) ? r->size : REPLAY_BUF_SZ;
+	struct stat st;
+	struct statvfs sv;
+	int res = 0;
+	int fd;
+
+	switch(kind) {
+	case REPLAY_STAT:
+	case REPLAY_LOOKUP:
+		res = fstatat(mountFd, ri->path, &st, AT_SYMLINK_NOFOLLOW);
+		break;
+
+	case REPLAY_OPEN:
+	case REPLAY_OPENDIR:
+		fd = openat(mountFd, ri->path, O_RDONLY | O_CLOEXEC |
+		            ((kind == REPLAY_OPENDIR) ? O_DIRECTORY : 0));
+		res = (fd == -1) ? -1 : close(fd);
+		break;
+
+	case REPLAY_READ:
+		fd = replayFd(ri, mountFd, false);
+		res = (fd == -1) ? -1 : (int) pread(fd, buf, size, r->off);
+
+		/* Some file systems want O_DIRECT reads to be aligned.  Read
+		 * through the page cache there instead. */
+		if((fd != -1) && (res == -1) && (errno == EINVAL) && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+			res = (int) pread(fd, buf, size, r->off);
+		}
+		break;
+
+	case REPLAY_WRITE:
+		fd = replayFd(ri, mountFd, false);
+		res = (fd == -1) ? -1 : (int) pwrite(fd, buf, size, r->off);
+		break;
+
+	case REPLAY_FALLOCATE:
+		fd = replayFd(ri, mountFd, false);
+		res = (fd == -1) ? -1 : fallocate(fd, 0, r->off, r->size);
+		break;
+
+	case REPLAY_FSYNC:
+		fd = replayFd(ri, mountFd, false);
+		res = (fd == -1) ? -1 : fsync(fd);
+		break;
+
+	case REPLAY_READDIR:
+		/* Each replay thread has its own buffer, but the dir fd is
+		 * shared, so the offsets are only a hint. */
+		fd = replayFd(ri, mountFd, true);
+		if((fd != -1) && (r->off == 0))
+			lseek(fd, 0, SEEK_SET);
+		res = (fd == -1) ? -1 : (int) syscall(SYS_getdents64, fd, buf, size);
+		break;
+
+	case REPLAY_READLINK:
+		res = (int) readlinkat(mountFd, ri->path, buf, REPLAY_BUF_SZ);
+		break;
+
+	case REPLAY_STATFS:
+		fd = openat(mountFd, ri->path, O_PATH | O_CLOEXEC);
+		res = (fd == -1) ? -1 : fstatvfs(fd, &sv);
+		if(fd != -1)
+			close(fd);
+		break;
+
+	case REPLAY_GETXATTR: {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", replay.mount, ri->path);
+		res = (int) lgetxattr(path, "user.proxy_replay", buf, size);
+		if((res == -1) && (errno == ENODATA))
+			res = 0;
+		break;
+	}
+
+	default:
+		return -1;
+	}
+
+	return (res == -1) ? errno : 0;
+}
+
+/* A replay thread.  It does the operations of the trace threads that hash to
+ * it, in order, each at its time. */
+static void *replayThread(void *arg)
+{
+	int me = (int) (intptr_t) arg;
+
+	char *buf = NULL;
+	if(posix_memalign((void **) &buf, 4096, REPLAY_BUF_SZ) != 0)
+		return NULL;
+	memset(buf, 0x5a, REPLAY_BUF_SZ);
+
+	int mountFd = open(replay.mount, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if(mountFd == -1) {
+		free(buf);
+		return NULL;
+	}
+
+	size_t i;
+	for(i = 0; i < replay.count; i++) {
+		struct replay_op *op = &replay.ops[i];
+		if((int) (op->thread % replay.threads) != me)
+			continue;
+
+		if(replay.speed > 0) {
+			uint64_t due = replay.startMono + (uint64_t) (op->rec->start / replay.speed);
+			uint64_t now = replayNow();
+			if(now < due) {
+				struct timespec ts = { .tv_sec = due / 1000000000ULL, .tv_nsec = due % 1000000000ULL };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+			} else {
+				uint64_t lag = now - due;
+				uint64_t max = __atomic_load_n(&replay.maxLag, __ATOMIC_RELAXED);
+				while((lag > max) &&
+				      !__atomic_compare_exchange_n(&replay.maxLag, &max, lag, false,
+				                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					;
+			}
+		}
+
+		uint64_t start = replayNow();
+		op->result = replayOne(op->rec, mountFd, buf);
+		op->latency = replayNow() - start;
+	}
+
+	close(mountFd);
+	free(buf);
+	return NULL;
+}
+
+/* The value at pct percent of a sorted array. */
+static uint64_t replayPercentile(const uint64_t *v, size_t n, int pct)
+{
+	return (n == 0) ? 0 : v[((n - 1) * pct) / 100];
+}
+
+/* Print a line per operation: how many there were and what happened to them,
+ * then p50/p99 as recorded and as replayed. */
+static void replayReport(uint64_t elapsed)
+{
+	uint64_t *orig = malloc((replay.count + 1) * sizeof(uint64_t));
+	uint64_t *mine = malloc((replay.count + 1) * sizeof(uint64_t));
+	if((orig == NULL) || (mine == NULL)) {
+		free(orig);
+		free(mine);
+		return;
+	}
+
+	printf("\n%-16s %10s %10s %8s %12s %12s %12s %12s\n", "op", "count", "skipped",
+	       "errors", "trace p50", "trace p99", "replay p50", "replay p99");
+
+	size_t op, i;
+	for(op = 0; op < replay.numOps; op++) {
+		size_t n = 0, done = 0, skipped = 0, errors = 0;
+		for(i = 0; i < replay.count; i++) {
+			struct replay_op *o = &replay.ops[i];
+			if(o->rec->op != op)
+				continue;
+			orig[n++] = o->rec->latency;
+			if(o->result == -1)
+				skipped++;
+			else if(o->result != 0)
+				errors++;
+			else
+				mine[done++] = o->latency;
+		}
+		if(n == 0)
+			continue;
+
+		qsort(orig, n, sizeof(uint64_t), replayCompareU64);
+		qsort(mine, done, sizeof(uint64_t), replayCompareU64);
+		printf("%-16s %10zu %10zu %8zu %10.1fus %10.1fus %10.1fus %10.1fus\n",
+		       replay.opNames[op], n, skipped, errors,
+		       replayPercentile(orig, n, 50) / 1000.0, replayPercentile(orig, n, 99) / 1000.0,
+		       replayPercentile(mine, done, 50) / 1000.0, replayPercentile(mine, done, 99) / 1000.0);
+	}
+
+	uint64_t traceLen = (replay.count > 0) ? replay.ops[replay.count - 1].rec->start : 0;
+	printf("\nTrace: %.3fs.  Replay: %.3fs at speed %g.  Fell behind by up to %.3fs.\n",
+	       traceLen / 1e9, elapsed / 1e9, replay.speed, replay.maxLag / 1e9);
+
+	free(orig);
+	free(mine);
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS
+ * ****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	bool makeMap = false;
+	int opt;
+	while((opt = getopt(argc, argv, "s:j:wm")) != -1) {
+		switch(opt) {
+		case 's':
+			replay.speed = atof(optarg);
+			break;
+		case 'j':
+			replay.threads = atoi(optarg);
+			break;
+		case 'w':
+			replay.writes = true;
+			break;
+		case 'm':
+			makeMap = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if((argc - optind != 2) || (replay.speed < 0) ||
+	   (replay.threads < 1) || (replay.threads > REPLAY_MAX_THREADS))
+		usage(argv[0]);
+
+	const char *tracePath = argv[optind];
+	replay.mount = argv[optind + 1];
+
+	int error = replayLoad(tracePath);
+	if(error != 0) {
+		fprintf(stderr, "%s: %s\n", tracePath, (error == EINVAL) ? "not a trace" : strerror(error));
+		return 1;
+	}
+	time_t started = replay.hdr->startTime / 1000000000ULL;
+	printf("%zu operations, recorded %s", replay.count, ctime(&started));
+
+	error = replayCollectInodes();
+	if(error == 0)
+		error = makeMap ? replayWriteMap(tracePath, replay.mount) : replayFindPaths(tracePath);
+	if(error != 0) {
+		fprintf(stderr, "%s: %s\n", replay.mount, strerror(error));
+		return 1;
+	}
+	if(makeMap)
+		return 0;
+
+	/* One replay thread per trace thread, up to the limit. */
+	uint32_t maxThread = 0;
+	size_t i;
+	for(i = 0; i < replay.count; i++) {
+		if(replay.ops[i].thread > maxThread)
+			maxThread = replay.ops[i].thread;
+	}
+	if(maxThread + 1 < (uint32_t) replay.threads)
+		replay.threads = maxThread + 1;
+
+	pthread_t threads[REPLAY_MAX_THREADS];
+	int t;
+	replay.startMono = replayNow();
+	for(t = 0; t < replay.threads; t++) {
+		error = pthread_create(&threads[t], NULL, replayThread, (void *) (intptr_t) t);
+		if(error != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(error));
+			return 1;
+		}
+	}
+	for(t = 0; t < replay.threads; t++)
+		pthread_join(threads[t], NULL);
+
+	replayReport(replayNow() - replay.startMono);
+	return 0;
+}
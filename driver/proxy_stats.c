@@ -0,0 +1,539 @@
+/* *****************************************************************************
+ * Statistics.  See proxy_stats.h for the big picture.
+ *
+ * Each thread gets a stats_thread block the first time it records something.
+ * The owning thread is the only one that writes it.  It uses relaxed atomic
+ * loads/stores (not read-modify-write), so the exporter can read it without
+ * tearing and without slowing the owner down.  When a thread exits, its
+ * numbers are folded into the "retired" block so nothing is lost.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "proxy_log.h"
+#include "proxy_stats.h"
+#include "proxy_trace.h"
+
+/* Bucket 0 is everything under 1 microsecond (1024ns).  Bucket N covers
+ * [2^(N+9), 2^(N+10)) nanoseconds.  The last bucket catches everything else
+ * (~20 minutes and up). */
+#define STATS_BUCKETS (32)
+
+#define STATS_MAX_GAUGES (32)
+
+struct stats_hist {
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t sumNs;
+};
+
+struct stats_op_data {
+	uint64_t started;
+	uint64_t finished;
+	struct stats_hist total;
+	struct stats_hist backend;
+};
+
+struct stats_thread {
+	struct stats_thread *next;
+	struct stats_op_data ops[STATS_OP_MAX];
+	uint64_t counters[STATS_CTR_MAX];
+};
+
+struct stats_gauge {
+	const char *name;
+	const char *help;
+	stats_gauge_fn fn;
+	void *arg;
+};
+
+#define STATS_OP_NAME(name) #name,
+static const char *opNames[STATS_OP_MAX] = { STATS_OPS(STATS_OP_NAME) };
+
+#define STATS_CTR_NAME(name, help) #name,
+static const char *ctrNames[STATS_CTR_MAX] = { STATS_COUNTERS(STATS_CTR_NAME) };
+#define STATS_CTR_HELP(name, help) help,
+static const char *ctrHelp[STATS_CTR_MAX] = { STATS_COUNTERS(STATS_CTR_HELP) };
+
+static pthread_mutex_t threadListLock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_thread *threadList = NULL;
+static struct stats_thread retired;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t threadKey;
+
+static __thread struct stats_thread *myStats = NULL;
+static __thread struct stats_timer *current = NULL;
+static __thread uint64_t backendTotal = 0;
+
+static struct stats_gauge gauges[STATS_MAX_GAUGES];
+static int gaugeCount = 0;
+
+static int listenFD = -1;
+static char *listenPath = NULL;
+static pthread_t serverThread;
+static int serverStop = 0;
+
+/* *****************************************************************************
+ * Recording.
+ * ****************************************************************************/
+
+/* Only the owning thread writes, so a plain load + store is enough. */
+static inline void statsBump(uint64_t *p, uint64_t n)
+{
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int statsBucket(uint64_t ns)
+{
+	uint64_t us = ns >> 10;
+	if(us == 0) {
+		return 0;
+	}
+	int b = 64 - __builtin_clzll(us);
+	return (b < STATS_BUCKETS) ? b : (STATS_BUCKETS - 1);
+}
+
+static void statsHistAdd(struct stats_hist *h, uint64_t ns)
+{
+	statsBump(&h->buckets[statsBucket(ns)], 1);
+	statsBump(&h->sumNs, ns);
+}
+
+static void statsHistFold(struct stats_hist *dst, struct stats_hist *src)
+{
+	int i;
+	for(i = 0; i < STATS_BUCKETS; i++) {
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	}
+	dst->sumNs += __atomic_load_n(&src->sumNs, __ATOMIC_RELAXED);
+}
+
+static void statsThreadFold(struct stats_thread *dst, struct stats_thread *src)
+{
+	int i;
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		struct stats_op_data *d = &dst->ops[i];
+		struct stats_op_data *s = &src->ops[i];
+		d->started  += __atomic_load_n(&s->started,  __ATOMIC_RELAXED);
+		d->finished += __atomic_load_n(&s->finished, __ATOMIC_RELAXED);
+		statsHistFold(&d->total,   &s->total);
+		statsHistFold(&d->backend, &s->backend);
+	}
+	for(i = 0; i < STATS_CTR_MAX; i++) {
+		dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* A thread is exiting.  Keep its numbers and throw away its block. */
+static void statsThreadRelease(void *arg)
+{
+	struct stats_thread *st = (struct stats_thread *) arg;
+
+	pthread_mutex_lock(&threadListLock);
+	struct stats_thread **pp = &threadList;
+	while(*pp != st) {
+		pp = &(*pp)->next;
+	}
+	*pp = st->next;
+	statsThreadFold(&retired, st);
+	pthread_mutex_unlock(&threadListLock);
+
+	free(st);
+}
+
+static void statsKeyCreate(void)
+{
+	pthread_key_create(&threadKey, statsThreadRelease);
+}
+
+static struct stats_thread *statsThread(void)
+{
+	if(myStats == NULL) {
+		struct stats_thread *st = calloc(1, sizeof(struct stats_thread));
+		if(st == NULL) {
+			return NULL;
+		}
+
+		pthread_once(&keyOnce, statsKeyCreate);
+
+		pthread_mutex_lock(&threadListLock);
+		st->next = threadList;
+		threadList = st;
+		pthread_mutex_unlock(&threadListLock);
+
+		pthread_setspecific(threadKey, st);
+		myStats = st;
+	}
+	return myStats;
+}
+
+uint64_t statsNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+void statsBegin(struct stats_timer *t, int op)
+{
+	t->op = op;
+	t->start = 0;
+	t->backend = 0;
+	t->prev = current;
+	t->ino = 0;
+	t->off = 0;
+	t->size = 0;
+
+	struct stats_thread *st = statsThread();
+	if((st == NULL) || (current != NULL)) {
+		t->op = -1;
+		return;
+	}
+
+	statsBump(&st->ops[op].started, 1);
+	current = t;
+	t->start = statsNow();
+}
+
+void statsEnd(struct stats_timer *t)
+{
+	if(t->op == -1) {
+		return;
+	}
+
+	struct stats_op_data *d = &myStats->ops[t->op];
+	uint64_t latency = statsNow() - t->start;
+	statsHistAdd(&d->total, latency);
+	statsHistAdd(&d->backend, t->backend);
+	statsBump(&d->finished, 1);
+	backendTotal += t->backend;
+	current = t->prev;
+
+	if(traceEnabled())
+		traceAdd(t->op, t->start, latency, t->ino, t->off, t->size);
+}
+
+/* Charge the time since start to the handler that is running on this
+ * thread.  Called by STATS_BACKEND(). */
+void statsBackendAdd(uint64_t start)
+{
+	if(current != NULL) {
+		__atomic_add_fetch(&current->backend, statsNow() - start, __ATOMIC_RELAXED);
+	}
+}
+
+/* The handler that is running on this thread, or NULL. */
+struct stats_timer *statsCurrent(void)
+{
+	return current;
+}
+
+/* Charge this thread's backend calls to t, which belongs to a handler on
+ * another thread that is waiting for us (e.g. in workPoolRun()).  The calls
+ * are added up, so a handler that runs them side by side can show more
+ * backend time than latency.
+ *
+ * Returns what to pass back in when we're done. */
+struct stats_timer *statsAdopt(struct stats_timer *t)
+{
+	struct stats_timer *prev = current;
+	current = t;
+	return prev;
+}
+
+/* Nanoseconds that the handlers on this thread have spent in backend calls,
+ * ever.  The request engine uses it to see how long requests wait for the
+ * NAS. */
+uint64_t statsBackendTotal(void)
+{
+	return backendTotal;
+}
+
+void statsCount(enum stats_counter ctr, uint64_t n)
+{
+	struct stats_thread *st = statsThread();
+	if(st != NULL) {
+		statsBump(&st->counters[ctr], n);
+	}
+}
+
+/* Register a gauge.  Must be called before statsStart().
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int statsAddGauge(const char *name, const char *help, stats_gauge_fn fn, void *arg)
+{
+	if(gaugeCount == STATS_MAX_GAUGES) {
+		return ENOSPC;
+	}
+	gauges[gaugeCount].name = name;
+	gauges[gaugeCount].help = help;
+	gauges[gaugeCount].fn = fn;
+	gauges[gaugeCount].arg = arg;
+	gaugeCount++;
+	return 0;
+}
+
+/* *****************************************************************************
+ * Exporting.
+ * ****************************************************************************/
+
+static void statsWriteHist(FILE *f, const char *metric, const char *op,
+                           struct stats_hist *h)
+{
+	uint64_t cumulative = 0;
+	int i;
+	for(i = 0; i < (STATS_BUCKETS - 1); i++) {
+		cumulative += h->buckets[i];
+		fprintf(f, "proxy_bridge_%s_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+		        metric, op, (double) (1ULL << (i + 10)) / 1e9,
+		        (unsigned long long) cumulative);
+	}
+	cumulative += h->buckets[i];
+	fprintf(f, "proxy_bridge_%s_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+	        metric, op, (unsigned long long) cumulative);
+	fprintf(f, "proxy_bridge_%s_seconds_sum{op=\"%s\"} %.9f\n",
+	        metric, op, (double) h->sumNs / 1e9);
+	fprintf(f, "proxy_bridge_%s_seconds_count{op=\"%s\"} %llu\n",
+	        metric, op, (unsigned long long) cumulative);
+}
+
+/* Add up all of the threads and write the Prometheus text.  Operations that
+ * have never been called are left out to keep the output readable. */
+static void statsWrite(FILE *f)
+{
+	struct stats_thread *sum = calloc(1, sizeof(struct stats_thread));
+	if(sum == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&threadListLock);
+	statsThreadFold(sum, &retired);
+	struct stats_thread *st;
+	for(st = threadList; st != NULL; st = st->next) {
+		statsThreadFold(sum, st);
+	}
+	pthread_mutex_unlock(&threadListLock);
+
+	int i;
+
+	fprintf(f, "# HELP proxy_bridge_ops_total Number of requests handled.\n");
+	fprintf(f, "# TYPE proxy_bridge_ops_total counter\n");
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		if(sum->ops[i].started != 0) {
+			fprintf(f, "proxy_bridge_ops_total{op=\"%s\"} %llu\n", opNames[i],
+			        (unsigned long long) sum->ops[i].finished);
+		}
+	}
+
+	fprintf(f, "# HELP proxy_bridge_ops_inflight Number of requests being handled right now.\n");
+	fprintf(f, "# TYPE proxy_bridge_ops_inflight gauge\n");
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		if(sum->ops[i].started != 0) {
+			/* The two counters aren't read at the same instant. */
+			int64_t inflight = (int64_t) (sum->ops[i].started - sum->ops[i].finished);
+			fprintf(f, "proxy_bridge_ops_inflight{op=\"%s\"} %lld\n", opNames[i],
+			        (long long) ((inflight < 0) ? 0 : inflight));
+		}
+	}
+
+	fprintf(f, "# HELP proxy_bridge_op_duration_seconds Total time spent in the handler.\n");
+	fprintf(f, "# TYPE proxy_bridge_op_duration_seconds histogram\n");
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		if(sum->ops[i].started != 0) {
+			statsWriteHist(f, "op_duration", opNames[i], &sum->ops[i].total);
+		}
+	}
+
+	fprintf(f, "# HELP proxy_bridge_backend_duration_seconds Time the handler spent in backend calls.\n");
+	fprintf(f, "# TYPE proxy_bridge_backend_duration_seconds histogram\n");
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		if(sum->ops[i].started != 0) {
+			statsWriteHist(f, "backend_duration", opNames[i], &sum->ops[i].backend);
+		}
+	}
+
+	for(i = 0; i < STATS_CTR_MAX; i++) {
+		fprintf(f, "# HELP proxy_bridge_%s_total %s\n", ctrNames[i], ctrHelp[i]);
+		fprintf(f, "# TYPE proxy_bridge_%s_total counter\n", ctrNames[i]);
+		fprintf(f, "proxy_bridge_%s_total %llu\n", ctrNames[i],
+		        (unsigned long long) sum->counters[i]);
+	}
+
+	for(i = 0; i < gaugeCount; i++) {
+		fprintf(f, "# HELP proxy_bridge_%s %s\n", gauges[i].name, gauges[i].help);
+		fprintf(f, "# TYPE proxy_bridge_%s gauge\n", gauges[i].name);
+		fprintf(f, "proxy_bridge_%s %.17g\n", gauges[i].name,
+		        gauges[i].fn(gauges[i].arg));
+	}
+
+	free(sum);
+}
+
+static void statsWriteAll(int fd, const char *buf, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n <= 0) {
+			if((n == -1) && (errno == EINTR)) {
+				continue;
+			}
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/* Serve one client.  If it sends an HTTP request (curl, Prometheus), we
+ * answer with an HTTP response.  If it doesn't say anything (socat, nc), we
+ * just send the text. */
+static void statsServe(int fd)
+{
+	int isHTTP = 0;
+
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if(poll(&pfd, 1, 100) == 1) {
+		char req[1024];
+		ssize_t n = read(fd, req, sizeof(req));
+		isHTTP = (n >= 4) && (memcmp(req, "GET ", 4) == 0);
+	}
+
+	statsCount(STATS_CTR_stats_reads, 1);
+
+	char *body = NULL;
+	size_t bodyLen = 0;
+	FILE *f = open_memstream(&body, &bodyLen);
+	if(f == NULL) {
+		return;
+	}
+	statsWrite(f);
+	fclose(f);
+
+	if(isHTTP) {
+		char hdr[256];
+		int len = snprintf(hdr, sizeof(hdr),
+		                   "HTTP/1.0 200 OK\r\n"
+		                   "Content-Type: text/plain; version=0.0.4\r\n"
+		                   "Content-Length: %zu\r\n"
+		                   "\r\n", bodyLen);
+		statsWriteAll(fd, hdr, len);
+	}
+	statsWriteAll(fd, body, bodyLen);
+
+	free(body);
+}
+
+static void *statsServerThread(void *arg)
+{
+	(void) arg;
+
+	while(!__atomic_load_n(&serverStop, __ATOMIC_ACQUIRE)) {
+		struct pollfd pfd = { .fd = listenFD, .events = POLLIN };
+		if(poll(&pfd, 1, 250) != 1) {
+			continue;
+		}
+
+		int fd = accept4(listenFD, NULL, NULL, SOCK_CLOEXEC);
+		if(fd == -1) {
+			continue;
+		}
+		statsServe(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* Start serving the stats on a unix socket.  The counters are always kept,
+ * even if nobody ever asks for them.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int statsStart(const char *sockPath)
+{
+	int error = 0;
+
+	do {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(sockPath) >= sizeof(addr.sun_path)) {
+			error = ENAMETOOLONG;
+			LOG_ERROR(NULL, "Socket path %s is too long.", sockPath);
+			break;
+		}
+		strcpy(addr.sun_path, sockPath);
+
+		listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(listenFD == -1) {
+			error = errno;
+			LOG_ERROR(NULL, "socket() failed (%m).");
+			break;
+		}
+
+		/* A stale socket from a previous run would make bind() fail. */
+		unlink(sockPath);
+		if(bind(listenFD, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+			error = errno;
+			LOG_ERROR(NULL, "bind(%s) failed (%m).", sockPath);
+			break;
+		}
+
+		if(listen(listenFD, 8) == -1) {
+			error = errno;
+			LOG_ERROR(NULL, "listen(%s) failed (%m).", sockPath);
+			break;
+		}
+
+		listenPath = strdup(sockPath);
+		serverStop = 0;
+		error = pthread_create(&serverThread, NULL, statsServerThread, NULL);
+		if(error != 0) {
+			LOG_ERROR(NULL, "pthread_create() failed (%d).", error);
+			break;
+		}
+	} while(0);
+
+	if(error != 0) {
+		if(listenFD != -1) {
+			close(listenFD);
+			listenFD = -1;
+		}
+		free(listenPath);
+		listenPath = NULL;
+	}
+
+	return error;
+}
+
+void statsStop(void)
+{
+	if(listenFD == -1) {
+		return;
+	}
+
+	__atomic_store_n(&serverStop, 1, __ATOMIC_RELEASE);
+	pthread_join(serverThread, NULL);
+
+	close(listenFD);
+	listenFD = -1;
+	unlink(listenPath);
+	free(listenPath);
+	listenPath = NULL;
+}
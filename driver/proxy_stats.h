@@ -0,0 +1,195 @@
+/* *****************************************************************************
+ * Statistics.
+ *
+ * Every lo_oper entry point is timed.  For each operation we keep:
+ * - The number of calls and the number currently in flight.
+ * - A latency histogram of the whole handler.
+ * - A latency histogram of the time spent in backend (NAS) calls.
+ *
+ * The counters are per-thread, and only the owning thread writes them, so the
+ * hot path never takes a lock or does a locked instruction.  The exporter adds
+ * up all of the threads when somebody asks for the numbers.
+ *
+ * The numbers are served in Prometheus text format on a unix socket
+ * (PROXY_BRIDGE_STATS_SOCK).  Either of these will read them:
+ *   curl --unix-socket <sock> http://localhost/metrics
+ *   socat - UNIX-CONNECT:<sock>
+ * ****************************************************************************/
+
+#ifndef PROXY_STATS_H
+#define PROXY_STATS_H
+
+#include <stdint.h>
+
+#include "proxy_emulate.h"
+
+/* The operations that we time.  Keep them in alphabetical order. */
+#define STATS_OPS(X) \
+	X(copy_file_range) \
+	X(create)       \
+	X(fallocate)    \
+	X(flush)        \
+	X(forget)       \
+	X(forget_multi) \
+	X(fsync)        \
+	X(getattr)      \
+	X(getxattr)     \
+	X(link)         \
+	X(lookup)       \
+	X(mkdir)        \
+	X(mknod)        \
+	X(open)         \
+	X(opendir)      \
+	X(read)         \
+	X(readdir)      \
+	X(readdirplus)  \
+	X(readlink)     \
+	X(release)      \
+	X(releasedir)   \
+	X(removexattr)  \
+	X(rename)       \
+	X(rmdir)        \
+	X(setattr)      \
+	X(statfs)       \
+	X(symlink)      \
+	X(unlink)       \
+	X(write_buf)
+
+/* Plain event counters (name, help text).  Subsystems add theirs here. */
+#define STATS_COUNTERS(X) \
+	X(stats_reads, "Number of times these statistics have been read.") \
+	X(cache_hits, "Block cache reads that were served from memory.") \
+	X(cache_misses, "Block cache reads that went to the backend.") \
+	X(cache_evictions, "Blocks evicted from the block cache to make room.") \
+	X(cache_stale, "Cached blocks thrown away because the file changed.") \
+	X(wbuf_writes, "Writes that were merged into a write buffer.") \
+	X(wbuf_flushes, "Write buffer flushes (backend writes).") \
+	X(wbuf_flush_bytes, "Bytes written to the backend by write buffer flushes.") \
+	X(uring_ops, "Backend calls queued on the io_uring.") \
+	X(uring_fallbacks, "Backend calls done synchronously because the io_uring was full.") \
+	X(closer_jobs, "Closes and releases finished by the background closer.") \
+	X(inode_reopens, "Inode fds reopened after they were closed to save fds.") \
+	X(inode_fd_evictions, "Inode fds closed to stay under the fd limit.") \
+	X(passthrough_opens, "Opens whose reads and writes the kernel does itself.") \
+	X(engine_spawns, "Request threads started by the engine.") \
+	X(engine_retires, "Request threads stopped by the engine because they were idle.") \
+	X(dcache_hits, "Block cache misses that were served from the disk cache.") \
+	X(dcache_misses, "Block cache misses that weren't in the disk cache either.") \
+	X(dcache_stale, "Disk cache blocks thrown away because the file changed.") \
+	X(dcache_corrupt, "Disk cache blocks thrown away because they failed their CRC.") \
+	X(dcache_fills, "Blocks written to the disk cache.") \
+	X(dcache_drops, "Blocks not written to the disk cache because the writer was behind.") \
+	X(dcache_evictions, "Disk cache blocks evicted to make room.") \
+	X(journal_writes, "Writes acknowledged from the journal.") \
+	X(journal_bytes, "Bytes written to the journal.") \
+	X(journal_destaged, "Journal records written to the backend.") \
+	X(journal_orphans, "Journal records dropped because their file was deleted.") \
+	X(journal_full_waits, "Journal writes that waited for the journal to have room.") \
+	X(journal_flush_waits, "Operations that waited for a file's journal records to be destaged.") \
+	X(journal_write_errors, "Journal records that couldn't be written.  The journal stops taking writes.") \
+	X(journal_bad_records, "Journal records that failed their checks when they were destaged.") \
+	X(crypt_encrypt_bytes, "Bytes encrypted for writes.") \
+	X(crypt_decrypt_bytes, "Bytes decrypted for reads.") \
+	X(crypt_header_reads, "Encryption headers read from the backend.") \
+	X(crypt_header_writes, "Encryption headers written to new files.") \
+	X(crypt_unit_rewrites, "Encryption units read back and encrypted again.") \
+	X(compress_bytes_in, "Bytes compressed for writes.") \
+	X(compress_bytes_out, "Compressed bytes written to the backend.") \
+	X(compress_raw_chunks, "Chunks stored as is because they didn't get smaller.") \
+	X(compress_chunk_reads, "Chunks read from the backend and decompressed.") \
+	X(compress_rmw_reads, "Chunks read back to fill in the rest of a partial write.") \
+	X(compress_bad_chunks, "Chunks that failed their CRC or didn't decompress.") \
+	X(copy_offload_bytes, "Bytes that copy_file_range() copied on the backend.") \
+	X(copy_fallback_bytes, "Bytes that copy_file_range() copied through the proxy.") \
+	X(dedup_hits, "Chunks written as a reference to the chunk store.") \
+	X(dedup_bytes_saved, "Plain bytes that weren't written because they were in the chunk store.") \
+	X(dedup_stored_chunks, "Chunks added to the chunk store.") \
+	X(dedup_stored_bytes, "Bytes added to the chunk store.") \
+	X(dedup_table_full, "Fingerprints not remembered because the table was full.") \
+	X(dedup_table_pruned, "Fingerprints seen only once, forgotten to make room in the table.") \
+	X(dedup_store_full, "Chunks not added because the chunk store was at its limit.") \
+	X(dedup_repointed, "First copies of chunks moved over to the chunk store.") \
+	X(dedup_repoint_skipped, "First copies of chunks left where they were (file gone or changed).") \
+	X(trace_records, "Operations recorded in the trace.") \
+	X(trace_dropped, "Operations not recorded because the trace was full.") \
+	X(emulate_calls, "Backend calls that the emulator slowed down.") \
+	X(emulate_delay_ns, "Nanoseconds that the emulator held up backend calls.") \
+	X(emulate_slot_waits, "Backend calls that waited for an emulated NAS slot.")
+
+#define STATS_OP_ENUM(name) STATS_OP_##name,
+enum stats_op {
+	STATS_OPS(STATS_OP_ENUM)
+	STATS_OP_MAX
+};
+
+#define STATS_CTR_ENUM(name, help) STATS_CTR_##name,
+enum stats_counter {
+	STATS_COUNTERS(STATS_CTR_ENUM)
+	STATS_CTR_MAX
+};
+
+struct stats_timer {
+	int op;                   /* -1 if this is a nested handler call. */
+	uint64_t start;
+	uint64_t backend;         /* Nanoseconds spent in backend calls. */
+	struct stats_timer *prev;
+	uint64_t ino;             /* What the trace records (see proxy_trace.h). */
+	uint64_t off;
+	uint64_t size;
+};
+
+uint64_t statsNow(void);
+void statsBegin(struct stats_timer *t, int op);
+void statsEnd(struct stats_timer *t);
+void statsBackendAdd(uint64_t start);
+struct stats_timer *statsCurrent(void);
+struct stats_timer *statsAdopt(struct stats_timer *t);
+uint64_t statsBackendTotal(void);
+void statsCount(enum stats_counter ctr, uint64_t n);
+
+/* Put this at the top of a handler.  The timer stops automatically when the
+ * handler returns, no matter which return it uses.  If one handler calls
+ * another (e.g. setattr calls getattr), only the outer one is counted. */
+#define STATS_OP(name) \
+	struct stats_timer __statsTimer __attribute__((cleanup(statsEnd))); \
+	statsBegin(&__statsTimer, STATS_OP_##name)
+
+/* Tell the trace what the handler is working on.  Only the outer handler's
+ * are recorded. */
+#define STATS_TRACE(inoArg, offArg, sizeArg) do { \
+	__statsTimer.ino = (inoArg); \
+	__statsTimer.off = (offArg); \
+	__statsTimer.size = (sizeArg); \
+} while(0)
+
+/* Wrap a call to the backend so its time is charged to the current handler.
+ *   res = STATS_BACKEND(fstatat(fd, "", &buf, flags));
+ * When the backend is being emulated (see proxy_emulate.h), the call is
+ * slowed down first, and a read or write's result is the bytes it moved. */
+#define STATS_BACKEND(call) \
+	STATS_BACKEND_EMULATE(call, 0, (int64_t) (intptr_t) __statsRes)
+
+/* The same, for a read or write whose result isn't a byte count, but whose
+ * size is known before the call. */
+#define STATS_BACKEND_BYTES(call, bytes) \
+	STATS_BACKEND_EMULATE(call, (int64_t) (bytes), 0)
+
+#define STATS_BACKEND_EMULATE(call, before, after) ({ \
+	static int __statsSite = EMULATE_UNCLASSIFIED; \
+	uint64_t __statsStart = statsNow(); \
+	int __statsEmulate = emulateEnabled() ? emulateBefore(&__statsSite, #call, (before)) : -1; \
+	__typeof__(call) __statsRes = (call); \
+	if(__statsEmulate >= 0) \
+		emulateAfter(__statsEmulate, (after)); \
+	statsBackendAdd(__statsStart); \
+	__statsRes; \
+})
+
+/* Gauges are sampled when the stats are read. */
+typedef double (*stats_gauge_fn)(void *arg);
+int statsAddGauge(const char *name, const char *help, stats_gauge_fn fn, void *arg);
+
+int statsStart(const char *sockPath);
+void statsStop(void);
+
+#endif /* PROXY_STATS_H */
@@ -0,0 +1,223 @@
+/* *****************************************************************************
+ * Operation trace.  See proxy_trace.h for the big picture and the file layout.
+ *
+ * The header's chunk count is the allocator: a thread that needs a chunk adds
+ * one to it, and the old value is its chunk.  A chunk's count is stored after
+ * its record, so a reader (or a crash) never sees a record that's only half
+ * written.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include "proxy_log.h"
+#include "proxy_stats.h"
+#include "proxy_trace.h"
+
+_Static_assert(sizeof(struct trace_header) == TRACE_HEADER_SZ, "trace_header must fill its page");
+_Static_assert(sizeof(struct trace_record) == 40, "trace_record is part of the file format");
+
+static struct {
+	int fd;
+	char *map;
+	size_t mapSize;
+	uint64_t maxChunks;
+	uint64_t startMono;
+	uint32_t nextThread;
+	bool enabled;
+} trace = {
+	.fd = -1,
+	.map = MAP_FAILED,
+};
+
+/* The chunk that this thread is filling, and its number in the trace. */
+static __thread struct trace_chunk *myChunk = NULL;
+static __thread uint32_t myThread = UINT32_MAX;
+static __thread bool myFull = false;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS
+ * ****************************************************************************/
+
+static struct trace_header *traceHeader(void)
+{
+	return (struct trace_header *) trace.map;
+}
+
+static struct trace_record *traceRecords(struct trace_chunk *c)
+{
+	return (struct trace_record *) (c + 1);
+}
+
+/* Take the next chunk for this thread.  Returns NULL when the file is full. */
+static struct trace_chunk *traceNewChunk(void)
+{
+	if(myThread == UINT32_MAX)
+		myThread = __atomic_fetch_add(&trace.nextThread, 1, __ATOMIC_RELAXED);
+
+	uint64_t n = __atomic_fetch_add(&traceHeader()->chunks, 1, __ATOMIC_RELAXED);
+	if(n >= trace.maxChunks) {
+		myFull = true;
+		return NULL;
+	}
+
+	struct trace_chunk *c = (struct trace_chunk *) (trace.map + TRACE_HEADER_SZ + n * TRACE_CHUNK_SZ);
+	c->thread = myThread;
+	__atomic_store_n(&c->count, 0, __ATOMIC_RELEASE);
+	return c;
+}
+
+/* Write the header: the magic, the sizes, and the names of the operations.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+static int traceWriteHeader(void)
+{
+#define TRACE_OP_NAME(name) #name,
+	static const char *names[] = { STATS_OPS(TRACE_OP_NAME) };
+#undef TRACE_OP_NAME
+
+	struct trace_header *h = traceHeader();
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	memset(h, 0, sizeof(*h));
+	h->recordSize = sizeof(struct trace_record);
+	h->chunkSize = TRACE_CHUNK_SZ;
+	h->startTime = ((uint64_t) now.tv_sec * 1000000000ULL) + now.tv_nsec;
+	h->numOps = STATS_OP_MAX;
+
+	size_t used = 0;
+	int i;
+	for(i = 0; i < STATS_OP_MAX; i++) {
+		size_t len = strlen(names[i]) + 1;
+		if(used + len > sizeof(h->opNames))
+			return ENAMETOOLONG;
+		memcpy(h->opNames + used, names[i], len);
+		used += len;
+	}
+
+	/* The magic goes last, so a header that's only half written isn't
+	 * mistaken for a trace. */
+	memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+	return 0;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS
+ * ****************************************************************************/
+
+/* Start recording to a new trace file of (about) bytes.  An old trace with
+ * the same name is replaced.
+ * Returns:
+ *   0 = success.
+ *  !0 = errno of failure. */
+int traceInit(const char *path, size_t bytes)
+{
+	if(path == NULL)
+		return 0;
+
+	trace.maxChunks = (bytes > TRACE_HEADER_SZ) ? (bytes - TRACE_HEADER_SZ) / TRACE_CHUNK_SZ : 0;
+	if(trace.maxChunks == 0)
+		return EINVAL;
+	trace.mapSize = TRACE_HEADER_SZ + trace.maxChunks * TRACE_CHUNK_SZ;
+
+	int error = 0;
+	do {
+		trace.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if(trace.fd == -1) {
+			error = errno;
+			break;
+		}
+
+		/* Allocate it now, so a full disk shows up here rather than as
+		 * a SIGBUS in a handler. */
+		error = posix_fallocate(trace.fd, 0, trace.mapSize);
+		if(error != 0)
+			break;
+
+		trace.map = mmap(NULL, trace.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, trace.fd, 0);
+		if(trace.map == MAP_FAILED) {
+			error = errno;
+			break;
+		}
+
+		error = traceWriteHeader();
+	} while(0);
+
+	if(error != 0) {
+		traceDestroy();
+		return error;
+	}
+
+	trace.startMono = statsNow();
+	trace.enabled = true;
+	LOG_STATUS(NULL, "Trace: %s : %llu MB.", path,
+	           (unsigned long long) (trace.mapSize / (1024 * 1024)));
+	return 0;
+}
+
+/* Stop recording, and cut the file down to the chunks that were used.  Call
+ * it after the handlers have stopped. */
+void traceDestroy(void)
+{
+	trace.enabled = false;
+
+	if(trace.map != MAP_FAILED) {
+		uint64_t chunks = __atomic_load_n(&traceHeader()->chunks, __ATOMIC_RELAXED);
+		if(chunks > trace.maxChunks)
+			chunks = trace.maxChunks;
+		traceHeader()->chunks = chunks;
+		msync(trace.map, trace.mapSize, MS_SYNC);
+		munmap(trace.map, trace.mapSize);
+		if(ftruncate(trace.fd, TRACE_HEADER_SZ + chunks * TRACE_CHUNK_SZ) == -1)
+			LOG_ERROR(NULL, "Unable to trim the trace: %s.", strerror(errno));
+	}
+	if(trace.fd != -1)
+		close(trace.fd);
+
+	trace.map = MAP_FAILED;
+	trace.fd = -1;
+}
+
+bool traceEnabled(void)
+{
+	return trace.enabled;
+}
+
+/* Record one operation.  Called by statsEnd() for every handler.
+ *   op      - Its enum stats_op.
+ *   start   - When it started (statsNow()).
+ *   latency - How long it took (ns).
+ *   ino, off, size - See proxy_trace.h. */
+void traceAdd(int op, uint64_t start, uint64_t latency, uint64_t ino, uint64_t off, uint64_t size)
+{
+	if(!trace.enabled)
+		return;
+
+	if(!myFull && ((myChunk == NULL) || (myChunk->count == TRACE_CHUNK_RECORDS)))
+		myChunk = traceNewChunk();
+	if(myFull) {
+		statsCount(STATS_CTR_trace_dropped, 1);
+		return;
+	}
+
+	struct trace_record *r = &traceRecords(myChunk)[myChunk->count];
+	r->start = (start > trace.startMono) ? start - trace.startMono : 0;
+	r->latency = latency;
+	r->ino = ino;
+	r->off = off;
+	r->size = (size > UINT32_MAX) ? UINT32_MAX : (uint32_t) size;
+	r->op = (uint16_t) op;
+	r->pad = 0;
+	__atomic_store_n(&myChunk->count, myChunk->count + 1, __ATOMIC_RELEASE);
+	statsCount(STATS_CTR_trace_records, 1);
+}
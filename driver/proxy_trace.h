@@ -0,0 +1,85 @@
+/* *****************************************************************************
+ * Operation trace.
+ *
+ * With PROXY_BRIDGE_TRACE set to a file name, every lo_oper call is recorded
+ * in that file: when it started, how long the handler took, which operation
+ * it was, the inode, and the offset and size that it was asked for.
+ * proxy_replay re-issues a trace against a mount, so what the clients did in
+ * production can be run again on a test box.
+ *
+ * The inode is recorded as its number on the backend (st_ino), not the FUSE
+ * node id, so it still means something after the proxy is gone (the root of
+ * the export is 0).  Names aren't recorded, so an operation on a name (create,
+ * mkdir, unlink, rename, ...) records its directory.  What "off" and "size"
+ * hold depends on the operation:
+ *   read, write_buf, fallocate - The byte range.
+ *   copy_file_range            - The range of the source file.
+ *   readdir, readdirplus       - The directory offset and the buffer size.
+ *   lookup                     - off is the inode that the name turned out to
+ *                                be (0 if there wasn't one).
+ *   forget_multi               - size is how many inodes were forgotten.
+ *
+ * The file is PROXY_BRIDGE_TRACE_MB long (default 256 MB), and is mapped into
+ * memory.  Each thread takes a chunk of it at a time (one atomic add) and
+ * writes its records straight into the chunk, so recording an operation costs
+ * a few stores and no locks.  When the file is full, recording stops
+ * (trace_dropped counts what's lost).  The file is cut down to the part that
+ * was used when the proxy stops.  If the proxy dies instead, everything up to
+ * the last record is still there, because the records are in the page cache.
+ *
+ * The layout is:
+ *   [trace_header][chunk 0][chunk 1]...
+ * A chunk is a trace_chunk followed by its records, in the order that the
+ * thread finished them.  Records from different chunks interleave, so a
+ * reader sorts them by start.  The header names the operations, so a trace
+ * stays readable when STATS_OPS changes.
+ * ****************************************************************************/
+
+#ifndef PROXY_TRACE_H
+#define PROXY_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC       "PBTRACE1"
+#define TRACE_HEADER_SZ   (4096)
+#define TRACE_CHUNK_SZ    (64 * 1024)
+#define TRACE_OP_NAMES_SZ (TRACE_HEADER_SZ - 40)
+
+struct trace_header {
+	char magic[8];
+	uint32_t recordSize;
+	uint32_t chunkSize;
+	uint64_t startTime;       /* When the trace started (ns since the epoch). */
+	uint64_t chunks;          /* Chunks taken.  Can overshoot the file. */
+	uint32_t numOps;
+	uint32_t pad;
+	char opNames[TRACE_OP_NAMES_SZ]; /* numOps names, each ending in a nul. */
+};
+
+struct trace_chunk {
+	uint32_t count;           /* Records in the chunk. */
+	uint32_t thread;          /* Which thread wrote them (0, 1, 2, ...). */
+};
+
+struct trace_record {
+	uint64_t start;           /* Nanoseconds since the trace started. */
+	uint64_t latency;         /* Nanoseconds in the handler. */
+	uint64_t ino;             /* Backend inode number. */
+	uint64_t off;
+	uint32_t size;
+	uint16_t op;              /* Index into the header's opNames. */
+	uint16_t pad;
+};
+
+#define TRACE_CHUNK_RECORDS \
+	((TRACE_CHUNK_SZ - sizeof(struct trace_chunk)) / sizeof(struct trace_record))
+
+int traceInit(const char *path, size_t bytes);
+void traceDestroy(void);
+bool traceEnabled(void);
+
+void traceAdd(int op, uint64_t start, uint64_t latency, uint64_t ino, uint64_t off, uint64_t size);
+
+#endif /* PROXY_TRACE_H */
@@ -0,0 +1,597 @@
+/* *****************************************************************************
+ * The io_uring data path.  See proxy_uring.h for the big picture.
+ *
+ * There is one ring.  Session threads put SQEs on it under sqLock, and a
+ * single completion thread takes the CQEs off and sends the replies.
+ *
+ * Every request in flight owns a uring_op.  There are exactly "depth" of
+ * them, so the completion queue (2 * depth) can never overflow.  When they're
+ * all in use, new requests just go the synchronous way.
+ *
+ * Lock order: sqLock, then opLock.  The completion thread only takes opLock.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <errno.h>
+#include <stdbool.h>
+
+#include "proxy_uring.h"
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/uio.h>
+
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+/* One registered buffer.  FUSE's default max_read and max_write, so almost
+ * every read and write fits in one. */
+#define URING_BUF_SZ (128 * 1024)
+
+/* The number of files that we can register with the ring. */
+#define URING_MAX_FILES (1024)
+
+enum uring_op_type { URING_READ, URING_WRITE, URING_FSYNC };
+
+struct uring_op {
+	struct uring_op *nextFree;
+	enum uring_op_type type;
+	fuse_req_t req;
+	struct lo_inode *inode;   /* Writes only. */
+	int bufIndex;             /* Registered buffer, or -1. */
+	char *buf;
+	struct iovec iov;         /* For unregistered buffers. */
+	bool abandoned;           /* Submit failed, and the caller replied. */
+};
+
+static struct io_uring ring;
+static bool ringRunning = false;
+static bool ringBroken = false;
+static pthread_t completionThread;
+
+static pthread_mutex_t sqLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Protected by opLock. */
+static pthread_mutex_t opLock = PTHREAD_MUTEX_INITIALIZER;
+static struct uring_op *ops = NULL;
+static struct uring_op *freeOps = NULL;
+static char *bufs = NULL;                 /* NULL if we couldn't register. */
+static int *freeBufs = NULL;
+static int numFreeBufs = 0;
+static bool fixedFiles = false;
+static int freeSlots[URING_MAX_FILES];
+static int numFreeSlots = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+/* Get a uring_op, and a registered buffer if it wants one (bufSize > 0) and
+ * the data fits.  Otherwise the data goes in a malloc()ed buffer.
+ *
+ * Returns NULL if there are too many requests in flight. */
+static struct uring_op *uringOpGet(enum uring_op_type type, fuse_req_t req, size_t bufSize)
+{
+	pthread_mutex_lock(&opLock);
+	struct uring_op *op = freeOps;
+	if(op != NULL) {
+		freeOps = op->nextFree;
+		op->bufIndex = -1;
+		op->buf = NULL;
+		if((bufSize > 0) && (bufSize <= URING_BUF_SZ) && (numFreeBufs > 0)) {
+			op->bufIndex = freeBufs[--numFreeBufs];
+			op->buf = bufs + ((size_t) op->bufIndex * URING_BUF_SZ);
+		}
+	}
+	pthread_mutex_unlock(&opLock);
+
+	if(op == NULL) {
+		return NULL;
+	}
+
+	op->type = type;
+	op->req = req;
+	op->inode = NULL;
+	op->abandoned = false;
+
+	if((bufSize > 0) && (op->buf == NULL)) {
+		op->buf = malloc(bufSize);
+		if(op->buf == NULL) {
+			pthread_mutex_lock(&opLock);
+			op->nextFree = freeOps;
+			freeOps = op;
+			pthread_mutex_unlock(&opLock);
+			return NULL;
+		}
+	}
+
+	return op;
+}
+
+static void uringOpPut(struct uring_op *op)
+{
+	pthread_mutex_lock(&opLock);
+	if(op->bufIndex >= 0) {
+		freeBufs[numFreeBufs++] = op->bufIndex;
+	}
+	else {
+		free(op->buf);
+	}
+	op->nextFree = freeOps;
+	freeOps = op;
+	pthread_mutex_unlock(&opLock);
+}
+
+/* Put sqe, prepared for op, on the ring.  Called with sqLock held.
+ *
+ * If the kernel won't take it, the caller replies the synchronous way, so the
+ * op mustn't reply too.  We can't take an SQE back off the ring, but the
+ * kernel hasn't read it yet, so we turn it into a NOP and mark the op.  If it
+ * ever completes, the completion thread just frees the op.
+ *
+ * Returns:
+ *   0 = success.  The completion thread owns the request now.
+ *  !0 = errno of failure.
+ */
+static int uringSubmit(struct io_uring_sqe *sqe, struct uring_op *op)
+{
+	while(1) {
+		int rc = io_uring_submit(&ring);
+		if(rc >= 0) {
+			statsCount(STATS_CTR_uring_ops, 1);
+			return 0;
+		}
+		if((rc == -EINTR) || (rc == -EAGAIN) || (rc == -EBUSY)) {
+			sched_yield();
+			continue;
+		}
+
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, op);
+		op->abandoned = true;
+
+		LOG_ERROR(NULL, "io_uring_submit() failed (%d).  Disabling io_uring.", -rc);
+		__atomic_store_n(&ringBroken, true, __ATOMIC_RELEASE);
+		return -rc;
+	}
+}
+
+/* Get an SQE and aim it at fd (or its registered slot).  Called with sqLock
+ * held.  Returns NULL if the ring is full or broken. */
+static struct io_uring_sqe *uringGetSQE(void)
+{
+	if(__atomic_load_n(&ringBroken, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return io_uring_get_sqe(&ring);
+}
+
+static void uringTarget(struct io_uring_sqe *sqe, int slot)
+{
+	if(slot >= 0) {
+		sqe->fd = slot;
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+	}
+}
+
+static void uringComplete(struct uring_op *op, int res)
+{
+	if(op->abandoned) {
+		uringOpPut(op);
+		return;
+	}
+
+	switch(op->type) {
+	case URING_READ:
+		if(res < 0)
+			fuse_reply_err(op->req, -res);
+		else
+			fuse_reply_buf(op->req, op->buf, res);
+		break;
+
+	case URING_WRITE:
+		inodeDataChanged(op->inode);
+		if(res < 0)
+			fuse_reply_err(op->req, -res);
+		else
+			fuse_reply_write(op->req, res);
+		break;
+
+	case URING_FSYNC:
+		fuse_reply_err(op->req, (res < 0) ? -res : 0);
+		break;
+	}
+
+	uringOpPut(op);
+}
+
+static void *uringCompletionThread(void *arg)
+{
+	(void) arg;
+
+	while(1) {
+		/* uringStop() cancels us if it can't wake us with a NOP, and
+		 * waiting isn't a cancellation point. */
+		struct io_uring_cqe *cqe;
+		pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+		int rc = io_uring_wait_cqe(&ring, &cqe);
+		pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+		if(rc == -EINTR) {
+			continue;
+		}
+		if(rc < 0) {
+			LOG_ERROR(NULL, "io_uring_wait_cqe() failed (%d).", -rc);
+			break;
+		}
+
+		struct uring_op *op = io_uring_cqe_get_data(cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+
+		/* uringStop() sends a NOP with no op. */
+		if(op == NULL) {
+			break;
+		}
+		uringComplete(op, res);
+	}
+
+	return NULL;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* Set up the ring with depth requests in flight, and start the completion
+ * thread.  Call it after fuse_daemonize().  depth = 0 leaves io_uring off.
+ *
+ * Returns:
+ *   0 = success (or nothing to do)
+ *  !0 = errno of failure.  The synchronous path is used.
+ */
+int uringStart(unsigned int depth)
+{
+	if(depth == 0) {
+		return 0;
+	}
+
+	int rc = io_uring_queue_init(depth, &ring, 0);
+	if(rc < 0) {
+		return -rc;
+	}
+
+	ops = calloc(depth, sizeof(struct uring_op));
+	freeBufs = calloc(depth, sizeof(int));
+	if((ops == NULL) || (freeBufs == NULL)) {
+		io_uring_queue_exit(&ring);
+		free(ops);
+		free(freeBufs);
+		return ENOMEM;
+	}
+
+	unsigned int i;
+	for(i = 0; i < depth; i++) {
+		ops[i].nextFree = freeOps;
+		freeOps = &ops[i];
+	}
+
+	/* Registered buffers are locked into memory, and older kernels charge
+	 * them to RLIMIT_MEMLOCK.  If we can't have them, we malloc(). */
+	struct iovec *iov = calloc(depth, sizeof(struct iovec));
+	bufs = aligned_alloc(4096, (size_t) depth * URING_BUF_SZ);
+	if((iov != NULL) && (bufs != NULL)) {
+		for(i = 0; i < depth; i++) {
+			iov[i].iov_base = bufs + ((size_t) i * URING_BUF_SZ);
+			iov[i].iov_len = URING_BUF_SZ;
+		}
+		rc = io_uring_register_buffers(&ring, iov, depth);
+		if(rc < 0) {
+			LOG_STATUS(NULL, "io_uring: no registered buffers (%d).", -rc);
+			free(bufs);
+			bufs = NULL;
+		}
+		else {
+			for(i = 0; i < depth; i++) {
+				freeBufs[numFreeBufs++] = i;
+			}
+		}
+	}
+	else {
+		free(bufs);
+		bufs = NULL;
+	}
+	free(iov);
+
+	/* Sparse file tables need kernel 5.5. */
+	for(i = 0; i < URING_MAX_FILES; i++) {
+		freeSlots[i] = -1;
+	}
+	rc = io_uring_register_files(&ring, freeSlots, URING_MAX_FILES);
+	if(rc < 0) {
+		LOG_STATUS(NULL, "io_uring: no registered files (%d).", -rc);
+	}
+	else {
+		fixedFiles = true;
+		for(i = 0; i < URING_MAX_FILES; i++) {
+			freeSlots[numFreeSlots++] = URING_MAX_FILES - 1 - i;
+		}
+	}
+
+	rc = pthread_create(&completionThread, NULL, uringCompletionThread, NULL);
+	if(rc != 0) {
+		io_uring_queue_exit(&ring);
+		return rc;
+	}
+
+	__atomic_store_n(&ringRunning, true, __ATOMIC_RELEASE);
+	LOG_STATUS(NULL, "io_uring: depth %u : registered buffers %s : registered files %s.",
+	           depth, (bufs != NULL) ? "yes" : "no", fixedFiles ? "yes" : "no");
+	return 0;
+}
+
+/* Stop the completion thread and tear down the ring.  Nothing can be in
+ * flight (the session loop has stopped). */
+void uringStop(void)
+{
+	if(!__atomic_load_n(&ringRunning, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&ringRunning, false, __ATOMIC_RELEASE);
+
+	/* A broken ring still has the SQE that it wouldn't take, and may not
+	 * take any more, so don't submit to it. */
+	pthread_mutex_lock(&sqLock);
+	struct io_uring_sqe *sqe = uringGetSQE();
+	if(sqe != NULL) {
+		io_uring_prep_nop(sqe);
+		io_uring_sqe_set_data(sqe, NULL);
+		io_uring_submit(&ring);
+	}
+	pthread_mutex_unlock(&sqLock);
+
+	if(sqe != NULL) {
+		pthread_join(completionThread, NULL);
+	}
+	else {
+		pthread_cancel(completionThread);
+		pthread_join(completionThread, NULL);
+	}
+
+	io_uring_queue_exit(&ring);
+	free(bufs);
+	free(freeBufs);
+	free(ops);
+	bufs = NULL;
+	freeBufs = NULL;
+	ops = NULL;
+	freeOps = NULL;
+	numFreeBufs = 0;
+	numFreeSlots = 0;
+	fixedFiles = false;
+}
+
+bool uringEnabled(void)
+{
+	return __atomic_load_n(&ringRunning, __ATOMIC_ACQUIRE) &&
+	       !__atomic_load_n(&ringBroken, __ATOMIC_ACQUIRE);
+}
+
+/* Register an open file with the ring.
+ *
+ * Returns the slot to pass to uringRead/Write/Fsync(), or -1 if the file
+ * isn't registered (it still works, it's just a little slower).
+ */
+int uringAddFile(int fd)
+{
+	if(!uringEnabled()) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&opLock);
+	int slot = (fixedFiles && (numFreeSlots > 0)) ? freeSlots[--numFreeSlots] : -1;
+	pthread_mutex_unlock(&opLock);
+
+	if((slot >= 0) && (io_uring_register_files_update(&ring, slot, &fd, 1) != 1)) {
+		uringRemoveFile(slot);
+		slot = -1;
+	}
+	return slot;
+}
+
+void uringRemoveFile(int slot)
+{
+	if(slot < 0) {
+		return;
+	}
+
+	int fd = -1;
+	io_uring_register_files_update(&ring, slot, &fd, 1);
+
+	pthread_mutex_lock(&opLock);
+	freeSlots[numFreeSlots++] = slot;
+	pthread_mutex_unlock(&opLock);
+}
+
+/* Read size bytes at off, and reply with what we get.
+ *
+ * Returns:
+ *   0 = success.  The reply will be sent by the completion thread.
+ *  !0 = errno of failure.  No reply has been sent.
+ */
+int uringRead(fuse_req_t req, int fd, int slot, size_t size, off_t off)
+{
+	struct uring_op *op = uringOpGet(URING_READ, req, (size > 0) ? size : 1);
+	if(op == NULL) {
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+
+	pthread_mutex_lock(&sqLock);
+	struct io_uring_sqe *sqe = uringGetSQE();
+	if(sqe == NULL) {
+		pthread_mutex_unlock(&sqLock);
+		uringOpPut(op);
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+
+	int target = (slot >= 0) ? slot : fd;
+	if(op->bufIndex >= 0) {
+		io_uring_prep_read_fixed(sqe, target, op->buf, size, off, op->bufIndex);
+	}
+	else {
+		op->iov.iov_base = op->buf;
+		op->iov.iov_len = size;
+		io_uring_prep_readv(sqe, target, &op->iov, 1, off);
+	}
+	uringTarget(sqe, slot);
+	io_uring_sqe_set_data(sqe, op);
+
+	int error = uringSubmit(sqe, op);
+	pthread_mutex_unlock(&sqLock);
+	return error;
+}
+
+/* Write src at off, and reply with the number of bytes written.  FUSE owns
+ * src, and only until we return, so the data is copied first.
+ *
+ * Returns:
+ *   0 = success.  The reply will be sent by the completion thread.
+ *  !0 = errno of failure.  No reply has been sent.
+ */
+int uringWrite(fuse_req_t req, int fd, int slot, struct fuse_bufvec *src,
+               off_t off, struct lo_inode *inode)
+{
+	size_t size = fuse_buf_size(src);
+	struct uring_op *op = uringOpGet(URING_WRITE, req, (size > 0) ? size : 1);
+	if(op == NULL) {
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+	op->inode = inode;
+
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = op->buf;
+	ssize_t copied = fuse_buf_copy(&dst, src, 0);
+	if(copied < 0) {
+		uringOpPut(op);
+		return -copied;
+	}
+
+	pthread_mutex_lock(&sqLock);
+	struct io_uring_sqe *sqe = uringGetSQE();
+	if(sqe == NULL) {
+		pthread_mutex_unlock(&sqLock);
+		uringOpPut(op);
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+
+	int target = (slot >= 0) ? slot : fd;
+	if(op->bufIndex >= 0) {
+		io_uring_prep_write_fixed(sqe, target, op->buf, copied, off, op->bufIndex);
+	}
+	else {
+		op->iov.iov_base = op->buf;
+		op->iov.iov_len = copied;
+		io_uring_prep_writev(sqe, target, &op->iov, 1, off);
+	}
+	uringTarget(sqe, slot);
+	io_uring_sqe_set_data(sqe, op);
+
+	int error = uringSubmit(sqe, op);
+	pthread_mutex_unlock(&sqLock);
+	return error;
+}
+
+/* fsync() or fdatasync() the file, and reply with the result.
+ *
+ * Returns:
+ *   0 = success.  The reply will be sent by the completion thread.
+ *  !0 = errno of failure.  No reply has been sent.
+ */
+int uringFsync(fuse_req_t req, int fd, int slot, bool datasync)
+{
+	struct uring_op *op = uringOpGet(URING_FSYNC, req, 0);
+	if(op == NULL) {
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+
+	pthread_mutex_lock(&sqLock);
+	struct io_uring_sqe *sqe = uringGetSQE();
+	if(sqe == NULL) {
+		pthread_mutex_unlock(&sqLock);
+		uringOpPut(op);
+		statsCount(STATS_CTR_uring_fallbacks, 1);
+		return EAGAIN;
+	}
+
+	io_uring_prep_fsync(sqe, (slot >= 0) ? slot : fd, datasync ? IORING_FSYNC_DATASYNC : 0);
+	uringTarget(sqe, slot);
+	io_uring_sqe_set_data(sqe, op);
+
+	int error = uringSubmit(sqe, op);
+	pthread_mutex_unlock(&sqLock);
+	return error;
+}
+
+#else /* HAVE_LIBURING */
+
+/* Built without liburing.  Everything takes the synchronous path. */
+
+int uringStart(unsigned int depth)
+{
+	return (depth == 0) ? 0 : ENOSYS;
+}
+
+void uringStop(void)
+{
+}
+
+bool uringEnabled(void)
+{
+	return false;
+}
+
+int uringAddFile(int fd)
+{
+	(void) fd;
+	return -1;
+}
+
+void uringRemoveFile(int slot)
+{
+	(void) slot;
+}
+
+int uringRead(struct fuse_req *req, int fd, int slot, size_t size, off_t off)
+{
+	(void) req, fd, slot, size, off;
+	return ENOSYS;
+}
+
+int uringWrite(struct fuse_req *req, int fd, int slot, struct fuse_bufvec *src,
+               off_t off, struct lo_inode *inode)
+{
+	(void) req, fd, slot, src, off, inode;
+	return ENOSYS;
+}
+
+int uringFsync(struct fuse_req *req, int fd, int slot, bool datasync)
+{
+	(void) req, fd, slot, datasync;
+	return ENOSYS;
+}
+
+#endif /* HAVE_LIBURING */
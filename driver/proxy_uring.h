@@ -0,0 +1,49 @@
+/* *****************************************************************************
+ * The io_uring data path.
+ *
+ * Without it, lo_read(), lo_write_buf() and lo_fsync() park a session thread
+ * in a synchronous NAS call, and the only way to get more I/O in flight is to
+ * run more threads.  With it, those handlers queue the backend call on an
+ * io_uring and return right away.  A completion thread sends the FUSE reply
+ * when the call finishes, so a few session threads can keep a deep queue of
+ * NAS I/O going.
+ *
+ * Buffers (and, on kernels that allow it, the open files) are registered with
+ * the ring, so the kernel doesn't have to map them on every call.
+ *
+ * It's optional in two ways.  The driver is only built with it if liburing is
+ * installed (HAVE_LIBURING), and it's only used if it's turned on
+ * (PROXY_BRIDGE_URING_DEPTH) and the kernel supports it.  Every function
+ * returns an error when it can't do the job, and the caller does it the old
+ * way.
+ *
+ * After a successful uringRead/Write/Fsync(), the reply belongs to the
+ * completion thread.  The caller must not touch req again.
+ * ****************************************************************************/
+
+#ifndef PROXY_URING_H
+#define PROXY_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "proxy_inode.h"
+
+struct fuse_bufvec;
+struct fuse_req;
+
+int uringStart(unsigned int depth);
+void uringStop(void);
+bool uringEnabled(void);
+
+int uringAddFile(int fd);
+void uringRemoveFile(int slot);
+
+int uringRead(struct fuse_req *req, int fd, int slot, size_t size, off_t off);
+int uringWrite(struct fuse_req *req, int fd, int slot, struct fuse_bufvec *src,
+               off_t off, struct lo_inode *inode);
+int uringFsync(struct fuse_req *req, int fd, int slot, bool datasync);
+
+#endif /* PROXY_URING_H */
@@ -0,0 +1,435 @@
+/* *****************************************************************************
+ * Write buffers.  See proxy_wbuf.h for the big picture.
+ *
+ * Each buffer holds one contiguous extent of the file, [off, off + len).  The
+ * data area is twice the configured buffer size.  A buffer never holds more
+ * than one buffer's worth of data between writes, so a write that touches the
+ * extent always fits.
+ *
+ * Every buffer is also on a global list, which the flusher thread and
+ * writeBufFlushInode() walk.  The list lock can't be held while we talk to
+ * the backend, so a buffer is "pinned" while somebody is flushing it, and
+ * writeBufClose() waits for the pins to go away before it unlinks it.
+ *
+ * Lock order: listLock, then write_buf.lock.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 31
+
+#include <fuse3/fuse_lowlevel.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "proxy_log.h"
+#include "proxy_stats.h"
+#include "proxy_wbuf.h"
+
+struct write_buf {
+	/* Protected by listLock. */
+	struct write_buf *prev;
+	struct write_buf *next;
+	int pins;
+
+	/* Protected by lock. */
+	pthread_mutex_t lock;
+	int fd;
+	struct lo_inode *inode;
+	int error;                /* Deferred write error. */
+	char *data;               /* Allocated on first use. */
+	off_t off;                /* File offset of data[0]. */
+	size_t len;
+
+	/* statsNow() when the buffer went dirty, or 0 if it's clean.  Written
+	 * under lock, but read without it by the list walkers. */
+	uint64_t dirtied;
+};
+
+/* 0 = write buffering is turned off. */
+static size_t bufSize = 0;
+static uint64_t maxAgeNS = 0;
+
+static pthread_mutex_t listLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t unpinned = PTHREAD_COND_INITIALIZER;
+static struct write_buf listHead = { .prev = &listHead, .next = &listHead };
+
+static pthread_t flusherThread;
+static int flusherRunning = 0;
+static int flusherStop = 0;
+
+/* *****************************************************************************
+ * PRIVATE UTILITY FUNCTIONS.
+ * ****************************************************************************/
+
+/* Write the first len bytes of the buffer to the backend, and slide the rest
+ * down to the front.  Called with wb->lock held.
+ *
+ * If the backend write fails, the error is saved for the application and the
+ * whole buffer is thrown away.  Keeping it would only make us fail again. */
+static void writeBufFlushLocked(struct write_buf *wb, size_t len)
+{
+	size_t done = 0;
+	while(done < len) {
+		ssize_t n = STATS_BACKEND(pwrite(wb->fd, wb->data + done, len - done,
+		                                 wb->off + done));
+		if(n == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			LOG_ERROR(NULL, "pwrite(%d, %zu, %lld) failed (%m).",
+			          wb->fd, len - done, (long long) (wb->off + done));
+			if(wb->error == 0) {
+				wb->error = errno;
+			}
+			len = wb->len;
+			break;
+		}
+		done += n;
+	}
+
+	statsCount(STATS_CTR_wbuf_flushes, 1);
+	statsCount(STATS_CTR_wbuf_flush_bytes, done);
+	inodeDataChanged(wb->inode);
+
+	memmove(wb->data, wb->data + len, wb->len - len);
+	wb->off += len;
+	wb->len -= len;
+	__atomic_store_n(&wb->dirtied, (wb->len == 0) ? 0 : statsNow(), __ATOMIC_RELAXED);
+}
+
+/* Flush every buffer that match() picks.  If idle is true, the data areas
+ * are freed too, since nobody has written to them in a while. */
+static void writeBufFlushEach(bool (*match)(struct write_buf *wb, void *arg),
+                              void *arg, bool idle)
+{
+	pthread_mutex_lock(&listLock);
+
+	struct write_buf *wb = listHead.next;
+	while(wb != &listHead) {
+		if(!match(wb, arg)) {
+			wb = wb->next;
+			continue;
+		}
+
+		wb->pins++;
+		pthread_mutex_unlock(&listLock);
+
+		pthread_mutex_lock(&wb->lock);
+		if(wb->len > 0) {
+			writeBufFlushLocked(wb, wb->len);
+		}
+		if(idle) {
+			free(wb->data);
+			wb->data = NULL;
+		}
+		pthread_mutex_unlock(&wb->lock);
+
+		/* The pin kept wb on the list, so wb->next is still good. */
+		pthread_mutex_lock(&listLock);
+		struct write_buf *next = wb->next;
+		if(--wb->pins == 0) {
+			pthread_cond_broadcast(&unpinned);
+		}
+		wb = next;
+	}
+
+	pthread_mutex_unlock(&listLock);
+}
+
+static bool writeBufIsDirty(struct write_buf *wb, void *arg)
+{
+	(void) arg;
+	return __atomic_load_n(&wb->dirtied, __ATOMIC_RELAXED) != 0;
+}
+
+static bool writeBufIsOld(struct write_buf *wb, void *arg)
+{
+	uint64_t dirtied = __atomic_load_n(&wb->dirtied, __ATOMIC_RELAXED);
+	return (dirtied != 0) && ((*(uint64_t *) arg - dirtied) >= maxAgeNS);
+}
+
+static bool writeBufIsInode(struct write_buf *wb, void *arg)
+{
+	return (wb->inode == arg) && writeBufIsDirty(wb, NULL);
+}
+
+/* Push out buffers that have been sitting around longer than maxAgeNS.  We
+ * look twice per age period, so nothing waits more than 1.5 periods. */
+static void *writeBufFlusherThread(void *arg)
+{
+	(void) arg;
+
+	const struct timespec tick = { 0, 10 * 1000 * 1000 };
+	uint64_t interval = maxAgeNS / 2;
+	uint64_t last = statsNow();
+
+	while(!__atomic_load_n(&flusherStop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&tick, NULL);
+
+		uint64_t now = statsNow();
+		if((now - last) < interval) {
+			continue;
+		}
+		last = now;
+
+		writeBufFlushEach(writeBufIsOld, &now, true);
+	}
+
+	return NULL;
+}
+
+/* *****************************************************************************
+ * PUBLIC FUNCTIONS.
+ * ****************************************************************************/
+
+/* bufBytes is the size of the pieces that we write to the backend.  0 turns
+ * write buffering off.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int writeBufInit(size_t bufBytes, unsigned int maxAgeMS)
+{
+	if((bufBytes != 0) && (bufBytes < 4096)) {
+		return EINVAL;
+	}
+
+	bufSize = bufBytes;
+	maxAgeNS = (uint64_t) maxAgeMS * 1000 * 1000;
+	return 0;
+}
+
+bool writeBufEnabled(void)
+{
+	return bufSize != 0;
+}
+
+/* Start the thread that flushes old buffers.  Call it after fuse_daemonize().
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure.
+ */
+int writeBufStart(void)
+{
+	if(!writeBufEnabled() || (maxAgeNS == 0)) {
+		return 0;
+	}
+
+	__atomic_store_n(&flusherStop, 0, __ATOMIC_RELEASE);
+	int rc = pthread_create(&flusherThread, NULL, writeBufFlusherThread, NULL);
+	if(rc != 0) {
+		return rc;
+	}
+
+	flusherRunning = 1;
+	return 0;
+}
+
+/* Stop the flusher, and flush anything that is still buffered. */
+void writeBufStop(void)
+{
+	if(flusherRunning) {
+		__atomic_store_n(&flusherStop, 1, __ATOMIC_RELEASE);
+		pthread_join(flusherThread, NULL);
+		flusherRunning = 0;
+	}
+
+	writeBufFlushEach(writeBufIsDirty, NULL, false);
+}
+
+/* Create the write buffer for a newly opened file.  fd still belongs to the
+ * caller, and must stay open until writeBufClose().
+ *
+ * Returns NULL (errno = ENOMEM) if we couldn't get the memory.
+ */
+struct write_buf *writeBufOpen(int fd, struct lo_inode *inode)
+{
+	struct write_buf *wb = calloc(1, sizeof(struct write_buf));
+	if(wb == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&wb->lock, NULL);
+	wb->fd = fd;
+	wb->inode = inode;
+	__atomic_add_fetch(&inode->wbufs, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&listLock);
+	wb->prev = listHead.prev;
+	wb->next = &listHead;
+	listHead.prev->next = wb;
+	listHead.prev = wb;
+	pthread_mutex_unlock(&listLock);
+
+	return wb;
+}
+
+/* Flush and free a write buffer.  The file is being released, so there can't
+ * be any more writes to it.
+ *
+ * The release may run in the background, after somebody else has already
+ * opened the file again.  So the flush happens while the buffer is still on
+ * the list, where writeBufFlushInode() can find it.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure (the last write-back error that nobody has seen).
+ */
+int writeBufClose(struct write_buf *wb)
+{
+	int error = writeBufFlush(wb);
+
+	pthread_mutex_lock(&listLock);
+	while(wb->pins > 0) {
+		pthread_cond_wait(&unpinned, &listLock);
+	}
+	wb->prev->next = wb->next;
+	wb->next->prev = wb->prev;
+	pthread_mutex_unlock(&listLock);
+
+	__atomic_sub_fetch(&wb->inode->wbufs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_destroy(&wb->lock);
+	free(wb->data);
+	free(wb);
+	return error;
+}
+
+/* Write src to the file at off.  Small writes that touch the buffered extent
+ * are merged into it.  Anything else pushes the buffer out first, so the
+ * backend always sees the writes in the order that they were made.
+ *
+ * Returns:
+ * >=0 = number of bytes written.
+ *  <0 = -errno of failure.
+ */
+ssize_t writeBufWrite(struct write_buf *wb, struct fuse_bufvec *src, off_t off)
+{
+	size_t size = fuse_buf_size(src);
+	off_t end = off + size;
+	ssize_t res;
+
+	pthread_mutex_lock(&wb->lock);
+
+	do {
+		if(wb->error != 0) {
+			res = -wb->error;
+			wb->error = 0;
+			break;
+		}
+
+		/* Big writes are already big, and data that is still in a pipe
+		 * would have to be copied twice. */
+		bool direct = (size >= bufSize) || (src->buf[0].flags & FUSE_BUF_IS_FD);
+
+		if(wb->len > 0) {
+			off_t bufEnd = wb->off + wb->len;
+			off_t lo = (off < wb->off) ? off : wb->off;
+			off_t hi = (end > bufEnd) ? end : bufEnd;
+			if(direct || (off > bufEnd) || (end < wb->off) || ((hi - lo) > (2 * bufSize))) {
+				writeBufFlushLocked(wb, wb->len);
+			}
+		}
+
+		if(wb->error != 0) {
+			res = -wb->error;
+			wb->error = 0;
+			break;
+		}
+
+		if(direct) {
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+			dst.buf[0].fd = wb->fd;
+			dst.buf[0].pos = off;
+			res = STATS_BACKEND(fuse_buf_copy(&dst, src, 0));
+			break;
+		}
+
+		if(wb->data == NULL) {
+			wb->data = malloc(2 * bufSize);
+			if(wb->data == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+		}
+
+		/* Make room in front if this write starts before the extent.
+		 * The write reaches the old extent, so it fills the gap. */
+		if(wb->len == 0) {
+			wb->off = off;
+		}
+		else if(off < wb->off) {
+			memmove(wb->data + (wb->off - off), wb->data, wb->len);
+			wb->len += wb->off - off;
+			wb->off = off;
+		}
+
+		struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+		dst.buf[0].mem = wb->data + (off - wb->off);
+		res = fuse_buf_copy(&dst, src, 0);
+		if(res < 0) {
+			break;
+		}
+
+		if((size_t) (end - wb->off) > wb->len) {
+			wb->len = end - wb->off;
+		}
+		if(wb->dirtied == 0) {
+			__atomic_store_n(&wb->dirtied, statsNow(), __ATOMIC_RELAXED);
+		}
+		statsCount(STATS_CTR_wbuf_writes, 1);
+
+		/* Once we have a full buffer, send everything up to the last
+		 * aligned boundary.  The leftover is less than bufSize. */
+		if(wb->len >= bufSize) {
+			off_t aligned = ((wb->off + wb->len) / bufSize) * bufSize;
+			writeBufFlushLocked(wb, aligned - wb->off);
+			if(wb->error != 0) {
+				res = -wb->error;
+				wb->error = 0;
+			}
+		}
+	} while(0);
+
+	pthread_mutex_unlock(&wb->lock);
+
+	return res;
+}
+
+/* Push out everything in the buffer.
+ *
+ * Returns:
+ *   0 = success
+ *  !0 = errno of failure (possibly from an earlier background write).
+ */
+int writeBufFlush(struct write_buf *wb)
+{
+	pthread_mutex_lock(&wb->lock);
+	if(wb->len > 0) {
+		writeBufFlushLocked(wb, wb->len);
+	}
+	int error = wb->error;
+	wb->error = 0;
+	pthread_mutex_unlock(&wb->lock);
+	return error;
+}
+
+/* Push out every buffer that holds data for this inode, no matter which open
+ * file it belongs to.  Call this before anything that looks at the backend
+ * file's data or attributes.  Errors stay with the open files that own them. */
+void writeBufFlushInode(struct lo_inode *inode)
+{
+	if(__atomic_load_n(&inode->wbufs, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	writeBufFlushEach(writeBufIsInode, inode, false);
+}
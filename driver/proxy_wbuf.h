@@ -0,0 +1,46 @@
+/* *****************************************************************************
+ * Write buffers.
+ *
+ * Applications that write a file 4KB at a time would otherwise send one NAS
+ * WRITE per FUSE WRITE.  Instead, each writable open file gets a buffer that
+ * collects adjacent and overlapping writes into a single extent, and the
+ * extent goes to the backend in large aligned pieces.
+ *
+ * A buffer is written to the backend when:
+ * - It holds a full buffer's worth of data (only whole aligned pieces go).
+ * - Its oldest data is older than the age limit (the flusher thread).
+ * - A write doesn't touch the buffered extent, or is too big to buffer.
+ * - Somebody needs to see the data: fsync, flush (close), release, read,
+ *   getattr and setattr on the inode.
+ *
+ * A backend write that fails in the background is remembered and returned by
+ * the next write, fsync or flush on that open file, the same way the NFS
+ * client reports write-back errors.
+ * ****************************************************************************/
+
+#ifndef PROXY_WBUF_H
+#define PROXY_WBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include "proxy_inode.h"
+
+struct fuse_bufvec;
+struct write_buf;
+
+int writeBufInit(size_t bufBytes, unsigned int maxAgeMS);
+bool writeBufEnabled(void);
+int writeBufStart(void);
+void writeBufStop(void);
+
+struct write_buf *writeBufOpen(int fd, struct lo_inode *inode);
+int writeBufClose(struct write_buf *wb);
+
+ssize_t writeBufWrite(struct write_buf *wb, struct fuse_bufvec *src, off_t off);
+int writeBufFlush(struct write_buf *wb);
+void writeBufFlushInode(struct lo_inode *inode);
+
+#endif /* PROXY_WBUF_H */
@@ -0,0 +1,129 @@
+/* *****************************************************************************
+ * The block cache hands back what was put in it, for as long as the file
+ * hasn't changed, and keeps to its budget.
+ *
+ * The stamps come from a real file and lo_inode, built the way
+ * lo_read_cached() builds them, so a write through the proxy (which bumps
+ * the inode's data generation), a change by another NAS client (which moves
+ * the mtime) and a truncate each have to make the cached blocks invisible.
+ * When the cache is full, old blocks are evicted, but a block that's been
+ * used more than once has to outlive a scan of blocks that are only used
+ * once.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "testUtils.h"
+
+#include "proxy_cache.h"
+#include "proxy_inode.h"
+
+/* Two blocks per shard (see CACHE_SHARDS in proxy_cache.c). */
+#define BUDGET (16 * 2 * CACHE_BLOCK_SZ)
+
+/* Enough blocks to fill the cache many times over. */
+#define SCAN_BLOCKS (64 * 16)
+
+static struct lo_inode inode;
+static int fd = -1;
+static char block[CACHE_BLOCK_SZ];
+
+static void stampFile(struct cache_stamp *stamp)
+{
+	uint64_t gen = inodeDataGen(&inode);
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	blockCacheStamp(stamp, &st, gen);
+}
+
+static void put(uint64_t blk)
+{
+	struct cache_stamp stamp;
+	stampFile(&stamp);
+	testFill(block, sizeof(block), blk);
+	blockCachePut(inode.dev, inode.ino, blk, &stamp, block, sizeof(block));
+}
+
+/* Is the block in the cache, with the right data? */
+static bool hit(uint64_t blk)
+{
+	struct cache_stamp stamp;
+	stampFile(&stamp);
+	static char buf[CACHE_BLOCK_SZ];
+	ssize_t n = blockCacheGet(inode.dev, inode.ino, blk, &stamp, buf);
+	if(n == -1)
+		return false;
+	CHECK(n == CACHE_BLOCK_SZ);
+	testFill(block, sizeof(block), blk);
+	CHECK(memcmp(buf, block, sizeof(block)) == 0);
+	return true;
+}
+
+int main(void)
+{
+	CHECK(blockCacheInit(BUDGET) == 0);
+	CHECK(blockCacheEnabled());
+
+	char *dir = testScratchDir("blockCacheTest");
+	char path[300];
+	snprintf(path, sizeof(path), "%s/file", dir);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(fd != -1);
+	CHECK(ftruncate(fd, 100 * CACHE_BLOCK_SZ) == 0);
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	inode.dev = st.st_dev;
+	inode.ino = st.st_ino;
+	inodeDataChanged(&inode);
+
+	printf("A block that was put is a hit.\n");
+	CHECK(!hit(0));
+	put(0);
+	CHECK(hit(0));
+	CHECK(hit(0));
+	CHECK(!hit(1));
+
+	printf("A write through the proxy invalidates it.\n");
+	inodeDataChanged(&inode);
+	CHECK(!hit(0));
+	put(0);
+	CHECK(hit(0));
+
+	printf("So does a change by another NAS client.\n");
+	struct timespec times[2] = { { 0, UTIME_OMIT }, { 12345, 0 } };
+	CHECK(futimens(fd, times) == 0);
+	CHECK(!hit(0));
+	put(0);
+	CHECK(hit(0));
+
+	printf("So does a truncate.\n");
+	CHECK(ftruncate(fd, 50 * CACHE_BLOCK_SZ) == 0);
+	CHECK(!hit(0));
+
+	printf("A scan evicts, keeps to the budget, and leaves hot blocks.\n");
+	put(0);
+	CHECK(hit(0));
+	uint64_t blk;
+	for(blk = 1; blk <= SCAN_BLOCKS; blk++) {
+		put(blk);
+		CHECK(blockCacheBytes(NULL) <= BUDGET);
+	}
+	CHECK(hit(0));
+	int resident = 0;
+	for(blk = 1; blk <= SCAN_BLOCKS; blk++) {
+		if(hit(blk))
+			resident++;
+	}
+	CHECK(resident > 0);
+	CHECK(resident < BUDGET / CACHE_BLOCK_SZ);
+	CHECK(!hit(1));
+
+	close(fd);
+	testRemoveDir(dir);
+	blockCacheDestroy();
+	CHECK(!blockCacheEnabled());
+	printf("blockCacheTest passed.\n");
+	return 0;
+}
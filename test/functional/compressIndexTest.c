@@ -0,0 +1,181 @@
+/* *****************************************************************************
+ * Compressed files read back what was written, once their index has been
+ * dropped and read back from the "NAS".
+ *
+ * The writes cover more than one group (so more than one index), don't line
+ * up with the chunks, leave a gap of zeros, and overwrite chunks more than
+ * once (so the data moves between the halves of their slots).  Between
+ * steps, the inode's compress_file is thrown away, the way it is when the
+ * kernel forgets the inode, so every check reads the index from the file.
+ * A chunk whose bytes are damaged on the NAS has to fail its read.
+ *
+ * It's all done twice: once as is, and once with encryption on, where the
+ * compressed layout is inside the encryption's header and none of it is on
+ * the NAS in the clear.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "testUtils.h"
+
+#include "proxy_compress.h"
+#include "proxy_crypt.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+
+#define CHUNK    ((off_t) COMPRESS_CHUNK_SZ)
+
+/* Past the first group, and not on a chunk boundary. */
+#define PLAIN_SZ ((COMPRESS_GROUP_CHUNKS + 20) * CHUNK + 12345)
+
+static struct lo_inode inode;
+static int fd = -1;
+
+/* What the file should hold. */
+static char *shadow;
+static off_t shadowSize = 0;
+
+/* Half compressible (so zlib has something to do), half not. */
+static void fill(char *buf, size_t len, uint64_t seed)
+{
+	testFill(buf, len, seed);
+	size_t i;
+	for(i = 0; i < len; i += 1024)
+		memset(buf + i, 'z', (len - i < 512) ? len - i : 512);
+}
+
+static void writePlain(off_t off, size_t len, uint64_t seed)
+{
+	fill(shadow + off, len, seed);
+	struct fuse_bufvec bv = testBuf(shadow + off, len);
+	CHECK(compressWrite(&inode, fd, &bv, off) == (ssize_t) len);
+	if(off + (off_t) len > shadowSize)
+		shadowSize = off + len;
+}
+
+/* Forget the index, and read the header back, like a new lookup and open. */
+static void reopen(void)
+{
+	compressFileFree(inode.compress);
+	inode.compress = NULL;
+	cryptFileFree(inode.crypt);
+	inode.crypt = NULL;
+	CHECK(compressOpen(&inode, fd, true) == 0);
+}
+
+static void checkFile(void)
+{
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	cryptStat(&st);
+	compressStat(&st);
+	CHECK(st.st_size == shadowSize);
+
+	/* Odd sized reads, so they start and end inside chunks. */
+	const size_t readSz = 3 * CHUNK + 777;
+	off_t off;
+	for(off = 0; off < shadowSize; off += readSz) {
+		char *buf;
+		size_t want = (shadowSize - off < (off_t) readSz) ? shadowSize - off : readSz;
+		CHECK(compressRead(&inode, fd, readSz, off, &buf) == (ssize_t) want);
+		if(memcmp(buf, shadow + off, want) != 0) {
+			fprintf(stderr, "The read at %lld doesn't match.\n", (long long) off);
+			exit(1);
+		}
+	}
+	char *buf;
+	CHECK(compressRead(&inode, fd, 100, shadowSize, &buf) == 0);
+}
+
+static void run(const char *dir)
+{
+	memset(shadow, 0, PLAIN_SZ);
+	shadowSize = 0;
+
+	char path[300];
+	snprintf(path, sizeof(path), "%s/file", dir);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	CHECK(fd != -1);
+	CHECK(compressOpen(&inode, fd, true) == 0);
+
+	printf("Write two groups, with a gap, out of order.\n");
+	writePlain(CHUNK * (COMPRESS_GROUP_CHUNKS - 2) + 100, 5 * CHUNK, 1);
+	writePlain(0, 3 * CHUNK + 5000, 2);
+	writePlain(PLAIN_SZ - 70000, 70000, 3);
+	reopen();
+	checkFile();
+
+	printf("Overwrite chunks (and parts of them), twice.\n");
+	writePlain(CHUNK / 2, CHUNK, 4);
+	writePlain(CHUNK * (COMPRESS_GROUP_CHUNKS - 1) - 10, 20, 5);
+	writePlain(CHUNK / 2, CHUNK, 6);
+	writePlain(CHUNK * (COMPRESS_GROUP_CHUNKS - 1) - 10, 20, 7);
+	reopen();
+	checkFile();
+
+	printf("Truncate into the middle of a chunk.\n");
+	shadowSize = CHUNK * (COMPRESS_GROUP_CHUNKS - 1) + 3;
+	memset(shadow + shadowSize, 0, PLAIN_SZ - shadowSize);
+	CHECK(compressTruncate(&inode, fd, shadowSize) == 0);
+	reopen();
+	checkFile();
+
+	/* Encrypted, the compressed header isn't where it would be. */
+	off_t base = cryptEnabled() ? CRYPT_HEADER_SZ : 0;
+	char magic[4];
+	CHECK(pread(fd, magic, sizeof(magic), base) == sizeof(magic));
+	CHECK((memcmp(magic, "NPXZ", sizeof(magic)) == 0) == !cryptEnabled());
+
+	printf("Damage a chunk on the NAS.\n");
+	reopen();
+	char junk[64];
+	memset(junk, 0x5a, sizeof(junk));
+
+	/* Chunk 0's slot is after the header and the first index (4096 bytes,
+	 * see COMPRESS_INDEX_SZ in proxy_compress.c).  Its data can be in
+	 * either half. */
+	off_t slot = base + COMPRESS_HEADER_SZ + 4096;
+	CHECK(pwrite(fd, junk, sizeof(junk), slot) == sizeof(junk));
+	CHECK(pwrite(fd, junk, sizeof(junk), slot + CHUNK) == sizeof(junk));
+	char *buf;
+	CHECK(compressRead(&inode, fd, 10, 0, &buf) == -EIO);
+
+	compressFileFree(inode.compress);
+	inode.compress = NULL;
+	cryptFileFree(inode.crypt);
+	inode.crypt = NULL;
+	close(fd);
+}
+
+int main(void)
+{
+	logInit(LOG_ERR, 0);
+	CHECK(workPoolStart(4) == 0);
+	CHECK(compressInit("zlib") == 0);
+
+	shadow = calloc(1, PLAIN_SZ);
+	CHECK(shadow != NULL);
+
+	char *dir = testScratchDir("compressIndexTest");
+	run(dir);
+
+	printf("Again, encrypted.\n");
+	char path[300];
+	snprintf(path, sizeof(path), "%s/key", dir);
+	FILE *key = fopen(path, "w");
+	CHECK(key != NULL);
+	fprintf(key, "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n");
+	fclose(key);
+	CHECK(cryptInit(path) == 0);
+	run(dir);
+
+	testRemoveDir(dir);
+	cryptDestroy();
+	compressDestroy();
+	workPoolStop();
+	free(shadow);
+	printf("compressIndexTest passed.\n");
+	return 0;
+}
@@ -0,0 +1,212 @@
+/* *****************************************************************************
+ * Encrypted files read back what was written, whatever the writes line up
+ * with.
+ *
+ * The writes start and end inside encryption units, run past the end of the
+ * file, leave gaps, and leave tails shorter than an AES block, so every way
+ * that a unit gets read back and encrypted again is used.  After each one,
+ * the whole file is read back and compared with what it should hold.  At the
+ * end, the inode's crypt_file is thrown away and the header read back, the
+ * way it is when the kernel forgets the inode, and the file is compared
+ * again.  What's on the NAS has to be the header plus the same number of
+ * bytes, none of them in the clear.  Last, a plain file is encrypted the way
+ * proxy_encrypt does it, and has to read back the same.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "testUtils.h"
+
+#include "proxy_crypt.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+
+#define MAX_SZ (256 * 1024)
+#define WRITES (200)
+
+static struct lo_inode inode;
+static int fd = -1;
+
+/* What the file should hold. */
+static char shadow[MAX_SZ];
+static off_t shadowSize = 0;
+
+/* Write the way lo_write_buf() does: encrypt, write what cryptWrite() hands
+ * back where it says, and let go of the file. */
+static void writePlain(off_t off, size_t len, uint64_t seed)
+{
+	testFill(shadow + off, len, seed);
+	struct fuse_bufvec src = testBuf(shadow + off, len);
+	struct fuse_bufvec cipher;
+	off_t at = off;
+	CHECK(cryptWrite(&inode, fd, &src, &at, &cipher) == (ssize_t) len);
+
+	struct fuse_bufvec out = FUSE_BUFVEC_INIT(fuse_buf_size(&cipher));
+	out.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+	out.buf[0].fd = fd;
+	out.buf[0].pos = at;
+	CHECK(fuse_buf_copy(&out, &cipher, 0) == (ssize_t) fuse_buf_size(&cipher));
+	cryptWriteEnd(&inode);
+
+	if(off + (off_t) len > shadowSize)
+		shadowSize = off + len;
+}
+
+/* Read the way lo_read_crypt() does.
+ *
+ * Returns the number of bytes read.
+ */
+static size_t readPlain(off_t off, size_t size, char *dst)
+{
+	struct crypt_file *cf = cryptFile(&inode);
+	CHECK(cf != NULL);
+
+	cryptReadBegin(cf);
+	off_t from;
+	size_t want;
+	cryptReadRange(cf, off, size, &from, &want);
+	char *buf = malloc(want + 1);
+	CHECK(buf != NULL);
+	ssize_t got = pread(fd, buf, want, from);
+	CHECK(got >= 0);
+	if(got > 0)
+		cryptDecrypt(cf, buf, got, from);
+	cryptReadEnd(cf);
+
+	size_t head = CRYPT_HEADER_SZ + off - from;
+	size_t len = (got > (ssize_t) head) ? got - head : 0;
+	if(len > size)
+		len = size;
+	memcpy(dst, buf + head, len);
+	free(buf);
+	return len;
+}
+
+static void checkFile(void)
+{
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	CHECK(st.st_size == CRYPT_HEADER_SZ + shadowSize);
+	cryptStat(&st);
+	CHECK(st.st_size == shadowSize);
+
+	static char buf[MAX_SZ];
+	CHECK(readPlain(0, MAX_SZ, buf) == (size_t) shadowSize);
+	if(memcmp(buf, shadow, shadowSize) != 0) {
+		fprintf(stderr, "The file doesn't match.\n");
+		exit(1);
+	}
+
+	/* And a read that starts and ends inside units. */
+	if(shadowSize > 5000) {
+		CHECK(readPlain(1234, 5000 - 1234, buf) == 5000 - 1234);
+		CHECK(memcmp(buf, shadow + 1234, 5000 - 1234) == 0);
+	}
+}
+
+int main(void)
+{
+	logInit(LOG_ERR, 0);
+	CHECK(workPoolStart(4) == 0);
+
+	char *dir = testScratchDir("cryptRoundTripTest");
+	char path[300];
+	snprintf(path, sizeof(path), "%s/key", dir);
+	FILE *key = fopen(path, "w");
+	CHECK(key != NULL);
+	fprintf(key, "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f\n");
+	fclose(key);
+	CHECK(cryptInit(path) == 0);
+
+	snprintf(path, sizeof(path), "%s/file", dir);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(fd != -1);
+	CHECK(cryptOpen(&inode, fd, true) == 0);
+
+	printf("Short writes, then a tail shorter than an AES block.\n");
+	writePlain(0, 1, 1);
+	checkFile();
+	writePlain(1, 10, 2);
+	checkFile();
+	writePlain(CRYPT_UNIT_SZ - 3, 9, 3);
+	checkFile();
+	writePlain(CRYPT_UNIT_SZ + 6, 2, 4);
+	checkFile();
+
+	printf("Writes past the end, with gaps.\n");
+	writePlain(3 * CRYPT_UNIT_SZ + 100, 5, 5);
+	checkFile();
+	writePlain(10 * CRYPT_UNIT_SZ - 1, 2 * CRYPT_UNIT_SZ + 3, 6);
+	checkFile();
+
+	printf("%d writes anywhere.\n", WRITES);
+	srandom(7);
+	int i;
+	for(i = 0; i < WRITES; i++) {
+		off_t off = random() % (MAX_SZ / 2);
+		size_t len = 1 + random() % ((i % 4 == 0) ? 3 * CRYPT_UNIT_SZ : 40);
+		writePlain(off, len, 100 + i);
+		checkFile();
+	}
+
+	printf("Truncate into the middle of a unit, then grow again.\n");
+	shadowSize = 5 * CRYPT_UNIT_SZ + 7;
+	memset(shadow + shadowSize, 0, MAX_SZ - shadowSize);
+	CHECK(cryptTruncate(&inode, fd, shadowSize) == 0);
+	checkFile();
+	shadowSize = 9 * CRYPT_UNIT_SZ + 3;
+	CHECK(cryptTruncate(&inode, fd, shadowSize) == 0);
+	checkFile();
+
+	printf("Read the header back.\n");
+	cryptFileFree(inode.crypt);
+	inode.crypt = NULL;
+	CHECK(cryptOpen(&inode, fd, true) == 0);
+	checkFile();
+
+	/* None of the application's bytes are on the NAS as is (but the
+	 * holes are zeros on both sides). */
+	static char nas[MAX_SZ];
+	static const char zeros[32];
+	CHECK(pread(fd, nas, shadowSize, CRYPT_HEADER_SZ) == shadowSize);
+	off_t off;
+	for(off = 0; off + 32 <= shadowSize; off += 32) {
+		if(memcmp(shadow + off, zeros, 32) != 0)
+			CHECK(memmem(nas, shadowSize, shadow + off, 32) == NULL);
+	}
+
+	cryptFileFree(inode.crypt);
+	inode.crypt = NULL;
+	close(fd);
+
+	/* A plain file, the way it was on the export before encryption was
+	 * turned on, with a gap of zeros that's bigger than a chunk. */
+	printf("Encrypt a plain file (proxy_encrypt).\n");
+	shadowSize = MAX_SZ - 5;
+	testFill(shadow, shadowSize, 500);
+	memset(shadow + 10000, 0, 150000);
+	snprintf(path, sizeof(path), "%s/plain", dir);
+	int plainFD = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(plainFD != -1);
+	CHECK(pwrite(plainFD, shadow, shadowSize, 0) == shadowSize);
+	snprintf(path, sizeof(path), "%s/imported", dir);
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(fd != -1);
+	CHECK(cryptOpen(&inode, plainFD, false) == EIO);
+	CHECK(cryptImport(plainFD, fd) == 0);
+	CHECK(cryptImport(fd, plainFD) == EEXIST);
+	CHECK(cryptOpen(&inode, fd, true) == 0);
+	checkFile();
+	CHECK(testDiskBytes(fd) < shadowSize);
+
+	cryptFileFree(inode.crypt);
+	close(plainFD);
+	close(fd);
+	testRemoveDir(dir);
+	cryptDestroy();
+	workPoolStop();
+	printf("cryptRoundTripTest passed.\n");
+	return 0;
+}
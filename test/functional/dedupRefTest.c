@@ -0,0 +1,167 @@
+/* *****************************************************************************
+ * Files whose chunks are in the dedup chunk store read back through their
+ * dedup_refs.
+ *
+ * Two files get the same data.  The second one's chunks go into the store,
+ * and the first one's copies are moved over to it (what lo_write_buf() does
+ * after each write), so both files end up holding only dedup_refs.  They
+ * have to read back the same, after their indexes are dropped, after the
+ * store is opened again (a restart), and after one of them is overwritten.
+ * A third file, written after the restart, has to find every chunk in the
+ * store.  Without the store, the files can't be read.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "testUtils.h"
+
+#include "proxy_compress.h"
+#include "proxy_dedup.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+
+/* Twelve whole chunks and a short one. */
+#define CHUNKS   (13)
+#define PLAIN_SZ ((CHUNKS - 1) * COMPRESS_CHUNK_SZ + 1000)
+
+struct test_file {
+	struct lo_inode inode;
+	int fd;
+};
+
+static char *dir;
+static char storePath[300];
+static char data[PLAIN_SZ];
+static struct test_file files[3];
+
+static void openFile(struct test_file *f, const char *name)
+{
+	char path[300];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(f->fd != -1);
+	struct stat st;
+	CHECK(fstat(f->fd, &st) == 0);
+	f->inode.dev = st.st_dev;
+	f->inode.ino = st.st_ino;
+	CHECK(compressOpen(&f->inode, f->fd, true) == 0);
+}
+
+static void writeFile(struct test_file *f, const char *src, off_t off, size_t len)
+{
+	struct fuse_bufvec bv = testBuf(src + off, len);
+	CHECK(compressWrite(&f->inode, f->fd, &bv, off) == (ssize_t) len);
+}
+
+/* Move the first copies of stored chunks over to the store, the way
+ * lo_dedup_repoint() does.
+ *
+ * Returns the number moved.
+ */
+static int repoint(void)
+{
+	int moved = 0;
+	struct dedup_origin origin;
+	struct dedup_ref ref;
+	while(dedupRepointNext(&origin, &ref)) {
+		size_t i;
+		for(i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+			struct test_file *f = &files[i];
+			if((f->fd != -1) && (f->inode.ino == origin.ino) && (f->inode.dev == origin.dev) &&
+			   (compressRepoint(&f->inode, f->fd, origin.chunk, &ref) == 0))
+				moved++;
+		}
+	}
+	return moved;
+}
+
+/* Forget the index, and read the file back. */
+static void checkFile(struct test_file *f, const char *src)
+{
+	compressFileFree(f->inode.compress);
+	f->inode.compress = NULL;
+	CHECK(compressOpen(&f->inode, f->fd, false) == 0);
+
+	char *buf;
+	CHECK(compressRead(&f->inode, f->fd, PLAIN_SZ, 0, &buf) == PLAIN_SZ);
+	CHECK(memcmp(buf, src, PLAIN_SZ) == 0);
+}
+
+/* Only refs (a block each), no chunks. */
+static void checkOnlyRefs(struct test_file *f)
+{
+	CHECK(testDiskBytes(f->fd) < PLAIN_SZ / 4);
+}
+
+int main(void)
+{
+	logInit(LOG_ERR, 0);
+	CHECK(workPoolStart(4) == 0);
+	CHECK(compressInit("none") == 0);
+
+	dir = testScratchDir("dedupRefTest");
+	snprintf(storePath, sizeof(storePath), "%s/store", dir);
+	CHECK(dedupInit(storePath, 1024 * 1024, 0) == 0);
+	testFill(data, PLAIN_SZ, 1);
+	size_t i;
+	for(i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+		files[i].fd = -1;
+
+	printf("Write the same data to two files.\n");
+	openFile(&files[0], "a");
+	writeFile(&files[0], data, 0, PLAIN_SZ);
+	CHECK(repoint() == 0);
+	CHECK(testDiskBytes(files[0].fd) >= PLAIN_SZ);
+	openFile(&files[1], "b");
+	writeFile(&files[1], data, 0, PLAIN_SZ);
+	CHECK(repoint() == CHUNKS);
+	CHECK(dedupSync(compressDedupSeq(&files[0].inode)) == 0);
+	CHECK(dedupSync(compressDedupSeq(&files[1].inode)) == 0);
+	checkOnlyRefs(&files[0]);
+	checkOnlyRefs(&files[1]);
+	checkFile(&files[0], data);
+	checkFile(&files[1], data);
+
+	printf("Open the store again.\n");
+	dedupDestroy();
+	CHECK(dedupInit(storePath, 1024 * 1024, 0) == 0);
+	CHECK(dedupEntries(NULL) == CHUNKS);
+	checkFile(&files[0], data);
+	checkFile(&files[1], data);
+
+	printf("A third file finds every chunk in the store.\n");
+	openFile(&files[2], "c");
+	writeFile(&files[2], data, 0, PLAIN_SZ);
+	CHECK(repoint() == 0);
+	checkOnlyRefs(&files[2]);
+	checkFile(&files[2], data);
+
+	printf("Overwrite part of one file.  The others don't change.\n");
+	static char changed[PLAIN_SZ];
+	memcpy(changed, data, PLAIN_SZ);
+	testFill(changed + COMPRESS_CHUNK_SZ + 10, 100, 2);
+	writeFile(&files[1], changed, COMPRESS_CHUNK_SZ + 10, 100);
+	checkFile(&files[1], changed);
+	checkFile(&files[0], data);
+	checkFile(&files[2], data);
+
+	printf("Without the store, a file can't be read.\n");
+	dedupDestroy();
+	compressFileFree(files[0].inode.compress);
+	files[0].inode.compress = NULL;
+	CHECK(compressOpen(&files[0].inode, files[0].fd, false) == 0);
+	char *buf;
+	CHECK(compressRead(&files[0].inode, files[0].fd, 10, 0, &buf) == -EIO);
+
+	for(i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		compressFileFree(files[i].inode.compress);
+		close(files[i].fd);
+	}
+	testRemoveDir(dir);
+	compressDestroy();
+	workPoolStop();
+	printf("dedupRefTest passed.\n");
+	return 0;
+}
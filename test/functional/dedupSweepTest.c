@@ -0,0 +1,225 @@
+/* *****************************************************************************
+ * The chunk store gives back the chunks that no file uses, and the
+ * fingerprint table makes room for new chunks when it fills up.
+ *
+ * Two pairs of files share their data, so it all goes into the store.  One
+ * pair is deleted, and a chunk of each of the others is overwritten.  The
+ * sweep (what proxy_dedup_sweep does) has to take out exactly the chunks
+ * that aren't used any more, and the files that are left have to read back
+ * the same after the store is opened again.
+ *
+ * Then one file writes more chunks, all different, than the table holds.
+ * The chunks in the store still have to be found, and so do the last ones
+ * that were seen, when another file writes them again.
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+
+#include "testUtils.h"
+
+#include "proxy_compress.h"
+#include "proxy_dedup.h"
+#include "proxy_log.h"
+#include "proxy_pool.h"
+
+#define CHUNK    ((off_t) COMPRESS_CHUNK_SZ)
+
+/* Twelve whole chunks and a short one. */
+#define CHUNKS   (13)
+#define PLAIN_SZ ((CHUNKS - 1) * CHUNK + 1000)
+
+/* The smallest table holds 768 fingerprints (see dedupInit()). */
+#define TABLE_MB (0)
+#define UNIQUE   (800)
+
+struct test_file {
+	struct lo_inode inode;
+	int fd;
+	char name[8];
+};
+
+static char *dir;
+static char storePath[300];
+static struct test_file files[6];
+
+static void openFile(struct test_file *f, const char *name)
+{
+	char path[300];
+	snprintf(f->name, sizeof(f->name), "%s", name);
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	f->fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(f->fd != -1);
+	struct stat st;
+	CHECK(fstat(f->fd, &st) == 0);
+	f->inode.dev = st.st_dev;
+	f->inode.ino = st.st_ino;
+	CHECK(compressOpen(&f->inode, f->fd, true) == 0);
+}
+
+static void closeFile(struct test_file *f, bool remove)
+{
+	compressFileFree(f->inode.compress);
+	f->inode.compress = NULL;
+	close(f->fd);
+	f->fd = -1;
+	if(remove) {
+		char path[300];
+		snprintf(path, sizeof(path), "%s/%s", dir, f->name);
+		CHECK(unlink(path) == 0);
+	}
+}
+
+static void writeFile(struct test_file *f, const char *src, off_t off, size_t len)
+{
+	struct fuse_bufvec bv = testBuf(src + off, len);
+	CHECK(compressWrite(&f->inode, f->fd, &bv, off) == (ssize_t) len);
+}
+
+/* Move the first copies of stored chunks over to the store, the way
+ * lo_dedup_repoint() does.
+ *
+ * Returns the number moved.
+ */
+static int repoint(void)
+{
+	int moved = 0;
+	struct dedup_origin origin;
+	struct dedup_ref ref;
+	while(dedupRepointNext(&origin, &ref)) {
+		size_t i;
+		for(i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+			struct test_file *f = &files[i];
+			if((f->fd != -1) && (f->inode.ino == origin.ino) && (f->inode.dev == origin.dev) &&
+			   (compressRepoint(&f->inode, f->fd, origin.chunk, &ref) == 0))
+				moved++;
+		}
+	}
+	return moved;
+}
+
+/* Forget the index, and read the file back. */
+static void checkFile(struct test_file *f, const char *src, size_t len)
+{
+	compressFileFree(f->inode.compress);
+	f->inode.compress = NULL;
+	CHECK(compressOpen(&f->inode, f->fd, false) == 0);
+
+	char *buf;
+	CHECK(compressRead(&f->inode, f->fd, len, 0, &buf) == (ssize_t) len);
+	CHECK(memcmp(buf, src, len) == 0);
+}
+
+/* compressRefs() callback. */
+static struct dedup_ref live[4 * CHUNKS];
+static size_t numLive = 0;
+
+static int addRef(const struct dedup_ref *ref, void *arg)
+{
+	(void) arg;
+	CHECK(numLive < sizeof(live) / sizeof(live[0]));
+	live[numLive++] = *ref;
+	return 0;
+}
+
+int main(void)
+{
+	logInit(LOG_ERR, 0);
+	CHECK(workPoolStart(4) == 0);
+	CHECK(compressInit("none") == 0);
+
+	dir = testScratchDir("dedupSweepTest");
+	snprintf(storePath, sizeof(storePath), "%s/store", dir);
+	CHECK(dedupInit(storePath, TABLE_MB, 0) == 0);
+	size_t i;
+	for(i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+		files[i].fd = -1;
+
+	static char data[2][PLAIN_SZ];
+	testFill(data[0], PLAIN_SZ, 1);
+	testFill(data[1], PLAIN_SZ, 2);
+
+	printf("Two pairs of files share their data.\n");
+	const char *names[] = { "a", "b", "c", "d" };
+	for(i = 0; i < 4; i++) {
+		openFile(&files[i], names[i]);
+		writeFile(&files[i], data[i / 2], 0, PLAIN_SZ);
+		repoint();
+	}
+	CHECK(dedupEntries(NULL) == 2 * CHUNKS);
+
+	printf("Delete one pair, and overwrite a chunk of each of the others.\n");
+	closeFile(&files[2], true);
+	closeFile(&files[3], true);
+	static char changed[2][PLAIN_SZ];
+	for(i = 0; i < 2; i++) {
+		memcpy(changed[i], data[0], PLAIN_SZ);
+		testFill(changed[i] + CHUNK + 10, 100, 10 + i);
+		writeFile(&files[i], changed[i], CHUNK + 10, 100);
+		CHECK(repoint() == 0);
+	}
+
+	printf("Sweep.  Only the chunks that are still used stay.\n");
+	dedupDestroy();
+	for(i = 0; i < 2; i++)
+		CHECK(compressRefs(files[i].fd, addRef, NULL) == 0);
+	CHECK(numLive == 2 * (CHUNKS - 1));
+	char path[300];
+	snprintf(path, sizeof(path), "%s/plain", dir);
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	CHECK(fd != -1);
+	CHECK(write(fd, "hello", 5) == 5);
+	CHECK(compressRefs(fd, addRef, NULL) == EINVAL);
+	close(fd);
+
+	uint64_t chunks, bytes;
+	CHECK(dedupSweep(storePath, live, numLive, &chunks, &bytes) == 0);
+	CHECK(chunks == CHUNKS + 1);
+	CHECK(bytes >= (CHUNKS - 1) * CHUNK);
+	CHECK(dedupSweep(storePath, live, numLive, &chunks, &bytes) == 0);
+	CHECK(chunks == 0);
+
+	CHECK(dedupInit(storePath, TABLE_MB, 0) == 0);
+	CHECK(dedupEntries(NULL) == CHUNKS - 1);
+	checkFile(&files[0], changed[0], PLAIN_SZ);
+	checkFile(&files[1], changed[1], PLAIN_SZ);
+
+	printf("Write more different chunks than the table holds.\n");
+	static char unique[UNIQUE * 100];
+	openFile(&files[4], "e");
+
+	/* Each one ends its chunk, so it's the same whole chunk whatever
+	 * comes after it. */
+	for(i = 0; i < UNIQUE; i++) {
+		testFill(unique + i * 100, 100, 1000 + i);
+		struct fuse_bufvec bv = testBuf(unique + i * 100, 100);
+		CHECK(compressWrite(&files[4].inode, files[4].fd, &bv, (i + 1) * CHUNK - 100) == 100);
+	}
+	CHECK(dedupEntries(NULL) < UNIQUE);
+
+	printf("The chunks in the store, and the last ones seen, are still found.\n");
+	openFile(&files[5], "f");
+	writeFile(&files[5], data[0], 0, PLAIN_SZ);
+	CHECK(repoint() == 0);
+	CHECK(testDiskBytes(files[5].fd) < PLAIN_SZ / 4);
+	closeFile(&files[5], true);
+
+	openFile(&files[5], "f");
+	for(i = UNIQUE - 10; i < UNIQUE; i++) {
+		struct fuse_bufvec bv = testBuf(unique + i * 100, 100);
+		CHECK(compressWrite(&files[5].inode, files[5].fd, &bv, (i + 1) * CHUNK - 100) == 100);
+	}
+	CHECK(repoint() == 10);
+
+	for(i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		if(files[i].fd != -1)
+			closeFile(&files[i], false);
+	}
+	dedupDestroy();
+	testRemoveDir(dir);
+	compressDestroy();
+	workPoolStop();
+	printf("dedupSweepTest passed.\n");
+	return 0;
+}
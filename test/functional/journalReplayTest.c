@@ -0,0 +1,187 @@
+/* *****************************************************************************
+ * The write-back journal replays what a crash left in it, up to a torn
+ * record.
+ *
+ * A child process journals three writes and dies without destaging any of
+ * them.  The last record is then torn (one byte of its data changed, as if
+ * the crash hit while it was being written).  The next journalInit() has to
+ * put the first two writes on the "NAS", and not the third.  A start after
+ * that has nothing left to replay.
+ *
+ * The journal names files by handle, so this needs a filesystem that gives
+ * them out, and CAP_DAC_READ_SEARCH (root) for open_by_handle_at().
+ * ****************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "testUtils.h"
+
+#include "proxy_journal.h"
+#include "proxy_log.h"
+
+/* The first 8 bytes of every record.  See JOURNAL_REC_MAGIC in
+ * proxy_journal.c. */
+#define REC_MAGIC (0x4345524a50584e4eULL)
+
+#define JOURNAL_BYTES (20 * 1024 * 1024)
+#define WRITE_SZ      (4096)
+#define FILE_SZ       (64 * 1024)
+
+static char journalPath[300];
+static char filePath[300];
+static int rootFd = -1;
+static struct lo_inode inode;
+
+/* Fill in the inode the way the bridge would for the file. */
+static void setInode(void)
+{
+	int fd = open(filePath, O_RDONLY);
+	CHECK(fd != -1);
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+
+	struct file_handle *fh = malloc(sizeof(struct file_handle) + MAX_HANDLE_SZ);
+	CHECK(fh != NULL);
+	fh->handle_bytes = MAX_HANDLE_SZ;
+	int mountId;
+	CHECK(name_to_handle_at(fd, "", fh, &mountId, AT_EMPTY_PATH) == 0);
+	close(fd);
+
+	memset(&inode, 0, sizeof(inode));
+	pthread_mutex_init(&inode.fdLock, NULL);
+	inode.fd = -1;
+	inode.dev = st.st_dev;
+	inode.ino = st.st_ino;
+	inode.nlookup = 1;
+	inode.handle = fh;
+}
+
+static void journalWriteFill(char c, off_t off)
+{
+	char buf[WRITE_SZ];
+	memset(buf, c, sizeof(buf));
+	struct fuse_bufvec bv = testBuf(buf, sizeof(buf));
+	CHECK(journalWrite(&inode, &bv, off) == WRITE_SZ);
+}
+
+/* Run body in a child that exits without cleaning up, like a crash. */
+static void inChild(void (*body)(void))
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	CHECK(pid != -1);
+	if(pid == 0) {
+		body();
+		_exit(0);
+	}
+	int status;
+	CHECK(waitpid(pid, &status, 0) == pid);
+	CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == 0));
+}
+
+static void writeAndCrash(void)
+{
+	CHECK(journalInit(journalPath, JOURNAL_BYTES, rootFd) == 0);
+	journalWriteFill('a', 0);
+	journalWriteFill('b', WRITE_SZ);
+	journalWriteFill('c', 2 * WRITE_SZ);
+}
+
+static void replay(void)
+{
+	CHECK(journalInit(journalPath, JOURNAL_BYTES, rootFd) == 0);
+	journalDestroy();
+}
+
+/* Change a byte in the middle of the last record's data. */
+static void tearLastRecord(void)
+{
+	int fd = open(journalPath, O_RDWR);
+	CHECK(fd != -1);
+
+	/* Records start on 512 byte boundaries, after the superblocks. */
+	off_t last = -1;
+	off_t pos;
+	for(pos = 8192; pos < JOURNAL_BYTES; pos += 512) {
+		uint64_t magic;
+		CHECK(pread(fd, &magic, sizeof(magic), pos) == sizeof(magic));
+		if(magic == REC_MAGIC)
+			last = pos;
+	}
+	CHECK(last != -1);
+
+	/* Past the record's header, in its data. */
+	char c;
+	off_t tear = last + WRITE_SZ / 2;
+	CHECK(pread(fd, &c, 1, tear) == 1);
+	c ^= 0x55;
+	CHECK(pwrite(fd, &c, 1, tear) == 1);
+	close(fd);
+}
+
+static void expectFile(off_t off, char c, size_t len)
+{
+	char *buf = malloc(len);
+	CHECK(buf != NULL);
+	int fd = open(filePath, O_RDONLY);
+	CHECK(fd != -1);
+	CHECK(pread(fd, buf, len, off) == (ssize_t) len);
+	size_t i;
+	for(i = 0; i < len; i++) {
+		if(buf[i] != c) {
+			fprintf(stderr, "Byte %lld is 0x%02x, not 0x%02x.\n",
+			        (long long) (off + i), buf[i] & 0xff, c & 0xff);
+			exit(1);
+		}
+	}
+	close(fd);
+	free(buf);
+}
+
+int main(void)
+{
+	logInit(LOG_ERR, 0);
+
+	char *dir = testScratchDir("journalReplayTest");
+	char nasDir[280];
+	snprintf(nasDir, sizeof(nasDir), "%s/nas", dir);
+	snprintf(filePath, sizeof(filePath), "%s/file", nasDir);
+	snprintf(journalPath, sizeof(journalPath), "%s/journal", dir);
+	CHECK(mkdir(nasDir, 0755) == 0);
+
+	int fd = open(filePath, O_RDWR | O_CREAT, 0644);
+	CHECK(fd != -1);
+	CHECK(ftruncate(fd, FILE_SZ) == 0);
+	close(fd);
+	rootFd = open(nasDir, O_PATH);
+	CHECK(rootFd != -1);
+	setInode();
+
+	printf("Journal three writes, then crash.\n");
+	inChild(writeAndCrash);
+	expectFile(0, 0, 3 * WRITE_SZ);
+
+	printf("Tear the last record, and replay.\n");
+	tearLastRecord();
+	inChild(replay);
+	expectFile(0, 'a', WRITE_SZ);
+	expectFile(WRITE_SZ, 'b', WRITE_SZ);
+	expectFile(2 * WRITE_SZ, 0, FILE_SZ - 2 * WRITE_SZ);
+
+	printf("Start again.  Nothing is left to replay.\n");
+	fd = open(filePath, O_RDWR);
+	CHECK(fd != -1);
+	CHECK(ftruncate(fd, 0) == 0);
+	CHECK(ftruncate(fd, FILE_SZ) == 0);
+	close(fd);
+	inChild(replay);
+	expectFile(0, 0, FILE_SZ);
+
+	close(rootFd);
+	testRemoveDir(dir);
+	printf("journalReplayTest passed.\n");
+	return 0;
+}
@@ -0,0 +1,81 @@
+/* *****************************************************************************
+ * Helpers shared by the functional tests.
+ *
+ * Each test is a program of its own, linked with the driver's modules (all
+ * of them but the ones with a main(), so there's no FUSE session).  It works in a
+ * scratch directory that stands in for the NAS, and calls the modules the
+ * way the bridge would.  See functionalTest.sh.
+ * ****************************************************************************/
+
+#ifndef TEST_UTILS_H
+#define TEST_UTILS_H
+
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fuse3/fuse_lowlevel.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+/* Stop the test if cond doesn't hold. */
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: CHECK(%s) failed.\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while(0)
+
+/* Make a scratch directory for a test.  It's left behind if the test fails,
+ * so it can be looked at. */
+static inline char *testScratchDir(const char *name)
+{
+	const char *tmp = getenv("TMPDIR");
+	char *dir = malloc(256);
+	CHECK(dir != NULL);
+	snprintf(dir, 256, "%s/%s.XXXXXX", (tmp != NULL) ? tmp : "/tmp", name);
+	CHECK(mkdtemp(dir) != NULL);
+	return dir;
+}
+
+static inline void testRemoveDir(const char *dir)
+{
+	char cmd[300];
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	CHECK(system(cmd) == 0);
+}
+
+/* Bytes that don't compress, and don't repeat, from a seed. */
+static inline void testFill(char *buf, size_t len, uint64_t seed)
+{
+	uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+	size_t i;
+	for(i = 0; i < len; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		buf[i] = (char) x;
+	}
+}
+
+/* A fuse_bufvec around some memory, the way a write request hands it in. */
+static inline struct fuse_bufvec testBuf(const char *data, size_t len)
+{
+	struct fuse_bufvec bv = FUSE_BUFVEC_INIT(len);
+	bv.buf[0].mem = (void *) data;
+	return bv;
+}
+
+/* How much of the disk a file really takes up. */
+static inline off_t testDiskBytes(int fd)
+{
+	struct stat st;
+	CHECK(fstat(fd, &st) == 0);
+	return (off_t) st.st_blocks * 512;
+}
+
+#endif /* TEST_UTILS_H */
@@ -0,0 +1,53 @@
+#!/bin/bash
+
+################################################################################
+# Functional tests for the bridge driver's modules.  Each test in functional/
+# is a small program that's linked with the driver's modules (all of them but
+# the ones with a main(), like proxy_bridge.c) and works in a scratch
+# directory (under ${TMPDIR}, default /tmp) that stands in for the NAS.  So
+# nothing has to be mounted, and no NAS is needed.  It does need what the
+# driver itself is built with (libfuse 3, OpenSSL, zlib).
+#
+# journalReplayTest needs file handles, so run this as root, with TMPDIR on a
+# local filesystem.
+#
+# Usage: functionalTest.sh [test name ...]   (default: all of them)
+################################################################################
+
+readonly TEST_DIR=$( cd `dirname ${0}`       && echo ${PWD} )
+readonly DRIVER_DIR=$( cd ${TEST_DIR}/../driver && echo ${PWD} )
+readonly BUILD_DIR=`mktemp -d ${TMPDIR:-/tmp}/functionalTest.XXXXXX`
+readonly LOG=${BUILD_DIR}/build.log
+
+if [ $# -gt 0 ]; then
+	readonly TESTS="$@"
+else
+	readonly TESTS=`cd ${TEST_DIR}/functional && ls *Test.c | sed 's/\.c$//'`
+fi
+
+# The same switches as buildBridgeDriver.sh's debug build.
+readonly SWITCHES="-D_REENTRANT -Wall -W -Wno-sign-compare -Wmissing-declarations -Wwrite-strings -DFE_OPTIMIZE_HEADER -DKEY_SET_PER_FILE -DOVERLAY_MOUNT -Wno-unused -I ${DRIVER_DIR} -I /usr/local/include -DDEBUG -g -O0 -fno-strict-aliasing -D_FILE_OFFSET_BITS=64"
+readonly LIBS="-lfuse3 -lcrypto -lz -lm -lc -lpthread -lrt -ldl"
+
+echo "Compile the driver's modules: ============================================"
+DRIVER_OBJECTS=""
+for SRC in ${DRIVER_DIR}/proxy_*.c; do
+	NAME=`basename ${SRC} .c`
+	grep -q "^int main(" ${SRC} && continue
+	gcc ${SWITCHES} -c -o ${BUILD_DIR}/${NAME}.o ${SRC} &>> ${LOG}
+	[ $? -ne 0 ] && echo "${NAME}.c: Fail (see ${LOG})." && exit 1
+	DRIVER_OBJECTS="${DRIVER_OBJECTS} ${BUILD_DIR}/${NAME}.o"
+done
+echo "Pass." ; echo ""
+
+for TEST in ${TESTS}; do
+	echo "${TEST}: ======================================================"
+	gcc ${SWITCHES} -o ${BUILD_DIR}/${TEST} ${TEST_DIR}/functional/${TEST}.c ${DRIVER_OBJECTS} ${LIBS} &>> ${LOG}
+	[ $? -ne 0 ] && echo "Build: Fail (see ${LOG})." && exit 1
+	${BUILD_DIR}/${TEST}
+	[ $? -ne 0 ] && echo "Fail." && exit 1 ; echo "Pass." ; echo ""
+done
+
+rm -rf ${BUILD_DIR}
+echo "Test passed."
+exit 0
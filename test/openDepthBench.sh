@@ -0,0 +1,71 @@
+#!/bin/bash
+
+################################################################################
+# Measure how long an open() through the bridge driver takes, depending on how
+# deep the file is in the tree.
+#
+# The driver is handed an inode, not a path.  If it opens the file by turning
+# the inode back into a full pathname, every open costs a lookup on the NAS for
+# each directory in the path, and the latency climbs with the depth.  If it
+# opens the file relative to the inode's own fd, the line stays flat.
+#
+# The opens are done from inside the deepest directory, so our own kernel only
+# has to look up one name.  That keeps the client side out of the numbers.
+#
+# To see the worst case, mount the NAS on the proxy with "actimeo=0" so the
+# NFS client can't answer path lookups from its cache.
+#
+# Usage: openDepthBench.sh <directory on the bridge mount> [opens per depth]
+################################################################################
+
+readonly TEST_DIR=${1}
+readonly OPENS=${2:-1000}
+readonly DEPTHS="1 2 4 8 16 32 64"
+
+if [ -z "${TEST_DIR}" ] || [ ! -d "${TEST_DIR}" ]; then
+	echo "Usage: `basename ${0}` <directory on the bridge mount> [opens per depth]"
+	exit 1
+fi
+
+readonly BENCH_DIR=${TEST_DIR}/openDepthBench.$$
+
+echo "Create the test trees: ==================================================="
+for DEPTH in ${DEPTHS}; do
+	DIR=${BENCH_DIR}/depth${DEPTH}
+	for (( i = 1; i < DEPTH; i++ )); do
+		DIR=${DIR}/d
+	done
+	mkdir -p ${DIR} && echo "Depth ${DEPTH}." > ${DIR}/file
+	[ $? -ne 0 ] && echo "Fail." && exit 1
+done
+echo "Pass." ; echo ""
+
+echo "Open each file ${OPENS} times: ==========================================="
+printf "%8s %12s\n" "Depth" "usec/open"
+for DEPTH in ${DEPTHS}; do
+	DIR=${BENCH_DIR}/depth${DEPTH}
+	for (( i = 1; i < DEPTH; i++ )); do
+		DIR=${DIR}/d
+	done
+
+	# The shell's own redirections open and close the file without forking,
+	# so nearly all of the time is spent in open().
+	pushd ${DIR} &> /dev/null
+	[ $? -ne 0 ] && echo "Fail." && exit 1
+	START=`date +%s%N`
+	for (( i = 0; i < OPENS; i++ )); do
+		exec 3< file
+		exec 3<&-
+	done
+	END=`date +%s%N`
+	popd &> /dev/null
+
+	printf "%8d %12d\n" ${DEPTH} $(( (END - START) / OPENS / 1000 ))
+done
+echo ""
+
+echo "Delete the test trees: ==================================================="
+rm -rf ${BENCH_DIR}
+[ $? -ne 0 ] && echo "Fail." && exit 1 ; echo "Pass." ; echo ""
+
+exit 0